@@ -1,7 +1,100 @@
+#define _DEFAULT_SOURCE                  // for MAP_ANONYMOUS and MAP_POPULATE when compiling with -std=c99
+
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+    #define FILE_MAP_SUPPORTED  1
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <errno.h>
+    #if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+        #define MAP_ANONYMOUS   MAP_ANON
+    #endif
+    #ifndef MAP_POPULATE
+        #define MAP_POPULATE    0
+    #endif
+#else
+    #define FILE_MAP_SUPPORTED  0
+#endif
+
+#if defined(_WIN32)
+    #include <io.h>                      // _setmode, _read
+    #include <fcntl.h>                   // _O_BINARY
+#endif
+
+#include "FileIO.h"
+#include "Thread.h"
+
+
+#define  LOAD_PADDING_LEN       65536
+#define  LOAD_PIPE_INIT_LEN     (1<<20)
+
+
+
+// the file name "-" means stdin (for reading) or stdout (for writing)
+static int isStdio (const char *filename) {
+    return strcmp(filename, "-") == 0;
+}
+
+
+static FILE *openFile (const char *filename, int is_write) {
+    if (isStdio(filename)) {
+        FILE *fp = is_write ? stdout : stdin;
+#if defined(_WIN32)
+        _setmode(_fileno(fp), _O_BINARY);                     // avoid "\n" -> "\r\n" translation
+#endif
+        return fp;
+    }
+    return fopen(filename, is_write ? "wb" : "rb");
+}
+
+
+static int closeFile (FILE *fp) {
+    if (fp == stdin)
+        return 0;
+    if (fp == stdout)                                         // don't close stdout, since others (e.g., the logs) may still use it
+        return fflush(fp) != 0;
+    return fclose(fp) != 0;
+}
+
+
+// read a non-seekable file (e.g., a pipe) until EOF, growing the buffer on demand
+static uint8_t *loadFromPipe (size_t *p_len, FILE *fp) {
+    size_t   cap   = LOAD_PIPE_INIT_LEN;
+    uint8_t *p_buf = (uint8_t*)malloc(cap + LOAD_PADDING_LEN);
+    
+    *p_len = 0;
+    
+    while (p_buf != NULL) {
+        size_t rlen = fread(p_buf+(*p_len), sizeof(uint8_t), cap-(*p_len), fp);
+        *p_len += rlen;
+        
+        if (rlen == 0) {
+            if (ferror(fp)) {
+                free(p_buf);
+                return NULL;
+            }
+            memset(p_buf+(*p_len), 0, LOAD_PADDING_LEN);
+            return p_buf;
+        }
+        
+        if (*p_len == cap) {
+            uint8_t *p_new = (uint8_t*)realloc(p_buf, 2*cap + LOAD_PADDING_LEN);
+            if (p_new == NULL)
+                free(p_buf);
+            p_buf = p_new;
+            cap  *= 2;
+        }
+    }
+    
+    return NULL;
+}
 
 
 
@@ -20,14 +113,15 @@ uint8_t *loadFromFile (size_t *p_len, const char *filename) {
     
     *p_len = 0;
     
-    fp = fopen(filename, "rb");
+    fp = openFile(filename, 0);
     
     if (fp == NULL)
         return NULL;
     
-    if (0 != fseek(fp, 0, SEEK_END)) {
-        fclose(fp);
-        return NULL;
+    if (isStdio(filename) || 0 != fseek(fp, 0, SEEK_END)) {    // not seekable, read it incrementally
+        p_buf = loadFromPipe(p_len, fp);
+        closeFile(fp);
+        return p_buf;
     }
     
     *p_len = ftell(fp);                  // get file data length
@@ -37,13 +131,7 @@ uint8_t *loadFromFile (size_t *p_len, const char *filename) {
         return NULL;
     }
     
-    if (*p_len == 0) {                   // special case : file length = 0 (empty file)
-        fclose(fp);
-        p_buf = (uint8_t*)malloc(1);     // malloc a 1-byte buffer
-        return p_buf;                    // directly return it without filling any data
-    }
-    
-    p_buf = (uint8_t*)malloc((*p_len) + 65536);
+    p_buf = (uint8_t*)malloc((*p_len) + LOAD_PADDING_LEN);
     
     if (p_buf == NULL) {
         fclose(fp);
@@ -54,6 +142,8 @@ uint8_t *loadFromFile (size_t *p_len, const char *filename) {
     
     fclose(fp);
     
+    memset(p_buf+(*p_len), 0, LOAD_PADDING_LEN);
+    
     if (rlen != (*p_len)) {             // actual readed length is not equal to expected readed length
         free(p_buf);
         return NULL;
@@ -76,7 +166,7 @@ int saveToFile (const uint8_t *p_buf, size_t len, const char *filename) {
     size_t  wlen = 0;
     FILE   *fp;
     
-    fp = fopen(filename, "wb");
+    fp = openFile(filename, 1);
     
     if (fp == NULL)
         return 1;
@@ -84,7 +174,8 @@ int saveToFile (const uint8_t *p_buf, size_t len, const char *filename) {
     if (len > 0)
         wlen = fwrite(p_buf, sizeof(uint8_t), len, fp);
     
-    fclose(fp);
+    if (closeFile(fp))
+        return 1;
     
     if (wlen != len)
         return 1;
@@ -92,3 +183,463 @@ int saveToFile (const uint8_t *p_buf, size_t len, const char *filename) {
     return 0;
 }
 
+
+
+
+#define  STREAM_N_SLOTS         3              // triple buffering : the I/O thread works on one slot, while the codec works on another, and one more is ready
+#define  STREAM_SLOT_SIZE       (1<<20)
+
+
+/// a file stream overlaps the file I/O with the codec : a reader thread prefetches the next chunks,
+/// and a writer thread drains the finished chunks, through a ring of slots.
+/// The stream falls back to synchronous I/O if the thread can't be started. Reading stdin is always synchronous,
+/// since it returns partial chunks as soon as data is available, and a thread blocked on a pipe couldn't be stopped.
+struct FileStream_t {
+    FILE     *fp;
+    int       is_write;
+    int       is_stdio;
+    size_t    n_writes;
+    
+    Thread_t *p_thread;                   // the background I/O thread, NULL for synchronous I/O
+    Mutex_t  *p_mutex;
+    Cond_t   *p_cond;
+    uint8_t  *p_slots;                    // STREAM_N_SLOTS slots, each has STREAM_SLOT_SIZE bytes
+    size_t    slot_len [STREAM_N_SLOTS];
+    size_t    head;                       // the oldest full slot, owned by the consumer (the codec when reading, the I/O thread when writing)
+    size_t    tail;                       // the next slot to fill, owned by the producer
+    size_t    head_pos;                   // reading : the length already taken from the head slot
+    size_t    n_full;                     // the number of full slots.                                                  protected by p_mutex
+    int       end;                        // reading : the I/O thread reached the end of file. writing : no more data.  protected by p_mutex
+    int       stop;                       // reading : the codec closed the stream, the I/O thread should exit.         protected by p_mutex
+    int       error;                      // the I/O thread failed.                                                     protected by p_mutex
+};
+
+
+
+static int readChunk (FileStream_t *p_fs, uint8_t *p_buf, size_t *p_len) {
+#if FILE_MAP_SUPPORTED || defined(_WIN32)
+    if (p_fs->is_stdio) {                              // for a pipe, return what is available instead of waiting until the buffer is full, so that the pipeline doesn't stall
+        for (;;) {
+#if defined(_WIN32)
+            int rlen = _read(_fileno(p_fs->fp), p_buf, (unsigned)((*p_len > 0x40000000) ? 0x40000000 : *p_len));
+#else
+            ssize_t rlen = read(fileno(p_fs->fp), p_buf, *p_len);
+            if (rlen < 0 && errno == EINTR)
+                continue;
+#endif
+            if (rlen < 0)
+                return 1;
+            *p_len = (size_t)rlen;
+            return 0;
+        }
+    }
+#endif
+    
+    *p_len = fread(p_buf, sizeof(uint8_t), (*p_len), p_fs->fp);
+    
+    if (*p_len == 0 && ferror(p_fs->fp))
+        return 1;
+    
+    return 0;
+}
+
+
+static int writeChunk (FileStream_t *p_fs, const uint8_t *p_buf, size_t len) {
+    if (len > 0 && fwrite(p_buf, sizeof(uint8_t), len, p_fs->fp) != len)
+        return 1;
+    
+    if (len > 0 && p_fs->is_stdio && fflush(p_fs->fp) != 0)      // pass the data to the next program in the pipeline as soon as possible
+        return 1;
+    
+    return 0;
+}
+
+
+
+static void readerThread (void *arg) {
+    FileStream_t *p_fs = (FileStream_t*)arg;
+    
+    for (;;) {
+        uint8_t *p_slot = p_fs->p_slots + p_fs->tail * STREAM_SLOT_SIZE;
+        size_t   len    = STREAM_SLOT_SIZE;
+        int      failed, stop;
+        
+        mutexLock(p_fs->p_mutex);
+        while (p_fs->n_full == STREAM_N_SLOTS && !p_fs->stop)          // wait for a free slot
+            condWait(p_fs->p_cond, p_fs->p_mutex);
+        stop = p_fs->stop;
+        mutexUnlock(p_fs->p_mutex);
+        
+        if (stop)
+            break;
+        
+        failed = readChunk(p_fs, p_slot, &len);                         // the tail slot is free, so read into it without the lock
+        
+        mutexLock(p_fs->p_mutex);
+        if (failed) {
+            p_fs->error = 1;
+        } else if (len == 0) {
+            p_fs->end = 1;
+        } else {
+            p_fs->slot_len[p_fs->tail] = len;
+            p_fs->tail = (p_fs->tail + 1) % STREAM_N_SLOTS;
+            p_fs->n_full ++;
+        }
+        condBroadcast(p_fs->p_cond);
+        mutexUnlock(p_fs->p_mutex);
+        
+        if (failed || len == 0)
+            break;
+    }
+}
+
+
+static void writerThread (void *arg) {
+    FileStream_t *p_fs = (FileStream_t*)arg;
+    
+    for (;;) {
+        int failed;
+        
+        mutexLock(p_fs->p_mutex);
+        while (p_fs->n_full == 0 && !p_fs->end)                         // wait for a full slot
+            condWait(p_fs->p_cond, p_fs->p_mutex);
+        if (p_fs->n_full == 0) {                                        // no more data
+            mutexUnlock(p_fs->p_mutex);
+            break;
+        }
+        mutexUnlock(p_fs->p_mutex);
+        
+        failed = writeChunk(p_fs, p_fs->p_slots + p_fs->head * STREAM_SLOT_SIZE, p_fs->slot_len[p_fs->head]);
+        p_fs->head = (p_fs->head + 1) % STREAM_N_SLOTS;
+        
+        mutexLock(p_fs->p_mutex);
+        p_fs->n_full --;
+        if (failed)
+            p_fs->error = 1;
+        condBroadcast(p_fs->p_cond);
+        mutexUnlock(p_fs->p_mutex);
+        
+        if (failed)
+            break;
+    }
+}
+
+
+/// start the background I/O thread. If failed, the stream keeps using synchronous I/O.
+static void startStreamThread (FileStream_t *p_fs) {
+    p_fs->p_slots = (uint8_t*)malloc(STREAM_N_SLOTS * STREAM_SLOT_SIZE);
+    p_fs->p_mutex = mutexNew();
+    p_fs->p_cond  = condNew();
+    
+    if (p_fs->p_slots && p_fs->p_mutex && p_fs->p_cond) {
+        p_fs->p_thread = threadStart(p_fs->is_write ? writerThread : readerThread, p_fs);
+    }
+    
+    if (p_fs->p_thread == NULL) {
+        free(p_fs->p_slots);
+        if (p_fs->p_mutex)
+            mutexFree(p_fs->p_mutex);
+        if (p_fs->p_cond)
+            condFree(p_fs->p_cond);
+        p_fs->p_slots = NULL;
+        p_fs->p_mutex = NULL;
+        p_fs->p_cond  = NULL;
+    }
+}
+
+
+/// stop and join the background I/O thread, return 1 if it failed
+static int stopStreamThread (FileStream_t *p_fs) {
+    int error;
+    
+    mutexLock(p_fs->p_mutex);
+    if (p_fs->is_write) {
+        p_fs->end  = 1;                                                 // the writer thread exits after draining all the full slots
+    } else {
+        p_fs->stop = 1;
+    }
+    condBroadcast(p_fs->p_cond);
+    mutexUnlock(p_fs->p_mutex);
+    
+    threadJoin(p_fs->p_thread);
+    
+    error = p_fs->error;
+    
+    free(p_fs->p_slots);
+    mutexFree(p_fs->p_mutex);
+    condFree(p_fs->p_cond);
+    p_fs->p_thread = NULL;
+    
+    return error;
+}
+
+
+
+FileStream_t *openFileStream (const char *filename, int is_write) {
+    FileStream_t *p_fs = (FileStream_t*)malloc(sizeof(FileStream_t));
+    
+    if (p_fs == NULL)
+        return NULL;
+    
+    memset(p_fs, 0, sizeof(FileStream_t));
+    
+    p_fs->is_write = is_write;
+    p_fs->is_stdio = isStdio(filename);
+    p_fs->fp = openFile(filename, is_write);
+    
+    if (p_fs->fp == NULL) {
+        free(p_fs);
+        return NULL;
+    }
+    
+    if (!is_write && !p_fs->is_stdio) {
+        startStreamThread(p_fs);                                        // start prefetching now. (the writer thread is started by the second write, so that a small file doesn't pay for it)
+    }
+    
+    return p_fs;
+}
+
+
+int readFromFileStream (FileStream_t *p_fs, uint8_t *p_buf, size_t *p_len) {
+    size_t len;
+    
+    if (p_fs->p_thread == NULL)
+        return readChunk(p_fs, p_buf, p_len);
+    
+    mutexLock(p_fs->p_mutex);
+    while (p_fs->n_full == 0 && !p_fs->end && !p_fs->error)            // wait for a full slot
+        condWait(p_fs->p_cond, p_fs->p_mutex);
+    if (p_fs->n_full == 0) {                                            // end of file, or failed
+        int error = p_fs->error;
+        mutexUnlock(p_fs->p_mutex);
+        *p_len = 0;
+        return error;
+    }
+    mutexUnlock(p_fs->p_mutex);
+    
+    len = p_fs->slot_len[p_fs->head] - p_fs->head_pos;                  // take data from the head slot
+    if (len > *p_len)
+        len = *p_len;
+    memcpy(p_buf, p_fs->p_slots + p_fs->head * STREAM_SLOT_SIZE + p_fs->head_pos, len);
+    p_fs->head_pos += len;
+    *p_len = len;
+    
+    if (p_fs->head_pos == p_fs->slot_len[p_fs->head]) {                 // the head slot is used up, give it back to the reader thread
+        p_fs->head_pos = 0;
+        p_fs->head = (p_fs->head + 1) % STREAM_N_SLOTS;
+        mutexLock(p_fs->p_mutex);
+        p_fs->n_full --;
+        condBroadcast(p_fs->p_cond);
+        mutexUnlock(p_fs->p_mutex);
+    }
+    
+    return 0;
+}
+
+
+int writeToFileStream (FileStream_t *p_fs, const uint8_t *p_buf, size_t len) {
+    if (len == 0)
+        return 0;
+    
+    if (p_fs->p_thread == NULL && (p_fs->n_writes ++) == 1) {      // only try once
+        startStreamThread(p_fs);
+    }
+    
+    if (p_fs->p_thread == NULL)
+        return writeChunk(p_fs, p_buf, len);
+    
+    while (len > 0) {
+        size_t chunk_len = (len < STREAM_SLOT_SIZE) ? len : STREAM_SLOT_SIZE;
+        int    error;
+        
+        mutexLock(p_fs->p_mutex);
+        while (p_fs->n_full == STREAM_N_SLOTS && !p_fs->error)          // wait for a free slot
+            condWait(p_fs->p_cond, p_fs->p_mutex);
+        error = p_fs->error;
+        mutexUnlock(p_fs->p_mutex);
+        
+        if (error)
+            return 1;
+        
+        memcpy(p_fs->p_slots + p_fs->tail * STREAM_SLOT_SIZE, p_buf, chunk_len);    // the tail slot is free, so fill it without the lock
+        p_fs->slot_len[p_fs->tail] = chunk_len;
+        p_fs->tail = (p_fs->tail + 1) % STREAM_N_SLOTS;
+        p_buf += chunk_len;
+        len   -= chunk_len;
+        
+        mutexLock(p_fs->p_mutex);
+        p_fs->n_full ++;
+        condBroadcast(p_fs->p_cond);
+        mutexUnlock(p_fs->p_mutex);
+    }
+    
+    return 0;
+}
+
+
+int closeFileStream (FileStream_t *p_fs) {
+    int ret = 0;
+    
+    if (p_fs->p_thread && stopStreamThread(p_fs))
+        ret = 1;
+    
+    if (p_fs->is_write && fflush(p_fs->fp) != 0)
+        ret = 1;
+    
+    if (closeFile(p_fs->fp))
+        ret = 1;
+    
+    free(p_fs);
+    
+    return ret;
+}
+
+
+
+
+int openInputFileMap (FileMap_t *p_map, const char *filename) {
+    p_map->map_len  = 0;
+    p_map->fd       = -1;
+    p_map->is_write = 0;
+    p_map->filename = filename;
+    
+#if FILE_MAP_SUPPORTED
+    if (!isStdio(filename)) {
+        struct stat st;
+        int fd = open(filename, O_RDONLY);
+        
+        if (fd < 0)
+            return 1;
+        
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && (uint64_t)st.st_size < (uint64_t)((size_t)-1) - LOAD_PADDING_LEN) {
+            size_t   len     = (size_t)st.st_size;
+            size_t   map_len = len + LOAD_PADDING_LEN;
+            uint8_t *p_base;
+            
+            p_base = (uint8_t*)mmap(NULL, map_len, PROT_READ, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);                  // reserve the address space with zero padding at the end
+            
+            if (p_base != (uint8_t*)MAP_FAILED) {
+                if (mmap(p_base, len, PROT_READ, MAP_PRIVATE|MAP_FIXED|MAP_POPULATE, fd, 0) == (void*)p_base) {  // map the file on the head of the reserved space
+                    posix_madvise(p_base, len, POSIX_MADV_SEQUENTIAL);
+                    close(fd);
+                    p_map->p_buf   = p_base;
+                    p_map->len     = len;
+                    p_map->map_len = map_len;
+                    return 0;
+                }
+                munmap(p_base, map_len);
+            }
+        }
+        
+        close(fd);
+    }
+#endif
+    
+    p_map->p_buf = loadFromFile(&p_map->len, filename);                 // fall back to read the file into a malloc'd buffer
+    
+    return (p_map->p_buf == NULL);
+}
+
+
+#if FILE_MAP_SUPPORTED
+/// allocate the disk blocks of a file of len bytes. Writing to a mapping of a sparse file raises SIGBUS when the disk is full,
+/// so the blocks must be reserved first. return 0 on success
+static int reserveFile (int fd, size_t len) {
+#if defined(__APPLE__)
+    fstore_t fst = {F_ALLOCATEALL, F_PEOFPOSMODE, 0, (off_t)len, 0};
+    if (fcntl(fd, F_PREALLOCATE, &fst) == -1)
+        return 1;
+    return ftruncate(fd, (off_t)len);
+#else
+    return posix_fallocate(fd, 0, (off_t)len);
+#endif
+}
+#endif
+
+
+int openOutputFileMap (FileMap_t *p_map, const char *filename, size_t capacity) {
+    p_map->len      = capacity;
+    p_map->map_len  = 0;
+    p_map->fd       = -1;
+    p_map->is_write = 1;
+    p_map->filename = filename;
+    
+#if FILE_MAP_SUPPORTED
+    if (capacity > 0 && !isStdio(filename)) {
+        int fd = open(filename, O_RDWR|O_CREAT|O_TRUNC, 0666);
+        
+        if (fd < 0)
+            return 1;
+        
+        if (reserveFile(fd, capacity) == 0) {                           // the unused blocks are freed when the file is cut to the data length
+            uint8_t *p_buf = (uint8_t*)mmap(NULL, capacity, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+            if (p_buf != (uint8_t*)MAP_FAILED) {
+                posix_madvise(p_buf, capacity, POSIX_MADV_SEQUENTIAL);
+                p_map->p_buf   = p_buf;
+                p_map->map_len = capacity;
+                p_map->fd      = fd;
+                return 0;
+            }
+        }
+        
+        close(fd);                                                      // not a regular file (e.g., a device), or no disk space for the capacity, fall back to malloc and the buffered writer
+        
+        p_map->p_buf = (uint8_t*)malloc(capacity);
+        if (p_map->p_buf == NULL)
+            unlink(filename);                                           // don't leave the file truncated
+        return (p_map->p_buf == NULL);
+    }
+#endif
+    
+    p_map->p_buf = (uint8_t*)malloc(capacity > 0 ? capacity : 1);
+    
+    return (p_map->p_buf == NULL);
+}
+
+
+int closeFileMap (FileMap_t *p_map, size_t len) {
+    int ret = 0;
+    
+    if (p_map->p_buf == NULL)
+        return 1;
+    
+#if FILE_MAP_SUPPORTED
+    if (p_map->map_len > 0) {
+        if (munmap(p_map->p_buf, p_map->map_len) != 0)
+            ret = 1;
+        
+        if (p_map->fd >= 0) {                                          // for output file, cut the file to the actual data length
+            if (ftruncate(p_map->fd, (off_t)len) != 0)
+                ret = 1;
+            if (close(p_map->fd) != 0)
+                ret = 1;
+        }
+        
+        p_map->p_buf = NULL;
+        return ret;
+    }
+#endif
+    
+    if (p_map->is_write && saveToFile(p_map->p_buf, len, p_map->filename))   // the buffer is malloc'd, save it to file
+        ret = 1;
+    
+    free(p_map->p_buf);
+    p_map->p_buf = NULL;
+    return ret;
+}
+
+
+int isSameFile (const char *filename1, const char *filename2) {
+    if (isStdio(filename1) || isStdio(filename2))
+        return 0;
+#if FILE_MAP_SUPPORTED
+    {
+        struct stat st1, st2;
+        if (stat(filename1, &st1) != 0 || stat(filename2, &st2) != 0)
+            return 0;
+        return st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino;
+    }
+#else
+    return strcmp(filename1, filename2) == 0;
+#endif
+}
@@ -7,6 +7,8 @@
 
 // Function  : read all data from file to a buffer.
 // Note      : The buffer is malloc in this function and need to be free outside by user !
+//             The data is followed by 65536 bytes of zero padding.
+//             The file may be non-seekable (e.g., a pipe), and "-" means stdin.
 // Parameter :
 //     size_t *p_len        : getting the data length, i.e. the file length.
 //     const char *filename : file name
@@ -20,11 +22,111 @@ uint8_t *loadFromFile (size_t *p_len, const char *filename);
 // Parameter :
 //     const uint8_t *p_buf : data buffer pointer
 //     size_t len           : data length
-//     const char *filename : file name
+//     const char *filename : file name, "-" means stdout
 // Return    :
 //     1 : failed
 //     0 : success
 int saveToFile (const uint8_t *p_buf, size_t len, const char *filename);
 
 
+
+typedef struct FileStream_t FileStream_t;
+
+
+// Function  : open a file for chunk-by-chunk reading or writing, so that the whole file never needs to be in memory.
+// Note      : A background thread reads ahead (or writes behind) through a few 1MB buffers, so the file I/O overlaps with
+//             the work of the caller. The stream must be used by only one thread. Reading stdin is synchronous.
+// Parameter :
+//     const char *filename : file name, "-" means stdin (for reading) or stdout (for writing)
+//     int is_write         : 0 : open for reading.   1 : open (create or truncate) for writing
+// Return    :
+//     non-NULL pointer     : success
+//     NULL                 : failed
+FileStream_t *openFileStream (const char *filename, int is_write);
+
+
+// Function  : read the next chunk of a file stream.
+// Parameter :
+//     FileStream_t *p_fs   : file stream opened for reading
+//     uint8_t *p_buf       : buffer to hold the chunk
+//     size_t *p_len        : input: buffer capacity.  output: readed length, which is 0 only when reaching end of file.
+//                            when reading stdin, it returns as soon as some data is available, so the length may be less than the capacity.
+// Return    :
+//     1 : failed
+//     0 : success
+int readFromFileStream (FileStream_t *p_fs, uint8_t *p_buf, size_t *p_len);
+
+
+// Function  : append a chunk to a file stream.
+// Parameter :
+//     FileStream_t *p_fs   : file stream opened for writing
+//     const uint8_t *p_buf : data buffer pointer
+//     size_t len           : data length
+// Return    :
+//     1 : failed
+//     0 : success
+int writeToFileStream (FileStream_t *p_fs, const uint8_t *p_buf, size_t len);
+
+
+// Function  : close a file stream and release it.
+// Return    :
+//     1 : failed (for writing stream, this means some data may not reach the disk)
+//     0 : success
+int closeFileStream (FileStream_t *p_fs);
+
+
+
+
+typedef struct {
+    uint8_t    *p_buf;          // the data buffer. For input file, its length is len, and it is followed by 65536 bytes of zero padding
+    size_t      len;            // for input file : the file length.  for output file : the capacity of the buffer
+    size_t      map_len;        // the length of the memory mapping, 0 if the buffer is not memory-mapped (i.e., malloc'd)
+    int         fd;             // the file descriptor of memory-mapped output file
+    int         is_write;       // 0 : input file.   1 : output file
+    const char *filename;       // the file name, which is needed when the output buffer is not memory-mapped
+} FileMap_t;
+
+
+// Function  : map a whole file into memory for reading (zero-copy, read-only).
+//             If memory mapping is not supported (e.g., on Windows or for a non-regular file), fall back to loadFromFile.
+// Parameter :
+//     FileMap_t *p_map     : getting the mapped buffer on p_map->p_buf and the file length on p_map->len
+//     const char *filename : file name, "-" means stdin
+// Return    :
+//     1 : failed
+//     0 : success
+int openInputFileMap (FileMap_t *p_map, const char *filename);
+
+
+// Function  : create (or truncate) a file, and map it into memory for writing, so that the data is written straight into the page cache.
+//             The disk blocks of the capacity are reserved first, so that a full disk is not found while writing the mapping.
+//             If memory mapping is not supported, or the blocks can't be reserved, fall back to a malloc'd buffer which will be saved by closeFileMap.
+//             If it fails after creating the file, the file is removed.
+// Parameter :
+//     FileMap_t *p_map     : getting the mapped buffer on p_map->p_buf
+//     const char *filename : file name, "-" means stdout
+//     size_t capacity      : the maximum length of data to write
+// Return    :
+//     1 : failed
+//     0 : success
+int openOutputFileMap (FileMap_t *p_map, const char *filename, size_t capacity);
+
+
+// Function  : unmap (or free) the buffer. For output file, the file length is set to len.
+// Parameter :
+//     FileMap_t *p_map     : the input or output file map
+//     size_t len           : for output file, the actual data length. ignored for input file
+// Return    :
+//     1 : failed
+//     0 : success
+int closeFileMap (FileMap_t *p_map, size_t len);
+
+
+// Function  : check if two file names refer to the same existing file (e.g., a link, or the same path written differently).
+// Return    :
+//     1 : the same file
+//     0 : different files, or any of them doesn't exist or is "-"
+int isSameFile (const char *filename1, const char *filename2);
+
+
 #endif // __FILE_IO_H__
@@ -0,0 +1,280 @@
+#ifndef   __RANGE_CODER_H__
+#define   __RANGE_CODER_H__
+
+#include <stddef.h>   // size_t
+#include <stdint.h>   // uint8_t, uint16_t, uint32_t, uint64_t
+#include <string.h>   // memset
+
+
+// the binary range coder of LZMA, shared by lzmaC.c (encoder) and lzmaD.c (decoder).
+// it's in a header so that the per-bit functions are inlined into the packet loops of both.
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// common definitions
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define   RANGE_CODE_NORMALIZE_THRESHOLD           (1 << 24)
+#define   RANGE_CODE_MOVE_BITS                     5
+#define   RANGE_CODE_N_BIT_MODEL_TOTAL_BITS        11
+#define   RANGE_CODE_BIT_MODEL_TOTAL               (1 << RANGE_CODE_N_BIT_MODEL_TOTAL_BITS)
+#define   RANGE_CODE_HALF_PROBABILITY              (RANGE_CODE_BIT_MODEL_TOTAL >> 1)
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Range Encoder
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+typedef struct {
+    uint8_t  overflow;
+    uint8_t  cache;              // the output byte which is held back, since a carry from "low" may still add 1 to it
+    uint64_t low;                // 33 bits are used, the 32th bit is the carry to the held back bytes
+    uint32_t range;
+    size_t   cache_size;         // 1 + the number of 0xFF bytes which are held back after cache (a carry turns them to 0x00)
+    uint8_t *p_dst;
+    uint8_t *p_dst_limit;
+} RangeEncoder_t;
+
+
+static inline RangeEncoder_t newRangeEncoder (uint8_t *p_dst, size_t dst_len) {
+    RangeEncoder_t coder;
+    coder.cache       = 0;
+    coder.low         = 0;
+    coder.range       = 0xFFFFFFFF;
+    coder.cache_size  = 1;
+    coder.p_dst       = p_dst;
+    coder.p_dst_limit = p_dst + dst_len;
+    coder.overflow    = 0;
+    return coder;
+}
+
+
+static inline void rangeEncodeOutByte (RangeEncoder_t *e, uint8_t byte) {
+    if (e->p_dst != e->p_dst_limit)
+        *(e->p_dst++) = byte;
+    else
+        e->overflow = 1;
+}
+
+
+/// move the high byte out of "low". The held back bytes are written once they can't be changed by a carry any more
+static inline void rangeEncodeShiftLow (RangeEncoder_t *e) {
+    if ((uint32_t)e->low < 0xFF000000 || (e->low >> 32) != 0) {
+        uint8_t carry = (uint8_t)(e->low >> 32);
+        size_t  n_ff  = e->cache_size - 1;
+        if ((size_t)(e->p_dst_limit - e->p_dst) > n_ff) {         // enough space, write the held back bytes at once
+            *(e->p_dst++) = e->cache + carry;
+            memset(e->p_dst, (uint8_t)(0xFF + carry), n_ff);
+            e->p_dst += n_ff;
+        } else {
+            rangeEncodeOutByte(e, e->cache + carry);
+            for (; n_ff>0; n_ff--)
+                rangeEncodeOutByte(e, (uint8_t)(0xFF + carry));
+        }
+        e->cache      = (uint8_t)(e->low >> 24);
+        e->cache_size = 0;
+    }
+    e->cache_size ++;
+    e->low = (e->low & 0x00FFFFFF) << 8;
+}
+
+
+static inline void rangeEncodeNormalize (RangeEncoder_t *e) {
+    if (e->range < RANGE_CODE_NORMALIZE_THRESHOLD) {
+        e->range <<= 8;
+        rangeEncodeShiftLow(e);
+    }
+}
+
+
+static inline void rangeEncodeTerminate (RangeEncoder_t *e) {
+    int i;
+    rangeEncodeNormalize(e);                               // the normalization which is pending after the last bit (the decoder also does it at the end)
+    for (i=0; i<5; i++)                                    // flush the cache and the 4 bytes of "low", and no more, since LZMA2 requires the decoder to end exactly at the end of a chunk
+        rangeEncodeShiftLow(e);
+}
+
+
+static inline void rangeEncodeIntByFixedProb (RangeEncoder_t *e, uint32_t val, uint32_t bit_count) {
+    for (; bit_count>0; bit_count--) {
+        rangeEncodeNormalize(e);
+        e->range >>= 1;
+        if (1 & (val >> (bit_count-1)))
+            e->low += e->range;
+    }
+}
+
+
+static inline void rangeEncodeBit (RangeEncoder_t *e, uint16_t *p_prob, uint8_t bit) {
+    uint32_t prob = *p_prob;
+    uint32_t bound;
+    
+    rangeEncodeNormalize(e);
+    
+    bound = (e->range >> RANGE_CODE_N_BIT_MODEL_TOTAL_BITS) * prob;
+    
+    if (!bit) {                                           // encode bit 0
+        e->range = bound;
+        *p_prob = (uint16_t)(prob + ((RANGE_CODE_BIT_MODEL_TOTAL - prob) >> RANGE_CODE_MOVE_BITS));
+    } else {                                              // encode bit 1
+        e->range -= bound;
+        e->low   += bound;
+        *p_prob = (uint16_t)(prob - (prob >> RANGE_CODE_MOVE_BITS));
+    }
+}
+
+
+static inline void rangeEncodeInt (RangeEncoder_t *e, uint16_t *p_prob, uint32_t val, uint32_t bit_count) {
+    uint32_t treepos = 1;
+    for (; bit_count>0; bit_count--) {
+        uint8_t bit = (uint8_t)(1 & (val >> (bit_count-1)));
+        rangeEncodeBit(e, p_prob+(treepos-1), bit);
+        treepos <<= 1;
+        if (bit)
+            treepos |= 1;
+    }
+}
+
+
+static inline void rangeEncodeMB (RangeEncoder_t *e, uint16_t *p_prob, uint32_t byte, uint32_t match_byte) {
+    uint32_t i, treepos = 1, off0 = 0x100, off1;
+    for (i=0; i<8; i++) {
+        uint8_t bit = (uint8_t)(1 & (byte >> 7));
+        byte <<= 1;
+        match_byte <<= 1;
+        off1 = off0;
+        off0 &= match_byte;
+        rangeEncodeBit(e, p_prob+(off0+off1+treepos-1), bit);
+        treepos <<= 1;
+        if (bit)
+            treepos |= 1;
+        else
+            off0 ^= off1;
+    }
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Range Decoder
+//   The per-bit functions don't check the input limit, each of them reads at most 1 byte. The caller must make sure
+//   that enough bytes are readable before decoding a symbol (lzmaD.c decodes the last bytes from a zero-padded copy).
+//   Only newRangeDecoder() and rangeDecodeNormalize() check the limit, and set overflow instead of reading beyond it.
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+typedef struct {
+    uint32_t       code;
+    uint32_t       range;
+    const uint8_t *p_src;
+    const uint8_t *p_src_limit;
+    uint8_t        overflow;
+} RangeDecoder_t;
+
+
+static inline void rangeDecodeNormalize (RangeDecoder_t *d) {
+    if (d->range < RANGE_CODE_NORMALIZE_THRESHOLD) {
+        if (d->p_src != d->p_src_limit) {
+            d->range <<= 8;
+            d->code  <<= 8;
+            d->code  |= (uint32_t)(*(d->p_src));
+            d->p_src ++;
+        } else {
+            d->overflow = 1;
+        }
+    }
+}
+
+
+/// the same as rangeDecodeNormalize, without checking the input limit
+static inline void rangeDecodeNormalizeFast (RangeDecoder_t *d) {
+    if (d->range < RANGE_CODE_NORMALIZE_THRESHOLD) {
+        d->range <<= 8;
+        d->code   = (d->code << 8) | (uint32_t)(*(d->p_src++));
+    }
+}
+
+
+static inline RangeDecoder_t newRangeDecoder (const uint8_t *p_src, size_t src_len) {
+    RangeDecoder_t coder;
+    coder.code        = 0;
+    coder.range       = 0;
+    coder.p_src       = p_src;
+    coder.p_src_limit = p_src + src_len;
+    coder.overflow    = 0;
+    rangeDecodeNormalize(&coder);
+    rangeDecodeNormalize(&coder);
+    rangeDecodeNormalize(&coder);
+    rangeDecodeNormalize(&coder);
+    rangeDecodeNormalize(&coder);
+    coder.range       = 0xFFFFFFFF;
+    return coder;
+}
+
+
+static inline uint32_t rangeDecodeIntByFixedProb (RangeDecoder_t *d, uint32_t bit_count) {
+    uint32_t val=0, b;
+    for (; bit_count>0; bit_count--) {
+        rangeDecodeNormalizeFast(d);
+        d->range >>= 1;
+        d->code -= d->range;
+        b = !(1 & (d->code >> 31));
+        if (!b)
+            d->code += d->range;
+        val <<= 1;
+        val  |= b;
+    }
+    return val;
+}
+
+
+static inline uint32_t rangeDecodeBit (RangeDecoder_t *d, uint16_t *p_prob) {
+    uint32_t prob = *p_prob;
+    uint32_t bound;
+    rangeDecodeNormalizeFast(d);
+    bound = (d->range >> RANGE_CODE_N_BIT_MODEL_TOTAL_BITS) * prob;
+    if (d->code < bound) {
+        d->range = bound;
+        *p_prob = (uint16_t)(prob + ((RANGE_CODE_BIT_MODEL_TOTAL - prob) >> RANGE_CODE_MOVE_BITS));
+        return 0;
+    } else {
+        d->range -= bound;
+        d->code  -= bound;
+        *p_prob = (uint16_t)(prob - (prob >> RANGE_CODE_MOVE_BITS));
+        return 1;
+    }
+}
+
+
+static inline uint32_t rangeDecodeInt (RangeDecoder_t *d, uint16_t *p_prob, uint32_t bit_count) {
+    uint32_t val = 1;
+    uint32_t i;
+    for (i=0; i<bit_count; i++)
+        val = (val << 1) | rangeDecodeBit(d, p_prob+val-1);
+    return val & ((1<<bit_count)-1) ;
+}
+
+
+static inline uint32_t rangeDecodeMB (RangeDecoder_t *d, uint16_t *p_prob, uint32_t match_byte) {
+    uint32_t i, val = 1, off0 = 0x100, off1;                       // off0 and off1 can only be 0x000 or 0x100
+    for (i=0; i<8; i++) {
+        match_byte <<= 1;
+        off1 = off0;
+        off0 &= match_byte;
+        if ( ! rangeDecodeBit(d, (p_prob+(off0+off1+val-1))) ) {  // get bit 0
+            val <<= 1;
+            off0 ^= off1;
+        } else {                                                  // get bit 1
+            val <<= 1;
+            val  |= 1;
+        }
+    }
+    return val & 0xFF;
+}
+
+
+#endif // __RANGE_CODER_H__
@@ -0,0 +1,64 @@
+#define _DEFAULT_SOURCE                  // for clock_gettime(CLOCK_MONOTONIC) and getrusage() when compiling with -std=c99
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#if defined(_WIN32)
+    #define PSAPI_VERSION 2              // GetProcessMemoryInfo() is in kernel32, no need to link psapi
+    #include <windows.h>
+    #include <psapi.h>
+#else
+    #include <sys/resource.h>
+#endif
+
+#include "SysUtil.h"
+
+
+
+double getWallTime (void) {
+#if defined(_WIN32)
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+#endif
+}
+
+
+double getCpuTime (void) {
+#if defined(_WIN32)
+    FILETIME t_create, t_exit, t_kernel, t_user;
+    if (!GetProcessTimes(GetCurrentProcess(), &t_create, &t_exit, &t_kernel, &t_user))
+        return 0.0;
+    return 1e-7 * ( (double)(((uint64_t)t_kernel.dwHighDateTime << 32) | t_kernel.dwLowDateTime) +
+                    (double)(((uint64_t)t_user.dwHighDateTime   << 32) | t_user.dwLowDateTime  ) );     // FILETIME is in 100ns
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+#endif
+}
+
+
+size_t getPeakMemory (void) {
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+        return 0;
+    return (size_t)pmc.PeakWorkingSetSize;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage))
+        return 0;
+#if defined(__APPLE__)
+    return (size_t)usage.ru_maxrss;                // in bytes on macOS
+#else
+    return (size_t)usage.ru_maxrss * 1024;         // in kilobytes on Linux and BSD
+#endif
+#endif
+}
@@ -0,0 +1,20 @@
+#ifndef   __SYS_UTIL_H__
+#define   __SYS_UTIL_H__
+
+
+// Function  : get the wall-clock time from a monotonic clock, which is not affected by system time changes.
+// Return    : time in seconds, from an arbitrary starting point. Only the difference of two calls is meaningful.
+double getWallTime (void);
+
+
+// Function  : get the CPU time consumed by this process (all threads, user + system).
+// Return    : time in seconds
+double getCpuTime (void);
+
+
+// Function  : get the peak physical memory (resident set size) used by this process so far.
+// Return    : bytes, 0 if unknown
+size_t getPeakMemory (void);
+
+
+#endif // __SYS_UTIL_H__
@@ -0,0 +1,225 @@
+#define _DEFAULT_SOURCE                  // for sysconf(_SC_NPROCESSORS_ONLN) when compiling with -std=c99
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#if defined(_WIN32)
+    #if !defined(_WIN32_WINNT) || (_WIN32_WINNT < 0x0600)
+        #undef  _WIN32_WINNT
+        #define _WIN32_WINNT 0x0600      // condition variables need Windows Vista or later
+    #endif
+    #include <windows.h>
+#else
+    #include <pthread.h>
+    #include <unistd.h>
+#endif
+
+#include "Thread.h"
+
+
+#define  THREAD_STACK_SIZE      (16*1024*1024)      // some codecs put large tables on the stack (e.g., the hash table of deflate), while the default stack of a Windows thread is only 1MB
+
+
+struct Thread_t {
+#if defined(_WIN32)
+    HANDLE    handle;
+#else
+    pthread_t handle;
+#endif
+    void    (*func)(void *);
+    void     *arg;
+};
+
+
+struct Mutex_t {
+#if defined(_WIN32)
+    CRITICAL_SECTION cs;
+#else
+    pthread_mutex_t  mutex;
+#endif
+};
+
+
+struct Cond_t {
+#if defined(_WIN32)
+    CONDITION_VARIABLE cv;
+#else
+    pthread_cond_t     cond;
+#endif
+};
+
+
+
+#if defined(_WIN32)
+
+static DWORD WINAPI threadEntry (LPVOID p) {
+    Thread_t *p_thread = (Thread_t*)p;
+    p_thread->func(p_thread->arg);
+    return 0;
+}
+
+#else
+
+static void *threadEntry (void *p) {
+    Thread_t *p_thread = (Thread_t*)p;
+    p_thread->func(p_thread->arg);
+    return NULL;
+}
+
+#endif
+
+
+
+Thread_t *threadStart (void (*func)(void *), void *arg) {
+    Thread_t *p_thread = (Thread_t*)malloc(sizeof(Thread_t));
+
+    if (p_thread == NULL)
+        return NULL;
+
+    p_thread->func = func;
+    p_thread->arg  = arg;
+
+#if defined(_WIN32)
+    p_thread->handle = CreateThread(NULL, THREAD_STACK_SIZE, threadEntry, p_thread, 0, NULL);
+    if (p_thread->handle == NULL) {
+        free(p_thread);
+        return NULL;
+    }
+#else
+    {
+        pthread_attr_t attr;
+        int failed = pthread_attr_init(&attr);
+        if (!failed) {
+            pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
+            failed = pthread_create(&p_thread->handle, &attr, threadEntry, p_thread);
+            pthread_attr_destroy(&attr);
+        }
+        if (failed) {
+            free(p_thread);
+            return NULL;
+        }
+    }
+#endif
+
+    return p_thread;
+}
+
+
+void threadJoin (Thread_t *p_thread) {
+#if defined(_WIN32)
+    WaitForSingleObject(p_thread->handle, INFINITE);
+    CloseHandle(p_thread->handle);
+#else
+    pthread_join(p_thread->handle, NULL);
+#endif
+    free(p_thread);
+}
+
+
+
+Mutex_t *mutexNew (void) {
+    Mutex_t *p_mutex = (Mutex_t*)malloc(sizeof(Mutex_t));
+
+    if (p_mutex == NULL)
+        return NULL;
+
+#if defined(_WIN32)
+    InitializeCriticalSection(&p_mutex->cs);
+#else
+    if (pthread_mutex_init(&p_mutex->mutex, NULL)) {
+        free(p_mutex);
+        return NULL;
+    }
+#endif
+
+    return p_mutex;
+}
+
+
+void mutexLock (Mutex_t *p_mutex) {
+#if defined(_WIN32)
+    EnterCriticalSection(&p_mutex->cs);
+#else
+    pthread_mutex_lock(&p_mutex->mutex);
+#endif
+}
+
+
+void mutexUnlock (Mutex_t *p_mutex) {
+#if defined(_WIN32)
+    LeaveCriticalSection(&p_mutex->cs);
+#else
+    pthread_mutex_unlock(&p_mutex->mutex);
+#endif
+}
+
+
+void mutexFree (Mutex_t *p_mutex) {
+#if defined(_WIN32)
+    DeleteCriticalSection(&p_mutex->cs);
+#else
+    pthread_mutex_destroy(&p_mutex->mutex);
+#endif
+    free(p_mutex);
+}
+
+
+
+Cond_t *condNew (void) {
+    Cond_t *p_cond = (Cond_t*)malloc(sizeof(Cond_t));
+    
+    if (p_cond == NULL)
+        return NULL;
+    
+#if defined(_WIN32)
+    InitializeConditionVariable(&p_cond->cv);
+#else
+    if (pthread_cond_init(&p_cond->cond, NULL)) {
+        free(p_cond);
+        return NULL;
+    }
+#endif
+    
+    return p_cond;
+}
+
+
+void condWait (Cond_t *p_cond, Mutex_t *p_mutex) {
+#if defined(_WIN32)
+    SleepConditionVariableCS(&p_cond->cv, &p_mutex->cs, INFINITE);
+#else
+    pthread_cond_wait(&p_cond->cond, &p_mutex->mutex);
+#endif
+}
+
+
+void condBroadcast (Cond_t *p_cond) {
+#if defined(_WIN32)
+    WakeAllConditionVariable(&p_cond->cv);
+#else
+    pthread_cond_broadcast(&p_cond->cond);
+#endif
+}
+
+
+void condFree (Cond_t *p_cond) {
+#if !defined(_WIN32)                     // a Win32 condition variable needs no destruction
+    pthread_cond_destroy(&p_cond->cond);
+#endif
+    free(p_cond);
+}
+
+
+
+int getCpuCount (void) {
+    long n;
+#if defined(_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    n = (long)info.dwNumberOfProcessors;
+#else
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return (n < 1) ? 1 : (int)n;
+}
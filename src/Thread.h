@@ -0,0 +1,55 @@
+#ifndef   __THREAD_H__
+#define   __THREAD_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// a minimal portable wrapper of threads (pthreads on Linux/Unix, Win32 threads on Windows)
+
+typedef struct Thread_t Thread_t;
+typedef struct Mutex_t  Mutex_t;
+typedef struct Cond_t   Cond_t;
+
+
+// Function  : start a new thread which runs func(arg).
+// Return    :
+//     non-NULL pointer     : success
+//     NULL                 : failed
+Thread_t *threadStart (void (*func)(void *), void *arg);
+
+
+// Function  : wait until the thread returns, and release it.
+void threadJoin (Thread_t *p_thread);
+
+
+// Function  : create a mutex.
+// Return    :
+//     non-NULL pointer     : success
+//     NULL                 : failed
+Mutex_t *mutexNew (void);
+
+void mutexLock   (Mutex_t *p_mutex);
+void mutexUnlock (Mutex_t *p_mutex);
+void mutexFree   (Mutex_t *p_mutex);
+
+
+// Function  : create a condition variable.
+// Return    :
+//     non-NULL pointer     : success
+//     NULL                 : failed
+Cond_t *condNew (void);
+
+// Function  : atomically unlock the mutex and wait until the condition variable is signaled, then lock the mutex again.
+//             it may also wake up spuriously, so always check the condition in a loop.
+void condWait      (Cond_t *p_cond, Mutex_t *p_mutex);
+void condBroadcast (Cond_t *p_cond);
+void condFree      (Cond_t *p_cond);
+
+
+// Function  : get the number of online CPU cores.
+// Return    : the number of CPU cores, at least 1
+int getCpuCount (void);
+
+
+#endif // __THREAD_H__
@@ -1,5 +1,7 @@
 #include <stddef.h>  // size_t
 #include <stdint.h>  // uint8_t, uint32_t
+#include <stdlib.h>  // malloc, free
+#include <string.h>  // memcpy
 
 #define R_OK                            0
 #define R_DST_OVERFLOW                  1
@@ -113,10 +115,10 @@ static uint32_t bitsReverse (uint32_t bits, uint32_t len) {
 }
 
 
-static uint32_t calcCrc32 (uint8_t *p_src, uint32_t len) {
+static uint32_t calcCrc32 (uint32_t crc, uint8_t *p_src, uint32_t len) {        // crc : the CRC of previous data, set to 0 for the first call
     static const uint32_t TABLE_CRC32 [] = { 0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c, 0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c };
-    uint32_t crc = 0xFFFFFFFF;
     uint8_t *p_end = p_src + len;
+    crc = ~crc;
     for (; p_src<p_end; p_src++) {
         crc ^= *p_src;
         crc = TABLE_CRC32[crc & 0x0f] ^ (crc >> 4);
@@ -437,6 +439,32 @@ static int deflateBlockFixedHuffman (uint8_t* hash_table[][HASH_SIZE], struct St
 
 
 
+static int deflateBlock (uint8_t* hash_table[][HASH_SIZE], struct StreamWriter_t *p_bs, uint8_t *p_src, uint32_t len, uint32_t is_final_block) {
+    struct StreamWriter_t bs_backup = *p_bs;                                                                     // backup
+    uint32_t fixed_len, dynamic_len;
+    
+    RET_WHEN_ERR(deflateBlockFixedHuffman(hash_table, p_bs, p_src, len, is_final_block));                        // try fixed huffman
+    fixed_len = (p_bs->p_buf - bs_backup.p_buf);
+    
+    #if ( !DISABLE_DYNAMIC_HUFFMAN )
+        *p_bs = bs_backup;
+        if (deflateBlockDynamicHuffman(hash_table, p_bs, p_src, len, is_final_block) == R_OK) {                  // try dynamic huffman
+            dynamic_len = (p_bs->p_buf - bs_backup.p_buf);
+        } else {
+            dynamic_len = UINT32_MAX;                                                                            // dynamic huffman overflows the buffer while fixed huffman fits, so that the output never exceeds gzipCBound()
+        }
+        
+        if (fixed_len <= dynamic_len) {                                                                          // if the fixed huffman gets a shorter result
+            *p_bs = bs_backup;
+            RET_WHEN_ERR(deflateBlockFixedHuffman(hash_table, p_bs, p_src, len, is_final_block));                // redo fixed huffman
+        }
+    #endif
+    
+    return R_OK;
+}
+
+
+
 int deflateEncode (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len) {
     struct StreamWriter_t bs = newStreamWriter(p_dst, (*p_dst_len));
     uint8_t* hash_table [HASH_LEVEL] [HASH_SIZE];
@@ -451,25 +479,9 @@ int deflateEncode (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst
     } else {
         uint32_t i;
         for (i=0; i<src_len; i+=MAX_BLOCK_LEN) {                                                                 // for all blocks
-            struct StreamWriter_t bs_backup = bs;                                                                // backup
             uint32_t is_final_block = (i+MAX_BLOCK_LEN >= src_len);
             uint32_t block_len = is_final_block ? src_len-i : MAX_BLOCK_LEN;
-            uint32_t fixed_len, dynamic_len;
-            
-            RET_WHEN_ERR(deflateBlockFixedHuffman(hash_table, &bs, p_src+i, block_len, is_final_block));         // try fixed huffman
-            fixed_len = (bs.p_buf - p_dst);
-            
-            #if ( !DISABLE_DYNAMIC_HUFFMAN )
-                bs = bs_backup;
-                RET_WHEN_ERR(deflateBlockDynamicHuffman(hash_table, &bs, p_src+i, block_len, is_final_block));   // try dynamic huffman
-                dynamic_len = (bs.p_buf - p_dst);
-                
-                if (fixed_len <= dynamic_len) {                                                                  // if the fixed huffman gets a shorter result
-                    bs = bs_backup;
-                    RET_WHEN_ERR(deflateBlockFixedHuffman(hash_table, &bs, p_src+i, block_len, is_final_block)); // redo fixed huffman
-                    //printf("block %08x (length=%10d) appies   fixed huffman\n", i, block_len);
-                }
-            #endif
+            RET_WHEN_ERR(deflateBlock(hash_table, &bs, p_src+i, block_len, is_final_block));
         }
     }
 
@@ -499,10 +511,144 @@ int gzipC (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len) {
     RET_WHEN_ERR(deflateEncode(p_src, src_len, *pp_dst, &deflate_len));
     (*pp_dst) += deflate_len;
     
-    RET_WHEN_ERR(writeValue(pp_dst, p_dst_limit, calcCrc32(p_src, src_len), 4));
+    RET_WHEN_ERR(writeValue(pp_dst, p_dst_limit, calcCrc32(0, p_src, src_len), 4));
     RET_WHEN_ERR(writeValue(pp_dst, p_dst_limit,                  src_len , 4));
     
     *p_dst_len = (*pp_dst) - p_dst;
 
     return R_OK;
 }
+
+
+
+// a fixed huffman block costs at most 9 bits per byte (a literal costs 8 or 9 bits, and a match costs less), plus 3 bits block header and 7 bits end_of_block
+size_t gzipCBound (size_t src_len) {
+    size_t n_blocks = src_len / MAX_BLOCK_LEN + 1;
+    return 10 + (src_len + (src_len>>3) + 2*n_blocks + 1) + 8;           // gzip header + deflate blocks + gzip footer
+}
+
+
+
+// streaming compressor : the input is collected into MAX_BLOCK_LEN blocks, each block is deflated into a pending buffer, and the pending
+//                        buffer is drained to the user's output. A full block is kept until we know whether it is the final block,
+//                        so the output is exactly the same as gzipC().
+
+#define     STREAM_PEND_SIZE           (2*MAX_BLOCK_LEN + 1024)                  // enough for gzip header + a block with any huffman tree + gzip footer
+
+typedef struct GzipCStream_t {
+    uint8_t  header_written;
+    uint8_t  ended;
+    uint32_t crc;
+    uint32_t isize;                                       // input length modulo 2^32, see RFC1952
+    uint32_t blk_len;
+    uint32_t pend_pos;
+    uint32_t pend_len;
+    struct StreamWriter_t bs;                             // keeps the unfinished bits between blocks
+    uint8_t* hash_table [HASH_LEVEL] [HASH_SIZE];
+    uint8_t  blk  [MAX_BLOCK_LEN];
+    uint8_t  pend [STREAM_PEND_SIZE];
+} GzipCStream_t;
+
+
+void gzipCStreamReset (GzipCStream_t *p_st) {
+    p_st->header_written = 0;
+    p_st->ended    = 0;
+    p_st->crc      = 0;
+    p_st->isize    = 0;
+    p_st->blk_len  = 0;
+    p_st->pend_pos = 0;
+    p_st->pend_len = 0;
+    p_st->bs = newStreamWriter(p_st->pend, STREAM_PEND_SIZE);
+}
+
+
+GzipCStream_t *gzipCStreamNew (void) {
+    GzipCStream_t *p_st = (GzipCStream_t*)malloc(sizeof(GzipCStream_t));
+    if (p_st) {
+        gzipCStreamReset(p_st);
+    }
+    return p_st;
+}
+
+
+void gzipCStreamFree (GzipCStream_t *p_st) {
+    free(p_st);
+}
+
+
+size_t gzipCStreamMemUsage (void) {
+    return sizeof(GzipCStream_t);
+}
+
+
+int gzipCStreamFeed (GzipCStream_t *p_st, uint8_t *p_src, size_t *p_src_len, uint8_t *p_dst, size_t *p_dst_len, uint8_t finish) {
+    size_t src_pos = 0;
+    size_t dst_pos = 0;
+    
+    for (;;) {
+        uint8_t *p_pend_tmp   = p_st->pend;
+        uint8_t *p_pend_limit = p_st->pend + STREAM_PEND_SIZE;
+        size_t   n;
+        uint8_t  input_ended;
+        
+        n = p_st->pend_len - p_st->pend_pos;                                                      // drain pending output
+        if (n > (*p_dst_len) - dst_pos)
+            n = (*p_dst_len) - dst_pos;
+        memcpy(p_dst+dst_pos, p_st->pend+p_st->pend_pos, n);
+        p_st->pend_pos += n;
+        dst_pos        += n;
+        
+        if (p_st->pend_pos < p_st->pend_len || p_st->ended)
+            break;
+        
+        n = (*p_src_len) - src_pos;                                                               // collect input to block
+        if (n > MAX_BLOCK_LEN - p_st->blk_len)
+            n = MAX_BLOCK_LEN - p_st->blk_len;
+        memcpy(p_st->blk+p_st->blk_len, p_src+src_pos, n);
+        p_st->blk_len += n;
+        src_pos       += n;
+        
+        input_ended = finish && (src_pos == (*p_src_len));
+        
+        p_st->pend_pos = p_st->pend_len = 0;
+        
+        if (!p_st->header_written) {
+            RET_WHEN_ERR(writeValue(&p_pend_tmp, p_pend_limit, 0x00088B1FU, 4));
+            RET_WHEN_ERR(writeValue(&p_pend_tmp, p_pend_limit, 0x00000000U, 4));
+            RET_WHEN_ERR(writeValue(&p_pend_tmp, p_pend_limit,     0x0304U, 2));
+            p_st->header_written = 1;
+        }
+        
+        if ((p_st->blk_len == MAX_BLOCK_LEN && src_pos < (*p_src_len)) || input_ended) {          // the block is full and there is more input, or the input is ended
+            p_st->bs.p_buf   = p_pend_tmp;
+            p_st->bs.p_limit = p_pend_limit;
+            if (p_st->blk_len == 0) {
+                RET_WHEN_ERR(deflateBlockFixedHuffman(p_st->hash_table, &p_st->bs, NULL, 0, 1));   // special case : data length = 0, fill a empty block
+            } else {
+                RET_WHEN_ERR(deflateBlock(p_st->hash_table, &p_st->bs, p_st->blk, p_st->blk_len, input_ended));
+            }
+            p_st->crc    = calcCrc32(p_st->crc, p_st->blk, p_st->blk_len);
+            p_st->isize += p_st->blk_len;
+            p_st->blk_len = 0;
+            p_pend_tmp   = p_st->bs.p_buf;
+        }
+        
+        if (input_ended) {
+            p_st->bs.p_buf = p_pend_tmp;
+            RET_WHEN_ERR(alignBitsToBytes(&p_st->bs));
+            p_pend_tmp = p_st->bs.p_buf;
+            RET_WHEN_ERR(writeValue(&p_pend_tmp, p_pend_limit, p_st->crc  , 4));
+            RET_WHEN_ERR(writeValue(&p_pend_tmp, p_pend_limit, p_st->isize, 4));
+            p_st->ended = 1;
+        }
+        
+        p_st->pend_len = p_pend_tmp - p_st->pend;
+        
+        if (p_st->pend_len == 0)                                                                  // need more input
+            break;
+    }
+    
+    *p_src_len = src_pos;
+    *p_dst_len = dst_pos;
+    return R_OK;
+}
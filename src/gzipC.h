@@ -6,4 +6,21 @@
 
 int gzipC (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len);
 
+// the output buffer length that is always enough for gzipC to compress src_len bytes of input.
+size_t gzipCBound (size_t src_len);
+
+
+// streaming interface : feed the input chunk by chunk, and get the output chunk by chunk.
+//   gzipCStreamFeed consumes input from p_src (*p_src_len: input=available, output=consumed),
+//   and produces output to p_dst (*p_dst_len: input=capacity, output=produced).
+//   set finish=1 when there is no more input, and keep calling until it produces nothing.
+//   gzipCStreamReset makes a stream ready for a new file, reusing its buffers.
+typedef struct GzipCStream_t GzipCStream_t;
+
+GzipCStream_t *gzipCStreamNew   (void);
+int            gzipCStreamFeed  (GzipCStream_t *p_st, uint8_t *p_src, size_t *p_src_len, uint8_t *p_dst, size_t *p_dst_len, uint8_t finish);
+void           gzipCStreamReset (GzipCStream_t *p_st);
+void           gzipCStreamFree  (GzipCStream_t *p_st);
+size_t         gzipCStreamMemUsage (void);          // the memory (in bytes) allocated by gzipCStreamNew
+
 #endif // __GZIP_C_H__
@@ -691,7 +691,6 @@ static int lpaq8CodecInit (uint8_t *p_buf, size_t buf_len, lpaq8Codec_t *p_lpaq,
     n_allocate_bytes = hashTableInit(&p_lpaq->t1, mem >> 1);                                                           RET_ERR_IF(R_ERR_MEMORY_RUNOUT, 0==n_allocate_bytes);  *p_n_total_allocate_bytes+=n_allocate_bytes;
     n_allocate_bytes = hashTableInit(&p_lpaq->t2, mem);                                                                RET_ERR_IF(R_ERR_MEMORY_RUNOUT, 0==n_allocate_bytes);  *p_n_total_allocate_bytes+=n_allocate_bytes;
     n_allocate_bytes = hashTableInit(&p_lpaq->t3, mem >> 1);                                                           RET_ERR_IF(R_ERR_MEMORY_RUNOUT, 0==n_allocate_bytes);  *p_n_total_allocate_bytes+=n_allocate_bytes;
-    n_allocate_bytes = hashTableInit(&p_lpaq->t3, mem >> 1);                                                           RET_ERR_IF(R_ERR_MEMORY_RUNOUT, 0==n_allocate_bytes);  *p_n_total_allocate_bytes+=n_allocate_bytes;
     n_allocate_bytes = stateMapInit(&p_lpaq->sm0, ((p_lpaq->method==METHOD_TEXT)?LIMIT_SM0_TEXT:LIMIT_SM0), (55<<8));  RET_ERR_IF(R_ERR_MEMORY_RUNOUT, 0==n_allocate_bytes);  *p_n_total_allocate_bytes+=n_allocate_bytes;
     n_allocate_bytes = stateMapInit(&p_lpaq->sm1, LIMIT_SM1, 768);                                                     RET_ERR_IF(R_ERR_MEMORY_RUNOUT, 0==n_allocate_bytes);  *p_n_total_allocate_bytes+=n_allocate_bytes;
     n_allocate_bytes = stateMapInit(&p_lpaq->sm2, LIMIT_SM2, 768);                                                     RET_ERR_IF(R_ERR_MEMORY_RUNOUT, 0==n_allocate_bytes);  *p_n_total_allocate_bytes+=n_allocate_bytes;
@@ -759,6 +758,18 @@ static int lpaq8CodecInit (uint8_t *p_buf, size_t buf_len, lpaq8Codec_t *p_lpaq,
     return R_OK;
 }
 
+// the total bytes allocated by lpaq8CodecInit, must be consistent with it
+size_t lpaq8MemUsage (uint8_t level) {
+    size_t mem = (size_t)1 << (level+20);
+    return  ((mem >> 1) + 0x400) + (mem + 0x400) + ((mem >> 1) + 0x400)          // t1, t2, t3
+          + sizeof(uint32_t) * ((55<<8) + 6*768)                                // sm0 ~ sm6
+          + sizeof(uint32_t) * (24*0x10000 + 24*0x800)                          // sse1, sse2
+          + sizeof(uint32_t) * ((mem/8) + (mem/2))                              // mm
+          + 0x10000                                                             // tbase
+          + sizeof(int32_t)  * (MI*MC)                                          // mxr_wx
+          + sizeof(uint32_t) * (4096*3 + 256) + 8192;                           // constant lookup tables
+}
+
 static void lpaq8CodecFree (lpaq8Codec_t *p_lpaq) {
     hashTableFree(&p_lpaq->t1);
     hashTableFree(&p_lpaq->t2);
@@ -769,9 +780,11 @@ static void lpaq8CodecFree (lpaq8Codec_t *p_lpaq) {
     stateMapFree(&p_lpaq->sm3);
     stateMapFree(&p_lpaq->sm4);
     stateMapFree(&p_lpaq->sm5);
+    stateMapFree(&p_lpaq->sm6);
     secondaryEstimitorFree(&p_lpaq->sse1);
     secondaryEstimitorFree(&p_lpaq->sse2);
     matchModelFree(&p_lpaq->mm);
+    free(p_lpaq->tbase);
     free(p_lpaq->mxr_wx);
     free(p_lpaq->TAB_stretch);
     free(p_lpaq->TAB_stretch2);
@@ -784,6 +797,7 @@ static void lpaq8CodecFree (lpaq8Codec_t *p_lpaq) {
 
 int lpaq8C (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len, uint8_t level, size_t *p_mem_usage) {
     size_t i;
+    int ret_code = R_OK;
     uint32_t method = METHOD_TEXT;
     lpaq8Codec_t lpaq8_codec;
 
@@ -814,14 +828,18 @@ int lpaq8C (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len, u
 
     RET_WHEN_ERR( lpaq8CodecInit((p_dst+9), (*p_dst_len-9), &lpaq8_codec, 1, method, level, p_mem_usage) );
     
-    for (i=0; i<src_len; i++) {
+    for (i=0; i<src_len && ret_code==R_OK; i++) {
         uint8_t waste_byte;
-        RET_WHEN_ERR( lpaq8CodecByte(&lpaq8_codec, p_src[i], &waste_byte) );  // compress a byte
+        ret_code = lpaq8CodecByte(&lpaq8_codec, p_src[i], &waste_byte);       // compress a byte
     }
     
-    RET_WHEN_ERR( ariCodecFlush(&lpaq8_codec.ari_codec) );
+    if (ret_code == R_OK) {
+        ret_code = ariCodecFlush(&lpaq8_codec.ari_codec);
+    }
     
-    lpaq8CodecFree(&lpaq8_codec);
+    lpaq8CodecFree(&lpaq8_codec);                                            // free the codec even if failed (e.g., output overflow), since the caller may retry with a larger output buffer
+    
+    RET_WHEN_ERR(ret_code);
 
     *p_dst_len = lpaq8_codec.ari_codec.p_buf - p_dst;
 
@@ -830,32 +848,67 @@ int lpaq8C (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len, u
 
 
 
+static int lpaq8ParseHeader (uint8_t *p_src, size_t src_len, uint8_t *p_level, size_t *p_dst_len, uint32_t *p_method) {
+    RET_ERR_IF(R_ERR_INPUT_OVERFLOW, (src_len<9));                                   // input file too small to contain the header
+    RET_ERR_IF(R_ERR_UNSUPPORTED, (p_src[0]!='p' || p_src[1]!='Q' || p_src[2]!=8));  // Check header version, get memory option, file size
+    *p_level = (p_src[3] - '0');
+    RET_ERR_IF(R_ERR_UNSUPPORTED, (*p_level>9));                                     // invalid level (must be 0~9)
+    *p_dst_len  = ((size_t)p_src[4]) << 24;
+    *p_dst_len |= ((size_t)p_src[5]) << 16;
+    *p_dst_len |= ((size_t)p_src[6]) << 8;
+    *p_dst_len |= ((size_t)p_src[7]);
+    RET_ERR_IF(R_ERR_OUTPUT_OVERFLOW, (*p_dst_len>=0x7FFFFFFF));                     // output file too large
+    *p_method   = p_src[8];
+    RET_ERR_IF(R_ERR_UNSUPPORTED, (*p_method!=METHOD_DEFAULT && *p_method!=METHOD_TEXT));
+    return R_OK;
+}
+
+
+
 int lpaq8D (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len, uint8_t *p_level, size_t *p_mem_usage) {
     size_t dst_len, i;
     uint32_t method;
+    int ret_code = R_OK;
     lpaq8Codec_t lpaq8_codec;
 
-    RET_ERR_IF(R_ERR_INPUT_OVERFLOW, (src_len<9));                                   // input file too small to contain the header
-    RET_ERR_IF(R_ERR_UNSUPPORTED, (p_src[0]!='p' || p_src[1]!='Q' || p_src[2]!=8));  // Check header version, get memory option, file size
-    *p_level = (p_src[3] - '0');
-    RET_ERR_IF(R_ERR_UNSUPPORTED, (*p_level>9));                                     // invalid level (must be 0~9)
-    dst_len  = ((size_t)p_src[4]) << 24;
-    dst_len |= ((size_t)p_src[5]) << 16;
-    dst_len |= ((size_t)p_src[6]) << 8;
-    dst_len |= ((size_t)p_src[7]);
-    RET_ERR_IF(R_ERR_OUTPUT_OVERFLOW, (dst_len>=0x7FFFFFFF));                        // output file too large
+    RET_WHEN_ERR( lpaq8ParseHeader(p_src, src_len, p_level, &dst_len, &method) );
     RET_ERR_IF(R_ERR_OUTPUT_OVERFLOW, (dst_len>(*p_dst_len)));                       // output file too large
-    method   = p_src[8];
-    RET_ERR_IF(R_ERR_UNSUPPORTED, (method!=METHOD_DEFAULT && method!=METHOD_TEXT));
 
     RET_WHEN_ERR( lpaq8CodecInit((p_src+9), (src_len-9), &lpaq8_codec, 0, method, (uint32_t)(*p_level), p_mem_usage) );
     
-    for (i=0; i<dst_len; i++) {
-        RET_WHEN_ERR( lpaq8CodecByte(&lpaq8_codec, 0, &p_dst[i]) );
+    for (i=0; i<dst_len && ret_code==R_OK; i++) {
+        ret_code = lpaq8CodecByte(&lpaq8_codec, 0, &p_dst[i]);
     }
 
+    lpaq8CodecFree(&lpaq8_codec);
+
+    RET_WHEN_ERR(ret_code);
+
     *p_dst_len = dst_len;
 
     return R_OK;
 }
 
+
+
+int lpaq8DGetMemUsage (uint8_t *p_src, size_t src_len, size_t *p_mem_usage) {
+    uint32_t method;
+    uint8_t  level;
+    size_t   dst_len;
+    RET_WHEN_ERR( lpaq8ParseHeader(p_src, src_len, &level, &dst_len, &method) );
+    *p_mem_usage = lpaq8MemUsage(level);
+    return R_OK;
+}
+
+
+int lpaq8DGetSize (uint8_t *p_src, size_t src_len, size_t *p_dst_len) {
+    uint8_t  level;
+    uint32_t method;
+    return lpaq8ParseHeader(p_src, src_len, &level, p_dst_len, &method);
+}
+
+
+
+size_t lpaq8CBound (size_t src_len) {
+    return 9 + src_len + (src_len>>4) + 1024;        // header + the data. lpaq8 expands incompressible data by less than 1%, only a pathological input may still overflow (R_ERR_OUTPUT_OVERFLOW)
+}
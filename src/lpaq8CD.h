@@ -7,4 +7,17 @@
 int lpaq8D (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len, uint8_t *p_level, size_t *p_mem_usage);
 int lpaq8C (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len, uint8_t    level, size_t *p_mem_usage);
 
+// get the decompressed length from the header without decompressing. return 0 on success.
+int lpaq8DGetSize (uint8_t *p_src, size_t src_len, size_t *p_dst_len);
+
+// the output buffer length that lpaq8C needs for src_len bytes of input.
+// only a pathological input may still overflow it, then lpaq8C returns 3 (output overflow) and the caller may retry with a larger buffer.
+size_t lpaq8CBound (size_t src_len);
+
+// the memory (in bytes) allocated by lpaq8C and lpaq8D at the given level (0~9). It's about 4.5 x (1<<(level+20)) + 7MB
+size_t lpaq8MemUsage (uint8_t level);
+
+// get the memory (in bytes) that lpaq8D will allocate from the header (it depends on the level). return 0 on success.
+int lpaq8DGetMemUsage (uint8_t *p_src, size_t src_len, size_t *p_mem_usage);
+
 #endif // __LPAQ8_CD_H__
@@ -1,9 +1,12 @@
 #include <stddef.h>   // size_t
 #include <stdint.h>   // uint8_t, uint64_t
+#include <stdlib.h>   // malloc, free
+#include <string.h>   // memcpy
 
 #define R_OK                            0
 #define R_DST_OVERFLOW                  1
 #define R_SRC_OVERFLOW                  2
+#define R_MALLOC_FAIL                   3
 
 #define RET_WHEN_ERR(err_code)          { int ec = (err_code); if (ec)  return ec; }
 #define RET_ERR_IF(err_code,condition)  { if (condition) return err_code; }
@@ -120,8 +123,14 @@ static int LZ4_compress_or_copy_block_with_csize (uint8_t *p_src, uint8_t *p_src
         RET_WHEN_ERR(LZ4_copy(p_src, p_src_end, pp_dst, p_dst_limit));
         csize |= 0x80000000U;
     } else {
-        RET_WHEN_ERR(LZ4_compress_block(p_src, p_src_end, pp_dst, p_dst_limit));
-        if (csize > (*pp_dst) - p_dst_base) {
+        uint8_t *p_cmprs_limit = p_dst_base + csize;                     // a compressed block which is not smaller than the original block is useless,
+        int      ret_code;                                               // so stop compressing at there, which also makes the output never exceed lz4CBound()
+        if (p_cmprs_limit > p_dst_limit) {
+            p_cmprs_limit = p_dst_limit;
+        }
+        ret_code = LZ4_compress_block(p_src, p_src_end, pp_dst, p_cmprs_limit);
+        RET_ERR_IF(ret_code, (ret_code != R_OK && ret_code != R_DST_OVERFLOW));
+        if (ret_code == R_OK && csize > (*pp_dst) - p_dst_base) {
             csize = (*pp_dst) - p_dst_base;
         } else {
             *pp_dst = p_dst_base;
@@ -137,13 +146,7 @@ static int LZ4_compress_or_copy_block_with_csize (uint8_t *p_src, uint8_t *p_src
 }
 
 
-int lz4C (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len) {
-    uint8_t  *p_src_limit = p_src + src_len;
-    uint8_t  *p_dst_tmp   = p_dst;
-    uint8_t **pp_dst      = &p_dst_tmp;
-    uint8_t  *p_dst_limit = p_dst + (*p_dst_len);
-    RET_ERR_IF(R_SRC_OVERFLOW, p_src > p_src_limit);
-    RET_ERR_IF(R_DST_OVERFLOW, p_dst > p_dst_limit);
+static int LZ4_write_frame_header (uint8_t **pp_dst, uint8_t *p_dst_limit) {
     RET_WHEN_ERR(LZ4_write(pp_dst, p_dst_limit, 0x04));
     RET_WHEN_ERR(LZ4_write(pp_dst, p_dst_limit, 0x22));
     RET_WHEN_ERR(LZ4_write(pp_dst, p_dst_limit, 0x4D));
@@ -151,6 +154,27 @@ int lz4C (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len) {
     RET_WHEN_ERR(LZ4_write(pp_dst, p_dst_limit, 0x60));
     RET_WHEN_ERR(LZ4_write(pp_dst, p_dst_limit, 0x70));
     RET_WHEN_ERR(LZ4_write(pp_dst, p_dst_limit, 0x73));
+    return R_OK;
+}
+
+
+static int LZ4_write_end_mark (uint8_t **pp_dst, uint8_t *p_dst_limit) {
+    RET_WHEN_ERR(LZ4_write(pp_dst, p_dst_limit, 0x00));
+    RET_WHEN_ERR(LZ4_write(pp_dst, p_dst_limit, 0x00));
+    RET_WHEN_ERR(LZ4_write(pp_dst, p_dst_limit, 0x00));
+    RET_WHEN_ERR(LZ4_write(pp_dst, p_dst_limit, 0x00));
+    return R_OK;
+}
+
+
+int lz4C (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len) {
+    uint8_t  *p_src_limit = p_src + src_len;
+    uint8_t  *p_dst_tmp   = p_dst;
+    uint8_t **pp_dst      = &p_dst_tmp;
+    uint8_t  *p_dst_limit = p_dst + (*p_dst_len);
+    RET_ERR_IF(R_SRC_OVERFLOW, p_src > p_src_limit);
+    RET_ERR_IF(R_DST_OVERFLOW, p_dst > p_dst_limit);
+    RET_WHEN_ERR(LZ4_write_frame_header(pp_dst, p_dst_limit));
     while (p_src < p_src_limit) {
         uint8_t *p_src_end = p_src_limit;      // block end
         if (p_src_end - p_src > MAX_COMPRESSED_BLOCK_SIZE) {
@@ -159,11 +183,113 @@ int lz4C (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len) {
         RET_WHEN_ERR(LZ4_compress_or_copy_block_with_csize(p_src, p_src_end, pp_dst, p_dst_limit));
         p_src = p_src_end;
     }
-    RET_WHEN_ERR(LZ4_write(pp_dst, p_dst_limit, 0x00));
-    RET_WHEN_ERR(LZ4_write(pp_dst, p_dst_limit, 0x00));
-    RET_WHEN_ERR(LZ4_write(pp_dst, p_dst_limit, 0x00));
-    RET_WHEN_ERR(LZ4_write(pp_dst, p_dst_limit, 0x00));
+    RET_WHEN_ERR(LZ4_write_end_mark(pp_dst, p_dst_limit));
     *p_dst_len = (*pp_dst) - p_dst;
     return R_OK;
 }
 
+
+
+size_t lz4CBound (size_t src_len) {
+    size_t n_blocks = (src_len + MAX_COMPRESSED_BLOCK_SIZE - 1) / MAX_COMPRESSED_BLOCK_SIZE;
+    return 7 + src_len + 4 * n_blocks + 4;                               // frame header + (csize + at most the original block) for each block + end mark
+}
+
+
+
+// streaming compressor : the input is collected into MAX_COMPRESSED_BLOCK_SIZE blocks, each block is compressed into a pending buffer,
+//                        and the pending buffer is drained to the user's output. So the output is exactly the same as lz4C().
+
+#define STREAM_PEND_SIZE                (MAX_COMPRESSED_BLOCK_SIZE + 64)   // enough for frame header + csize + a block (which is never larger than the original block) + end mark
+
+typedef struct LZ4CStream_t {
+    uint8_t  header_written;
+    uint8_t  ended;
+    size_t   blk_len;
+    size_t   pend_pos;
+    size_t   pend_len;
+    uint8_t  blk  [MAX_COMPRESSED_BLOCK_SIZE];
+    uint8_t  pend [STREAM_PEND_SIZE];
+} LZ4CStream_t;
+
+
+void lz4CStreamReset (LZ4CStream_t *p_st) {
+    p_st->header_written = 0;
+    p_st->ended    = 0;
+    p_st->blk_len  = 0;
+    p_st->pend_pos = 0;
+    p_st->pend_len = 0;
+}
+
+
+LZ4CStream_t *lz4CStreamNew (void) {
+    LZ4CStream_t *p_st = (LZ4CStream_t*)malloc(sizeof(LZ4CStream_t));
+    if (p_st) {
+        lz4CStreamReset(p_st);
+    }
+    return p_st;
+}
+
+
+void lz4CStreamFree (LZ4CStream_t *p_st) {
+    free(p_st);
+}
+
+
+size_t lz4CStreamMemUsage (void) {
+    return sizeof(LZ4CStream_t);
+}
+
+
+int lz4CStreamFeed (LZ4CStream_t *p_st, uint8_t *p_src, size_t *p_src_len, uint8_t *p_dst, size_t *p_dst_len, uint8_t finish) {
+    size_t src_pos = 0;
+    size_t dst_pos = 0;
+    for (;;) {
+        uint8_t  *p_pend_tmp   = p_st->pend;
+        uint8_t  *p_pend_limit = p_st->pend + STREAM_PEND_SIZE;
+        size_t    n;
+        
+        n = p_st->pend_len - p_st->pend_pos;                                                      // drain pending output
+        if (n > (*p_dst_len) - dst_pos)
+            n = (*p_dst_len) - dst_pos;
+        memcpy(p_dst+dst_pos, p_st->pend+p_st->pend_pos, n);
+        p_st->pend_pos += n;
+        dst_pos        += n;
+        
+        if (p_st->pend_pos < p_st->pend_len || p_st->ended)
+            break;
+        
+        n = (*p_src_len) - src_pos;                                                               // collect input to block
+        if (n > MAX_COMPRESSED_BLOCK_SIZE - p_st->blk_len)
+            n = MAX_COMPRESSED_BLOCK_SIZE - p_st->blk_len;
+        memcpy(p_st->blk+p_st->blk_len, p_src+src_pos, n);
+        p_st->blk_len += n;
+        src_pos       += n;
+        
+        p_st->pend_pos = p_st->pend_len = 0;
+        
+        if (!p_st->header_written) {
+            RET_WHEN_ERR(LZ4_write_frame_header(&p_pend_tmp, p_pend_limit));
+            p_st->header_written = 1;
+        }
+        
+        if (p_st->blk_len == MAX_COMPRESSED_BLOCK_SIZE || (finish && src_pos == (*p_src_len) && p_st->blk_len > 0)) {
+            RET_WHEN_ERR(LZ4_compress_or_copy_block_with_csize(p_st->blk, p_st->blk+p_st->blk_len, &p_pend_tmp, p_pend_limit));
+            p_st->blk_len = 0;
+        }
+        
+        if (finish && src_pos == (*p_src_len) && p_st->blk_len == 0) {
+            RET_WHEN_ERR(LZ4_write_end_mark(&p_pend_tmp, p_pend_limit));
+            p_st->ended = 1;
+        }
+        
+        p_st->pend_len = p_pend_tmp - p_st->pend;
+        
+        if (p_st->pend_len == 0)                                                                  // need more input
+            break;
+    }
+    *p_src_len = src_pos;
+    *p_dst_len = dst_pos;
+    return R_OK;
+}
+
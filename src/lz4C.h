@@ -6,4 +6,21 @@
 
 int lz4C (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len);
 
+// the output buffer length that is always enough for lz4C to compress src_len bytes of input.
+size_t lz4CBound (size_t src_len);
+
+
+// streaming interface : feed the input chunk by chunk, and get the output chunk by chunk.
+//   lz4CStreamFeed consumes input from p_src (*p_src_len: input=available, output=consumed),
+//   and produces output to p_dst (*p_dst_len: input=capacity, output=produced).
+//   set finish=1 when there is no more input, and keep calling until it produces nothing.
+//   lz4CStreamReset makes a stream ready for a new file, reusing its buffers.
+typedef struct LZ4CStream_t LZ4CStream_t;
+
+LZ4CStream_t *lz4CStreamNew   (void);
+int           lz4CStreamFeed  (LZ4CStream_t *p_st, uint8_t *p_src, size_t *p_src_len, uint8_t *p_dst, size_t *p_dst_len, uint8_t finish);
+void          lz4CStreamReset (LZ4CStream_t *p_st);
+void          lz4CStreamFree  (LZ4CStream_t *p_st);
+size_t        lz4CStreamMemUsage (void);          // the memory (in bytes) allocated by lz4CStreamNew
+
 #endif // __LZ4_C_H__
@@ -1,5 +1,7 @@
 #include <stddef.h>   // size_t
 #include <stdint.h>   // uint8_t, uint64_t
+#include <stdlib.h>   // malloc, free
+#include <string.h>   // memcpy, memmove
 
 #define R_OK                            0
 #define R_DST_OVERFLOW                  1
@@ -7,6 +9,7 @@
 #define R_CORRUPT                       3
 #define R_VERSION                       4
 #define R_NOT_LZ4                       5
+#define R_MALLOC_FAIL                   6
 #define R_NOT_YET_SUPPORT               101
 
 #define RET_WHEN_ERR(err_code)          { int ec = (err_code); if (ec)  return ec; }
@@ -19,6 +22,8 @@
 
 #define MIN_ML                          4
 
+#define LEGACY_BLOCK_SIZE               (8*1024*1024)
+
 
 static int LZ4_skip (uint8_t **pp_src, uint8_t *p_src_limit, uint64_t n_bytes) {
     RET_ERR_IF(R_SRC_OVERFLOW, (n_bytes > p_src_limit - *pp_src));
@@ -183,3 +188,304 @@ int lz4D (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len) {
     return R_OK;
 }
 
+
+
+// a compressed block decompresses to at most 255 bytes per compressed byte (a 255 byte in the match length VLC), and never exceeds the max block size
+static uint64_t LZ4_block_bound (uint64_t block_csize, uint64_t block_max_size) {
+    if (block_csize >= 0x80000000U) {                                   // uncompressed block
+        return block_csize - 0x80000000U;
+    } else if (block_csize > block_max_size / 255) {
+        return block_max_size;
+    } else {
+        return block_csize * 255;
+    }
+}
+
+
+int lz4DGetSize (uint8_t *p_src, size_t src_len, size_t *p_dst_len) {
+    uint8_t *p_src_limit = p_src + src_len;
+    uint64_t total = 0;
+    while (p_src < p_src_limit) {
+        uint64_t magic, block_csize;
+        RET_WHEN_ERR(LZ4_read(&p_src, p_src_limit, 4, &magic));
+        if        (magic == MAGIC_LZ4LEGACY) {
+            while (p_src != p_src_limit) {
+                RET_WHEN_ERR(LZ4_read(&p_src, p_src_limit, 4, &block_csize));
+                if (block_csize == MAGIC_LZ4LEGACY || block_csize == MAGIC_LZ4FRAME || (MAGIC_SKIPFRAME_MIN <= block_csize && block_csize <= MAGIC_SKIPFRAME_MAX)) {
+                    p_src -= 4;
+                    break;
+                }
+                RET_WHEN_ERR(LZ4_skip(&p_src, p_src_limit, block_csize));
+                total += LZ4_block_bound(block_csize, LEGACY_BLOCK_SIZE);
+            }
+        } else if (magic == MAGIC_LZ4FRAME) {
+            uint8_t  block_checksum_flag, content_checksum_flag, content_size_flag;
+            uint64_t content_size, block_max_size, frame_bound = 0;
+            uint8_t *p_descriptor = p_src;
+            RET_WHEN_ERR(LZ4_parse_frame_descriptor(&p_src, p_src_limit, &block_checksum_flag, &content_checksum_flag, &content_size_flag, &content_size));
+            block_max_size = (uint64_t)1 << (8 + 2 * ((p_descriptor[1] >> 4) & 7));   // Block MaxSize 4,5,6,7 -> 64kB, 256kB, 1MB, 4MB
+            RET_WHEN_ERR(LZ4_read(&p_src, p_src_limit, 4, &block_csize));
+            while (block_csize != 0x00000000U) {                                 // walk the blocks even if the content size is known, to validate the frame structure
+                RET_WHEN_ERR(LZ4_skip(&p_src, p_src_limit, (block_csize & 0x7FFFFFFFU) + (block_checksum_flag ? 4 : 0)));
+                frame_bound += LZ4_block_bound(block_csize, block_max_size);
+                RET_WHEN_ERR(LZ4_read(&p_src, p_src_limit, 4, &block_csize));
+            }
+            if (content_checksum_flag) {
+                RET_WHEN_ERR(LZ4_skip(&p_src, p_src_limit, 4));
+            }
+            if (content_size_flag && content_size < frame_bound) {
+                frame_bound = content_size;                                      // exact size. (a corrupted content size larger than the bound is ignored)
+            }
+            total += frame_bound;
+        } else if (MAGIC_SKIPFRAME_MIN <= magic && magic <= MAGIC_SKIPFRAME_MAX) {
+            uint64_t skip_frame_len;
+            RET_WHEN_ERR(LZ4_read(&p_src, p_src_limit, 4, &skip_frame_len));
+            RET_WHEN_ERR(LZ4_skip(&p_src, p_src_limit, skip_frame_len));
+        } else {
+            RET_ERR_IF(R_NOT_LZ4, 1);
+        }
+    }
+    RET_ERR_IF(R_DST_OVERFLOW, (total > (size_t)-1));
+    *p_dst_len = (size_t)total;
+    return R_OK;
+}
+
+
+
+// streaming decompressor : the input is collected until a whole unit (magic, frame descriptor, block, ...) is available.
+//                          each block is decompressed into a window which keeps the last 64kB of history for the linked blocks,
+//                          and the decompressed block is drained to the user's output.
+
+#define STREAM_HISTORY_SIZE             65536                            // LZ4 offset is at most 65535
+#define STREAM_MAX_BLOCK_SIZE           LEGACY_BLOCK_SIZE                    // legacy frame's block size is 8MB, LZ4 frame's block size is at most 4MB
+#define STREAM_MAX_UNIT_SIZE            (STREAM_MAX_BLOCK_SIZE + STREAM_MAX_BLOCK_SIZE/255 + 64)
+
+typedef enum {
+    ST_MAGIC,
+    ST_FRAME_DESCRIPTOR,
+    ST_BLOCK_SIZE,
+    ST_BLOCK,
+    ST_CONTENT_CHECKSUM,
+    ST_SKIP_FRAME_LEN,
+    ST_SKIP_FRAME,
+    ST_LEGACY_BLOCK_SIZE,
+    ST_LEGACY_BLOCK
+} STREAM_STATE_t;
+
+typedef struct LZ4DStream_t {
+    STREAM_STATE_t state;
+    uint8_t  block_checksum_flag;
+    uint8_t  content_checksum_flag;
+    uint8_t  content_size_flag;
+    uint64_t content_size;
+    uint64_t frame_decoded_size;
+    uint64_t block_csize;
+    uint64_t skip_len;
+    size_t   need;                                      // the length of current unit
+    size_t   unit_len;                                  // the collected length of current unit
+    size_t   win_len;                                   // history + decompressed block in window
+    size_t   pend_pos;
+    uint8_t  unit [STREAM_MAX_UNIT_SIZE];
+    uint8_t  win  [STREAM_HISTORY_SIZE + STREAM_MAX_BLOCK_SIZE];
+} LZ4DStream_t;
+
+
+void lz4DStreamReset (LZ4DStream_t *p_st) {
+    p_st->state    = ST_MAGIC;
+    p_st->need     = 4;
+    p_st->unit_len = 0;
+    p_st->win_len  = 0;
+    p_st->pend_pos = 0;
+}
+
+
+LZ4DStream_t *lz4DStreamNew (void) {
+    LZ4DStream_t *p_st = (LZ4DStream_t*)malloc(sizeof(LZ4DStream_t));
+    if (p_st) {
+        lz4DStreamReset(p_st);
+    }
+    return p_st;
+}
+
+
+void lz4DStreamFree (LZ4DStream_t *p_st) {
+    free(p_st);
+}
+
+
+size_t lz4DStreamMemUsage (void) {
+    return sizeof(LZ4DStream_t);
+}
+
+
+static int LZ4_stream_decompress_block (LZ4DStream_t *p_st, uint8_t is_compressed) {
+    uint8_t *p_src       = p_st->unit;
+    uint8_t *p_src_limit = p_st->unit + p_st->unit_len;
+    uint8_t *p_dst, *p_dst_limit;
+    
+    if (p_st->win_len > STREAM_HISTORY_SIZE) {                                                    // only keep the last 64kB as history
+        memmove(p_st->win, p_st->win + p_st->win_len - STREAM_HISTORY_SIZE, STREAM_HISTORY_SIZE);
+        p_st->win_len = STREAM_HISTORY_SIZE;
+    }
+    
+    p_dst       = p_st->win + p_st->win_len;
+    p_dst_limit = p_st->win + sizeof(p_st->win);
+    p_st->pend_pos = p_st->win_len;
+    
+    if (is_compressed) {
+        RET_WHEN_ERR(LZ4_decompress_block(&p_src, p_src_limit, &p_dst, p_dst_limit, p_st->block_csize));
+    } else {
+        RET_WHEN_ERR(LZ4_copy(&p_src, p_src_limit, &p_dst, p_dst_limit, p_st->block_csize));
+    }
+    
+    p_st->win_len = p_dst - p_st->win;
+    p_st->frame_decoded_size += p_st->win_len - p_st->pend_pos;
+    return R_OK;
+}
+
+
+static int LZ4_stream_parse_unit (LZ4DStream_t *p_st) {
+    uint8_t *p_src       = p_st->unit;
+    uint8_t *p_src_limit = p_st->unit + p_st->unit_len;
+    uint64_t value;
+    
+    switch (p_st->state) {
+        case ST_MAGIC :
+            RET_WHEN_ERR(LZ4_read(&p_src, p_src_limit, 4, &value));
+            if        (value == MAGIC_LZ4LEGACY) {
+                p_st->state = ST_LEGACY_BLOCK_SIZE;
+                p_st->need  = 4;
+            } else if (value == MAGIC_LZ4FRAME) {
+                p_st->state = ST_FRAME_DESCRIPTOR;
+                p_st->need  = 3;
+            } else if (MAGIC_SKIPFRAME_MIN <= value && value <= MAGIC_SKIPFRAME_MAX) {
+                p_st->state = ST_SKIP_FRAME_LEN;
+                p_st->need  = 4;
+            } else {
+                RET_ERR_IF(R_NOT_LZ4, 1);
+            }
+            break;
+        
+        case ST_FRAME_DESCRIPTOR :
+            if (p_st->need == 3 && ((p_src[0] >> 3) & 1)) {                                       // content size exists, the descriptor is 8 bytes longer
+                p_st->need = 3 + 8;
+                return R_OK;
+            }
+            RET_WHEN_ERR(LZ4_parse_frame_descriptor(&p_src, p_src_limit, &p_st->block_checksum_flag, &p_st->content_checksum_flag, &p_st->content_size_flag, &p_st->content_size));
+            p_st->frame_decoded_size = 0;
+            p_st->state = ST_BLOCK_SIZE;
+            p_st->need  = 4;
+            break;
+        
+        case ST_BLOCK_SIZE :
+            RET_WHEN_ERR(LZ4_read(&p_src, p_src_limit, 4, &p_st->block_csize));
+            if (p_st->block_csize == 0x00000000U) {                                              // end mark
+                if (p_st->content_size_flag) {
+                    RET_ERR_IF(R_CORRUPT, (p_st->frame_decoded_size != p_st->content_size));
+                }
+                p_st->state = p_st->content_checksum_flag ? ST_CONTENT_CHECKSUM : ST_MAGIC;
+                p_st->need  = 4;
+            } else {
+                RET_ERR_IF(R_CORRUPT, ((p_st->block_csize & 0x7FFFFFFFU) > STREAM_MAX_UNIT_SIZE - 4));
+                p_st->state = ST_BLOCK;
+                p_st->need  = (p_st->block_csize & 0x7FFFFFFFU) + (p_st->block_checksum_flag ? 4 : 0);
+            }
+            break;
+        
+        case ST_BLOCK :                                                                           // the block checksum (if any) is the tail of the unit, it is not verified on purpose, like lz4D()
+            if (p_st->block_csize < 0x80000000U) {
+                RET_WHEN_ERR(LZ4_stream_decompress_block(p_st, 1));
+            } else {
+                p_st->block_csize -= 0x80000000U;
+                RET_WHEN_ERR(LZ4_stream_decompress_block(p_st, 0));
+            }
+            p_st->state = ST_BLOCK_SIZE;
+            p_st->need  = 4;
+            break;
+        
+        case ST_CONTENT_CHECKSUM :                                                                // the content checksum is not verified on purpose, like lz4D()
+            p_st->state = ST_MAGIC;
+            p_st->need  = 4;
+            break;
+        
+        case ST_SKIP_FRAME_LEN :
+            RET_WHEN_ERR(LZ4_read(&p_src, p_src_limit, 4, &p_st->skip_len));
+            p_st->state = ST_SKIP_FRAME;
+            p_st->need  = 0;
+            break;
+        
+        case ST_SKIP_FRAME :                                                                      // skipping is done in lz4DStreamFeed
+            break;
+        
+        case ST_LEGACY_BLOCK_SIZE :
+            RET_WHEN_ERR(LZ4_read(&p_src, p_src_limit, 4, &p_st->block_csize));
+            if (p_st->block_csize == MAGIC_LZ4LEGACY || p_st->block_csize == MAGIC_LZ4FRAME || (MAGIC_SKIPFRAME_MIN <= p_st->block_csize && p_st->block_csize <= MAGIC_SKIPFRAME_MAX)) {  // meeting known magic
+                p_st->state = ST_MAGIC;                                                           // parse this unit again as a magic
+                return LZ4_stream_parse_unit(p_st);
+            }
+            RET_ERR_IF(R_CORRUPT, (p_st->block_csize > STREAM_MAX_UNIT_SIZE));
+            p_st->state = ST_LEGACY_BLOCK;
+            p_st->need  = p_st->block_csize;
+            break;
+        
+        case ST_LEGACY_BLOCK :
+            RET_WHEN_ERR(LZ4_stream_decompress_block(p_st, 1));
+            p_st->state = ST_LEGACY_BLOCK_SIZE;
+            p_st->need  = 4;
+            break;
+    }
+    
+    p_st->unit_len = 0;
+    return R_OK;
+}
+
+
+int lz4DStreamFeed (LZ4DStream_t *p_st, uint8_t *p_src, size_t *p_src_len, uint8_t *p_dst, size_t *p_dst_len, uint8_t finish) {
+    size_t src_pos = 0;
+    size_t dst_pos = 0;
+    
+    for (;;) {
+        size_t n = p_st->win_len - p_st->pend_pos;                                                // drain the decompressed block
+        if (n > (*p_dst_len) - dst_pos)
+            n = (*p_dst_len) - dst_pos;
+        memcpy(p_dst+dst_pos, p_st->win+p_st->pend_pos, n);
+        p_st->pend_pos += n;
+        dst_pos        += n;
+        
+        if (p_st->pend_pos < p_st->win_len)                                                       // user's output is full
+            break;
+        
+        if (p_st->state == ST_SKIP_FRAME) {
+            n = (*p_src_len) - src_pos;
+            if (n > p_st->skip_len)
+                n = p_st->skip_len;
+            src_pos        += n;
+            p_st->skip_len -= n;
+            if (p_st->skip_len > 0)                                                               // need more input
+                break;
+            p_st->state = ST_MAGIC;
+            p_st->need  = 4;
+        }
+        
+        n = (*p_src_len) - src_pos;                                                               // collect input to the current unit
+        if (n > p_st->need - p_st->unit_len)
+            n = p_st->need - p_st->unit_len;
+        memcpy(p_st->unit+p_st->unit_len, p_src+src_pos, n);
+        p_st->unit_len += n;
+        src_pos        += n;
+        
+        if (p_st->unit_len < p_st->need)                                                          // need more input
+            break;
+        
+        RET_WHEN_ERR(LZ4_stream_parse_unit(p_st));
+    }
+    
+    if (finish && src_pos == (*p_src_len) && dst_pos == 0) {                                     // all done, check whether the input is truncated
+        uint8_t at_boundary = (p_st->unit_len == 0) && (p_st->state == ST_MAGIC || p_st->state == ST_LEGACY_BLOCK_SIZE);
+        RET_ERR_IF(R_SRC_OVERFLOW, !at_boundary);
+    }
+    
+    *p_src_len = src_pos;
+    *p_dst_len = dst_pos;
+    return R_OK;
+}
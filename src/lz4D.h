@@ -6,4 +6,22 @@
 
 int lz4D (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len);
 
+// get the decompressed length without decompressing : exact if all frames record the content size, otherwise an upper bound. return 0 on success.
+int lz4DGetSize (uint8_t *p_src, size_t src_len, size_t *p_dst_len);
+
+
+// streaming interface : feed the input chunk by chunk, and get the output chunk by chunk.
+//   lz4DStreamFeed consumes input from p_src (*p_src_len: input=available, output=consumed),
+//   and produces output to p_dst (*p_dst_len: input=capacity, output=produced).
+//   set finish=1 when there is no more input, and keep calling until it produces nothing.
+//   lz4DStreamReset makes a stream ready for a new file, reusing its buffers.
+//   like lz4D, the block and content checksums (xxh32) are skipped without verifying.
+typedef struct LZ4DStream_t LZ4DStream_t;
+
+LZ4DStream_t *lz4DStreamNew   (void);
+int           lz4DStreamFeed  (LZ4DStream_t *p_st, uint8_t *p_src, size_t *p_src_len, uint8_t *p_dst, size_t *p_dst_len, uint8_t finish);
+void          lz4DStreamReset (LZ4DStream_t *p_st);
+void          lz4DStreamFree  (LZ4DStream_t *p_st);
+size_t        lz4DStreamMemUsage (void);          // the memory (in bytes) allocated by lz4DStreamNew
+
 #endif // __LZ4_D_H__
@@ -1,6 +1,11 @@
 #include <stddef.h>   // size_t
 #include <stdint.h>   // uint8_t, uint16_t, uint32_t
 #include <stdlib.h>   // malloc, free
+#include <string.h>   // memcpy
+
+#include "lzmaC.h"    // LzmaCParams_t
+#include "Thread.h"   // for the match finder thread
+#include "RangeCoder.h"
 
 #define   R_OK                           0
 #define   R_ERR_MEMORY_RUNOUT            1
@@ -46,216 +51,848 @@ static uint32_t countBit (uint32_t val) {         // count bits after the highes
 
 
 
+
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Range Encoder
+// LZ {length, distance} searching algorithm
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-#define   RANGE_CODE_NORMALIZE_THRESHOLD           (1 << 24)
-#define   RANGE_CODE_MOVE_BITS                     5
-#define   RANGE_CODE_N_BIT_MODEL_TOTAL_BITS        11
-#define   RANGE_CODE_BIT_MODEL_TOTAL               (1 << RANGE_CODE_N_BIT_MODEL_TOTAL_BITS)
-#define   RANGE_CODE_HALF_PROBABILITY              (RANGE_CODE_BIT_MODEL_TOTAL >> 1)
+#define    LZ_LEN_MAX                          273
+//#define    LZ_DIST_MAX_PLUS1                   0xFFFFFFFF
+#define    LZ_DIST_MAX_PLUS1                   0x40000000
+
+#define    DICT_LEN_MIN                        4096
+#define    DICT_LEN_MAX                        LZ_DIST_MAX_PLUS1
+#define    HASH_BITS_MIN                       10
+#define    HASH_BITS_MAX                       24
+#define    HASH_DEPTH_MIN                      1
+#define    HASH_DEPTH_MAX                      64
+#define    NICE_LEN_MIN                        8
 
-#define   RANGE_CODE_CACHE_SIZE_MAX                (~((size_t)0))
+#define    INVALID_HASH_ITEM                   (~((size_t)0))               // use maximum value of size_t as invalid hash entry
 
 
-typedef struct {
-    uint8_t  overflow;
-    uint8_t  cache;
-    uint8_t  low_msb;            // the 32th bit (high 1 bit) of "low"
-    uint32_t low_lsb;            // the 31~0th bit (low 32 bits) of "low". Note that ((low_msb<<32) | low_lsb) forms a 33-bit unsigned integer. The goal is to avoid using 64-bit integer type.
-    uint32_t range;
-    size_t   cache_size;
-    uint8_t *p_dst;
-    uint8_t *p_dst_limit;
-} RangeEncoder_t;
-
-
-static RangeEncoder_t newRangeEncoder (uint8_t *p_dst, size_t dst_len) {
-    RangeEncoder_t coder;
-    coder.cache       = 0;
-    coder.low_msb     = 0;
-    coder.low_lsb     = 0;
-    coder.range       = 0xFFFFFFFF;
-    coder.cache_size  = 1;
-    coder.p_dst       = p_dst;
-    coder.p_dst_limit = p_dst + dst_len;
-    coder.overflow    = 0;
-    return coder;
+#define    HASH_MULTIPLIER                     0x9E3779B1U                  // golden ratio of 2^32, for multiplicative hashing
+#define    CACHE_LINE_SIZE                     64
+
+
+// The hash chain table of the HC match finder. Each bucket is a ring of (depth) 32-bit positions, the oldest one is overwritten
+// by a new one, so that inserting is O(1). A position is stored as (pos+1) modulo 2^32, 0 means empty. The distance is restored
+// by modular subtraction, thus an input larger than 4GB is also correct : an aliased old position only gives a bad candidate,
+// whose bytes are always verified. With the default depth of 16, a bucket is exactly a 64-byte cache line.
+typedef struct HashTable_t {
+    void     *p_buf;                      // the allocated memory, the items are aligned to the cache line in it
+    uint32_t *p_items;                    // (1<<bits) buckets, each bucket has (depth) items
+    uint8_t  *p_heads;                    // (1<<bits) ring heads : the index in the bucket where the next position is written
+    uint32_t  shift;                      // 32 - bits
+    uint32_t  depth;
+    size_t    next_pos;                   // all the positions before it are in the table
+} HashTable_t;
+
+
+static int newHashTable (HashTable_t *p_ht, uint32_t bits, uint32_t depth) {
+    size_t n_items = ((size_t)1 << bits) * depth;
+    
+    p_ht->p_buf   = calloc(sizeof(uint32_t) * n_items + ((size_t)1 << bits) + CACHE_LINE_SIZE, 1);   // the table is large, we must use malloc instead of local variables to prevent stack-overflow. calloc gives empty items
+    p_ht->shift   = 32 - bits;
+    p_ht->depth   = depth;
+    p_ht->next_pos = 0;
+    
+    if (p_ht->p_buf == NULL)
+        return R_ERR_MEMORY_RUNOUT;
+    
+    p_ht->p_items = (uint32_t*)( (uint8_t*)p_ht->p_buf + (CACHE_LINE_SIZE - ((uintptr_t)p_ht->p_buf % CACHE_LINE_SIZE)) % CACHE_LINE_SIZE );
+    p_ht->p_heads = (uint8_t*)(p_ht->p_items + n_items);
+    
+    return R_OK;
 }
 
 
-static void rangeEncodeOutByte (RangeEncoder_t *e, uint8_t byte) {
-    if (e->p_dst != e->p_dst_limit)
-        *(e->p_dst++) = byte;
+static uint32_t getHash (uint8_t *p_src, size_t src_len, size_t pos, uint32_t shift) {
+    if (pos >= src_len || pos+1 == src_len || pos+2 == src_len)
+        return 0 ;
     else
-        e->overflow = 1;
+        return ((p_src[pos] | ((uint32_t)p_src[pos+1] << 8) | ((uint32_t)p_src[pos+2] << 16)) * HASH_MULTIPLIER) >> shift;
 }
 
 
-static void rangeEncodeNormalize (RangeEncoder_t *e) {
-    if (e->range < RANGE_CODE_NORMALIZE_THRESHOLD) {
-        if (e->low_msb) {                                  // if "low" is greater than or equal to (1<<32)
-            rangeEncodeOutByte(e, e->cache+1);
-            for (; e->cache_size>1; e->cache_size--)
-                rangeEncodeOutByte(e, 0x00);
-            e->cache = (uint8_t)((e->low_lsb) >> 24);
-            e->cache_size = 0;
-            
-        } else if (e->low_lsb < 0xFF000000) {              // if "low" is less than ((1<<32)-(1<<24))
-            rangeEncodeOutByte(e, e->cache);
-            for (; e->cache_size>1; e->cache_size--)
-                rangeEncodeOutByte(e, 0xFF);
-            e->cache = (uint8_t)((e->low_lsb) >> 24);
-            e->cache_size = 0;
+static void updateHashTable (uint8_t *p_src, size_t src_len, size_t pos, HashTable_t *p_ht) {
+    uint32_t  hash = getHash(p_src, src_len, pos, p_ht->shift);
+    uint32_t *bucket;
+    uint8_t  *p_head;
+    
+    if (pos >= src_len)
+        return;
+    
+    bucket = p_ht->p_items + (size_t)hash * p_ht->depth;
+    p_head = p_ht->p_heads + hash;
+    
+    bucket[*p_head] = (uint32_t)(pos + 1);                   // overwrite the oldest item
+    
+    if (++(*p_head) >= p_ht->depth)
+        *p_head = 0;
+}
+
+
+
+// the binary tree match finder (BT4) ---------------------------------------------------------------------------------------
+// each position in the window is a node of a binary tree, whose root is the latest position of the same 4-byte hash.
+// the nodes are sorted by the bytes following their positions, so a search walks down the tree like a binary search, and the
+// common prefix lengths of the two sides (len0, len1) let it skip comparing the bytes that are known to be equal.
+// the search also re-links the tree so that the current position becomes the new root (7-zip's BT4 does the same).
+// the positions are stored plus 1, so 0 means empty.
+
+#define    BT_HASH2_SIZE                       (1<<16)                      // the 2-byte "hash" is the 2 bytes themselves
+#define    BT_HASH3_BITS                       16
+#define    BT_MAX_PAIRS                        (LZ_LEN_MAX + 1)            // the matches of a position have increasing lengths of 2~273
+#define    BT_N_CACHED                         4                            // lzmaEncode searches at most 3 positions ahead
+
+typedef struct BinTree_t {
+    uint32_t *p_head2;                    // the latest position of each 2-byte value
+    uint32_t *p_head3;                    // the latest position of each 3-byte hash
+    uint32_t *p_head4;                    // the tree root of each 4-byte hash
+    uint32_t *p_son;                      // the two children of each position in the window, indexed by (position % cyclic_size)
+    size_t    cyclic_size;                // the window length plus 1. The nodes older than it are overwritten, and are cut from the tree
+    uint32_t  shift4;                     // 32 - hash_bits
+    uint32_t  cut_value;                  // the max number of tree nodes visited per search
+    uint32_t  nice_len;
+    size_t    next_pos;                   // all the positions before it are in the tree
+    size_t    cache_pos   [BT_N_CACHED];  // the found matches of the latest searched positions, since a position can only be searched once
+    uint32_t  cache_n     [BT_N_CACHED];
+    uint32_t  cache_pairs [BT_N_CACHED] [2*BT_MAX_PAIRS];
+} BinTree_t;
+
+
+static void freeBinTree (BinTree_t *p_bt) {
+    free(p_bt->p_head2);
+    free(p_bt->p_head3);
+    free(p_bt->p_head4);
+    free(p_bt->p_son);
+}
+
+
+static int newBinTree (BinTree_t *p_bt, size_t src_len, const LzmaCParams_t *p_params) {
+    uint32_t i;
+    
+    if ((uint64_t)src_len >= 0xFFFFFFFFU)                                      // the positions plus 1 must fit in uint32_t
+        return R_ERR_UNSUPPORTED;
+    
+    p_bt->cyclic_size = ((src_len < p_params->dict_len) ? src_len : p_params->dict_len) + 1;
+    p_bt->shift4      = 32 - p_params->hash_bits;
+    p_bt->cut_value   = p_params->hash_depth;
+    p_bt->nice_len    = p_params->nice_len;
+    p_bt->next_pos    = 0;
+    
+    p_bt->p_head2 = (uint32_t*)calloc(BT_HASH2_SIZE            , sizeof(uint32_t));
+    p_bt->p_head3 = (uint32_t*)calloc((size_t)1<<BT_HASH3_BITS , sizeof(uint32_t));
+    p_bt->p_head4 = (uint32_t*)calloc((size_t)1<<p_params->hash_bits, sizeof(uint32_t));
+    p_bt->p_son   = (uint32_t*)malloc(sizeof(uint32_t) * 2 * p_bt->cyclic_size);   // a node is always written before it is read, so it's not initialized
+    
+    for (i=0; i<BT_N_CACHED; i++)
+        p_bt->cache_pos[i] = INVALID_HASH_ITEM;
+    
+    if (p_bt->p_head2 == NULL || p_bt->p_head3 == NULL || p_bt->p_head4 == NULL || p_bt->p_son == NULL) {
+        freeBinTree(p_bt);
+        return R_ERR_MEMORY_RUNOUT;
+    }
+    
+    return R_OK;
+}
+
+
+/// walk down the tree from cur_match to find the matches of pos, and re-link the tree to make pos the new root.
+/// the matches longer than max_len are appended to p_pairs as {len, dist}, and their count is returned. If p_pairs is NULL, only re-link the tree.
+static uint32_t btSearchTree (BinTree_t *p_bt, const uint8_t *p_src, size_t pos, uint32_t cur_match, uint32_t len_limit, uint32_t max_len, uint32_t *p_pairs) {
+    const uint8_t *cur = p_src + pos;
+    size_t    cyclic_pos = pos % p_bt->cyclic_size;
+    uint32_t *ptr0 = p_bt->p_son + (cyclic_pos << 1) + 1;                      // where to link the next node which is greater than cur
+    uint32_t *ptr1 = p_bt->p_son + (cyclic_pos << 1);                          // where to link the next node which is less than cur
+    uint32_t  len0 = 0, len1 = 0;                                              // the common prefix lengths of cur and the nodes of the two sides
+    uint32_t  count = p_bt->cut_value;
+    uint32_t  n = 0;
+    
+    for (;;) {
+        size_t    delta = pos + 1 - cur_match;
+        uint32_t *pair;
+        const uint8_t *pb;
+        uint32_t  len;
+        
+        if (cur_match == 0 || delta >= p_bt->cyclic_size || count-- == 0) {
+            *ptr0 = *ptr1 = 0;
+            return n;
         }
         
-        if (e->cache_size < RANGE_CODE_CACHE_SIZE_MAX)
-            e->cache_size ++;
+        pair = p_bt->p_son + (((cyclic_pos >= delta) ? (cyclic_pos - delta) : (cyclic_pos - delta + p_bt->cyclic_size)) << 1);
+        pb   = cur - delta;
+        len  = (len0 < len1) ? len0 : len1;
+        
+        if (pb[len] == cur[len]) {
+            while (++len < len_limit)
+                if (pb[len] != cur[len])
+                    break;
+            if (len > max_len) {
+                max_len = len;
+                if (p_pairs) {
+                    p_pairs[2*n]   = len;
+                    p_pairs[2*n+1] = (uint32_t)delta;
+                    n ++;
+                }
+            }
+            if (len == len_limit) {                                            // cur is equal to this node (within len_limit), so it takes over the children of this node
+                *ptr1 = pair[0];
+                *ptr0 = pair[1];
+                return n;
+            }
+        }
         
-        e->low_msb = 0;
-        e->low_lsb <<= 8;
-        e->range <<= 8;
+        if (pb[len] < cur[len]) {
+            *ptr1     = cur_match;
+            ptr1      = pair + 1;
+            cur_match = *ptr1;
+            len1      = len;
+        } else {
+            *ptr0     = cur_match;
+            ptr0      = pair;
+            cur_match = *ptr0;
+            len0      = len;
+        }
     }
 }
 
 
-static void rangeEncodeTerminate (RangeEncoder_t *e) {
-    e->range = 0;
-    rangeEncodeNormalize(e);
-    rangeEncodeNormalize(e);
-    rangeEncodeNormalize(e);
-    rangeEncodeNormalize(e);
-    rangeEncodeNormalize(e);
-    rangeEncodeNormalize(e);
+/// insert pos to the match finder, and get its matches of increasing lengths as {len, dist} pairs if p_pairs is not NULL.
+/// return the number of pairs.
+static uint32_t btInsert (BinTree_t *p_bt, const uint8_t *p_src, size_t src_len, size_t pos, uint32_t *p_pairs) {
+    const uint8_t *cur = p_src + pos;
+    uint32_t  avail = ((src_len-pos) < LZ_LEN_MAX) ? (uint32_t)(src_len-pos) : LZ_LEN_MAX;
+    uint32_t  len_limit = (avail < p_bt->nice_len) ? avail : p_bt->nice_len;
+    uint32_t  h2, h3, h4, cur_match, max_len = 1, n = 0;
+    size_t    d2 = 0, d3 = 0;                                                  // 0 means no candidate
+    
+    if (avail < 4)                                                             // too close to the end to be hashed, and no later position can match it
+        return 0;
+    
+    h2 = cur[0] | ((uint32_t)cur[1] << 8);
+    h3 = ((h2 | ((uint32_t)cur[2] << 16)) * HASH_MULTIPLIER) >> (32 - BT_HASH3_BITS);
+    h4 = ((h2 | ((uint32_t)cur[2] << 16) | ((uint32_t)cur[3] << 24)) * HASH_MULTIPLIER) >> p_bt->shift4;
+    
+    if (p_bt->p_head2[h2] != 0)
+        d2 = pos + 1 - p_bt->p_head2[h2];
+    if (p_bt->p_head3[h3] != 0)
+        d3 = pos + 1 - p_bt->p_head3[h3];
+    cur_match = p_bt->p_head4[h4];
+    
+    p_bt->p_head2[h2] = p_bt->p_head3[h3] = p_bt->p_head4[h4] = (uint32_t)(pos + 1);
+    
+    if (p_pairs == NULL) {
+        btSearchTree(p_bt, p_src, pos, cur_match, len_limit, 0, NULL);
+        return 0;
+    }
+    
+    if (d2 != 0 && d2 < p_bt->cyclic_size) {                                   // the 2 bytes must be equal, since the 2-byte value is not hashed
+        max_len = 2;
+        p_pairs[0] = 2;
+        p_pairs[1] = (uint32_t)d2;
+        n = 1;
+    }
+    
+    if (d3 != 0 && d3 != d2 && d3 < p_bt->cyclic_size && (cur-d3)[0] == cur[0] && (cur-d3)[1] == cur[1] && (cur-d3)[2] == cur[2]) {
+        max_len = 3;
+        p_pairs[2*n]   = 3;
+        p_pairs[2*n+1] = (uint32_t)d3;
+        n ++;
+        d2 = d3;
+    }
+    
+    if (n > 0) {                                                               // extend the longer of the short matches
+        const uint8_t *pb = cur - d2;
+        while (max_len < len_limit && pb[max_len] == cur[max_len])
+            max_len ++;
+        p_pairs[2*n-2] = max_len;
+    }
+    
+    if (max_len == len_limit) {                                                // long enough, only re-link the tree
+        btSearchTree(p_bt, p_src, pos, cur_match, len_limit, 0, NULL);
+    } else {
+        n += btSearchTree(p_bt, p_src, pos, cur_match, len_limit, (max_len < 3) ? 3 : max_len, p_pairs + 2*n);
+    }
+    
+    if (n > 0 && p_pairs[2*n-2] == len_limit) {                                // a match reaches nice_len, extend it to the max length without searching more
+        const uint8_t *pb = cur - p_pairs[2*n-1];
+        uint32_t len = len_limit;
+        while (len < avail && pb[len] == cur[len])
+            len ++;
+        p_pairs[2*n-2] = len;
+    }
+    
+    return n;
 }
 
 
-static void rangeEncodeIntByFixedProb (RangeEncoder_t *e, uint32_t val, uint32_t bit_count) {
-    for (; bit_count>0; bit_count--) {
-        uint8_t bit = 1 & (val >> (bit_count-1));
-        rangeEncodeNormalize(e);
-        e->range >>= 1;
-        if (bit) {
-            if ((e->low_lsb + e->range) < e->low_lsb)     // if low_lsb + range overflow from 32-bit unsigned integer
-                e->low_msb = 1;
-            e->low_lsb += e->range;
-        }
+/// get the matches of pos. The positions are inserted in order, and the skipped ones are inserted without searching.
+static const uint32_t *btGetMatches (BinTree_t *p_bt, const uint8_t *p_src, size_t src_len, size_t pos, uint32_t *p_n) {
+    uint32_t i = pos % BT_N_CACHED;
+    
+    for (; p_bt->next_pos < pos; p_bt->next_pos++)
+        btInsert(p_bt, p_src, src_len, p_bt->next_pos, NULL);
+    
+    if (p_bt->next_pos == pos) {
+        p_bt->cache_pos[i] = pos;
+        p_bt->cache_n  [i] = btInsert(p_bt, p_src, src_len, pos, p_bt->cache_pairs[i]);
+        p_bt->next_pos ++;
     }
+    
+    *p_n = (p_bt->cache_pos[i] == pos) ? p_bt->cache_n[i] : 0;
+    return p_bt->cache_pairs[i];
 }
 
 
-static void rangeEncodeBit (RangeEncoder_t *e, uint16_t *p_prob, uint8_t bit) {
-    uint32_t prob = *p_prob;
-    uint32_t bound;
+
+// the suffix array match finder (SA) ----------------------------------------------------------------------------------------
+// the whole window of the input is indexed at once, since lzmaC has all of it in memory : the suffix array sorts its positions by
+// the following bytes (by SA-IS, the induced sorting of Nong, Zhang and Chan), and the LCP array keeps the common prefix length of
+// each suffix and the one before it. The common prefix of pos and a suffix is the minimum LCP between them, so walking from pos to
+// both sides visits the candidates from the longest to the shortest, and finds the nearest one of each length without hashing.
+// As BT4 visits at most hash_depth tree nodes, it visits at most 2 x hash_depth suffixes per search.
+// The window is the dictionary before a segment of dict_len positions and the segment itself, so the memory is 10 bytes per
+// position of 2 x dict_len (not of the whole input), and the window is sorted again when the search goes out of the segment.
+
+#define    SA_EMPTY                            0xFFFFFFFFU
+#define    SA_STEPS_PER_DEPTH                  2                            // the suffixes visited per search (of both sides) is hash_depth times this
+
+#define    SA_IS_S(p_types, i)                 (((p_types)[(i)>>3] >> ((i)&7)) & 1)                          // S-type : the suffix is less than the next one
+#define    SA_IS_LMS(p_types, i)               ((i) > 0 && SA_IS_S(p_types, (i)) && !SA_IS_S(p_types, (i)-1))   // the leftmost S-type of a run
+
+typedef struct SuffixArray_t {
+    uint32_t *p_sa;                       // the window positions sorted by their suffixes
+    uint32_t *p_rank;                     // the index in p_sa of each window position. Also the buckets while sorting
+    uint16_t *p_lcp;                      // the common prefix length (at most LZ_LEN_MAX) of p_sa[i] and p_sa[i-1]. Also the S/L types while sorting
+    size_t    cap;                        // the max window length
+    size_t    dict_len;
+    uint32_t  max_steps;                  // the max number of suffixes visited per search
+    uint32_t  nice_len;
+    size_t    win_start, win_len;         // the window of the input which is sorted
+    size_t    seg_start, seg_end;         // the positions whose dictionary is in the window. seg_end=0 : not sorted yet
+} SuffixArray_t;
+
+
+static void freeSuffixArray (SuffixArray_t *p_sa) {
+    free(p_sa->p_sa);
+    free(p_sa->p_rank);
+    free(p_sa->p_lcp);
+}
+
+
+static int newSuffixArray (SuffixArray_t *p_sa, size_t src_len, const LzmaCParams_t *p_params) {
+    p_sa->cap       = 2 * (size_t)p_params->dict_len + LZ_LEN_MAX;
+    if (p_sa->cap > src_len)
+        p_sa->cap   = src_len;
+    p_sa->dict_len  = p_params->dict_len;
+    p_sa->max_steps = p_params->hash_depth * SA_STEPS_PER_DEPTH;
+    p_sa->nice_len  = p_params->nice_len;
+    p_sa->seg_start = p_sa->seg_end = 0;
     
-    rangeEncodeNormalize(e);
+    p_sa->p_sa   = (uint32_t*)malloc(sizeof(uint32_t) * (p_sa->cap + 1));
+    p_sa->p_rank = (uint32_t*)malloc(sizeof(uint32_t) * (p_sa->cap + 256));     // the buckets need max(256, cap/2) words
+    p_sa->p_lcp  = (uint16_t*)malloc(sizeof(uint16_t) * (p_sa->cap + 32));      // the types need about cap/4 bytes
     
-    bound = (e->range >> RANGE_CODE_N_BIT_MODEL_TOTAL_BITS) * prob;
+    if (p_sa->p_sa == NULL || p_sa->p_rank == NULL || p_sa->p_lcp == NULL) {
+        freeSuffixArray(p_sa);
+        return R_ERR_MEMORY_RUNOUT;
+    }
     
-    if (!bit) {                                           // encode bit 0
-        e->range = bound;
-        *p_prob = (uint16_t)(prob + ((RANGE_CODE_BIT_MODEL_TOTAL - prob) >> RANGE_CODE_MOVE_BITS));
-    } else {                                              // encode bit 1
-        e->range -= bound;
-        if ((e->low_lsb + bound) < e->low_lsb)            // if low_lsb + bound overflow from 32-bit unsigned integer
-            e->low_msb = 1;
-        e->low_lsb += bound;
-        *p_prob = (uint16_t)(prob - (prob >> RANGE_CODE_MOVE_BITS));
+    return R_OK;
+}
+
+
+/// the i-th symbol of the text to be sorted : a byte of the input, or a name of an LMS substring in the recursion
+static uint32_t saSymbol (const void *p_text, uint8_t wide, uint32_t i) {
+    return wide ? ((const uint32_t*)p_text)[i] : ((const uint8_t*)p_text)[i];
+}
+
+
+/// set p_bkt to the starts (or the ends) of the buckets, i.e., of the suffixes beginning with each symbol
+static void saGetBuckets (const void *p_text, uint8_t wide, uint32_t n, uint32_t k, uint32_t *p_bkt, uint8_t ends) {
+    uint32_t i, sum = 0;
+    for (i=0; i<k; i++)
+        p_bkt[i] = 0;
+    for (i=0; i<n; i++)
+        p_bkt[saSymbol(p_text, wide, i)] ++;
+    for (i=0; i<k; i++) {
+        sum += p_bkt[i];
+        p_bkt[i] = ends ? sum : (sum - p_bkt[i]);
     }
 }
 
 
-static void rangeEncodeInt (RangeEncoder_t *e, uint16_t *p_prob, uint32_t val, uint32_t bit_count) {
-    uint32_t treepos = 1;
-    for (; bit_count>0; bit_count--) {
-        uint8_t bit = (uint8_t)(1 & (val >> (bit_count-1)));
-        rangeEncodeBit(e, p_prob+(treepos-1), bit);
-        treepos <<= 1;
-        if (bit)
-            treepos |= 1;
+/// sort the L-type suffixes from the sorted LMS suffixes, then the S-type suffixes from the L-type ones
+static void saInduce (const void *p_text, uint8_t wide, const uint8_t *p_types, uint32_t *p_sa, uint32_t n, uint32_t k, uint32_t *p_bkt) {
+    uint32_t i, j;
+    
+    saGetBuckets(p_text, wide, n, k, p_bkt, 0);
+    j = n - 1;                                                                 // induced by the virtual sentinel after the text, which is the least suffix
+    p_sa[p_bkt[saSymbol(p_text, wide, j)]++] = j;
+    for (i=0; i<n; i++) {
+        if (p_sa[i] != SA_EMPTY && p_sa[i] > 0) {
+            j = p_sa[i] - 1;
+            if (!SA_IS_S(p_types, j))
+                p_sa[p_bkt[saSymbol(p_text, wide, j)]++] = j;
+        }
+    }
+    
+    saGetBuckets(p_text, wide, n, k, p_bkt, 1);
+    for (i=n; i-->0; ) {
+        if (p_sa[i] != SA_EMPTY && p_sa[i] > 0) {
+            j = p_sa[i] - 1;
+            if (SA_IS_S(p_types, j))
+                p_sa[--p_bkt[saSymbol(p_text, wide, j)]] = j;
+        }
     }
 }
 
 
-static void rangeEncodeMB (RangeEncoder_t *e, uint16_t *p_prob, uint32_t byte, uint32_t match_byte) {
-    uint32_t i, treepos = 1, off0 = 0x100, off1;
-    for (i=0; i<8; i++) {
-        uint8_t bit = (uint8_t)(1 & (byte >> 7));
-        byte <<= 1;
-        match_byte <<= 1;
-        off1 = off0;
-        off0 &= match_byte;
-        rangeEncodeBit(e, p_prob+(off0+off1+treepos-1), bit);
-        treepos <<= 1;
-        if (bit)
-            treepos |= 1;
-        else
-            off0 ^= off1;
+/// sort the suffixes of a text of n symbols (0~k-1) by SA-IS, with a virtual sentinel after the text.
+/// p_bkt has max(k, n/2) words, which are shared by the recursion. p_types has n/8+1 bytes of this level, followed by the ones of the recursion
+static void saSort (const void *p_text, uint8_t wide, uint32_t *p_sa, uint32_t n, uint32_t k, uint32_t *p_bkt, uint8_t *p_types) {
+    uint32_t  i, j, n1 = 0, n_names = 0, prev = SA_EMPTY;
+    uint32_t *p_text1;
+    
+    if (n <= 1) {
+        if (n == 1)
+            p_sa[0] = 0;
+        return;
+    }
+    
+    // classify the suffixes as S-type or L-type, from the last one, which is L-type since it's greater than the sentinel
+    memset(p_types, 0, (n>>3) + 1);
+    for (i=n-1; i-->0; ) {
+        uint32_t c0 = saSymbol(p_text, wide, i);
+        uint32_t c1 = saSymbol(p_text, wide, i+1);
+        if (c0 < c1 || (c0 == c1 && SA_IS_S(p_types, i+1)))
+            p_types[i>>3] |= (uint8_t)(1 << (i&7));
+    }
+    
+    // sort the LMS substrings : put the LMS positions to the ends of their buckets, and induce
+    for (i=0; i<n; i++)
+        p_sa[i] = SA_EMPTY;
+    saGetBuckets(p_text, wide, n, k, p_bkt, 1);
+    for (i=1; i<n; i++)
+        if (SA_IS_LMS(p_types, i))
+            p_sa[--p_bkt[saSymbol(p_text, wide, i)]] = i;
+    saInduce(p_text, wide, p_types, p_sa, n, k, p_bkt);
+    
+    // name the LMS substrings by their order, the equal ones get the same name. The names are written to p_sa[n1 + pos/2]
+    for (i=0; i<n; i++)
+        if (p_sa[i] != SA_EMPTY && SA_IS_LMS(p_types, p_sa[i]))
+            p_sa[n1++] = p_sa[i];
+    for (i=n1; i<n; i++)
+        p_sa[i] = SA_EMPTY;
+    for (i=0; i<n1; i++) {
+        uint32_t pos = p_sa[i], d;
+        uint8_t  diff = (prev == SA_EMPTY);
+        for (d=0; !diff; d++) {
+            if (pos+d == n || prev+d == n || saSymbol(p_text, wide, pos+d) != saSymbol(p_text, wide, prev+d) || SA_IS_S(p_types, pos+d) != SA_IS_S(p_types, prev+d))
+                diff = 1;                                                      // the sentinel is unique, so a substring that reaches it is different
+            else if (d > 0 && (SA_IS_LMS(p_types, pos+d) || SA_IS_LMS(p_types, prev+d)))
+                break;                                                         // both end here
+        }
+        if (diff)
+            n_names ++;
+        prev = pos;
+        p_sa[n1 + (pos>>1)] = n_names - 1;
     }
+    
+    // the names in the text order are the reduced text at the end of p_sa. Sort its suffixes to p_sa[0~n1-1], recursively if the names are not unique
+    for (i=n, j=n; i-->n1; )
+        if (p_sa[i] != SA_EMPTY)
+            p_sa[--j] = p_sa[i];
+    p_text1 = p_sa + n - n1;
+    if (n_names < n1) {
+        saSort(p_text1, 1, p_sa, n1, n_names, p_bkt, p_types + (n>>3) + 1);
+    } else {
+        for (i=0; i<n1; i++)
+            p_sa[p_text1[i]] = i;
+    }
+    
+    // put the sorted LMS suffixes to the ends of their buckets, and induce all the suffixes from them
+    for (i=1, j=0; i<n; i++)
+        if (SA_IS_LMS(p_types, i))
+            p_text1[j++] = i;
+    for (i=0; i<n1; i++)
+        p_sa[i] = p_text1[p_sa[i]];
+    for (i=n1; i<n; i++)
+        p_sa[i] = SA_EMPTY;
+    saGetBuckets(p_text, wide, n, k, p_bkt, 1);
+    for (i=n1; i-->0; ) {
+        j = p_sa[i];
+        p_sa[i] = SA_EMPTY;
+        p_sa[--p_bkt[saSymbol(p_text, wide, j)]] = j;
+    }
+    saInduce(p_text, wide, p_types, p_sa, n, k, p_bkt);
 }
 
 
+/// sort the window for the segment from pos, and get the ranks and the LCP array (by Kasai's algorithm, capped to LZ_LEN_MAX)
+static void saBuildWindow (SuffixArray_t *p_sa, const uint8_t *p_src, size_t src_len, size_t pos) {
+    const uint8_t *p_text;
+    uint32_t i, j, n, h = 0;
+    
+    p_sa->win_start = (pos > p_sa->dict_len) ? (pos - p_sa->dict_len) : 0;
+    p_sa->win_len   = src_len - p_sa->win_start;
+    if (p_sa->win_len > p_sa->cap)
+        p_sa->win_len = p_sa->cap;
+    p_sa->seg_start = pos;
+    p_sa->seg_end   = (p_sa->win_start + p_sa->win_len == src_len) ? src_len : (p_sa->win_start + p_sa->win_len - LZ_LEN_MAX);   // a match of the segment never reaches the window end
+    
+    p_text = p_src + p_sa->win_start;
+    n      = (uint32_t)p_sa->win_len;
+    
+    saSort(p_text, 0, p_sa->p_sa, n, 256, p_sa->p_rank, (uint8_t*)p_sa->p_lcp);
+    
+    for (i=0; i<n; i++)
+        p_sa->p_rank[p_sa->p_sa[i]] = i;
+    
+    for (i=0; i<n; i++) {                                                      // the LCP of i+1 is at least the LCP of i minus 1, which also holds when they are capped
+        uint32_t r = p_sa->p_rank[i];
+        if (r == 0) {
+            p_sa->p_lcp[0] = 0;
+            h = 0;
+            continue;
+        }
+        j = p_sa->p_sa[r-1];
+        while (h < LZ_LEN_MAX && i+h < n && j+h < n && p_text[i+h] == p_text[j+h])
+            h ++;
+        p_sa->p_lcp[r] = (uint16_t)h;
+        if (h > 0)
+            h --;
+    }
+}
 
 
-/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// LZ {length, distance} searching algorithm
-/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// get the matches of pos of increasing lengths as {len, dist} pairs, each is the nearest one of its length among the visited suffixes. return the number of pairs.
+/// The positions can be searched in any order, but going back out of the segment sorts the window again.
+static uint32_t saGetMatches (SuffixArray_t *p_sa, const uint8_t *p_src, size_t src_len, size_t pos, uint32_t *p_pairs) {
+    uint32_t avail, q, k0, k1, len0, len1, steps = p_sa->max_steps, n = 0, i;
+    size_t   near = (size_t)p_sa->dict_len + 1;
+    
+    if (pos >= src_len)
+        return 0;
+    
+    avail = ((src_len-pos) < LZ_LEN_MAX) ? (uint32_t)(src_len-pos) : LZ_LEN_MAX;
+    if (avail < 2)
+        return 0;
+    
+    if (p_sa->seg_end == 0 || pos < p_sa->seg_start || pos >= p_sa->seg_end)
+        saBuildWindow(p_sa, p_src, src_len, pos);
+    
+    q  = (uint32_t)(pos - p_sa->win_start);
+    k0 = k1 = p_sa->p_rank[q];
+    len0 = len1 = avail;                                                       // the common prefix of pos and the suffixes at k0 (the lesser side) and k1 (the greater side)
+    
+    while (steps-- > 0) {                                                      // step to the side of the longer common prefix, so the candidates are visited from the longest
+        uint32_t l0 = (k0 > 0)                ? p_sa->p_lcp[k0]   : 0;
+        uint32_t l1 = (k1+1 < p_sa->win_len)  ? p_sa->p_lcp[k1+1] : 0;
+        uint32_t len, cand;
+        if (l0 > len0)
+            l0 = len0;
+        if (l1 > len1)
+            l1 = len1;
+        if (l0 < 2 && l1 < 2)
+            break;
+        if (l0 >= l1) {
+            len = len0 = l0;
+            cand = p_sa->p_sa[--k0];
+        } else {
+            len = len1 = l1;
+            cand = p_sa->p_sa[++k1];
+        }
+        if (cand < q && q - cand < near) {                                     // a position before pos, and nearer than all the longer ones
+            near = q - cand;
+            if (n > 0 && p_pairs[2*n-2] == len)
+                n --;                                                          // replace the farther one of the same length
+            p_pairs[2*n]   = len;
+            p_pairs[2*n+1] = (uint32_t)near;
+            n ++;
+            if (near == 1 || len >= p_sa->nice_len)                            // can't be nearer, or long enough
+                break;
+        }
+    }
+    
+    for (i=0; i<n/2; i++) {                                                    // to increasing lengths
+        uint32_t t0 = p_pairs[2*i], t1 = p_pairs[2*i+1];
+        p_pairs[2*i]   = p_pairs[2*(n-1-i)];
+        p_pairs[2*i+1] = p_pairs[2*(n-1-i)+1];
+        p_pairs[2*(n-1-i)]   = t0;
+        p_pairs[2*(n-1-i)+1] = t1;
+    }
+    
+    return n;
+}
 
-#define    LZ_LEN_MAX                          273
-//#define    LZ_DIST_MAX_PLUS1                   0xFFFFFFFF
-#define    LZ_DIST_MAX_PLUS1                   0x40000000
 
-#define    HASH_LEVEL                          16
-#define    HASH_N                              21
-#define    HASH_SIZE                           (1<<HASH_N)
-#define    HASH_MASK                           ((1<<HASH_N)-1)
 
-#define    INVALID_HASH_ITEM                   (~((size_t)0))               // use maximum value of size_t as invalid hash entry
+// the match finder, which is one of the above ---------------------------------------------------------------------------
+
+typedef struct MatchFinder_t {
+    uint32_t    type;                     // LZMA_MF_HC, LZMA_MF_BT4 or LZMA_MF_SA
+    size_t      dict_len;                 // the max match distance
+    uint32_t    nice_len;                 // a match of this length is long enough to stop searching
+    HashTable_t ht;                       // for HC
+    BinTree_t  *p_bt;                     // for BT4
+    SuffixArray_t *p_sa;                  // for SA
+    struct MatchPipe_t *p_pipe;           // not NULL : the match finder runs in its own thread, see below
+} MatchFinder_t;
+
+
+
+// the match finder thread ----------------------------------------------------------------------------------------------
+// lzmaEncode can run the match finder in its own thread, ahead of the parser and the range coder (like 7-zip's MT match finder).
+// The matches of a position only depend on the positions before it, so the thread finds them for every position in order, and
+// the output is the same as finding them in the encoder. The records {n, n x {len, dist}} are in a ring of words, and the start of
+// the record of each position is in a ring of positions. The threads lock the mutex once per PIPE_BATCH positions, or when they wait.
+// It's only used when the match finder visits every position anyway, i.e., with the optimal parser or BT4. The greedy and lazy parsers
+// only search HC at the start of the packets, so the thread would search about 3 times more positions than the encoder.
+
+#define    PIPE_N_POS                          (1<<16)                      // the positions in the ring, i.e., how far the thread can run ahead
+#define    PIPE_N_WORDS                        (1<<20)
+#define    PIPE_BATCH                          1024
+#define    PIPE_RECORD_MAX                     (1 + 2*BT_MAX_PAIRS)         // the words of the largest record. HC has at most (HASH_DEPTH_MAX+2) pairs, which is fewer
+
+typedef struct MatchPipe_t {
+    MatchFinder_t  mf;                        // the match finder, which is only used by the thread
+    uint8_t       *p_src;
+    size_t         src_len;
+    uint8_t        all_pairs;                 // 1 : the matches of lzGetMatches, for the optimal parser.   0 : the match of lzSearchMatch
+    uint32_t      *p_words;                   // the records
+    size_t        *p_starts;                  // the record of pos starts at p_starts[pos % PIPE_N_POS], which is an index of p_words modulo PIPE_N_WORDS
+    size_t         done_pos;                  // the records before it are written.                   protected by p_mutex
+    size_t         free_pos;                  // the positions before it are passed by the encoder.   protected by p_mutex
+    uint8_t        stop;                      // the encoder is finished before the end of the input. protected by p_mutex
+    size_t         avail_pos;                 // for the encoder : a copy of done_pos
+    size_t         next_pos;                  // for the encoder : the next position to be passed
+    Mutex_t       *p_mutex;
+    Cond_t        *p_cond;
+    Thread_t      *p_thread;
+} MatchPipe_t;
+
+
+/// get the record of pos written by the match finder thread, wait if it's not written yet. return the number of pairs
+static uint32_t pipeGetPairs (MatchPipe_t *p_pipe, size_t pos, uint32_t *p_pairs) {
+    size_t   start;
+    uint32_t i, n;
+    
+    if (pos >= p_pipe->avail_pos) {
+        mutexLock(p_pipe->p_mutex);
+        p_pipe->free_pos = p_pipe->next_pos;                                    // the thread may be waiting for the free space
+        condBroadcast(p_pipe->p_cond);
+        while (p_pipe->done_pos <= pos)
+            condWait(p_pipe->p_cond, p_pipe->p_mutex);
+        p_pipe->avail_pos = p_pipe->done_pos;
+        mutexUnlock(p_pipe->p_mutex);
+    }
+    
+    start = p_pipe->p_starts[pos % PIPE_N_POS];
+    n     = p_pipe->p_words[start % PIPE_N_WORDS];
+    
+    for (i=0; i<2*n; i++)
+        p_pairs[i] = p_pipe->p_words[(start + 1 + i) % PIPE_N_WORDS];
+    
+    return n;
+}
 
-#define    INIT_HASH_TABLE(hash_table) {            \
-    uint32_t i, j;                                  \
-    for (i=0; i<HASH_SIZE; i++)                     \
-        for (j=0; j<HASH_LEVEL; j++)                \
-            hash_table[i][j] = INVALID_HASH_ITEM;   \
+
+/// the encoder passed pos, so its record can be overwritten
+static void pipePass (MatchPipe_t *p_pipe, size_t pos) {
+    if (p_pipe->next_pos == pos) {
+        p_pipe->next_pos ++;
+        if (p_pipe->next_pos % PIPE_BATCH == 0) {
+            mutexLock(p_pipe->p_mutex);
+            p_pipe->free_pos = p_pipe->next_pos;
+            condBroadcast(p_pipe->p_cond);
+            mutexUnlock(p_pipe->p_mutex);
+        }
+    }
 }
 
 
-static uint32_t getHash (uint8_t *p_src, size_t src_len, size_t pos) {
-    if (pos >= src_len || pos+1 == src_len || pos+2 == src_len)
-        return 0 ;
-    else
-#if HASH_N < 24
-        return ((p_src[pos+2]<<16) + (p_src[pos+1]<<8) + p_src[pos]) & HASH_MASK;
-#else
-        return ((p_src[pos+2]<<16) + (p_src[pos+1]<<8) + p_src[pos]);
-#endif
+/// a hash table with more buckets than the positions it can ever hold only costs memory and cache misses,
+/// so for a short input, use the smallest table that still has a bucket for each position of the window
+static uint32_t adaptHashBits (uint32_t hash_bits, size_t src_len, size_t dict_len) {
+    size_t   window = (src_len < dict_len) ? src_len : dict_len;
+    uint32_t bits   = HASH_BITS_MIN;
+    
+    while (bits < hash_bits && ((size_t)1 << bits) < window)
+        bits ++;
+    
+    return bits;
 }
 
 
-static void updateHashTable (uint8_t *p_src, size_t src_len, size_t pos, size_t hash_table [][HASH_LEVEL]) {
-    uint32_t hash = getHash(p_src, src_len, pos);
-    uint32_t i, oldest_i = 0;
-    size_t   oldest_pos = INVALID_HASH_ITEM;
+static int newMatchFinder (MatchFinder_t *p_mf, size_t src_len, const LzmaCParams_t *p_params) {
+    LzmaCParams_t params = *p_params;
+    int ret_code;
     
-    if (pos >= src_len)
-        return;
+    params.hash_bits = adaptHashBits(p_params->hash_bits, src_len, p_params->dict_len);
+    
+    p_mf->type     = params.match_finder;
+    p_mf->dict_len = params.dict_len;
+    p_mf->nice_len = params.nice_len;
+    p_mf->p_bt     = NULL;
+    p_mf->p_sa     = NULL;
+    p_mf->p_pipe   = NULL;
     
-    for (i=0; i<HASH_LEVEL; i++) {
-        if (hash_table[hash][i] == INVALID_HASH_ITEM) {      // find a invalid (empty) hash item
-            hash_table[hash][i] = pos;                       // fill it
-            return;                                          // return immediently
+    if (p_mf->type == LZMA_MF_HC)
+        return newHashTable(&p_mf->ht, params.hash_bits, params.hash_depth);
+    
+    if (p_mf->type == LZMA_MF_SA) {
+        p_mf->p_sa = (SuffixArray_t*)malloc(sizeof(SuffixArray_t));
+        if (p_mf->p_sa == NULL)
+            return R_ERR_MEMORY_RUNOUT;
+        ret_code = newSuffixArray(p_mf->p_sa, src_len, &params);
+        if (ret_code) {
+            free(p_mf->p_sa);
+            p_mf->p_sa = NULL;
         }
-        if (oldest_pos > hash_table[hash][i]) {              // search the oldest hash item
-            oldest_pos = hash_table[hash][i];
-            oldest_i   = i;
+        return ret_code;
+    }
+    
+    p_mf->p_bt = (BinTree_t*)malloc(sizeof(BinTree_t));                        // the cached matches make it a bit large for the stack
+    if (p_mf->p_bt == NULL)
+        return R_ERR_MEMORY_RUNOUT;
+    
+    ret_code = newBinTree(p_mf->p_bt, src_len, &params);
+    if (ret_code) {
+        free(p_mf->p_bt);
+        p_mf->p_bt = NULL;
+    }
+    return ret_code;
+}
+
+
+static void freeMatchFinder (MatchFinder_t *p_mf) {
+    MatchPipe_t *p_pipe = p_mf->p_pipe;
+    
+    if (p_pipe != NULL) {                                                       // stop the thread, then free the match finder that it has
+        mutexLock(p_pipe->p_mutex);
+        p_pipe->stop = 1;
+        condBroadcast(p_pipe->p_cond);
+        mutexUnlock(p_pipe->p_mutex);
+        threadJoin(p_pipe->p_thread);
+        freeMatchFinder(&p_pipe->mf);
+        mutexFree(p_pipe->p_mutex);
+        condFree(p_pipe->p_cond);
+        free(p_pipe->p_words);
+        free(p_pipe->p_starts);
+        free(p_pipe);
+        p_mf->p_pipe = NULL;
+    } else if (p_mf->type == LZMA_MF_HC) {
+        free(p_mf->ht.p_buf);
+    } else if (p_mf->type == LZMA_MF_SA) {
+        freeSuffixArray(p_mf->p_sa);
+        free(p_mf->p_sa);
+    } else {
+        freeBinTree(p_mf->p_bt);
+        free(p_mf->p_bt);
+    }
+}
+
+
+/// tell the match finder that pos is passed. This must be called for every position in order
+static void updateMatchFinder (uint8_t *p_src, size_t src_len, size_t pos, MatchFinder_t *p_mf) {
+    if (p_mf->p_pipe != NULL) {
+        pipePass(p_mf->p_pipe, pos);
+    } else if (p_mf->type == LZMA_MF_HC) {
+        if (p_mf->ht.next_pos == pos) {                                     // the positions that were searched by the optimal parser are already inserted
+            updateHashTable(p_src, src_len, pos, &p_mf->ht);
+            p_mf->ht.next_pos ++;
         }
+    } else if (p_mf->type == LZMA_MF_SA) {
+        return;                                                             // the window is sorted at once, nothing to insert
+    } else if (p_mf->p_bt->next_pos == pos && pos < src_len) {              // the positions that were searched ahead are already inserted
+        btInsert(p_mf->p_bt, p_src, src_len, pos, NULL);
+        p_mf->p_bt->next_pos ++;
+    }
+}
+
+
+/// empty the match finder for a new input, keeping its tables. Not for the match finder thread
+static void clearMatchFinder (MatchFinder_t *p_mf) {
+    uint32_t i;
+    
+    if (p_mf->type == LZMA_MF_HC) {
+        size_t n_buckets = (size_t)1 << (32 - p_mf->ht.shift);
+        memset(p_mf->ht.p_items, 0, sizeof(uint32_t) * n_buckets * p_mf->ht.depth);
+        memset(p_mf->ht.p_heads, 0, n_buckets);
+        p_mf->ht.next_pos = 0;
+    } else if (p_mf->type == LZMA_MF_SA) {
+        p_mf->p_sa->seg_end = 0;
+    } else {
+        BinTree_t *p_bt = p_mf->p_bt;
+        memset(p_bt->p_head2, 0, sizeof(uint32_t) * BT_HASH2_SIZE);
+        memset(p_bt->p_head3, 0, sizeof(uint32_t) * ((size_t)1 << BT_HASH3_BITS));
+        memset(p_bt->p_head4, 0, sizeof(uint32_t) * ((size_t)1 << (32 - p_bt->shift4)));
+        p_bt->next_pos = 0;
+        for (i=0; i<BT_N_CACHED; i++)
+            p_bt->cache_pos[i] = INVALID_HASH_ITEM;
+    }
+}
+
+
+/// a position (plus 1) kept in the match finder, after the positions are moved back by shift. The ones before shift become empty
+static uint32_t rebaseItem (uint32_t item, size_t shift) {
+    return (item > shift) ? (uint32_t)(item - shift) : 0;
+}
+
+
+/// reverse the order of the tree nodes [i, j)
+static void btReverseNodes (uint32_t *p_son, size_t i, size_t j) {
+    for (; i+1 < j; i++, j--) {
+        uint32_t t0 = p_son[2*i], t1 = p_son[2*i+1];
+        p_son[2*i]   = p_son[2*j-2];
+        p_son[2*i+1] = p_son[2*j-1];
+        p_son[2*j-2] = t0;
+        p_son[2*j-1] = t1;
     }
+}
+
+
+/// move all the positions of the match finder back by shift, when the input window is moved back by shift (see LzmaCStream_t).
+/// the positions before shift must be farther than the dictionary from the ones to be searched, so dropping them changes no match.
+/// The tree nodes are indexed by (position % cyclic_size), so they are rotated. Not for the match finder thread
+static void rebaseMatchFinder (MatchFinder_t *p_mf, size_t shift) {
+    size_t i, n;
     
-    hash_table[hash][oldest_i] = pos;
+    if (p_mf->type == LZMA_MF_HC) {
+        n = ((size_t)1 << (32 - p_mf->ht.shift)) * p_mf->ht.depth;
+        for (i=0; i<n; i++)
+            if (p_mf->ht.p_items[i] != 0)                                     // don't write the empty items, whose pages may be untouched
+                p_mf->ht.p_items[i] = rebaseItem(p_mf->ht.p_items[i], shift);
+        p_mf->ht.next_pos -= shift;
+    } else {
+        BinTree_t *p_bt = p_mf->p_bt;
+        size_t     r    = shift % p_bt->cyclic_size;
+        for (i=0; i<BT_HASH2_SIZE; i++)
+            if (p_bt->p_head2[i] != 0)
+                p_bt->p_head2[i] = rebaseItem(p_bt->p_head2[i], shift);
+        for (i=0; i<((size_t)1<<BT_HASH3_BITS); i++)
+            if (p_bt->p_head3[i] != 0)
+                p_bt->p_head3[i] = rebaseItem(p_bt->p_head3[i], shift);
+        for (i=0; i<((size_t)1<<(32-p_bt->shift4)); i++)
+            if (p_bt->p_head4[i] != 0)
+                p_bt->p_head4[i] = rebaseItem(p_bt->p_head4[i], shift);
+        for (i=0; i<2*p_bt->cyclic_size; i++)                                 // all the nodes are written, since the window is longer than cyclic_size
+            p_bt->p_son[i] = rebaseItem(p_bt->p_son[i], shift);
+        btReverseNodes(p_bt->p_son, 0, r);                                     // rotate left by r, so that the node of (position-shift) is at ((position-shift) % cyclic_size)
+        btReverseNodes(p_bt->p_son, r, p_bt->cyclic_size);
+        btReverseNodes(p_bt->p_son, 0, p_bt->cyclic_size);
+        p_bt->next_pos -= shift;
+        for (i=0; i<BT_N_CACHED; i++)
+            if (p_bt->cache_pos[i] != INVALID_HASH_ITEM)
+                p_bt->cache_pos[i] = (p_bt->cache_pos[i] >= shift) ? (p_bt->cache_pos[i] - shift) : INVALID_HASH_ITEM;
+    }
 }
 
 
+
 static uint32_t lenDistScore (uint32_t len, uint32_t dist, uint32_t rep0, uint32_t rep1, uint32_t rep2, uint32_t rep3) {
     #define D 12
     static const uint32_t TABLE_THRESHOLDS [] = {D*D*D*D*D*5, D*D*D*D*4, D*D*D*3, D*D*2, D};
@@ -278,9 +915,8 @@ static uint32_t lenDistScore (uint32_t len, uint32_t dist, uint32_t rep0, uint32
 }
 
 
-static void lzSearchMatch (uint8_t *p_src, size_t src_len, size_t pos, size_t hash_table [][HASH_LEVEL], uint32_t *p_len, uint32_t *p_dist) {
+static void lzSearchMatch (uint8_t *p_src, size_t src_len, size_t pos, MatchFinder_t *p_mf, uint32_t *p_len, uint32_t *p_dist) {
     uint32_t len_max = ((src_len-pos) < LZ_LEN_MAX) ? (src_len-pos) : LZ_LEN_MAX;
-    uint32_t hash = getHash(p_src, src_len, pos);
     uint32_t i, j, score1, score2;
     
     *p_len  = 0;
@@ -288,20 +924,123 @@ static void lzSearchMatch (uint8_t *p_src, size_t src_len, size_t pos, size_t ha
     
     score1 = lenDistScore(0, 0xFFFFFFFF, 0, 0, 0, 0);
     
-    for (i=0; i<HASH_LEVEL+2; i++) {
-        size_t ppos = (i<HASH_LEVEL) ? hash_table[hash][i] : (pos-1-(i-HASH_LEVEL));
-        if (ppos != INVALID_HASH_ITEM && ppos < pos && (pos - ppos) < LZ_DIST_MAX_PLUS1) {
-            for (j=0; j<len_max; j++)
-                if (p_src[pos+j] != p_src[ppos+j])
+    if (p_mf->p_pipe != NULL) {                              // found by the match finder thread
+        uint32_t pair [2];
+        pipeGetPairs(p_mf->p_pipe, pos, pair);
+        *p_len  = pair[0];
+        *p_dist = pair[1];
+    } else if (p_mf->type == LZMA_MF_HC) {
+        const HashTable_t *p_ht = &p_mf->ht;
+        
+        for (; p_mf->ht.next_pos<pos; p_mf->ht.next_pos++)            // the lazy parser searches ahead, insert the positions before, so that the matches only depend on pos
+            updateHashTable(p_src, src_len, p_mf->ht.next_pos, &p_mf->ht);
+        
+        uint32_t  hash   = getHash(p_src, src_len, pos, p_ht->shift);
+        uint32_t *bucket = p_ht->p_items + (size_t)hash * p_ht->depth;
+        uint32_t  head   = p_ht->p_heads[hash];
+        
+        for (i=0; i<p_ht->depth+2; i++) {                    // from the newest item to the oldest, then pos-1 and pos-2
+            size_t dist;
+            if (i < p_ht->depth) {
+                uint32_t item = bucket[(head + p_ht->depth - 1 - i) % p_ht->depth];
+                if (item == 0) {                             // the ring is not full, the older items are also empty
+                    i = p_ht->depth - 1;
+                    continue;
+                }
+                dist = (uint32_t)((uint32_t)(pos + 1) - item);
+            } else {
+                dist = 1 + (i - p_ht->depth);
+            }
+            if (dist > 0 && dist <= pos && dist <= p_mf->dict_len) {
+                const uint8_t *p_prev = p_src + (pos - dist);
+                if (i < p_ht->depth && *p_len > 0 && (*p_len >= len_max || p_src[pos+*p_len] != p_prev[*p_len]))
+                    continue;                                // not longer than the found match but farther, so it can't have a higher score. Skip comparing its bytes
+                for (j=0; j<len_max; j++)
+                    if (p_src[pos+j] != p_prev[j])
+                        break;
+                score2 = lenDistScore(j, dist, 0, 0, 0, 0);
+                if (j >= 2 && score1 < score2) {
+                    score1  = score2;
+                    *p_len  = j;
+                    *p_dist = dist;
+                }
+                if (j >= p_mf->nice_len)                     // long enough, don't search the farther ones
                     break;
-            score2 = lenDistScore(j, (pos-ppos), 0, 0, 0, 0);
-            if (j >= 2 && score1 < score2) {
+            }
+        }
+    } else {
+        uint32_t n, sa_pairs [2*BT_MAX_PAIRS];
+        const uint32_t *pairs;
+        
+        if (p_mf->type == LZMA_MF_SA) {
+            n = saGetMatches(p_mf->p_sa, p_src, src_len, pos, sa_pairs);
+            pairs = sa_pairs;
+        } else {
+            pairs = btGetMatches(p_mf->p_bt, p_src, src_len, pos, &n);
+        }
+        
+        for (i=0; i<n; i++) {                                // a longer match of the tree or the suffix array is farther, choose by the score
+            score2 = lenDistScore(pairs[2*i], pairs[2*i+1], 0, 0, 0, 0);
+            if (score1 < score2) {
                 score1  = score2;
-                *p_len  = j;
-                *p_dist = pos - ppos;
+                *p_len  = pairs[2*i];
+                *p_dist = pairs[2*i+1];
+            }
+        }
+    }
+}
+
+
+/// get the matches of pos of increasing lengths as {len, dist} pairs, for the optimal parser. return the number of pairs.
+/// The positions must be searched in order, and each one is inserted to the match finder after it is searched.
+static uint32_t lzGetMatches (uint8_t *p_src, size_t src_len, size_t pos, MatchFinder_t *p_mf, uint32_t *p_pairs) {
+    uint32_t len_max = ((src_len-pos) < LZ_LEN_MAX) ? (src_len-pos) : LZ_LEN_MAX;
+    uint32_t i, j, n = 0, max_len = 1;
+    
+    if (p_mf->p_pipe != NULL) {                                          // found by the match finder thread
+        n = pipeGetPairs(p_mf->p_pipe, pos, p_pairs);
+    } else if (p_mf->type == LZMA_MF_HC) {
+        const HashTable_t *p_ht = &p_mf->ht;
+        uint32_t  hash   = getHash(p_src, src_len, pos, p_ht->shift);
+        uint32_t *bucket = p_ht->p_items + (size_t)hash * p_ht->depth;
+        uint32_t  head   = p_ht->p_heads[hash];
+        
+        for (i=0; i<p_ht->depth+2 && max_len<len_max && max_len<p_mf->nice_len; i++) {             // pos-1 and pos-2, then from the newest item to the oldest, so the distances increase
+            size_t dist;
+            if (i < 2) {
+                dist = 1 + i;
+            } else {
+                uint32_t item = bucket[(head + p_ht->depth + 1 - i) % p_ht->depth];
+                if (item == 0)                                           // the ring is not full, the older items are also empty
+                    break;
+                dist = (uint32_t)((uint32_t)(pos + 1) - item);
+            }
+            if (dist > 0 && dist <= pos && dist <= p_mf->dict_len) {
+                const uint8_t *p_prev = p_src + (pos - dist);
+                if (p_src[pos+max_len] != p_prev[max_len])               // it can't be longer than max_len, skip comparing its bytes
+                    continue;
+                for (j=0; j<len_max; j++)
+                    if (p_src[pos+j] != p_prev[j])
+                        break;
+                if (j >= 2 && j > max_len) {                             // only keep a farther match when it's longer
+                    max_len = j;
+                    p_pairs[2*n]   = j;
+                    p_pairs[2*n+1] = (uint32_t)dist;
+                    n ++;
+                }
             }
         }
+    } else if (p_mf->type == LZMA_MF_SA) {
+        n = saGetMatches(p_mf->p_sa, p_src, src_len, pos, p_pairs);
+    } else {
+        const uint32_t *pairs = btGetMatches(p_mf->p_bt, p_src, src_len, pos, &n);
+        for (i=0; i<2*n; i++)
+            p_pairs[i] = pairs[i];
     }
+    
+    updateMatchFinder(p_src, src_len, pos, p_mf);
+    
+    return n;
 }
 
 
@@ -333,12 +1072,12 @@ static void lzSearchRep (uint8_t *p_src, size_t src_len, size_t pos, uint32_t re
 }
 
 
-static void lzSearch (uint8_t *p_src, size_t src_len, size_t pos, uint32_t rep0, uint32_t rep1, uint32_t rep2, uint32_t rep3, size_t hash_table [][HASH_LEVEL], uint32_t *p_len, uint32_t *p_dist) {
+static void lzSearch (uint8_t *p_src, size_t src_len, size_t pos, uint32_t rep0, uint32_t rep1, uint32_t rep2, uint32_t rep3, MatchFinder_t *p_mf, uint32_t *p_len, uint32_t *p_dist) {
     uint32_t rlen, rdist;
     uint32_t mlen, mdist;
     
     lzSearchRep(p_src, src_len, pos, rep0, rep1, rep2, rep3, 0xFFFFFFFF, &rlen, &rdist);
-    lzSearchMatch(p_src, src_len, pos, hash_table, &mlen, &mdist);
+    lzSearchMatch(p_src, src_len, pos, p_mf, &mlen, &mdist);
     
     if ( lenDistScore(rlen, rdist, rep0, rep1, rep2, rep3) >= lenDistScore(mlen, mdist, rep0, rep1, rep2, rep3) ) {
         *p_len  = rlen;
@@ -350,11 +1089,111 @@ static void lzSearch (uint8_t *p_src, size_t src_len, size_t pos, uint32_t rep0,
 }
 
 
-static uint8_t isShortRep (uint8_t *p_src, size_t src_len, size_t pos, uint32_t rep0) {
+static uint8_t isShortRep (uint8_t *p_src, size_t pos, uint32_t rep0) {
     return (pos >= rep0 && (p_src[pos] == p_src[pos-rep0])) ? 1 : 0;
 }
 
 
+/// whether the ring has no space for the record of pos. The records from free_pos are in use (the encoder may also be ahead of pos)
+static uint8_t pipeIsFull (const MatchPipe_t *p_pipe, size_t pos, size_t word, size_t free_pos) {
+    if (free_pos >= pos)
+        return 0;
+    return (pos - free_pos >= PIPE_N_POS) || (word - p_pipe->p_starts[free_pos % PIPE_N_POS] > PIPE_N_WORDS - PIPE_RECORD_MAX);
+}
+
+
+/// the thread function of the match finder : write the records of all the positions in order, and wait when the ring is full
+static void matchPipeWorker (void *arg) {
+    MatchPipe_t *p_pipe = (MatchPipe_t*)arg;
+    uint32_t     pairs [2*BT_MAX_PAIRS];
+    size_t       pos, word = 0, free_pos = 0;
+    uint8_t      stop = 0;
+    
+    for (pos=0; pos<p_pipe->src_len; pos++) {
+        uint32_t i, n;
+        
+        if (pos % PIPE_BATCH == 0 || pipeIsFull(p_pipe, pos, word, free_pos)) {
+            mutexLock(p_pipe->p_mutex);
+            p_pipe->done_pos = pos;
+            condBroadcast(p_pipe->p_cond);
+            for (;;) {                                                          // wait until there is space for a record
+                free_pos = p_pipe->free_pos;
+                stop     = p_pipe->stop;
+                if (stop || !pipeIsFull(p_pipe, pos, word, free_pos))
+                    break;
+                condWait(p_pipe->p_cond, p_pipe->p_mutex);
+            }
+            mutexUnlock(p_pipe->p_mutex);
+            if (stop)
+                return;
+        }
+        
+        if (pos < free_pos) {                                                   // the encoder has passed it in a match, so only insert it, like the encoder does
+            updateMatchFinder(p_pipe->p_src, p_pipe->src_len, pos, &p_pipe->mf);
+            continue;
+        }
+        
+        if (p_pipe->all_pairs) {
+            n = lzGetMatches(p_pipe->p_src, p_pipe->src_len, pos, &p_pipe->mf, pairs);
+        } else {
+            n = 1;
+            lzSearchMatch(p_pipe->p_src, p_pipe->src_len, pos, &p_pipe->mf, &pairs[0], &pairs[1]);
+            updateMatchFinder(p_pipe->p_src, p_pipe->src_len, pos, &p_pipe->mf);
+        }
+        
+        p_pipe->p_starts[pos % PIPE_N_POS] = word;
+        p_pipe->p_words[word % PIPE_N_WORDS] = n;
+        for (i=0; i<2*n; i++)
+            p_pipe->p_words[(word + 1 + i) % PIPE_N_WORDS] = pairs[i];
+        word += 1 + 2*n;
+    }
+    
+    mutexLock(p_pipe->p_mutex);
+    p_pipe->done_pos = pos;
+    condBroadcast(p_pipe->p_cond);
+    mutexUnlock(p_pipe->p_mutex);
+}
+
+
+static uint8_t useMatchPipe (const LzmaCParams_t *p_params) {
+    return p_params->mf_thread && (p_params->parser == LZMA_PARSER_OPTIMAL || p_params->match_finder == LZMA_MF_BT4);
+}
+
+
+/// move the match finder to its own thread. If it fails, the match finder stays in the encoder, which gives the same output
+static void startMatchPipe (MatchFinder_t *p_mf, uint8_t *p_src, size_t src_len, uint8_t all_pairs) {
+    MatchPipe_t *p_pipe = (MatchPipe_t*)calloc(1, sizeof(MatchPipe_t));
+    
+    if (p_pipe == NULL)
+        return;
+    
+    p_pipe->mf        = *p_mf;
+    p_pipe->p_src     = p_src;
+    p_pipe->src_len   = src_len;
+    p_pipe->all_pairs = all_pairs;
+    p_pipe->p_words   = (uint32_t*)malloc(sizeof(uint32_t) * PIPE_N_WORDS);
+    p_pipe->p_starts  = (size_t*)  malloc(sizeof(size_t)   * PIPE_N_POS);
+    p_pipe->p_mutex   = mutexNew();
+    p_pipe->p_cond    = condNew();
+    
+    if (p_pipe->p_words != NULL && p_pipe->p_starts != NULL && p_pipe->p_mutex != NULL && p_pipe->p_cond != NULL)
+        p_pipe->p_thread = threadStart(matchPipeWorker, p_pipe);
+    
+    if (p_pipe->p_thread == NULL) {
+        if (p_pipe->p_mutex != NULL)
+            mutexFree(p_pipe->p_mutex);
+        if (p_pipe->p_cond  != NULL)
+            condFree(p_pipe->p_cond);
+        free(p_pipe->p_words);
+        free(p_pipe->p_starts);
+        free(p_pipe);
+        return;
+    }
+    
+    p_mf->p_pipe = p_pipe;                                                      // the tables are only used by the thread from now on
+}
+
+
 
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -392,92 +1231,654 @@ static uint8_t stateTransition (uint8_t state, PACKET_t type) {
 
 
 
-#define   N_STATES                                  12
-#define   N_LIT_STATES                              7
-
-#define   LC                                        4                  // valid range : 0~8
-#define   N_PREV_BYTE_LC_MSBS                       (1 << LC)
-#define   LC_SHIFT                                  (8 - LC)
-#define   LC_MASK                                   ((1 << LC) - 1)
-
-#define   LP                                        0                  // valid range : 0~4
-#define   N_LIT_POS_STATES                          (1 << LP)
-#define   LP_MASK                                   ((1 << LP) - 1)
-
-#define   PB                                        3                  // valid range : 0~4
-#define   N_POS_STATES                              (1 << PB)
-#define   PB_MASK                                   ((1 << PB) - 1)
+#define   N_STATES                                  12
+#define   N_LIT_STATES                              7
+
+#define   MAX_LC                                    8                  // see LZMA specification
+#define   MAX_LP                                    4
+#define   MAX_PB                                    4
+#define   N_POS_STATES                              (1 << MAX_PB)      // the arrays of the pos states are for the max pb, since they are small
+
+#define   N_LITERAL_PROBS(lc, lp)                   (((size_t)1 << ((lc) + (lp))) * 3*(1<<8))      // the literal probability array has (1<<lp) x (1<<lc) x 0x300 items
+
+#define   LCLPPB_BYTE(lc, lp, pb)                   ((uint8_t)( ((pb) * 5 + (lp)) * 9 + (lc) ))
+
+
+typedef struct {                                                        // all the probability arrays of the LZMA encoder, except the literal one, whose size depends on lc and lp
+    uint16_t is_match     [N_STATES] [N_POS_STATES] ;
+    uint16_t is_rep       [N_STATES] ;
+    uint16_t is_rep0      [N_STATES] ;
+    uint16_t is_rep0_long [N_STATES] [N_POS_STATES] ;
+    uint16_t is_rep1      [N_STATES] ;
+    uint16_t is_rep2      [N_STATES] ;
+    uint16_t dist_slot    [4]  [(1<<6)-1];
+    uint16_t dist_special [10] [(1<<5)-1];
+    uint16_t dist_align   [(1<<4)-1];
+    uint16_t len_choice   [2];
+    uint16_t len_choice2  [2];
+    uint16_t len_low      [2] [N_POS_STATES] [(1<<3)-1];
+    uint16_t len_mid      [2] [N_POS_STATES] [(1<<3)-1];
+    uint16_t len_high     [2] [(1<<8)-1];
+} LzmaProbs_t;
+
+
+#define   INIT_PROBS(probs)                         {                  \
+    uint16_t *p = (uint16_t*)&(probs);                                 \
+    uint16_t *q = p + (sizeof(probs) / sizeof(uint16_t));              \
+    for (; p<q; p++)                                                   \
+        *p = RANGE_CODE_HALF_PROBABILITY;                              \
+}                                                                       // all probabilities are init to 50% (half probability)
+
+
+static uint32_t getDistSlot (uint32_t dist) {     // dist is (distance - 1)
+    uint32_t dist_slot;
+    
+    if (dist < 4)
+        return dist;
+    
+    dist_slot = countBit(dist) - 1;
+    return (dist_slot<<1) | ((dist>>(dist_slot-1)) & 1);
+}
+
+
+
+
+// the optimal parser : choose the packets by their prices, i.e., the bits they cost with the current probabilities ---------------------------------------
+
+// The parser works on a window of up to OPT_LEN positions. Node i of the window is position (pos+i), it keeps the cheapest known path to it :
+// the total price, the last packet, and where the last packet starts. The nodes are visited in order, and each one relaxes the later nodes
+// through a literal, a short rep, the rep matches and the matches. Since a node keeps only one path (and its reps), a literal followed by
+// a rep0 match is also tried after a literal, a rep match or a match, like 7-zip does, so that a rep0 which is broken by one byte can be
+// resumed even if the node after that byte has a cheaper path with other reps. When no packet goes beyond the visited node, all the paths
+// meet there, so the cheapest path to it is final, and its packets are queued. The price tables of lengths and distances are updated every
+// PRICE_UPDATE_LEN bytes, since the probabilities change slowly.
+
+#define   PRICE_SHIFT_BITS                          4                  // the prices are in 1/16 bit
+#define   PRICE_REDUCING_BITS                       4                  // the price of a bit is looked up by (probability >> PRICE_REDUCING_BITS)
+#define   PRICE_INFINITY                            0x3FFFFFFFU
+#define   PRICE_UPDATE_LEN                          1024
+#define   DECODE_WORK_PACKET                        4                  // the decode work of a packet besides its range-decoded bits (an iteration of the loop, the state and the copy), in bits
+#define   DECODE_WORK_LIT                           (DECODE_WORK_PACKET + 9)                                // is_match and 8 bits
+#define   DECODE_WORK_SHORTREP                      (DECODE_WORK_PACKET + 4)                                // is_match, is_rep, is_rep0 and is_rep0_long
+#define   DECODE_BIAS_PRICE(bias, work)             (((bias) * (work)) >> 1)                                // the extra price of a packet : 1/32 bit per decode_bias per bit of decode work
+#define   DECODE_BIAS_PRICE_LIT_CAP                 ((8<<PRICE_SHIFT_BITS) + (8<<PRICE_SHIFT_BITS)/16)   // the extra price never makes a literal cost more than 8.5 bits, the expansion allowed by lzmaCBound
+#define   N_FULL_DISTS                              128                // the distances of which (dist-1) < 128 (dist slot < 14) have their whole prices in a table
+
+#define   OPT_LEN                                   (1<<11)
+
+
+typedef struct {
+    uint32_t price;                       // the price of the cheapest path from the start of the window to here
+    uint32_t prev;                        // the node where the last packet of the path starts
+    uint32_t len;                         // the last packet of the path : 0 for a literal, 1 for a short rep, otherwise the length of a (rep) match
+    uint32_t dist;
+    uint32_t len_before, dist_before;     // the path may reach here from prev with more packets : a (rep) match of len_before (0 if not),
+    uint8_t  lit_before;                  //   then a literal (if lit_before), then the last packet, which is a rep0 match
+    uint32_t reps [4];                    // the reps after the path
+    uint8_t  state;                       // the state after the path
+} OptNode_t;
+
+
+typedef struct {
+    uint32_t  bit_prices   [RANGE_CODE_BIT_MODEL_TOTAL >> PRICE_REDUCING_BITS];
+    uint32_t  len_prices   [2] [N_POS_STATES] [LZ_LEN_MAX+1];             // [0] for matches, [1] for rep matches
+    uint32_t  slot_prices  [4] [64];                                      // including the direct bits
+    uint32_t  dist_prices  [4] [N_FULL_DISTS];
+    uint32_t  align_prices [16];
+    size_t    update_pos;                                                 // the price tables are updated when the parser reaches it
+    uint32_t  pairs        [2*BT_MAX_PAIRS];
+    OptNode_t nodes        [OPT_LEN + 2*LZ_LEN_MAX + 2];                  // a match, a literal and a rep0 match may go beyond the last visited node
+    uint32_t  n_packets;                                                  // the packets of the cheapest path, to be encoded
+    uint32_t  i_packet;
+    uint32_t  packet_len   [OPT_LEN];
+    uint32_t  packet_dist  [OPT_LEN];
+} OptParser_t;
+
+
+static void initOptParser (OptParser_t *p_opt) {
+    uint32_t i, j;
+    
+    for (i=0; i<(RANGE_CODE_BIT_MODEL_TOTAL >> PRICE_REDUCING_BITS); i++) {    // -log2(probability), got by squaring the probability PRICE_SHIFT_BITS times (like 7-zip)
+        uint32_t w = (i << PRICE_REDUCING_BITS) + (1 << (PRICE_REDUCING_BITS - 1));
+        uint32_t bit_count = 0;
+        for (j=0; j<PRICE_SHIFT_BITS; j++) {
+            w = w * w;
+            bit_count <<= 1;
+            while (w >= (1U << 16)) {
+                w >>= 1;
+                bit_count ++;
+            }
+        }
+        p_opt->bit_prices[i] = (RANGE_CODE_N_BIT_MODEL_TOTAL_BITS << PRICE_SHIFT_BITS) - 15 - bit_count;
+    }
+    
+    p_opt->update_pos = 0;
+    p_opt->n_packets  = 0;
+    p_opt->i_packet   = 0;
+}
+
+
+static uint32_t priceBit (const OptParser_t *p_opt, uint16_t prob, uint8_t bit) {
+    return p_opt->bit_prices[(bit ? (RANGE_CODE_BIT_MODEL_TOTAL - prob) : prob) >> PRICE_REDUCING_BITS];
+}
+
+
+static uint32_t priceInt (const OptParser_t *p_opt, const uint16_t *p_prob, uint32_t val, uint32_t bit_count) {     // the price of rangeEncodeInt
+    uint32_t price = 0, treepos = 1;
+    for (; bit_count>0; bit_count--) {
+        uint8_t bit = (uint8_t)(1 & (val >> (bit_count-1)));
+        price += priceBit(p_opt, p_prob[treepos-1], bit);
+        treepos = (treepos << 1) | bit;
+    }
+    return price;
+}
+
+
+static uint32_t priceMB (const OptParser_t *p_opt, const uint16_t *p_prob, uint32_t byte, uint32_t match_byte) {  // the price of rangeEncodeMB
+    uint32_t i, price = 0, treepos = 1, off0 = 0x100, off1;
+    for (i=0; i<8; i++) {
+        uint8_t bit = (uint8_t)(1 & (byte >> 7));
+        byte <<= 1;
+        match_byte <<= 1;
+        off1 = off0;
+        off0 &= match_byte;
+        price += priceBit(p_opt, p_prob[off0+off1+treepos-1], bit);
+        treepos = (treepos << 1) | bit;
+        if (!bit)
+            off0 ^= off1;
+    }
+    return price;
+}
+
+
+static void updatePrices (OptParser_t *p_opt, const LzmaProbs_t *p_probs, uint32_t n_pos_states) {
+    uint32_t i, pos_state, len, dist_slot, dist;
+    
+    for (i=0; i<2; i++) {
+        uint32_t price_low  = priceBit(p_opt, p_probs->len_choice[i], 0);
+        uint32_t price_mid  = priceBit(p_opt, p_probs->len_choice[i], 1) + priceBit(p_opt, p_probs->len_choice2[i], 0);
+        uint32_t price_high = priceBit(p_opt, p_probs->len_choice[i], 1) + priceBit(p_opt, p_probs->len_choice2[i], 1);
+        for (pos_state=0; pos_state<n_pos_states; pos_state++) {
+            for (len=2; len<=LZ_LEN_MAX; len++) {
+                if      (len < 10)
+                    p_opt->len_prices[i][pos_state][len] = price_low + priceInt(p_opt, p_probs->len_low[i][pos_state], len-2 , 3);
+                else if (len < 18)
+                    p_opt->len_prices[i][pos_state][len] = price_mid + priceInt(p_opt, p_probs->len_mid[i][pos_state], len-10, 3);
+                else if (pos_state == 0)
+                    p_opt->len_prices[i][pos_state][len] = price_high + priceInt(p_opt, p_probs->len_high[i], len-18, 8);
+                else                                                                      // the high lengths don't depend on the pos_state
+                    p_opt->len_prices[i][pos_state][len] = p_opt->len_prices[i][0][len];
+            }
+        }
+    }
+    
+    for (i=0; i<4; i++) {
+        for (dist_slot=0; dist_slot<64; dist_slot++) {
+            p_opt->slot_prices[i][dist_slot] = priceInt(p_opt, p_probs->dist_slot[i], dist_slot, 6);
+            if (dist_slot >= 14)
+                p_opt->slot_prices[i][dist_slot] += ((dist_slot >> 1) - 1 - 4) << PRICE_SHIFT_BITS;
+        }
+        for (dist=0; dist<N_FULL_DISTS; dist++) {
+            uint32_t bcnt = 0;
+            dist_slot = getDistSlot(dist);
+            p_opt->dist_prices[i][dist] = p_opt->slot_prices[i][dist_slot];
+            if (dist_slot >= 4) {
+                bcnt = (dist_slot >> 1) - 1;
+                p_opt->dist_prices[i][dist] += priceInt(p_opt, p_probs->dist_special[dist_slot-4], bitsReverse(dist & ((1<<bcnt)-1), bcnt), bcnt);
+            }
+        }
+    }
+    
+    for (i=0; i<16; i++)
+        p_opt->align_prices[i] = priceInt(p_opt, p_probs->dist_align, bitsReverse(i, 4), 4);
+}
+
+
+static uint32_t priceRep (const OptParser_t *p_opt, const LzmaProbs_t *p_probs, uint32_t i, uint8_t state, uint32_t pos_state) {   // the price of choosing rep i after the is_rep bit
+    if (i == 0)
+        return priceBit(p_opt, p_probs->is_rep0[state], 0) + priceBit(p_opt, p_probs->is_rep0_long[state][pos_state], 1);
+    else if (i == 1)
+        return priceBit(p_opt, p_probs->is_rep0[state], 1) + priceBit(p_opt, p_probs->is_rep1[state], 0);
+    else
+        return priceBit(p_opt, p_probs->is_rep0[state], 1) + priceBit(p_opt, p_probs->is_rep1[state], 1) + priceBit(p_opt, p_probs->is_rep2[state], i-2);
+}
+
+
+static uint32_t priceMatch (const OptParser_t *p_opt, uint32_t len, uint32_t dist, uint32_t pos_state) {     // the price of the length and distance of a match
+    uint32_t len_state = (len > 5) ? 3 : (len - 2);
+    uint32_t price = p_opt->len_prices[0][pos_state][len];
+    
+    dist --;
+    
+    if (dist < N_FULL_DISTS)
+        return price + p_opt->dist_prices[len_state][dist];
+    else
+        return price + p_opt->slot_prices[len_state][getDistSlot(dist)] + p_opt->align_prices[dist & 15];
+}
+
+
+/// try to reach node (cur+step) with a packet, and extend the window if it's beyond the end. Return 1 if it's the cheapest path to there
+static int optRelax (OptNode_t *nodes, uint32_t *p_end, uint32_t cur, uint32_t step, uint32_t price, uint32_t len, uint32_t dist) {
+    uint32_t target = cur + step;
+    
+    while (*p_end < target)
+        nodes[++(*p_end)].price = PRICE_INFINITY;
+    
+    if (price < nodes[target].price) {
+        nodes[target].price = price;
+        nodes[target].prev  = cur;
+        nodes[target].len   = len;
+        nodes[target].dist  = dist;
+        nodes[target].len_before = 0;
+        nodes[target].lit_before = 0;
+        return 1;
+    }
+    
+    return 0;
+}
+
+
+/// try to reach a node with a literal and a rep0 match of len2, after a (rep) match of len_before (0 if not)
+static void optRelaxLitRep0 (OptNode_t *nodes, uint32_t *p_end, uint32_t cur, uint32_t price, uint32_t len_before, uint32_t dist_before, uint32_t len2, uint32_t rep0) {
+    if (optRelax(nodes, p_end, cur, len_before+1+len2, price, len2, rep0)) {
+        nodes[cur+len_before+1+len2].len_before  = len_before;
+        nodes[cur+len_before+1+len2].dist_before = dist_before;
+        nodes[cur+len_before+1+len2].lit_before  = 1;
+    }
+}
+
+
+/// apply a packet to the reps and the state. The packets are classified the same way as lzmaEncode does
+static void optApply (uint32_t *reps, uint8_t *p_state, uint32_t len, uint32_t dist) {
+    uint32_t i, j;
+    PACKET_t type;
+    
+    if        (len == 0) {
+        type = PKT_LIT;
+    } else if (len == 1) {
+        type = PKT_SHORTREP;
+    } else {
+        for (i=0; i<4; i++)
+            if (dist == reps[i])
+                break;
+        type = (i < 4) ? (PACKET_t)(PKT_REP0 + i) : PKT_MATCH;
+        for (j=(i<4?i:3); j>0; j--)
+            reps[j] = reps[j-1];
+        reps[0] = dist;
+    }
+    
+    *p_state = stateTransition(*p_state, type);
+}
+
+
+/// get the state and reps of a node from the packets of its path since the previous node
+static void optFollow (OptNode_t *nodes, uint32_t cur) {
+    OptNode_t       *node = nodes + cur;
+    const OptNode_t *prev = nodes + node->prev;
+    uint32_t i;
+    
+    for (i=0; i<4; i++)
+        node->reps[i] = prev->reps[i];
+    node->state = prev->state;
+    
+    if (node->len_before >= 2)
+        optApply(node->reps, &node->state, node->len_before, node->dist_before);
+    if (node->lit_before)
+        optApply(node->reps, &node->state, 0, 0);
+    optApply(node->reps, &node->state, node->len, node->dist);
+}
+
+
+typedef struct {                                                        // the state of the encoder which is kept between the calls of lzmaEncodePackets
+    LzmaProbs_t    probs;
+    uint16_t      *probs_literal;                                       // [1<<lp] [1<<lc] [3*(1<<8)]
+    uint8_t        lc, lp, pb;
+    uint8_t        state;                                               // valid value : 0~12
+    uint32_t       rep0, rep1, rep2, rep3;
+    uint32_t       n_bypass, len_bypass, dist_bypass;                   // the packets decided ahead by the lazy parser
+    MatchFinder_t  mf;
+    OptParser_t   *p_opt;                                               // only for LZMA_PARSER_OPTIMAL
+    uint32_t       parser;
+    uint32_t       nice_len;
+    uint32_t       decode_bias;                                         // only for LZMA_PARSER_OPTIMAL
+} LzmaEncoder_t;
+
+
+/// the literal probabilities of a byte, by the low lp bits of its position and the high lc bits of the previous byte
+static uint16_t *getLiteralProbs (const LzmaEncoder_t *p_enc, size_t pos, uint8_t prev_byte) {
+    size_t lit_state = (((size_t)pos & ((1 << p_enc->lp) - 1)) << p_enc->lc) + (prev_byte >> (8 - p_enc->lc));
+    return p_enc->probs_literal + lit_state * 3*(1<<8);
+}
+
+
+/// the length of the match at p with dist, up to len_max
+static uint32_t optMatchLen (const uint8_t *p_src, size_t p, uint32_t dist, uint32_t len_max) {
+    uint32_t len;
+    for (len=0; len<len_max; len++)
+        if (p_src[p+len] != p_src[p+len-dist])
+            break;
+    return len;
+}
+
+
+/// if the byte at p breaks a (rep) match with dist, and it resumes at (p+1) for at least 2 bytes, get that length
+static int optLitRep0Len (const uint8_t *p_src, size_t src_len, size_t p, uint32_t dist, uint32_t nice_len, uint32_t *p_len2) {
+    size_t len2_max;
+    if (p+3 > src_len || p_src[p] == p_src[p-dist])
+        return 0;
+    len2_max = src_len - p - 1;
+    *p_len2  = optMatchLen(p_src, p+1, dist, (len2_max < nice_len) ? (uint32_t)len2_max : nice_len);
+    return *p_len2 >= 2;
+}
+
+
+/// the decode work of a packet is counted in range-decoded bits, plus DECODE_WORK_PACKET. A literal takes 9 bits, a short rep 4, and a
+/// (rep) match about 10~30 bits for any length. So per byte, the short matches pay the most : a literal run is only replaced by the
+/// matches which really save the decode work, and the longer matches and the rep matches are preferred.
+static uint32_t decodeWorkLen (uint32_t len) {                          // the bits of a length : 4 for 2~9, 5 for 10~17, 10 for 18~273
+    return (len < 10) ? 4 : (len < 18) ? 5 : 10;
+}
+
+
+static uint32_t decodeWorkMatch (uint32_t len, uint32_t dist) {         // the work of a match : is_match, is_rep, the length, the slot and the footer bits
+    uint32_t dist_slot = getDistSlot(dist - 1);
+    return DECODE_WORK_PACKET + 2 + decodeWorkLen(len) + 6 + ((dist_slot < 4) ? 0 : (dist_slot >> 1) - 1);
+}
+
+
+static uint32_t decodeWorkRep (uint32_t i, uint32_t len) {              // the work of rep match i : is_match, is_rep, 2~3 bits to choose i, and the length
+    return DECODE_WORK_PACKET + ((i < 2) ? 4 : 5) + decodeWorkLen(len);
+}
+
+
+/// add the decode bias to the price of a literal or a short rep, but not beyond DECODE_BIAS_PRICE_LIT_CAP. Otherwise, the matches
+/// which are chosen instead of the incompressible literals (of 8 bits or more) could expand the output beyond lzmaCBound
+static uint32_t priceBiasLit (uint32_t bias_lit, uint32_t price) {
+    if (price + bias_lit <= DECODE_BIAS_PRICE_LIT_CAP)
+        return price + bias_lit;
+    return (price > DECODE_BIAS_PRICE_LIT_CAP) ? price : DECODE_BIAS_PRICE_LIT_CAP;
+}
+
+
+/// the price of a literal at p and a rep0 match of len at (p+1), from state. rep0 must not be larger than p
+static uint32_t priceLitRep0 (const LzmaEncoder_t *p_enc, const uint8_t *p_src, size_t p, uint8_t state, uint32_t rep0, uint32_t len) {
+    const OptParser_t *p_opt   = p_enc->p_opt;
+    const LzmaProbs_t *p_probs = &p_enc->probs;
+    uint32_t   pb_mask   = (1 << p_enc->pb) - 1;
+    uint32_t   pos_state = pb_mask & (uint32_t)p;
+    const uint16_t *p_lit = getLiteralProbs(p_enc, p, p_src[p-1]);
+    uint32_t   price = priceBit(p_opt, p_probs->is_match[state][pos_state], 0);
+    uint32_t   bias  = p_enc->decode_bias;
+    
+    if (state < N_LIT_STATES)
+        price += priceInt(p_opt, p_lit, p_src[p], 8);
+    else
+        price += priceMB (p_opt, p_lit, p_src[p], p_src[p-rep0]);
+    
+    price  = priceBiasLit(DECODE_BIAS_PRICE(bias, DECODE_WORK_LIT), price);
+    
+    state     = stateTransition(state, PKT_LIT);
+    pos_state = pb_mask & (uint32_t)(p+1);
+    
+    price += priceBit(p_opt, p_probs->is_match[state][pos_state], 1) + priceBit(p_opt, p_probs->is_rep[state], 1);
+    price += priceRep(p_opt, p_probs, 0, state, pos_state) + p_opt->len_prices[1][pos_state][len] + DECODE_BIAS_PRICE(bias, decodeWorkRep(0, len));
+    return price;
+}
+
+
+/// find the cheapest packets from pos by dynamic programming on a window of the following positions, and queue them in p_opt
+static void optimalParse (LzmaEncoder_t *p_enc, uint8_t *p_src, size_t src_len, size_t pos, uint8_t state, uint32_t rep0, uint32_t rep1, uint32_t rep2, uint32_t rep3) {
+    OptParser_t       *p_opt   = p_enc->p_opt;
+    const LzmaProbs_t *p_probs = &p_enc->probs;
+    MatchFinder_t     *p_mf    = &p_enc->mf;
+    uint32_t   nice_len = p_enc->nice_len;
+    uint32_t   pb_mask  = (1 << p_enc->pb) - 1;
+    uint32_t   bias     = p_enc->decode_bias;                               // DECODE_BIAS_PRICE(bias, the decode work) is added to the price of each packet (capped for the literals)
+    OptNode_t *nodes = p_opt->nodes;
+    uint32_t   cur, end = 0, n;
+    
+    if (pos >= p_opt->update_pos) {
+        updatePrices(p_opt, p_probs, 1 << p_enc->pb);
+        p_opt->update_pos = pos + PRICE_UPDATE_LEN;
+    }
+    
+    nodes[0].price   = 0;
+    nodes[0].state   = state;
+    nodes[0].reps[0] = rep0;
+    nodes[0].reps[1] = rep1;
+    nodes[0].reps[2] = rep2;
+    nodes[0].reps[3] = rep3;
+    
+    for (cur=0; ; cur++) {
+        OptNode_t *node = nodes + cur;
+        size_t     p = pos + cur;
+        uint32_t   len_max = ((src_len-p) < LZ_LEN_MAX) ? (uint32_t)(src_len-p) : LZ_LEN_MAX;
+        uint32_t   len2_max;
+        uint32_t   pos_state = pb_mask & (uint32_t)p;
+        uint32_t   rep_lens [4];
+        uint32_t   i, j, len, n_pairs, long_len = 0, long_dist = 0, work;
+        uint32_t   price_match, price_rep, price_normal, price;
+        const uint16_t *p_lit;
+        
+        if (cur > 0) {
+            optFollow(nodes, cur);
+            if (cur == end)                                                    // all the paths meet here
+                break;
+        }
+        
+        if (p >= src_len || cur >= OPT_LEN)
+            break;
+        
+        n_pairs = lzGetMatches(p_src, src_len, p, p_mf, p_opt->pairs);
+        
+        if (n_pairs > 0) {
+            long_len  = p_opt->pairs[2*n_pairs-2];
+            long_dist = p_opt->pairs[2*n_pairs-1];
+        }
+        
+        for (i=0; i<4; i++) {
+            rep_lens[i] = 0;
+            if (node->reps[i] > p)
+                continue;
+            for (j=0; j<i; j++)                                                // a rep equal to an earlier one is always encoded as the earlier one
+                if (node->reps[j] == node->reps[i])
+                    break;
+            if (j < i)
+                continue;
+            for (len=0; len<len_max; len++)
+                if (p_src[p+len] != p_src[p+len-node->reps[i]])
+                    break;
+            rep_lens[i] = len;
+            if (len >= nice_len && len >= long_len) {                          // prefer a long rep match to a long match
+                long_len  = len;
+                long_dist = node->reps[i];
+            }
+        }
+        
+        if (long_len >= nice_len) {                                            // a long enough match is taken without comparing, and ends the window
+            optRelax(nodes, &end, cur, long_len, 0, long_len, long_dist);   // the price of 0 makes it the cheapest
+            cur += long_len;
+            break;
+        }
+        
+        price_match  = node->price  + priceBit(p_opt, p_probs->is_match[node->state][pos_state], 1);
+        price_rep    = price_match  + priceBit(p_opt, p_probs->is_rep[node->state], 1);
+        price_normal = price_match  + priceBit(p_opt, p_probs->is_rep[node->state], 0);
+        
+        p_lit = getLiteralProbs(p_enc, p, (p > 0) ? p_src[p-1] : 0);
+        price = priceBit(p_opt, p_probs->is_match[node->state][pos_state], 0);
+        if (node->state < N_LIT_STATES)
+            price += priceInt(p_opt, p_lit, p_src[p], 8);
+        else
+            price += priceMB (p_opt, p_lit, p_src[p], p_src[p-node->reps[0]]);
+        optRelax(nodes, &end, cur, 1, node->price + priceBiasLit(DECODE_BIAS_PRICE(bias, DECODE_WORK_LIT), price), 0, 0);
+        
+        if (node->reps[0] <= p && p_src[p] == p_src[p-node->reps[0]]) {
+            price = price_rep - node->price + priceBit(p_opt, p_probs->is_rep0[node->state], 0) + priceBit(p_opt, p_probs->is_rep0_long[node->state][pos_state], 0);
+            optRelax(nodes, &end, cur, 1, node->price + priceBiasLit(DECODE_BIAS_PRICE(bias, DECODE_WORK_SHORTREP), price), 1, node->reps[0]);
+        } else if (node->reps[0] <= p && optLitRep0Len(p_src, src_len, p, node->reps[0], nice_len, &len2_max)) {                // a literal and a rep0 match
+            price = node->price + priceLitRep0(p_enc, p_src, p, node->state, node->reps[0], len2_max);
+            optRelaxLitRep0(nodes, &end, cur, price, 0, 0, len2_max, node->reps[0]);
+        }
+        
+        for (i=0; i<4; i++) {
+            uint32_t price_base = price_rep + priceRep(p_opt, p_probs, i, node->state, pos_state);
+            for (len=2; len<=rep_lens[i]; len++)
+                optRelax(nodes, &end, cur, len, price_base + p_opt->len_prices[1][pos_state][len] + DECODE_BIAS_PRICE(bias, decodeWorkRep(i, len)), len, node->reps[i]);
+            len = rep_lens[i];
+            if (len >= 2 && optLitRep0Len(p_src, src_len, p+len, node->reps[i], nice_len, &len2_max)) {          // a rep match, a literal and a rep0 match
+                price = price_base + p_opt->len_prices[1][pos_state][len] + DECODE_BIAS_PRICE(bias, decodeWorkRep(i, len)) + priceLitRep0(p_enc, p_src, p+len, stateTransition(node->state, PKT_REP0), node->reps[i], len2_max);
+                optRelaxLitRep0(nodes, &end, cur, price, len, node->reps[i], len2_max, node->reps[i]);
+            }
+        }
+        
+        len = 2;
+        for (i=0; i<n_pairs; i++) {                                            // the pairs have increasing lengths, each length uses the nearest pair which can reach it
+            uint32_t dist = p_opt->pairs[2*i+1];
+            if (dist == node->reps[0] || dist == node->reps[1] || dist == node->reps[2] || dist == node->reps[3])
+                continue;                                                      // it's a rep match, which is already tried
+            work = (bias > 0) ? decodeWorkMatch(2, dist) - decodeWorkLen(2) : 0;                              // the work besides the length
+            for (; len<=p_opt->pairs[2*i]; len++)
+                optRelax(nodes, &end, cur, len, price_normal + priceMatch(p_opt, len, dist, pos_state) + DECODE_BIAS_PRICE(bias, work + decodeWorkLen(len)), len, dist);
+            j = p_opt->pairs[2*i];
+            if (optLitRep0Len(p_src, src_len, p+j, dist, nice_len, &len2_max)) {                                  // a match, a literal and a rep0 match
+                price = price_normal + priceMatch(p_opt, j, dist, pos_state) + DECODE_BIAS_PRICE(bias, decodeWorkMatch(j, dist)) + priceLitRep0(p_enc, p_src, p+j, stateTransition(node->state, PKT_MATCH), dist, len2_max);
+                optRelaxLitRep0(nodes, &end, cur, price, j, dist, len2_max, dist);
+            }
+        }
+    }
+    
+    for (n=0, end=cur; end>0; end=nodes[end].prev)                             // trace back the cheapest path
+        n += 1 + nodes[end].lit_before + (nodes[end].len_before >= 2);
+    
+    p_opt->n_packets = n;
+    p_opt->i_packet  = 0;
+    
+    for (end=cur; end>0; end=nodes[end].prev) {
+        n --;
+        p_opt->packet_len [n] = nodes[end].len;
+        p_opt->packet_dist[n] = nodes[end].dist;
+        if (nodes[end].lit_before) {
+            n --;
+            p_opt->packet_len [n] = 0;
+            p_opt->packet_dist[n] = 0;
+        }
+        if (nodes[end].len_before >= 2) {
+            n --;
+            p_opt->packet_len [n] = nodes[end].len_before;
+            p_opt->packet_dist[n] = nodes[end].dist_before;
+        }
+    }
+}
+
+
+/// reset the probabilities, the state and the reps, and drop the packets decided ahead (they may depend on the old reps).
+/// the match finder is kept, so that the following packets can still refer to the data before
+static void resetLzmaEncoderState (LzmaEncoder_t *p_enc) {
+    size_t i;
+    INIT_PROBS(p_enc->probs);
+    for (i=0; i<N_LITERAL_PROBS(p_enc->lc, p_enc->lp); i++)
+        p_enc->probs_literal[i] = RANGE_CODE_HALF_PROBABILITY;
+    p_enc->state = 0;
+    p_enc->rep0  = p_enc->rep1 = p_enc->rep2 = p_enc->rep3 = 1;
+    p_enc->n_bypass = p_enc->len_bypass = p_enc->dist_bypass = 0;
+    if (p_enc->p_opt != NULL)
+        p_enc->p_opt->i_packet = p_enc->p_opt->n_packets = 0;
+}
+
 
-#define   LCLPPB_BYTE                               ((uint8_t)( (PB * 5 + LP) * 9 + LC ))
+static int newLzmaEncoder (LzmaEncoder_t *p_enc, size_t src_len, const LzmaCParams_t *p_params) {
+    LzmaCParams_t params;
+    int ret_code;
+    
+    if (p_params == NULL) {
+        lzmaCDefaultParams(&params);
+        p_params = &params;
+    }
+    
+    if ((p_params->match_finder != LZMA_MF_HC && p_params->match_finder != LZMA_MF_BT4 && p_params->match_finder != LZMA_MF_SA) ||
+        p_params->dict_len   < DICT_LEN_MIN   || p_params->dict_len   > DICT_LEN_MAX   ||
+        p_params->hash_bits  < HASH_BITS_MIN  || p_params->hash_bits  > HASH_BITS_MAX  ||
+        p_params->hash_depth < HASH_DEPTH_MIN || p_params->hash_depth > HASH_DEPTH_MAX ||
+        p_params->nice_len   < NICE_LEN_MIN   || p_params->nice_len   > LZ_LEN_MAX     ||
+        p_params->parser     > LZMA_PARSER_OPTIMAL ||
+        p_params->mf_thread  > 1 ||
+        p_params->decode_bias > LZMA_DECODE_BIAS_MAX ||
+        p_params->lc > MAX_LC || p_params->lp > MAX_LP || p_params->pb > MAX_PB )
+        return R_ERR_UNSUPPORTED;
+    
+    p_enc->parser   = p_params->parser;
+    p_enc->nice_len = p_params->nice_len;
+    p_enc->decode_bias = p_params->decode_bias;
+    p_enc->lc       = (uint8_t)p_params->lc;
+    p_enc->lp       = (uint8_t)p_params->lp;
+    p_enc->pb       = (uint8_t)p_params->pb;
+    p_enc->p_opt    = NULL;
+    
+    p_enc->probs_literal = (uint16_t*)malloc(sizeof(uint16_t) * N_LITERAL_PROBS(p_enc->lc, p_enc->lp));    // 6MB for the max lc and lp
+    if (p_enc->probs_literal == NULL)
+        return R_ERR_MEMORY_RUNOUT;
+    
+    ret_code = newMatchFinder(&p_enc->mf, src_len, p_params);
+    if (ret_code) {
+        free(p_enc->probs_literal);
+        return ret_code;
+    }
+    
+    if (p_params->parser == LZMA_PARSER_OPTIMAL) {
+        p_enc->p_opt = (OptParser_t*)malloc(sizeof(OptParser_t));               // it's too large for the stack
+        if (p_enc->p_opt == NULL) {
+            freeMatchFinder(&p_enc->mf);
+            free(p_enc->probs_literal);
+            return R_ERR_MEMORY_RUNOUT;
+        }
+        initOptParser(p_enc->p_opt);
+    }
+    
+    resetLzmaEncoderState(p_enc);
+    
+    return R_OK;
+}
 
 
-#define   INIT_PROBS(probs)                         {                  \
-    uint16_t *p = (uint16_t*)(probs);                                  \
-    uint16_t *q = p + (sizeof(probs) / sizeof(uint16_t));              \
-    for (; p<q; p++)                                                   \
-        *p = RANGE_CODE_HALF_PROBABILITY;                              \
-}                                                                       // all probabilities are init to 50% (half probability)
+static void freeLzmaEncoder (LzmaEncoder_t *p_enc) {
+    freeMatchFinder(&p_enc->mf);
+    free(p_enc->p_opt);
+    free(p_enc->probs_literal);
+    p_enc->p_opt = NULL;
+    p_enc->probs_literal = NULL;
+}
 
 
-int lzmaEncode (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len, uint8_t with_end_mark) {
-    uint8_t  state = 0;                           // valid value : 0~12
-    size_t   pos   = 0;                           // position of uncompressed data (p_dst)
-    uint32_t rep0  = 1;
-    uint32_t rep1  = 1;
-    uint32_t rep2  = 1;
-    uint32_t rep3  = 1;
-    uint32_t n_bypass=0, len_bypass=0, dist_bypass=0;
+/// encode the packets from *p_pos, until pos reaches pos_end (then encode the end marker if with_end_mark),
+/// or until the output (including the bytes pending in the range coder) reaches p_dst_stop (NULL for no limit).
+/// the last packet may go beyond pos_end by at most LZ_LEN_MAX-1 bytes. The range coder is not terminated here
+static void lzmaEncodePackets (LzmaEncoder_t *p_enc, RangeEncoder_t *p_coder, uint8_t *p_src, size_t src_len, size_t *p_pos, size_t pos_end, const uint8_t *p_dst_stop, uint8_t with_end_mark) {
+    uint8_t  state = p_enc->state;
+    size_t   pos   = *p_pos;                      // position of uncompressed data (p_src)
+    uint32_t rep0  = p_enc->rep0;
+    uint32_t rep1  = p_enc->rep1;
+    uint32_t rep2  = p_enc->rep2;
+    uint32_t rep3  = p_enc->rep3;
+    uint32_t n_bypass    = p_enc->n_bypass;
+    uint32_t len_bypass  = p_enc->len_bypass;
+    uint32_t dist_bypass = p_enc->dist_bypass;
+    uint32_t pb_mask     = (1 << p_enc->pb) - 1;
     
-    RangeEncoder_t coder = newRangeEncoder(p_dst, *p_dst_len);
+    OptParser_t *p_opt = p_enc->p_opt;
     
-    // probability arrays ---------------------------------------
-    uint16_t probs_is_match     [N_STATES] [N_POS_STATES] ;
-    uint16_t probs_is_rep       [N_STATES] ;
-    uint16_t probs_is_rep0      [N_STATES] ;
-    uint16_t probs_is_rep0_long [N_STATES] [N_POS_STATES] ;
-    uint16_t probs_is_rep1      [N_STATES] ;
-    uint16_t probs_is_rep2      [N_STATES] ;
-    uint16_t probs_literal      [N_LIT_POS_STATES] [N_PREV_BYTE_LC_MSBS] [3*(1<<8)];
-    uint16_t probs_dist_slot    [4]  [(1<<6)-1];
-    uint16_t probs_dist_special [10] [(1<<5)-1];
-    uint16_t probs_dist_align   [(1<<4)-1];
-    uint16_t probs_len_choice   [2];
-    uint16_t probs_len_choice2  [2];
-    uint16_t probs_len_low      [2] [N_POS_STATES] [(1<<3)-1];
-    uint16_t probs_len_mid      [2] [N_POS_STATES] [(1<<3)-1];
-    uint16_t probs_len_high     [2] [(1<<8)-1];
-    
-    // size_t hash_table [HASH_SIZE][HASH_LEVEL];                                            // if HASH_LEVEL and HASH_SIZE is small, you can use this instead of malloc
-    
-    size_t (*hash_table) [HASH_LEVEL];
-    
-    hash_table = (size_t (*) [HASH_LEVEL]) malloc (sizeof(size_t) * HASH_SIZE * HASH_LEVEL); // if HASH_LEVEL and HASH_SIZE is large, we must use malloc instead of local variables to prevent stack-overflow
-    
-    if (hash_table == 0)
-        return R_ERR_MEMORY_RUNOUT;
+    LzmaProbs_t *p_probs = &p_enc->probs;
     
-    INIT_HASH_TABLE(hash_table);
-    
-    INIT_PROBS(probs_is_match);
-    INIT_PROBS(probs_is_rep);
-    INIT_PROBS(probs_is_rep0);
-    INIT_PROBS(probs_is_rep0_long);
-    INIT_PROBS(probs_is_rep1);
-    INIT_PROBS(probs_is_rep2);
-    INIT_PROBS(probs_literal);
-    INIT_PROBS(probs_dist_slot);
-    INIT_PROBS(probs_dist_special);
-    INIT_PROBS(probs_dist_align);
-    INIT_PROBS(probs_len_choice);
-    INIT_PROBS(probs_len_choice2);
-    INIT_PROBS(probs_len_low);
-    INIT_PROBS(probs_len_mid);
-    INIT_PROBS(probs_len_high);
+    MatchFinder_t *p_mf = &p_enc->mf;
+    
+    RangeEncoder_t coder = *p_coder;
     
     while (!coder.overflow) {
-        uint32_t lit_pos_state = LP_MASK & (uint32_t)pos;
-        uint32_t pos_state     = PB_MASK & (uint32_t)pos;
-        uint32_t curr_byte=0, match_byte=0, prev_byte_lc_msbs=0;
+        if (p_dst_stop != NULL && (coder.p_dst >= p_dst_stop || (size_t)(p_dst_stop - coder.p_dst) <= coder.cache_size))
+            break;
+        
+        uint32_t pos_state = pb_mask & (uint32_t)pos;
+        uint32_t curr_byte=0, match_byte=0, prev_byte=0;
         uint32_t dist=0, len=0;
         PACKET_t type;
         
@@ -486,10 +1887,10 @@ int lzmaEncode (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_le
         
         if (pos > 0) {
             match_byte        =  p_src[pos-rep0];
-            prev_byte_lc_msbs = (p_src[pos-1] >> LC_SHIFT) & LC_MASK;
+            prev_byte         =  p_src[pos-1];
         }
         
-        if (pos >= src_len) {                                                    // input end (no more data to be encoded)
+        if (pos >= pos_end) {                                                    // input end (no more data to be encoded)
             if (!with_end_mark)                                                  // if user dont want to encode end marker
                 break;                                                           // finish immediently
             with_end_mark = 0;                                                   // clear with_end_mark. we will finish at the next loop
@@ -498,7 +1899,13 @@ int lzmaEncode (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_le
             dist = 0;                                                            // this MATCH packet's dist = 0, in next steps, we will encode dist-1 (0xFFFFFFFF), aka end marker
         
         } else {                                                                 // there are still data need to be encoded
-            if (n_bypass > 0) {
+            if (p_opt != NULL) {
+                if (p_opt->i_packet >= p_opt->n_packets)
+                    optimalParse(p_enc, p_src, src_len, pos, state, rep0, rep1, rep2, rep3);
+                len  = p_opt->packet_len [p_opt->i_packet];
+                dist = p_opt->packet_dist[p_opt->i_packet];
+                p_opt->i_packet ++;
+            } else if (n_bypass > 0) {
                 len  = 0;
                 dist = 0;
                 n_bypass --;
@@ -508,18 +1915,18 @@ int lzmaEncode (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_le
                 len_bypass  = 0;
                 dist_bypass = 0;
             } else {
-                lzSearch(p_src, src_len, pos, rep0, rep1, rep2, rep3, hash_table, &len, &dist);
+                lzSearch(p_src, src_len, pos, rep0, rep1, rep2, rep3, p_mf, &len, &dist);
                 
-                if ((src_len-pos)>8 && len>=2) {
+                if (p_enc->parser == LZMA_PARSER_LAZY && (src_len-pos)>8 && len>=2 && len<p_enc->nice_len) {   // look ahead for a better match, unless it's already long enough
                     uint32_t score0 = lenDistScore(len, dist, rep0, rep1, rep2, rep3);
                     uint32_t len1=0, dist1=0, score1=0;
                     uint32_t len2=0, dist2=0, score2=0;
                     
-                    lzSearch(p_src, src_len, pos+1, rep0, rep1, rep2, rep3, hash_table, &len1, &dist1);
+                    lzSearch(p_src, src_len, pos+1, rep0, rep1, rep2, rep3, p_mf, &len1, &dist1);
                     score1 = lenDistScore(len1, dist1, rep0, rep1, rep2, rep3);
                     
                     if (len >= 3) {
-                        lzSearch(p_src, src_len, pos+2, rep0, rep1, rep2, rep3, hash_table, &len2, &dist2);
+                        lzSearch(p_src, src_len, pos+2, rep0, rep1, rep2, rep3, p_mf, &len2, &dist2);
                         score2 = lenDistScore(len2, dist2, rep0, rep1, rep2, rep3) - 1;
                     }
                     
@@ -540,8 +1947,10 @@ int lzmaEncode (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_le
                 }
             }
             
-            if        (len <  2) {
-                type = isShortRep(p_src, src_len, pos, rep0) ? PKT_SHORTREP : PKT_LIT;
+            if        (len == 1) {                                               // only the optimal parser gives a short rep explicitly
+                type = PKT_SHORTREP;
+            } else if (len <  2) {
+                type = (p_opt == NULL && isShortRep(p_src, pos, rep0)) ? PKT_SHORTREP : PKT_LIT;
             } else if (dist == rep0) {
                 type = PKT_REP0;
             } else if (dist == rep1) {
@@ -570,72 +1979,72 @@ int lzmaEncode (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_le
             {
                 size_t pos2 = pos + ((type==PKT_LIT || type==PKT_SHORTREP) ? 1 : len);
                 for (; pos<pos2; pos++)
-                    updateHashTable(p_src, src_len, pos, hash_table);
+                    updateMatchFinder(p_src, src_len, pos, p_mf);
             }
         }
         
         switch (type) {
             case PKT_LIT :
-                rangeEncodeBit(&coder, &probs_is_match    [state][pos_state], 0);
+                rangeEncodeBit(&coder, &p_probs->is_match    [state][pos_state], 0);
                 break;
             case PKT_MATCH :
-                rangeEncodeBit(&coder, &probs_is_match    [state][pos_state], 1);
-                rangeEncodeBit(&coder, &probs_is_rep      [state]           , 0);
+                rangeEncodeBit(&coder, &p_probs->is_match    [state][pos_state], 1);
+                rangeEncodeBit(&coder, &p_probs->is_rep      [state]           , 0);
                 break;
             case PKT_SHORTREP :
-                rangeEncodeBit(&coder, &probs_is_match    [state][pos_state], 1);
-                rangeEncodeBit(&coder, &probs_is_rep      [state]           , 1);
-                rangeEncodeBit(&coder, &probs_is_rep0     [state]           , 0);
-                rangeEncodeBit(&coder, &probs_is_rep0_long[state][pos_state], 0);
+                rangeEncodeBit(&coder, &p_probs->is_match    [state][pos_state], 1);
+                rangeEncodeBit(&coder, &p_probs->is_rep      [state]           , 1);
+                rangeEncodeBit(&coder, &p_probs->is_rep0     [state]           , 0);
+                rangeEncodeBit(&coder, &p_probs->is_rep0_long[state][pos_state], 0);
                 break;
             case PKT_REP0     :
-                rangeEncodeBit(&coder, &probs_is_match    [state][pos_state], 1);
-                rangeEncodeBit(&coder, &probs_is_rep      [state]           , 1);
-                rangeEncodeBit(&coder, &probs_is_rep0     [state]           , 0);
-                rangeEncodeBit(&coder, &probs_is_rep0_long[state][pos_state], 1);
+                rangeEncodeBit(&coder, &p_probs->is_match    [state][pos_state], 1);
+                rangeEncodeBit(&coder, &p_probs->is_rep      [state]           , 1);
+                rangeEncodeBit(&coder, &p_probs->is_rep0     [state]           , 0);
+                rangeEncodeBit(&coder, &p_probs->is_rep0_long[state][pos_state], 1);
                 break;
             case PKT_REP1     :
-                rangeEncodeBit(&coder, &probs_is_match    [state][pos_state], 1);
-                rangeEncodeBit(&coder, &probs_is_rep      [state]           , 1);
-                rangeEncodeBit(&coder, &probs_is_rep0     [state]           , 1);
-                rangeEncodeBit(&coder, &probs_is_rep1     [state]           , 0);
+                rangeEncodeBit(&coder, &p_probs->is_match    [state][pos_state], 1);
+                rangeEncodeBit(&coder, &p_probs->is_rep      [state]           , 1);
+                rangeEncodeBit(&coder, &p_probs->is_rep0     [state]           , 1);
+                rangeEncodeBit(&coder, &p_probs->is_rep1     [state]           , 0);
                 break;
             case PKT_REP2     :
-                rangeEncodeBit(&coder, &probs_is_match    [state][pos_state], 1);
-                rangeEncodeBit(&coder, &probs_is_rep      [state]           , 1);
-                rangeEncodeBit(&coder, &probs_is_rep0     [state]           , 1);
-                rangeEncodeBit(&coder, &probs_is_rep1     [state]           , 1);
-                rangeEncodeBit(&coder, &probs_is_rep2     [state]           , 0);
+                rangeEncodeBit(&coder, &p_probs->is_match    [state][pos_state], 1);
+                rangeEncodeBit(&coder, &p_probs->is_rep      [state]           , 1);
+                rangeEncodeBit(&coder, &p_probs->is_rep0     [state]           , 1);
+                rangeEncodeBit(&coder, &p_probs->is_rep1     [state]           , 1);
+                rangeEncodeBit(&coder, &p_probs->is_rep2     [state]           , 0);
                 break;
             default :  // PKT_REP3
-                rangeEncodeBit(&coder, &probs_is_match    [state][pos_state], 1);
-                rangeEncodeBit(&coder, &probs_is_rep      [state]           , 1);
-                rangeEncodeBit(&coder, &probs_is_rep0     [state]           , 1);
-                rangeEncodeBit(&coder, &probs_is_rep1     [state]           , 1);
-                rangeEncodeBit(&coder, &probs_is_rep2     [state]           , 1);
+                rangeEncodeBit(&coder, &p_probs->is_match    [state][pos_state], 1);
+                rangeEncodeBit(&coder, &p_probs->is_rep      [state]           , 1);
+                rangeEncodeBit(&coder, &p_probs->is_rep0     [state]           , 1);
+                rangeEncodeBit(&coder, &p_probs->is_rep1     [state]           , 1);
+                rangeEncodeBit(&coder, &p_probs->is_rep2     [state]           , 1);
                 break;
         }
         
         if (type == PKT_LIT) {
             if (state < N_LIT_STATES)
-                rangeEncodeInt(&coder, probs_literal[lit_pos_state][prev_byte_lc_msbs], curr_byte, 8);
+                rangeEncodeInt(&coder, getLiteralProbs(p_enc, pos, (uint8_t)prev_byte), curr_byte, 8);
             else
-                rangeEncodeMB (&coder, probs_literal[lit_pos_state][prev_byte_lc_msbs], curr_byte, match_byte);
+                rangeEncodeMB (&coder, getLiteralProbs(p_enc, pos, (uint8_t)prev_byte), curr_byte, match_byte);
         }
         
         if (type == PKT_MATCH || type == PKT_REP0 || type == PKT_REP1 || type == PKT_REP2 || type == PKT_REP3) {
             uint8_t isrep = (type != PKT_MATCH);
             if        (len < 10) {                                                          // len = 2~9
-                rangeEncodeBit(&coder, &probs_len_choice [isrep], 0);
-                rangeEncodeInt(&coder,  probs_len_low    [isrep][pos_state], len-2 , 3);
+                rangeEncodeBit(&coder, &p_probs->len_choice [isrep], 0);
+                rangeEncodeInt(&coder,  p_probs->len_low    [isrep][pos_state], len-2 , 3);
             } else if (len < 18) {                                                          // len = 10~17
-                rangeEncodeBit(&coder, &probs_len_choice [isrep], 1);
-                rangeEncodeBit(&coder, &probs_len_choice2[isrep], 0);
-                rangeEncodeInt(&coder,  probs_len_mid    [isrep][pos_state], len-10, 3);
+                rangeEncodeBit(&coder, &p_probs->len_choice [isrep], 1);
+                rangeEncodeBit(&coder, &p_probs->len_choice2[isrep], 0);
+                rangeEncodeInt(&coder,  p_probs->len_mid    [isrep][pos_state], len-10, 3);
             } else {                                                                        // len = 18~273
-                rangeEncodeBit(&coder, &probs_len_choice [isrep], 1);
-                rangeEncodeBit(&coder, &probs_len_choice2[isrep], 1);
-                rangeEncodeInt(&coder,  probs_len_high   [isrep],            len-18, 8);
+                rangeEncodeBit(&coder, &p_probs->len_choice [isrep], 1);
+                rangeEncodeBit(&coder, &p_probs->len_choice2[isrep], 1);
+                rangeEncodeInt(&coder,  p_probs->len_high   [isrep],            len-18, 8);
             }
         }
         
@@ -645,14 +2054,9 @@ int lzmaEncode (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_le
             
             dist --;
             
-            if (dist < 4) {
-                dist_slot = dist;
-            } else {
-                dist_slot = countBit(dist) - 1;
-                dist_slot = (dist_slot<<1) | ((dist>>(dist_slot-1)) & 1);
-            }
+            dist_slot = getDistSlot(dist);
             
-            rangeEncodeInt(&coder, probs_dist_slot[len_min5_minus2], dist_slot, 6);
+            rangeEncodeInt(&coder, p_probs->dist_slot[len_min5_minus2], dist_slot, 6);
             
             bcnt = (dist_slot >> 1) - 1;
             
@@ -663,18 +2067,45 @@ int lzmaEncode (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_le
                 
                 bits = dist & ((1<<4)-1);
                 bits = bitsReverse(bits, 4);
-                rangeEncodeInt(&coder, probs_dist_align, bits, 4);
+                rangeEncodeInt(&coder, p_probs->dist_align, bits, 4);
             } else if (dist_slot >= 4) {                                                    // dist slot = 4~13
                 bits = dist & ((1<<bcnt)-1);
                 bits = bitsReverse(bits, bcnt);
-                rangeEncodeInt(&coder, probs_dist_special[dist_slot-4], bits, bcnt);
+                rangeEncodeInt(&coder, p_probs->dist_special[dist_slot-4], bits, bcnt);
             }
         }
         
         state = stateTransition(state, type);
     }
     
-    free(hash_table);
+    *p_coder = coder;
+    *p_pos   = pos;
+    p_enc->state = state;
+    p_enc->rep0  = rep0;
+    p_enc->rep1  = rep1;
+    p_enc->rep2  = rep2;
+    p_enc->rep3  = rep3;
+    p_enc->n_bypass    = n_bypass;
+    p_enc->len_bypass  = len_bypass;
+    p_enc->dist_bypass = dist_bypass;
+}
+
+
+int lzmaEncode (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len, uint8_t with_end_mark, const LzmaCParams_t *p_params) {
+    size_t pos = 0;
+    
+    RangeEncoder_t coder = newRangeEncoder(p_dst, *p_dst_len);
+    
+    LzmaEncoder_t enc;
+    
+    RET_WHEN_ERR( newLzmaEncoder(&enc, src_len, p_params) );
+    
+    if (p_params != NULL && useMatchPipe(p_params))
+        startMatchPipe(&enc.mf, p_src, src_len, enc.parser == LZMA_PARSER_OPTIMAL);
+    
+    lzmaEncodePackets(&enc, &coder, p_src, src_len, &pos, src_len, NULL, with_end_mark);
+    
+    freeLzmaEncoder(&enc);
     
     rangeEncodeTerminate(&coder);
     
@@ -693,12 +2124,124 @@ int lzmaEncode (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_le
 // LZMA compress function, output data is packed in ".lzma" format
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-#define   LZMA_DIC_MIN                             4096
-#define   LZMA_DIC_LEN                             ((LZ_DIST_MAX_PLUS1>LZMA_DIC_MIN) ? LZ_DIST_MAX_PLUS1 : LZMA_DIC_MIN)
+void lzmaCLevelParams (LzmaCParams_t *p_params, int level) {
+    static const uint32_t LEVEL_PARAMS [10] [6] = {       // match_finder, dict_len, hash_bits, hash_depth, nice_len, parser
+        { LZMA_MF_HC , DICT_LEN_MAX, 16,  1,  16, LZMA_PARSER_GREEDY  },     // single probe of the hash, no look ahead
+        { LZMA_MF_HC , DICT_LEN_MAX, 18,  2,  24, LZMA_PARSER_GREEDY  },
+        { LZMA_MF_HC , DICT_LEN_MAX, 20,  4,  32, LZMA_PARSER_GREEDY  },
+        { LZMA_MF_HC , DICT_LEN_MAX, 20,  8,  32, LZMA_PARSER_GREEDY  },
+        { LZMA_MF_HC , DICT_LEN_MAX, 21,  8,  48, LZMA_PARSER_LAZY    },
+        { LZMA_MF_HC , DICT_LEN_MAX, 21, 12,  64, LZMA_PARSER_LAZY    },
+        { LZMA_MF_HC , DICT_LEN_MAX, 21, 16,  64, LZMA_PARSER_LAZY    },     // the default
+        { LZMA_MF_HC , DICT_LEN_MAX, 21, 16,  64, LZMA_PARSER_OPTIMAL },
+        { LZMA_MF_BT4, 1<<25       , 22, 32, 128, LZMA_PARSER_OPTIMAL },     // the tree of BT4 takes 8 bytes per position of the dictionary
+        { LZMA_MF_BT4, 1<<26       , 24, 64, 273, LZMA_PARSER_OPTIMAL }
+    };
+    const uint32_t *p = LEVEL_PARAMS[(level < 0) ? 0 : (level > 9) ? 9 : level];
+    
+    p_params->match_finder = p[0];
+    p_params->dict_len     = p[1];
+    p_params->hash_bits    = p[2];
+    p_params->hash_depth   = p[3];
+    p_params->nice_len     = p[4];
+    p_params->parser       = p[5];
+    p_params->mf_thread    = 0;
+    p_params->lc           = LZMA_LC_DEFAULT;
+    p_params->lp           = LZMA_LP_DEFAULT;
+    p_params->pb           = LZMA_PB_DEFAULT;
+    p_params->decode_bias  = 0;
+}
+
+
+void lzmaCDefaultParams (LzmaCParams_t *p_params) {
+    lzmaCLevelParams(p_params, LZMA_LEVEL_DEFAULT);
+}
+
+
+size_t lzmaCMemUsage (const LzmaCParams_t *p_params) {
+    size_t mem = (p_params->parser == LZMA_PARSER_OPTIMAL) ? sizeof(OptParser_t) : 0;
+    
+    if (p_params->lc <= MAX_LC && p_params->lp <= MAX_LP)
+        mem += sizeof(uint16_t) * N_LITERAL_PROBS(p_params->lc, p_params->lp);
+    
+    if (useMatchPipe(p_params))
+        mem += sizeof(MatchPipe_t) + sizeof(uint32_t) * PIPE_N_WORDS + sizeof(size_t) * PIPE_N_POS;
+    
+    if (p_params->match_finder == LZMA_MF_HC) {
+        return mem + (sizeof(uint32_t) * p_params->hash_depth + 1) * ((size_t)1 << p_params->hash_bits) + CACHE_LINE_SIZE;   // the hash table. The other probability arrays are on the stack and are small (about 10 kB)
+    } else if (p_params->match_finder == LZMA_MF_SA) {
+        return mem + (2 * sizeof(uint32_t) + sizeof(uint16_t)) * (2 * (size_t)p_params->dict_len + LZ_LEN_MAX) + sizeof(SuffixArray_t);   // the window of 2 x dictionary
+    } else {
+        return mem + sizeof(uint32_t) * (BT_HASH2_SIZE + ((size_t)1 << BT_HASH3_BITS) + ((size_t)1 << p_params->hash_bits)) +
+                     sizeof(uint32_t) * 2 * ((size_t)p_params->dict_len + 1) + sizeof(BinTree_t);
+    }
+}
+
+
+int lzmaCFitMemory (LzmaCParams_t *p_params, size_t mem_budget) {
+    while (lzmaCMemUsage(p_params) > mem_budget) {           // shrink the table. Halving the bucket count keeps the match quality better than halving the depth, until the buckets are few
+        if        (p_params->match_finder == LZMA_MF_SA  && p_params->dict_len > DICT_LEN_MIN) {
+            p_params->dict_len >>= 1;                        // the suffix array has no hash table, only the window
+        } else if (p_params->match_finder == LZMA_MF_SA) {
+            return 1;
+        } else if (p_params->match_finder == LZMA_MF_BT4 && p_params->dict_len > (1<<20)) {
+            p_params->dict_len >>= 1;                        // the tree of BT4 is much larger than its hash heads
+        } else if (p_params->hash_bits  > 16) {
+            p_params->hash_bits --;
+        } else if (p_params->match_finder == LZMA_MF_BT4 && p_params->dict_len > DICT_LEN_MIN) {
+            p_params->dict_len >>= 1;
+        } else if (p_params->match_finder == LZMA_MF_HC  && p_params->hash_depth > 4) {
+            p_params->hash_depth >>= 1;
+        } else if (p_params->hash_bits  > HASH_BITS_MIN) {
+            p_params->hash_bits --;
+        } else if (p_params->match_finder == LZMA_MF_HC  && p_params->hash_depth > HASH_DEPTH_MIN) {
+            p_params->hash_depth >>= 1;
+        } else {
+            return 1;
+        }
+    }
+    return 0;
+}
+
 
 #define   LZMA_HEADER_LEN                          13
 
-static int writeLzmaHeader (uint8_t *p_dst, size_t *p_dst_len, size_t uncompressed_len, uint8_t uncompressed_len_known) {
+
+/// the dictionary size written to the header, which is the memory that the decoder allocates for the history. A distance never reaches
+/// the input length either, so write the smaller one instead of the dictionary of the parameters (e.g., 1GB for a 10kB file).
+/// Some decoders only accept 2^n or 2^n+2^(n-1), so round it up to one of them
+static uint32_t getHeaderDictLen (const LzmaCParams_t *p_params, size_t src_len) {
+    uint32_t dict_len = (p_params != NULL) ? p_params->dict_len : DICT_LEN_MAX;
+    uint32_t n;
+    
+    if (src_len < dict_len)
+        dict_len = (uint32_t)src_len;
+    
+    for (n=12; n<31; n++) {
+        if ((1U<<n) >= dict_len)
+            return (1U<<n);
+        if ((1U<<n) + (1U<<(n-1)) >= dict_len)
+            return (1U<<n) + (1U<<(n-1));
+    }
+    
+    return dict_len;
+}
+
+
+/// the byte of lc, lp and pb in the header
+static uint8_t getHeaderPropsByte (const LzmaCParams_t *p_params) {
+    LzmaCParams_t params;
+    
+    if (p_params == NULL) {
+        lzmaCDefaultParams(&params);
+        p_params = &params;
+    }
+    
+    return LCLPPB_BYTE(p_params->lc, p_params->lp, p_params->pb);
+}
+
+
+static int writeLzmaHeader (uint8_t *p_dst, size_t *p_dst_len, size_t uncompressed_len, uint8_t uncompressed_len_known, uint8_t props_byte, uint32_t dict_len) {
     uint32_t i;
     
     if (*p_dst_len < LZMA_HEADER_LEN)
@@ -706,10 +2249,10 @@ static int writeLzmaHeader (uint8_t *p_dst, size_t *p_dst_len, size_t uncompress
     
     *p_dst_len = LZMA_HEADER_LEN;
     
-    *(p_dst++) = LCLPPB_BYTE;
+    *(p_dst++) = props_byte;
     
     for (i=0; i<4; i++)
-        *(p_dst++) = (uint8_t)(LZMA_DIC_LEN >> (i*8));
+        *(p_dst++) = (uint8_t)(dict_len >> (i*8));
     
     for (i=0; i<8; i++) {
         if (uncompressed_len_known) {
@@ -724,16 +2267,16 @@ static int writeLzmaHeader (uint8_t *p_dst, size_t *p_dst_len, size_t uncompress
 }
 
 
-int lzmaC (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len) {
+int lzmaC (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len, const LzmaCParams_t *p_params) {
     size_t hdr_len, cmprs_len;
     
     hdr_len = *p_dst_len;                                                      // set available space for header length
     
-    RET_WHEN_ERR( writeLzmaHeader(p_dst, &hdr_len, src_len, 1) );              // 
+    RET_WHEN_ERR( writeLzmaHeader(p_dst, &hdr_len, src_len, 1, getHeaderPropsByte(p_params), getHeaderDictLen(p_params, src_len)) );
     
     cmprs_len = *p_dst_len - hdr_len;                                          // set available space for compressed data length
     
-    RET_WHEN_ERR( lzmaEncode(p_src, src_len, p_dst+hdr_len, &cmprs_len, 1) );  // do compression
+    RET_WHEN_ERR( lzmaEncode(p_src, src_len, p_dst+hdr_len, &cmprs_len, 1, p_params) );  // do compression
     
     *p_dst_len = hdr_len + cmprs_len;                                          // the final output data length = LZMA file header len + compressed data len
     
@@ -742,14 +2285,372 @@ int lzmaC (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len) {
 
 
 
+size_t lzmaCBound (size_t src_len) {
+    return LZMA_HEADER_LEN + src_len + (src_len>>4) + 1024;                    // LZMA expands incompressible data by less than 2%, only a pathological input may still overflow (R_ERR_OUTPUT_OVERFLOW)
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// choose lc, lp and pb by compressing a sample of the input with each candidate
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define   AUTO_N_PIECES                     4
+#define   AUTO_PIECE_LEN                    (1<<16)                            // the sample is 4 pieces of 64kB, which are spread over the input
+
+static const uint8_t AUTO_CANDIDATES [] [3] = {                                // lc, lp, pb.  lc+lp <= 4, so that they also work for LZMA2
+    { LZMA_LC_DEFAULT, LZMA_LP_DEFAULT, LZMA_PB_DEFAULT },                     // the default comes first
+    { 3, 0, 2 },                                                               // the default of xz and 7-zip
+    { 4, 0, 0 },                                                               // text
+    { 3, 0, 0 },
+    { 0, 1, 1 },                                                               // 2-byte aligned data
+    { 0, 2, 2 },                                                               // 4-byte aligned data, e.g., tables of uint32 or float
+    { 1, 2, 2 },
+    { 0, 3, 3 }                                                                // 8-byte aligned data
+};
+
+#define   AUTO_N_CANDIDATES                 (sizeof(AUTO_CANDIDATES) / sizeof(AUTO_CANDIDATES[0]))
+
+#define   AUTO_MARGIN                       128                                // a candidate is used only if it is 1/128 smaller than the default on the sample
+
+
+typedef struct {
+    uint8_t       *p_sample;
+    size_t         sample_len;
+    LzmaCParams_t  params;
+    size_t         lens [AUTO_N_CANDIDATES];                                   // the compressed length of each candidate, ~0 if failed
+    int            ret_codes [AUTO_N_CANDIDATES];
+    size_t         next;                                                       // the next candidate to be taken by a thread, protected by p_mutex
+    Mutex_t       *p_mutex;
+} AutoJobs_t;
+
+
+/// the thread function : take the candidates one by one and compress the sample with them
+static void autoWorker (void *arg) {
+    AutoJobs_t *p_jobs = (AutoJobs_t*)arg;
+    size_t      buf_len = lzmaCBound(p_jobs->sample_len);
+    uint8_t    *p_buf   = (uint8_t*)malloc(buf_len);
+    
+    for (;;) {
+        LzmaCParams_t params = p_jobs->params;
+        size_t i, len = buf_len;
+        
+        mutexLock(p_jobs->p_mutex);
+        i = p_jobs->next++;
+        mutexUnlock(p_jobs->p_mutex);
+        
+        if (i >= AUTO_N_CANDIDATES)
+            break;
+        
+        params.lc = AUTO_CANDIDATES[i][0];
+        params.lp = AUTO_CANDIDATES[i][1];
+        params.pb = AUTO_CANDIDATES[i][2];
+        
+        p_jobs->ret_codes[i] = (p_buf == NULL) ? R_ERR_MEMORY_RUNOUT : lzmaEncode(p_jobs->p_sample, p_jobs->sample_len, p_buf, &len, 0, &params);
+        p_jobs->lens[i]      = (p_jobs->ret_codes[i] == R_OK) ? len : ~((size_t)0);
+    }
+    
+    free(p_buf);
+}
+
+
+int lzmaCAutoLcLpPb (uint8_t *p_src, size_t src_len, LzmaCParams_t *p_params, int n_threads) {
+    AutoJobs_t  jobs;
+    Thread_t  **threads = NULL;
+    uint8_t    *p_copy  = NULL;
+    size_t      i, best = 0, best_len;
+    
+    jobs.params           = *p_params;
+    jobs.params.mf_thread = 0;
+    jobs.next             = 0;
+    
+    if (src_len <= AUTO_N_PIECES * AUTO_PIECE_LEN) {                           // a short input is the sample itself
+        jobs.p_sample   = p_src;
+        jobs.sample_len = src_len;
+    } else {
+        p_copy = (uint8_t*)malloc(AUTO_N_PIECES * AUTO_PIECE_LEN);
+        if (p_copy == NULL)
+            return R_ERR_MEMORY_RUNOUT;
+        for (i=0; i<AUTO_N_PIECES; i++) {                                      // the pieces start at multiples of 16, so that their positions have the same low bits as in the input
+            size_t offset = ((src_len - AUTO_PIECE_LEN) / (AUTO_N_PIECES - 1) * i) & ~((size_t)15);
+            memcpy(p_copy + i * AUTO_PIECE_LEN, p_src + offset, AUTO_PIECE_LEN);
+        }
+        jobs.p_sample   = p_copy;
+        jobs.sample_len = AUTO_N_PIECES * AUTO_PIECE_LEN;
+    }
+    
+    jobs.p_mutex = mutexNew();
+    if (jobs.p_mutex == NULL) {
+        free(p_copy);
+        return R_ERR_MEMORY_RUNOUT;
+    }
+    
+    if (n_threads <= 0)
+        n_threads = getCpuCount();
+    if ((size_t)n_threads > AUTO_N_CANDIDATES)
+        n_threads = (int)AUTO_N_CANDIDATES;
+    
+    if (n_threads > 1)
+        threads = (Thread_t**)malloc((n_threads-1) * sizeof(Thread_t*));
+    
+    if (threads == NULL) {                                                     // single thread, or failed to allocate the thread list
+        autoWorker(&jobs);
+    } else {
+        for (i=0; i<(size_t)n_threads-1; i++)
+            threads[i] = threadStart(autoWorker, &jobs);                       // if a thread failed to start, the others take its candidates
+        autoWorker(&jobs);
+        for (i=0; i<(size_t)n_threads-1; i++) {
+            if (threads[i] != NULL)
+                threadJoin(threads[i]);
+        }
+        free(threads);
+    }
+    
+    mutexFree(jobs.p_mutex);
+    free(p_copy);
+    
+    best_len = jobs.lens[0];
+    if (jobs.ret_codes[0] == R_OK)
+        best_len -= best_len / AUTO_MARGIN;                                    // another candidate should be clearly smaller than the default, since the sample is only a small part of the input
+    
+    for (i=1; i<AUTO_N_CANDIDATES; i++) {
+        if (jobs.lens[i] < best_len) {
+            best_len = jobs.lens[i];
+            best     = i;
+        }
+    }
+    
+    if (jobs.ret_codes[best] != R_OK)                                          // all failed
+        return jobs.ret_codes[best];
+    
+    p_params->lc = AUTO_CANDIDATES[best][0];
+    p_params->lp = AUTO_CANDIDATES[best][1];
+    p_params->pb = AUTO_CANDIDATES[best][2];
+    
+    return R_OK;
+}
+
+
+
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// LZMA streaming compress, output data is packed in ".lzma" format with an unknown length and an end marker
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// The input is kept in a window : the dictionary before the position to be encoded, and the bytes after it. The positions (of the encoder
+// and the match finder) are counted from the start of the window. When the window is full, the data before the dictionary is dropped,
+// i.e., the window is moved back by a multiple of 16 bytes (so that the position states of LZMA are kept) and so are all the positions.
+// A position is only encoded when LZMA_STREAM_AHEAD bytes after it are in the window, which is all that the parsers look at, so the
+// output only depends on the input and the parameters, but not on how the input is split into chunks.
+
+#define   LZMA_STREAM_AHEAD                 (OPT_LEN + 2*LZ_LEN_MAX)           // the optimal parser looks at most OPT_LEN+LZ_LEN_MAX bytes ahead
+#define   LZMA_STREAM_STEP_MIN              (1<<20)                            // the window is moved by at least max(dict_len/4, this), since moving it also rewrites the match finder
+#define   LZMA_STREAM_WIN_INIT              (1<<20)                            // the window starts small and is doubled on demand, so a short input doesn't take the memory of the whole dictionary
+#define   LZMA_STREAM_PEND_LEN              (1<<16)
+#define   LZMA_STREAM_PACKET_MAX_LEN        64                                 // a packet (with the terminating bytes of the range coder) never takes more than 64 bytes
+
+
+struct LzmaCStream_t {
+    LzmaCParams_t  params;
+    LzmaEncoder_t  enc;
+    RangeEncoder_t coder;
+    uint8_t       *p_win;
+    size_t         win_cap;                                                    // the allocated length of the window
+    size_t         win_max;                                                    // dict_len + step + LZMA_STREAM_AHEAD
+    size_t         win_len;
+    size_t         pos;                                                        // the next position to be encoded
+    uint8_t        header_written;
+    uint8_t        ended;
+    size_t         pend_pos;
+    size_t         pend_len;
+    uint8_t        pend [LZMA_STREAM_PEND_LEN];                                // the output which is not taken yet
+};
+
+
+static size_t getStreamWindowMax (const LzmaCParams_t *p_params) {
+    size_t step = p_params->dict_len / 4;
+    if (step < LZMA_STREAM_STEP_MIN)
+        step = LZMA_STREAM_STEP_MIN;
+    return p_params->dict_len + step + LZMA_STREAM_AHEAD;
+}
+
+
+/// the state of a new input, except the encoder
+static void initStream (LzmaCStream_t *p_st) {
+    p_st->coder          = newRangeEncoder(p_st->pend, LZMA_STREAM_PEND_LEN);
+    p_st->win_len        = 0;
+    p_st->pos            = 0;
+    p_st->header_written = 0;
+    p_st->ended          = 0;
+    p_st->pend_pos       = 0;
+    p_st->pend_len       = 0;
+}
+
+
+void lzmaCStreamReset (LzmaCStream_t *p_st) {
+    if (p_st->header_written) {                                                // a stream that is not fed yet is still empty. Clearing the large tables would touch all their pages
+        clearMatchFinder(&p_st->enc.mf);
+        if (p_st->enc.p_opt != NULL)
+            initOptParser(p_st->enc.p_opt);
+        resetLzmaEncoderState(&p_st->enc);
+    }
+    initStream(p_st);
+}
+
+
+LzmaCStream_t *lzmaCStreamNew (const LzmaCParams_t *p_params) {
+    LzmaCStream_t *p_st;
+    
+    if (p_params != NULL && p_params->match_finder == LZMA_MF_SA)              // it sorts a fixed window of the input, which can't slide
+        return NULL;
+    
+    p_st = (LzmaCStream_t*)malloc(sizeof(LzmaCStream_t));
+    if (p_st == NULL)
+        return NULL;
+    
+    if (p_params != NULL)
+        p_st->params = *p_params;
+    else
+        lzmaCDefaultParams(&p_st->params);
+    
+    p_st->params.mf_thread = 0;                                                // the window is moved under the match finder, which the thread can't follow
+    
+    p_st->win_max = getStreamWindowMax(&p_st->params);
+    p_st->win_cap = (p_st->win_max < LZMA_STREAM_WIN_INIT) ? p_st->win_max : LZMA_STREAM_WIN_INIT;
+    p_st->p_win   = (uint8_t*)malloc(p_st->win_cap);
+    
+    if (p_st->p_win == NULL || newLzmaEncoder(&p_st->enc, p_st->params.dict_len, &p_st->params)) {   // the match finder is sized for an input as long as the dictionary
+        free(p_st->p_win);
+        free(p_st);
+        return NULL;
+    }
+    
+    initStream(p_st);                                                          // the tables of the new encoder are already empty
+    return p_st;
+}
+
+
+void lzmaCStreamFree (LzmaCStream_t *p_st) {
+    if (p_st) {
+        freeLzmaEncoder(&p_st->enc);
+        free(p_st->p_win);
+        free(p_st);
+    }
+}
+
+
+size_t lzmaCStreamMemUsage (const LzmaCParams_t *p_params) {
+    LzmaCParams_t params;
+    
+    if (p_params != NULL)
+        params = *p_params;
+    else
+        lzmaCDefaultParams(&params);
+    
+    params.mf_thread = 0;
+    
+    return sizeof(LzmaCStream_t) + getStreamWindowMax(&params) + lzmaCMemUsage(&params);
+}
+
+
+/// append the input to the window. If the window is full, double it, or move it back to drop the data before the dictionary
+static int streamAppend (LzmaCStream_t *p_st, const uint8_t *p_src, size_t src_len, size_t *p_consumed) {
+    if (p_st->win_len == p_st->win_cap) {
+        if (p_st->win_cap < p_st->win_max) {
+            size_t   cap   = (p_st->win_cap > p_st->win_max / 2) ? p_st->win_max : (2 * p_st->win_cap);
+            uint8_t *p_win = (uint8_t*)realloc(p_st->p_win, cap);
+            if (p_win == NULL)
+                return R_ERR_MEMORY_RUNOUT;
+            p_st->p_win   = p_win;
+            p_st->win_cap = cap;
+        } else {
+            size_t shift = (p_st->pos - p_st->params.dict_len) & ~((size_t)15);   // pos is at least (dict_len + step), since all the positions before (win_len - LZMA_STREAM_AHEAD) are encoded
+            memmove(p_st->p_win, p_st->p_win + shift, p_st->win_len - shift);
+            p_st->win_len -= shift;
+            p_st->pos     -= shift;
+            rebaseMatchFinder(&p_st->enc.mf, shift);
+            if (p_st->enc.p_opt != NULL)
+                p_st->enc.p_opt->update_pos = (p_st->enc.p_opt->update_pos > shift) ? (p_st->enc.p_opt->update_pos - shift) : 0;
+        }
+    }
+    
+    *p_consumed = p_st->win_cap - p_st->win_len;
+    if (*p_consumed > src_len)
+        *p_consumed = src_len;
+    
+    memcpy(p_st->p_win + p_st->win_len, p_src, *p_consumed);
+    p_st->win_len += *p_consumed;
+    
+    return R_OK;
+}
+
+
+int lzmaCStreamFeed (LzmaCStream_t *p_st, uint8_t *p_src, size_t *p_src_len, uint8_t *p_dst, size_t *p_dst_len, uint8_t finish) {
+    size_t src_pos = 0;
+    size_t dst_pos = 0;
+    for (;;) {
+        RangeEncoder_t *p_coder = &p_st->coder;
+        uint8_t  last;
+        size_t   n, pos_end;
+        
+        n = p_st->pend_len - p_st->pend_pos;                                                      // drain pending output
+        if (n > (*p_dst_len) - dst_pos)
+            n = (*p_dst_len) - dst_pos;
+        memcpy(p_dst+dst_pos, p_st->pend+p_st->pend_pos, n);
+        p_st->pend_pos += n;
+        dst_pos        += n;
+        
+        if (p_st->pend_pos < p_st->pend_len || p_st->ended)
+            break;
+        
+        p_st->pend_pos = p_st->pend_len = 0;
+        p_coder->p_dst       = p_st->pend;                                                        // the range coder continues in the empty pending buffer
+        p_coder->p_dst_limit = p_st->pend + LZMA_STREAM_PEND_LEN;
+        
+        last    = finish && src_pos == (*p_src_len);
+        pos_end = last ? p_st->win_len : (p_st->win_len > LZMA_STREAM_AHEAD) ? (p_st->win_len - LZMA_STREAM_AHEAD) : 0;
+        
+        if (!p_st->header_written) {
+            n = LZMA_STREAM_PEND_LEN;
+            RET_WHEN_ERR( writeLzmaHeader(p_st->pend, &n, 0, 0, getHeaderPropsByte(&p_st->params), getHeaderDictLen(&p_st->params, p_st->params.dict_len)) );
+            p_coder->p_dst += n;
+            p_st->header_written = 1;
+        } else if (p_st->pos < pos_end) {                                                          // encode the positions that have enough bytes after them
+            lzmaEncodePackets(&p_st->enc, p_coder, p_st->p_win, p_st->win_len, &p_st->pos, pos_end, p_st->pend+LZMA_STREAM_PEND_LEN-LZMA_STREAM_PACKET_MAX_LEN, 0);
+        } else if (last) {                                                                         // all encoded, write the end marker and flush the range coder
+            lzmaEncodePackets(&p_st->enc, p_coder, p_st->p_win, p_st->win_len, &p_st->pos, pos_end, NULL, 1);
+            rangeEncodeTerminate(p_coder);
+            p_st->ended = 1;
+        } else if (src_pos < (*p_src_len)) {
+            RET_WHEN_ERR( streamAppend(p_st, p_src+src_pos, (*p_src_len)-src_pos, &n) );
+            src_pos += n;
+        } else {                                                                                   // need more input
+            break;
+        }
+        
+        if (p_coder->overflow)
+            return R_ERR_OUTPUT_OVERFLOW;
+        
+        p_st->pend_len = p_coder->p_dst - p_st->pend;
+    }
+    *p_src_len = src_pos;
+    *p_dst_len = dst_pos;
+    return R_OK;
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // for zip container
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 #define   ZIP_LZMA_PROPERTY_LEN             9
 
-int writeZipLzmaProperty (uint8_t *p_dst, size_t *p_dst_len) {
+int writeZipLzmaProperty (uint8_t *p_dst, size_t *p_dst_len, const LzmaCParams_t *p_params, size_t src_len) {
+    uint32_t dict_len = getHeaderDictLen(p_params, src_len);
+    
     if (*p_dst_len < ZIP_LZMA_PROPERTY_LEN)                 // no enough space for writing ZIP's LZMA property
         return R_ERR_OUTPUT_OVERFLOW;
     
@@ -759,11 +2660,131 @@ int writeZipLzmaProperty (uint8_t *p_dst, size_t *p_dst_len) {
     *(p_dst++) = 0x02;
     *(p_dst++) = 0x05;
     *(p_dst++) = 0x00;
-    *(p_dst++) = LCLPPB_BYTE;
-    *(p_dst++) = (uint8_t)(LZMA_DIC_LEN >> 0);
-    *(p_dst++) = (uint8_t)(LZMA_DIC_LEN >> 8);
-    *(p_dst++) = (uint8_t)(LZMA_DIC_LEN >>16);
-    *(p_dst++) = (uint8_t)(LZMA_DIC_LEN >>24);
+    *(p_dst++) = getHeaderPropsByte(p_params);
+    *(p_dst++) = (uint8_t)(dict_len >> 0);
+    *(p_dst++) = (uint8_t)(dict_len >> 8);
+    *(p_dst++) = (uint8_t)(dict_len >>16);
+    *(p_dst++) = (uint8_t)(dict_len >>24);
+    
+    return R_OK;
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// for xz container : LZMA2 stream
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// An LZMA2 stream is a sequence of chunks, ended with a 0x00 byte :
+//   LZMA chunk         : 1 byte control (0x80 | reset<<5 | (unpacked_len-1)>>16), 2 bytes (unpacked_len-1), 2 bytes (packed_len-1), [1 byte LCLPPB if reset>=2], packed data
+//                        reset : 0 = nothing, 1 = state, 2 = state + properties, 3 = state + properties + dictionary. Each chunk has its own range coder.
+//   uncompressed chunk : 1 byte control (0x01 resets the dictionary, 0x02 does not), 2 bytes (len-1), the raw data
+// All the multi-byte lengths are big-endian.
+
+#define   LZMA2_UNPACKED_MAX                (1<<21)
+#define   LZMA2_PACKED_MAX                  (1<<16)
+#define   LZMA2_RAW_MAX                     (1<<16)
+#define   LZMA2_PACKET_MAX_LEN              64                 // a packet (with the terminating bytes of the range coder) never takes more than 64 bytes, so stop at (LZMA2_PACKED_MAX-64)
+#define   LZMA2_LZMA_HEADER_LEN             6
+#define   LZMA2_RAW_HEADER_LEN              3
+#define   LZMA2_LCLP_MAX                    4                  // LZMA2 requires lc+lp <= 4
+
+
+size_t lzma2Bound (size_t src_len) {
+    return src_len + (src_len>>9) + 16;        // an incompressible chunk is stored raw, with 3 bytes header per 64kB. A chunk has at least 2kB data, since a packet is less than 32 bytes
+}
+
+
+/// write raw data as uncompressed chunks
+static uint8_t *writeLzma2RawChunks (uint8_t *p_dst, const uint8_t *p_src, size_t len, uint8_t dict_reset) {
+    while (len > 0) {
+        size_t n = (len < LZMA2_RAW_MAX) ? len : LZMA2_RAW_MAX;
+        *(p_dst++) = dict_reset ? 0x01 : 0x02;
+        *(p_dst++) = (uint8_t)((n-1) >> 8);
+        *(p_dst++) = (uint8_t)((n-1) >> 0);
+        memcpy(p_dst, p_src, n);
+        p_dst += n;
+        p_src += n;
+        len   -= n;
+        dict_reset = 0;
+    }
+    return p_dst;
+}
+
+
+// compress data to a raw LZMA2 stream, which starts with a dictionary reset (so that it is an independent .xz block).
+// the state is kept across the LZMA chunks, and a chunk which can not be compressed is stored raw. *p_dst_len should be at least lzma2Bound(src_len)
+int lzma2Encode (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len, const LzmaCParams_t *p_params) {
+    uint8_t *p_dst_base  = p_dst;
+    uint8_t *p_chunk     = NULL;
+    uint8_t  need_reset  = 3;                                  // the reset level of the next LZMA chunk, 3 : dictionary, 2 : properties, 1 : state, 0 : nothing
+    size_t   pos = 0;
+    
+    LzmaEncoder_t enc;
+    
+    if (*p_dst_len < lzma2Bound(src_len))
+        return R_ERR_OUTPUT_OVERFLOW;
+    
+    p_chunk = (uint8_t*)malloc(LZMA2_PACKED_MAX);
+    if (p_chunk == NULL)
+        return R_ERR_MEMORY_RUNOUT;
+    
+    if (newLzmaEncoder(&enc, src_len, p_params)) {
+        free(p_chunk);
+        return R_ERR_UNSUPPORTED;
+    }
+    
+    if (enc.lc + enc.lp > LZMA2_LCLP_MAX) {
+        freeLzmaEncoder(&enc);
+        free(p_chunk);
+        return R_ERR_UNSUPPORTED;
+    }
+    
+    while (pos < src_len) {
+        size_t chunk_start = pos;
+        size_t pos_end     = (src_len - pos <= LZMA2_UNPACKED_MAX) ? src_len : (pos + LZMA2_UNPACKED_MAX - LZ_LEN_MAX);    // the last packet may exceed pos_end
+        size_t unpacked_len, packed_len, raw_len;
+        
+        RangeEncoder_t coder = newRangeEncoder(p_chunk, LZMA2_PACKED_MAX);
+        
+        if (need_reset > 0)
+            resetLzmaEncoderState(&enc);
+        
+        lzmaEncodePackets(&enc, &coder, p_src, src_len, &pos, pos_end, p_chunk+LZMA2_PACKED_MAX-LZMA2_PACKET_MAX_LEN, 0);
+        
+        rangeEncodeTerminate(&coder);
+        
+        unpacked_len = pos - chunk_start;
+        packed_len   = coder.p_dst - p_chunk;
+        raw_len      = unpacked_len + LZMA2_RAW_HEADER_LEN * ((unpacked_len + LZMA2_RAW_MAX - 1) / LZMA2_RAW_MAX);
+        
+        if (!coder.overflow && LZMA2_LZMA_HEADER_LEN + (need_reset>=2) + packed_len < raw_len) {
+            *(p_dst++) = (uint8_t)(0x80 | (need_reset << 5) | ((unpacked_len-1) >> 16));
+            *(p_dst++) = (uint8_t)((unpacked_len-1) >> 8);
+            *(p_dst++) = (uint8_t)((unpacked_len-1) >> 0);
+            *(p_dst++) = (uint8_t)((packed_len-1) >> 8);
+            *(p_dst++) = (uint8_t)((packed_len-1) >> 0);
+            if (need_reset >= 2)
+                *(p_dst++) = LCLPPB_BYTE(enc.lc, enc.lp, enc.pb);
+            memcpy(p_dst, p_chunk, packed_len);
+            p_dst += packed_len;
+            need_reset = 0;
+        } else {
+            p_dst = writeLzma2RawChunks(p_dst, p_src+chunk_start, unpacked_len, (need_reset==3));
+            if (need_reset == 3)
+                need_reset = 2;                                // the decoder wants the properties after an uncompressed chunk which resets the dictionary
+            else if (need_reset == 0)
+                need_reset = 1;                                // the decoder did not see the packets of this chunk, so the state must be reset
+        }
+    }
+    
+    *(p_dst++) = 0x00;                                         // end of LZMA2 stream
+    
+    freeLzmaEncoder(&enc);
+    free(p_chunk);
+    
+    *p_dst_len = p_dst - p_dst_base;
     
     return R_OK;
 }
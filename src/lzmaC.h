@@ -4,6 +4,96 @@
 #include <stddef.h>
 #include <stdint.h>
 
-int lzmaC (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len);
+
+#define  LZMA_MF_HC    0                  // match finder : hash buckets, each keeps the latest positions of a 3-byte hash. fast
+#define  LZMA_MF_BT4   1                  // match finder : binary trees of the positions sorted by the following bytes (like 7-zip's BT4). slower, but finds the longer and farther matches
+#define  LZMA_MF_SA    2                  // match finder : a suffix array of the input, sorted at once. finds the nearest match of each length even for very repetitive data. not for the streaming mode
+
+#define  LZMA_PARSER_GREEDY   0           // parser : take the match of the best fixed score of its length and distance at once. fastest
+#define  LZMA_PARSER_LAZY     1           // parser : like greedy, but look ahead 2 positions for a better match. fast
+#define  LZMA_PARSER_OPTIMAL  2           // parser : choose the packets of the least bits with the current probabilities, by dynamic programming over up to 2048 positions. slower, smaller output
+
+typedef struct {
+    uint32_t match_finder;                // LZMA_MF_HC, LZMA_MF_BT4 or LZMA_MF_SA
+    uint32_t dict_len;                    // the dictionary size (the max match distance), which is written to the header. valid range : 4096~(1<<30)
+    uint32_t hash_bits;                   // the hash table of the match finder has (1<<hash_bits) buckets (HC) or heads (BT4). valid range : 10~24
+    uint32_t hash_depth;                  // the max number of candidates compared per search. HC : the positions kept in each bucket.  BT4 : the tree nodes visited.  SA : half of the suffixes visited. valid range : 1~64
+    uint32_t nice_len;                    // a match of this length is long enough to stop searching, and to be taken without looking ahead or comparing. valid range : 8~273
+    uint32_t parser;                      // LZMA_PARSER_GREEDY, LZMA_PARSER_LAZY or LZMA_PARSER_OPTIMAL
+    uint32_t mf_thread;                   // 1 : lzmaC runs the match finder in its own thread, ahead of the parser and the range coder. The output is the same. only for the optimal parser or BT4, and not for LZMA2 (.xz)
+    uint32_t lc;                          // the literals are coded by the high lc bits of the previous byte. valid range : 0~8
+    uint32_t lp;                          // the literals are coded by the low lp bits of their position. valid range : 0~4, and lc+lp <= 4 for LZMA2 (.xz)
+    uint32_t pb;                          // the packets are coded by the low pb bits of their position. valid range : 0~4.  e.g., lp=2,pb=2 for 4-byte aligned data, lc=4,pb=0 for text
+    uint32_t decode_bias;                 // 0 : the optimal parser chooses the least bits.  1~LZMA_DECODE_BIAS_MAX : it also charges each packet by its decode work (its range-decoded bits, which don't grow with the length of a match), so it prefers fewer literals and longer matches, which decode faster but take more bits. only for the optimal parser
+} LzmaCParams_t;
+
+#define  LZMA_DECODE_BIAS_MAX 8
+
+
+#define  LZMA_LC_DEFAULT      4
+#define  LZMA_LP_DEFAULT      0
+#define  LZMA_PB_DEFAULT      3
+
+
+#define  LZMA_LEVEL_DEFAULT   6
+
+// Function  : set the parameters of a compress level, like the levels of xz :
+//               0~3 : a short hash chain and the greedy parser, the fastest
+//               4~6 : a longer hash chain and the lazy parser
+//               7~9 : the optimal parser, and the binary-tree match finder with a 32MB/64MB dictionary for 8~9. the smallest output
+// Parameter :
+//     int level : 0~9, it's clamped to this range
+void lzmaCLevelParams (LzmaCParams_t *p_params, int level);
+
+// Function  : set the default parameters, which are of level LZMA_LEVEL_DEFAULT
+void lzmaCDefaultParams (LzmaCParams_t *p_params);
+
+// Return    : the memory (in bytes) allocated by lzmaC with these parameters, for an input not shorter than the dictionary or the hash table.
+//             A shorter input gets smaller tables. The tables are zeroed by calloc, so their untouched pages are not really used either.
+//             LZMA_MF_SA indexes a window of 2 x dictionary, so it needs 10 bytes per position of min(2 x dictionary, input length)
+size_t lzmaCMemUsage (const LzmaCParams_t *p_params);
+
+// Function  : shrink the hash table (and the dictionary of BT4 and SA) until lzmaCMemUsage fits in mem_budget bytes
+// Return    :
+//     0 : success
+//     1 : the budget is too small even for the smallest hash table
+int lzmaCFitMemory (LzmaCParams_t *p_params, size_t mem_budget);
+
+// Function  : choose lc, lp and pb for the input, by compressing a few samples of it with each candidate setting
+//             (n_threads in parallel) and keeping the smallest. Another setting replaces the default one
+//             only if it is clearly (1/128) smaller, since the samples are only a part of the input.
+// Parameter :
+//     uint8_t *p_src          : input data
+//     size_t   src_len        : input data length
+//     LzmaCParams_t *p_params : the other parameters of the trial compress, and its lc, lp and pb will be set
+//     int      n_threads      : the number of threads, 0 means all the CPU cores
+// Return    :
+//     0 : success
+//     1 : out of memory
+//     2 : unsupported parameters
+int lzmaCAutoLcLpPb (uint8_t *p_src, size_t src_len, LzmaCParams_t *p_params, int n_threads);
+
+
+// p_params : NULL to use the default parameters
+int lzmaC (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len, const LzmaCParams_t *p_params);
+
+// the output buffer length that lzmaC needs for src_len bytes of input.
+// only a pathological input may still overflow it, then lzmaC returns 3 (output overflow) and the caller may retry with a larger buffer.
+size_t lzmaCBound (size_t src_len);
+
+
+// streaming interface : feed the input chunk by chunk, and get the output chunk by chunk (the same as lz4CStreamFeed, see lz4C.h).
+//   The input is kept in a sliding window of 1.25 x the dictionary (at least 1MB more), so the memory is bounded by p_params->dict_len
+//   instead of the input length. Since the length is not known in advance, the header says "unknown length" and the data ends with
+//   an end marker. The header has the dictionary size of p_params, which is also the max distance of the matches.
+//   lzmaCStreamNew copies p_params (NULL for the default parameters), and mf_thread is ignored. It returns NULL for invalid parameters
+//   (including LZMA_MF_SA, which can't slide) or out of memory. lzmaCStreamFeed returns 0 for success, 1 for out of memory.
+typedef struct LzmaCStream_t LzmaCStream_t;
+
+LzmaCStream_t *lzmaCStreamNew   (const LzmaCParams_t *p_params);
+int            lzmaCStreamFeed  (LzmaCStream_t *p_st, uint8_t *p_src, size_t *p_src_len, uint8_t *p_dst, size_t *p_dst_len, uint8_t finish);
+void           lzmaCStreamReset (LzmaCStream_t *p_st);
+void           lzmaCStreamFree  (LzmaCStream_t *p_st);
+size_t         lzmaCStreamMemUsage (const LzmaCParams_t *p_params);     // the max memory (in bytes) allocated by lzmaCStreamNew and lzmaCStreamFeed
 
 #endif // __LZMA_C_H__
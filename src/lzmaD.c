@@ -1,6 +1,9 @@
 #include <stddef.h>   // size_t
 #include <stdint.h>   // uint8_t, uint16_t, uint32_t
 #include <stdlib.h>   // malloc, free
+#include <string.h>   // memcpy, memset
+
+#include "RangeCoder.h"   // the range decoder
 
 #define   R_OK                           0
 #define   R_ERR_MEMORY_RUNOUT            1
@@ -41,125 +44,6 @@ static uint32_t bitsReverse (uint32_t bits, uint32_t bit_count) {
 
 
 
-/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Range Decoder
-/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-#define   RANGE_CODE_NORMALIZE_THRESHOLD           (1 << 24)
-#define   RANGE_CODE_MOVE_BITS                     5
-#define   RANGE_CODE_N_BIT_MODEL_TOTAL_BITS        11
-#define   RANGE_CODE_BIT_MODEL_TOTAL               (1 << RANGE_CODE_N_BIT_MODEL_TOTAL_BITS)
-#define   RANGE_CODE_HALF_PROBABILITY              (RANGE_CODE_BIT_MODEL_TOTAL >> 1)
-
-
-typedef struct {
-    uint32_t       code;
-    uint32_t       range;
-    const uint8_t *p_src;
-    const uint8_t *p_src_limit;
-    uint8_t        overflow;
-} RangeDecoder_t;
-
-
-static void rangeDecodeNormalize (RangeDecoder_t *d) {
-    if (d->range < RANGE_CODE_NORMALIZE_THRESHOLD) {
-        if (d->p_src != d->p_src_limit) {
-            d->range <<= 8;
-            d->code  <<= 8;
-            d->code  |= (uint32_t)(*(d->p_src));
-            d->p_src ++;
-        } else {
-            d->overflow = 1;
-        }
-    }
-}
-
-
-static RangeDecoder_t newRangeDecoder (const uint8_t *p_src, size_t src_len) {
-    RangeDecoder_t coder;
-    coder.code        = 0;
-    coder.range       = 0;
-    coder.p_src       = p_src;
-    coder.p_src_limit = p_src + src_len;
-    coder.overflow    = 0;
-    rangeDecodeNormalize(&coder);
-    rangeDecodeNormalize(&coder);
-    rangeDecodeNormalize(&coder);
-    rangeDecodeNormalize(&coder);
-    rangeDecodeNormalize(&coder);
-    coder.range       = 0xFFFFFFFF;
-    return coder;
-}
-
-
-static uint32_t rangeDecodeIntByFixedProb (RangeDecoder_t *d, uint32_t bit_count) {
-    uint32_t val=0, b;
-    for (; bit_count>0; bit_count--) {
-        rangeDecodeNormalize(d);
-        d->range >>= 1;
-        d->code -= d->range;
-        b = !(1 & (d->code >> 31));
-        if (!b)
-            d->code += d->range;
-        val <<= 1;
-        val  |= b;
-    }
-    return val;
-}
-
-
-static uint32_t rangeDecodeBit (RangeDecoder_t *d, uint16_t *p_prob) {
-    uint32_t prob = *p_prob;
-    uint32_t bound;
-    rangeDecodeNormalize(d);
-    bound = (d->range >> RANGE_CODE_N_BIT_MODEL_TOTAL_BITS) * prob;
-    if (d->code < bound) {
-        d->range = bound;
-        *p_prob = (uint16_t)(prob + ((RANGE_CODE_BIT_MODEL_TOTAL - prob) >> RANGE_CODE_MOVE_BITS));
-        return 0;
-    } else {
-        d->range -= bound;
-        d->code  -= bound;
-        *p_prob = (uint16_t)(prob - (prob >> RANGE_CODE_MOVE_BITS));
-        return 1;
-    }
-}
-
-
-static uint32_t rangeDecodeInt (RangeDecoder_t *d, uint16_t *p_prob, uint32_t bit_count) {
-    uint32_t val = 1;
-    uint32_t i;
-    for (i=0; i<bit_count; i++) {
-        if ( ! rangeDecodeBit(d, p_prob+val-1) ) {                // get bit 0
-            val <<= 1;
-        } else {                                                  // get bit 1
-            val <<= 1;
-            val  |= 1;
-        }
-    }
-    return val & ((1<<bit_count)-1) ;
-}
-
-
-static uint32_t rangeDecodeMB (RangeDecoder_t *d, uint16_t *p_prob, uint32_t match_byte) {
-    uint32_t i, val = 1, off0 = 0x100, off1;                       // off0 and off1 can only be 0x000 or 0x100
-    for (i=0; i<8; i++) {
-        match_byte <<= 1;
-        off1 = off0;
-        off0 &= match_byte;
-        if ( ! rangeDecodeBit(d, (p_prob+(off0+off1+val-1))) ) {  // get bit 0
-            val <<= 1;
-            off0 ^= off1;
-        } else {                                                  // get bit 1
-            val <<= 1;
-            val  |= 1;
-        }
-    }
-    return val & 0xFF;
-}
-
-
-
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // LZMA Decoder
@@ -200,119 +84,197 @@ static uint8_t stateTransition (uint8_t state, PACKET_t type) {
 #define   N_LIT_STATES                              7
 
 #define   MAX_LC                                    8                    // max value of lc is 8, see LZMA specification
-#define   N_PREV_BYTE_LC_MSBS                       (1 << MAX_LC)
 
 #define   MAX_LP                                    4                    // max value of lp is 4, see LZMA specification
-#define   N_LIT_POS_STATES                          (1 << MAX_LP)
 
 #define   MAX_PB                                    4                    // max value of pb is 4, see LZMA specification
 #define   N_POS_STATES                              (1 << MAX_PB)
 
 
 #define   INIT_PROBS(probs)                         {                  \
-    uint16_t *p = (uint16_t*)(probs);                                  \
+    uint16_t *p = (uint16_t*)&(probs);                                 \
     uint16_t *q = p + (sizeof(probs) / sizeof(uint16_t));              \
     for (; p<q; p++)                                                   \
         *p = RANGE_CODE_HALF_PROBABILITY;                              \
 }                                                                       // all probabilities are init to 50% (half probability)
 
 
-#define   INIT_PROBS_LITERAL(probs)                 {                  \
-    uint16_t *p = (uint16_t*)(probs);                                  \
-    uint16_t *q = p + (N_LIT_POS_STATES*N_PREV_BYTE_LC_MSBS*3*(1<<8)); \
-    for (; p<q; p++)                                                   \
-        *p = RANGE_CODE_HALF_PROBABILITY;                              \
-}                                                                       // all probabilities are init to 50% (half probability)
+#define   N_LITERAL_PROBS(lc, lp)                   (((size_t)1 << ((lc) + (lp))) * 3*(1<<8))      // the literal probability array has (1<<lp) x (1<<lc) x 0x300 items
+
+
+typedef struct {                                                        // all the probability arrays except the literal one, whose size depends on lc and lp
+    uint16_t is_match     [N_STATES] [N_POS_STATES] ;
+    uint16_t is_rep       [N_STATES] ;
+    uint16_t is_rep0      [N_STATES] ;
+    uint16_t is_rep0_long [N_STATES] [N_POS_STATES] ;
+    uint16_t is_rep1      [N_STATES] ;
+    uint16_t is_rep2      [N_STATES] ;
+    uint16_t dist_slot    [4]  [(1<<6)-1];
+    uint16_t dist_special [10] [(1<<5)-1];
+    uint16_t dist_align   [(1<<4)-1];
+    uint16_t len_choice   [2];
+    uint16_t len_choice2  [2];
+    uint16_t len_low      [2] [N_POS_STATES] [(1<<3)-1];
+    uint16_t len_mid      [2] [N_POS_STATES] [(1<<3)-1];
+    uint16_t len_high     [2] [(1<<8)-1];
+} LzmaDProbs_t;
+
+
+typedef struct {                                                        // the state of the decoder which is kept between the calls of lzmaDecodePackets
+    LzmaDProbs_t probs;
+    uint16_t    *probs_literal;                                         // [1<<lp] [1<<lc] [3*(1<<8)], allocated for lc+lp <= max_lclp
+    uint8_t      max_lclp;
+    uint8_t      lc, lp, pb;
+    uint8_t      state;                                                 // valid value : 0~12
+    uint32_t     rep0, rep1, rep2, rep3;
+    size_t       hist_len;                                              // the decoded bytes before pos which can be referred by the matches
+    uint32_t     rem_len;                                               // the bytes of the last match (at rep0) which are not copied yet, since it goes beyond pos_end
+} LzmaDecoder_t;
+
+
+/// reset the probabilities, the state and the reps. The dictionary (the decoded data) is not touched
+static void resetLzmaDecoderState (LzmaDecoder_t *p_dec) {
+    size_t i;
+    INIT_PROBS(p_dec->probs);
+    for (i=0; i<N_LITERAL_PROBS(p_dec->lc, p_dec->lp); i++)
+        p_dec->probs_literal[i] = RANGE_CODE_HALF_PROBABILITY;
+    p_dec->state = 0;
+    p_dec->rep0  = p_dec->rep1 = p_dec->rep2 = p_dec->rep3 = 1;
+    p_dec->rem_len = 0;
+}
+
+
+/// the literal probability array is allocated for lc+lp <= max_lclp, so that lc, lp and pb can be changed later without reallocating it
+static int newLzmaDecoder (LzmaDecoder_t *p_dec, uint8_t lc, uint8_t lp, uint8_t pb, uint8_t max_lclp) {
+    if (lc > MAX_LC || lp > MAX_LP || pb > MAX_PB || lc+lp > max_lclp)
+        return R_ERR_UNSUPPORTED;
+    
+    p_dec->probs_literal = (uint16_t*) malloc (sizeof(uint16_t) * N_LITERAL_PROBS(max_lclp, 0));    // only allocate for the actual lc and lp, since it's quiet large for the max lc and lp (3145728 items, 6MB). we need to use malloc
+    
+    if (p_dec->probs_literal == NULL)
+        return R_ERR_MEMORY_RUNOUT;
+    
+    p_dec->max_lclp = max_lclp;
+    p_dec->lc = lc;
+    p_dec->lp = lp;
+    p_dec->pb = pb;
+    p_dec->hist_len = 0;
     
+    resetLzmaDecoderState(p_dec);
+    
+    return R_OK;
+}
 
-static int lzmaDecode (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len, uint8_t lc, uint8_t lp, uint8_t pb) {
+
+static void freeLzmaDecoder (LzmaDecoder_t *p_dec) {
+    free(p_dec->probs_literal);
+    p_dec->probs_literal = NULL;
+}
+
+
+#define   PACKET_MAX_IN_LEN                         48                   // a packet takes at most 48 range-coded bits (a match of dist slot 63 : 2 + 10 + 6 + 26 + 4), so at most 48 input bytes
+
+
+/// decode the packets to p_dst[*p_pos], until pos reaches pos_end or meeting the end marker (then *p_end_mark = 1).
+/// p_dst is a ring of buf_len bytes, and pos_end <= buf_len. The caller wraps pos to 0 at buf_len, so buf_len must be a multiple of 16,
+/// then the low bits of pos are the same as the position in the data. For a linear output, buf_len is the length of the output buffer.
+/// the matches can refer to the last p_dec->hist_len bytes. A match which goes beyond pos_end is left in p_dec->rem_len, and copied
+/// first in the next call. The range decoder reads the input without checking its limit. When less than PACKET_MAX_IN_LEN bytes are
+/// left, it stops if more_input=1, otherwise they are copied to a zero-padded buffer and decoded from there, and reading beyond
+/// the limit is found after the packet
+static int lzmaDecodePackets (LzmaDecoder_t *p_dec, RangeDecoder_t *p_coder, uint8_t *p_dst, size_t buf_len, size_t *p_pos, size_t pos_end, uint8_t more_input, uint8_t *p_end_mark) {
+    const uint8_t lc       = p_dec->lc;
     const uint8_t lc_shift = (8 - lc);
     const uint8_t lc_mask  = (1 << lc) - 1;
-    const uint8_t lp_mask  = (1 << lp) - 1;
-    const uint8_t pb_mask  = (1 << pb) - 1;
+    const uint8_t lp_mask  = (1 << p_dec->lp) - 1;
+    const uint8_t pb_mask  = (1 << p_dec->pb) - 1;
     
-    uint8_t  prev_byte = 0;
-    uint8_t  state = 0;        // valid value : 0~12
-    size_t   pos   = 0;        // position of uncompressed data (p_dst)
-    uint32_t rep0  = 1;
-    uint32_t rep1  = 1;
-    uint32_t rep2  = 1;
-    uint32_t rep3  = 1;
+    size_t   pos   = *p_pos;   // position of uncompressed data (p_dst)
+    size_t   hist  = p_dec->hist_len;
+    uint32_t rem   = p_dec->rem_len;
+    uint8_t  prev_byte = (hist > 0) ? p_dst[(pos > 0 ? pos : buf_len) - 1] : 0;
+    uint8_t  state = p_dec->state;
+    uint32_t rep0  = p_dec->rep0;
+    uint32_t rep1  = p_dec->rep1;
+    uint32_t rep2  = p_dec->rep2;
+    uint32_t rep3  = p_dec->rep3;
+    int      ret_code = R_OK;
     
-    RangeDecoder_t coder = newRangeDecoder(p_src, src_len);
+    RangeDecoder_t coder = *p_coder;
     
-    // probability arrays ---------------------------------------
-    uint16_t probs_is_match     [N_STATES] [N_POS_STATES] ;
-    uint16_t probs_is_rep       [N_STATES] ;
-    uint16_t probs_is_rep0      [N_STATES] ;
-    uint16_t probs_is_rep0_long [N_STATES] [N_POS_STATES] ;
-    uint16_t probs_is_rep1      [N_STATES] ;
-    uint16_t probs_is_rep2      [N_STATES] ;
-    uint16_t probs_dist_slot    [4]  [(1<<6)-1];
-    uint16_t probs_dist_special [10] [(1<<5)-1];
-    uint16_t probs_dist_align   [(1<<4)-1];
-    uint16_t probs_len_choice   [2];
-    uint16_t probs_len_choice2  [2];
-    uint16_t probs_len_low      [2] [N_POS_STATES] [(1<<3)-1];
-    uint16_t probs_len_mid      [2] [N_POS_STATES] [(1<<3)-1];
-    uint16_t probs_len_high     [2] [(1<<8)-1];
-    
-    // uint16_t probs_literal  [N_LIT_POS_STATES] [N_PREV_BYTE_LC_MSBS] [3*(1<<8)];
-    
-    uint16_t (*probs_literal) [N_PREV_BYTE_LC_MSBS] [3*(1<<8)];
-    
-    probs_literal = (uint16_t (*) [N_PREV_BYTE_LC_MSBS] [3*(1<<8)]) malloc (sizeof(uint16_t) * N_PREV_BYTE_LC_MSBS * N_LIT_POS_STATES * 3*(1<<8));    // since this array is quiet large (3145728 items, 6MB), we need to use malloc
-    
-    if (probs_literal == 0)
-        return R_ERR_MEMORY_RUNOUT;
+    uint8_t        tail [2*PACKET_MAX_IN_LEN];
+    const uint8_t *p_tail_src = NULL;                                                   // the input address of tail[0], NULL if not decoding from tail
+    
+    LzmaDProbs_t *p_probs = &p_dec->probs;
+    
+    uint16_t *probs_literal = p_dec->probs_literal;
     
-    INIT_PROBS(probs_is_match);
-    INIT_PROBS(probs_is_rep);
-    INIT_PROBS(probs_is_rep0);
-    INIT_PROBS(probs_is_rep0_long);
-    INIT_PROBS(probs_is_rep1);
-    INIT_PROBS(probs_is_rep2);
-    INIT_PROBS(probs_dist_slot);
-    INIT_PROBS(probs_dist_special);
-    INIT_PROBS(probs_dist_align);
-    INIT_PROBS(probs_len_choice);
-    INIT_PROBS(probs_len_choice2);
-    INIT_PROBS(probs_len_low);
-    INIT_PROBS(probs_len_mid);
-    INIT_PROBS(probs_len_high);
-    //INIT_PROBS(probs_literal);
-    INIT_PROBS_LITERAL(probs_literal);
-    
-    while (pos < *p_dst_len) {                                                          // main loop
-        const uint8_t prev_byte_lc_msbs = lc_mask & (prev_byte >> lc_shift);
-        const uint8_t literal_pos_state = lp_mask & (uint32_t)pos;
-        const uint8_t pos_state         = pb_mask & (uint32_t)pos;
+    *p_end_mark = 0;
+    
+    for (;;) {                                                                          // main loop
+        uint8_t  prev_byte_lc_msbs, literal_pos_state, pos_state;
         uint32_t dist=0, len=0;
         PACKET_t type;
         
-        if (coder.overflow)
-            return R_ERR_INPUT_OVERFLOW;
+        if (rem > 0) {                                                                  // copy the match, or the rest of it
+            size_t src = (pos >= rep0) ? (pos - rep0) : (pos + buf_len - rep0);
+            size_t n   = (rem < pos_end - pos) ? rem : (pos_end - pos);
+            rem  -= (uint32_t)n;
+            hist += n;
+            for (; n>0; n--) {
+                p_dst[pos++] = prev_byte = p_dst[src++];
+                if (src == buf_len)
+                    src = 0;
+            }
+        }
+        
+        if (hist > buf_len)
+            hist = buf_len;
+        
+        if (pos >= pos_end)
+            break;
+        
+        prev_byte_lc_msbs = lc_mask & (prev_byte >> lc_shift);
+        literal_pos_state = lp_mask & (uint32_t)pos;
+        pos_state         = pb_mask & (uint32_t)pos;
+        
+        if (coder.p_src_limit - coder.p_src < PACKET_MAX_IN_LEN && p_tail_src == NULL) {
+            size_t n = coder.p_src_limit - coder.p_src;
+            if (more_input)                                                             // wait for the following input, which is needed by the next packet
+                break;
+            memcpy(tail, coder.p_src, n);
+            memset(tail+n, 0, sizeof(tail)-n);
+            p_tail_src        = coder.p_src;
+            coder.p_src       = tail;
+            coder.p_src_limit = tail + n;
+        }
+        
+        if (coder.overflow || coder.p_src > coder.p_src_limit) {
+            ret_code = R_ERR_INPUT_OVERFLOW;
+            break;
+        }
         
-        if        ( !rangeDecodeBit(&coder, &probs_is_match    [state][pos_state]) ) {  // decoded bit sequence = 0     (packet LIT)
+        if        ( !rangeDecodeBit(&coder, &p_probs->is_match    [state][pos_state]) ) {  // decoded bit sequence = 0     (packet LIT)
             type = PKT_LIT;
-        } else if ( !rangeDecodeBit(&coder, &probs_is_rep      [state]           ) ) {  // decoded bit sequence = 10    (packet MATCH)
+        } else if ( !rangeDecodeBit(&coder, &p_probs->is_rep      [state]           ) ) {  // decoded bit sequence = 10    (packet MATCH)
             type = PKT_MATCH;
-        } else if ( !rangeDecodeBit(&coder, &probs_is_rep0     [state]           ) ) {  // decoded bit sequence = 110   (packet SHORTREP or LONGREP0)
-            type =   rangeDecodeBit(&coder, &probs_is_rep0_long[state][pos_state]) ? PKT_REP0 : PKT_SHORTREP;
-        } else if ( !rangeDecodeBit(&coder, &probs_is_rep1     [state]           ) ) {  // decoded bit sequence = 1110  (packet LONGREP1)
+        } else if ( !rangeDecodeBit(&coder, &p_probs->is_rep0     [state]           ) ) {  // decoded bit sequence = 110   (packet SHORTREP or LONGREP0)
+            type =   rangeDecodeBit(&coder, &p_probs->is_rep0_long[state][pos_state]) ? PKT_REP0 : PKT_SHORTREP;
+        } else if ( !rangeDecodeBit(&coder, &p_probs->is_rep1     [state]           ) ) {  // decoded bit sequence = 1110  (packet LONGREP1)
             type = PKT_REP1;
         } else {
-            type =   rangeDecodeBit(&coder, &probs_is_rep2     [state]           ) ? PKT_REP3 : PKT_REP2;
+            type =   rangeDecodeBit(&coder, &p_probs->is_rep2     [state]           ) ? PKT_REP3 : PKT_REP2;
         }
         
         if (type == PKT_LIT) {
+            uint16_t *probs = probs_literal + (((size_t)literal_pos_state << lc) + prev_byte_lc_msbs) * 3*(1<<8);     // probs_literal[literal_pos_state][prev_byte_lc_msbs]
             if (state < N_LIT_STATES) {
-                prev_byte = rangeDecodeInt(&coder, probs_literal[literal_pos_state][prev_byte_lc_msbs], 8);
+                prev_byte = rangeDecodeInt(&coder, probs, 8);
             } else {
                 uint8_t match_byte = 0;
-                if (pos >= (size_t)rep0)
-                    match_byte = p_dst[pos-rep0];
-                prev_byte = rangeDecodeMB (&coder, probs_literal[literal_pos_state][prev_byte_lc_msbs], match_byte);
+                if (hist >= (size_t)rep0)
+                    match_byte = p_dst[(pos >= rep0) ? (pos - rep0) : (pos + buf_len - rep0)];
+                prev_byte = rangeDecodeMB (&coder, probs, match_byte);
             }
         }
         
@@ -339,56 +301,95 @@ static int lzmaDecode (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p
         
         if (len == 0) {                                                                    // unknown length, need to decode
             const uint32_t is_rep = (type != PKT_MATCH);
-            if      ( !rangeDecodeBit(&coder, &probs_len_choice [is_rep]) )
-                len =   2 + rangeDecodeInt(&coder, probs_len_low[is_rep][pos_state], 3);   // len = 2~9
-            else if ( !rangeDecodeBit(&coder, &probs_len_choice2[is_rep]) )
-                len =  10 + rangeDecodeInt(&coder, probs_len_mid[is_rep][pos_state], 3);   // len = 10~17
+            if      ( !rangeDecodeBit(&coder, &p_probs->len_choice [is_rep]) )
+                len =   2 + rangeDecodeInt(&coder, p_probs->len_low[is_rep][pos_state], 3);   // len = 2~9
+            else if ( !rangeDecodeBit(&coder, &p_probs->len_choice2[is_rep]) )
+                len =  10 + rangeDecodeInt(&coder, p_probs->len_mid[is_rep][pos_state], 3);   // len = 10~17
             else
-                len =  18 + rangeDecodeInt(&coder,probs_len_high[is_rep], 8);              // len = 18~273
+                len =  18 + rangeDecodeInt(&coder, p_probs->len_high[is_rep], 8);             // len = 18~273
         }
         
         if (type == PKT_MATCH) {                                                           // unknown distance, need to decode
             const uint32_t len_min5_minus2 = (len>5) ? 3 : (len-2);
             uint32_t dist_slot, bcnt;
             
-            dist_slot = rangeDecodeInt(&coder, probs_dist_slot[len_min5_minus2], 6);       // decode distance slot (0~63)
+            dist_slot = rangeDecodeInt(&coder, p_probs->dist_slot[len_min5_minus2], 6);    // decode distance slot (0~63)
             bcnt  = (dist_slot >> 1) - 1;
             dist  = (2 | (dist_slot & 1));                                                 // high 2 bits of dist
-            dist<<= bcnt;
+            if (dist_slot >= 4)
+                dist <<= bcnt;
             
             if        (dist_slot >=14) {                                                   // dist slot = 14~63
                 dist |= rangeDecodeIntByFixedProb (&coder, bcnt-4) << 4;
-                dist |= bitsReverse(rangeDecodeInt(&coder, probs_dist_align, 4), 4);
+                dist |= bitsReverse(rangeDecodeInt(&coder, p_probs->dist_align, 4), 4);
             } else if (dist_slot >=4 ) {                                                   // dist slot = 4~13
-                dist |= bitsReverse(rangeDecodeInt(&coder, probs_dist_special[dist_slot-4], bcnt), bcnt);
+                dist |= bitsReverse(rangeDecodeInt(&coder, p_probs->dist_special[dist_slot-4], bcnt), bcnt);
             } else {                                                                       // dist slot = 0~3
                 dist  = dist_slot;
             }
             
-            if (dist == 0xFFFFFFFF)                                                        // meeting end marker
+            if (dist == 0xFFFFFFFF) {                                                      // meeting end marker
+                *p_end_mark = 1;
                 break;
+            }
             
             dist ++;
         }
             
-        if ((size_t)dist > pos)
-            return R_ERR_DATA;
-        
-        if ((pos+len) > *p_dst_len)
-            return R_ERR_OUTPUT_OVERFLOW;
-        
-        if (type == PKT_LIT)
-            p_dst[pos] = prev_byte;
-        else
+        if (type == PKT_LIT) {
+            p_dst[pos++] = prev_byte;
+            hist ++;
+        } else if ((size_t)dist > hist) {
+            ret_code = R_ERR_DATA;
+            break;
+        } else {
             rep0 = dist;
-        
-        for (; len>0; len--) {
-            p_dst[pos] = prev_byte = p_dst[pos-dist];
-            pos ++;
+            rem  = len;
         }
     }
     
-    free(probs_literal);
+    if (p_tail_src != NULL) {                                                            // back to the input
+        if (coder.p_src > coder.p_src_limit) {
+            coder.overflow = 1;
+            coder.p_src    = coder.p_src_limit;
+        }
+        coder.p_src       = p_tail_src + (coder.p_src       - tail);
+        coder.p_src_limit = p_tail_src + (coder.p_src_limit - tail);
+    }
+    
+    *p_coder = coder;
+    *p_pos   = pos;
+    p_dec->hist_len = (hist < buf_len) ? hist : buf_len;
+    p_dec->rem_len  = rem;
+    p_dec->state = state;
+    p_dec->rep0  = rep0;
+    p_dec->rep1  = rep1;
+    p_dec->rep2  = rep2;
+    p_dec->rep3  = rep3;
+    
+    return ret_code;
+}
+
+
+static int lzmaDecode (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len, uint8_t lc, uint8_t lp, uint8_t pb) {
+    size_t   pos = 0;
+    uint8_t  end_mark;
+    int      ret_code;
+    
+    RangeDecoder_t coder = newRangeDecoder(p_src, src_len);
+    
+    LzmaDecoder_t dec;
+    
+    RET_WHEN_ERR( newLzmaDecoder(&dec, lc, lp, pb, lc+lp) );
+    
+    ret_code = lzmaDecodePackets(&dec, &coder, p_dst, *p_dst_len, &pos, *p_dst_len, 0, &end_mark);
+    
+    if (ret_code == R_OK && dec.rem_len > 0)                                 // the last match goes beyond the output buffer
+        ret_code = R_ERR_OUTPUT_OVERFLOW;
+    
+    freeLzmaDecoder(&dec);
+    
+    RET_WHEN_ERR(ret_code);
     
     *p_dst_len = pos;
     
@@ -404,6 +405,7 @@ static int lzmaDecode (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p
 
 #define   LZMA_HEADER_LEN                           13
 #define   LZMA_DIC_MIN                              (1 << 12)
+#define   LZMA_RATIO_MAX                            8300               // no LZMA data decompresses to more bytes than this per byte : the cheapest packet, a rep0 of 273 bytes, takes 12 bits which cost at least 0.022 bit each
 
 
 static int parseLzmaHeader (uint8_t *p_src, uint8_t *p_lc, uint8_t *p_lp, uint8_t *p_pb, uint32_t *p_dict_len, size_t *p_uncompressed_len, uint32_t *p_uncompressed_len_known) {
@@ -470,3 +472,418 @@ int lzmaD (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len) {
     return R_OK;
 }
 
+
+
+int lzmaDGetSize (uint8_t *p_src, size_t src_len, size_t *p_dst_len) {
+    uint8_t  lc, lp, pb;
+    uint32_t dict_len, uncompressed_len_known;
+    
+    if (src_len < LZMA_HEADER_LEN)
+        return R_ERR_INPUT_OVERFLOW;
+    
+    RET_WHEN_ERR( parseLzmaHeader(p_src, &lc, &lp, &pb, &dict_len, p_dst_len, &uncompressed_len_known) )
+    
+    if (!uncompressed_len_known)
+        *p_dst_len = (size_t)-1;                                     // the header doesn't record it, the data ends with an end mark
+    else if (src_len - LZMA_HEADER_LEN <= (size_t)-1 / LZMA_RATIO_MAX && *p_dst_len > (src_len - LZMA_HEADER_LEN) * LZMA_RATIO_MAX)
+        return R_ERR_DATA;                                           // more than the data can produce, it's corrupted or not LZMA at all
+    
+    return R_OK;
+}
+
+
+
+int lzmaDGetProps (uint8_t *p_src, size_t src_len, uint8_t *p_lc, uint8_t *p_lp, uint8_t *p_pb, uint32_t *p_dict_len) {
+    uint32_t uncompressed_len_known;
+    size_t   uncompressed_len;
+    
+    if (src_len < LZMA_HEADER_LEN)
+        return R_ERR_INPUT_OVERFLOW;
+    
+    return parseLzmaHeader(p_src, p_lc, p_lp, p_pb, p_dict_len, &uncompressed_len, &uncompressed_len_known);
+}
+
+
+
+int lzmaDGetMemUsage (uint8_t *p_src, size_t src_len, size_t *p_mem_usage) {
+    uint8_t  lc, lp, pb;
+    uint32_t dict_len;
+    
+    RET_WHEN_ERR( lzmaDGetProps(p_src, src_len, &lc, &lp, &pb, &dict_len) );
+    
+    *p_mem_usage = sizeof(uint16_t) * N_LITERAL_PROBS(lc, lp);      // the literal probability array. the other arrays are on the stack and are small
+    
+    return R_OK;
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// LZMA streaming decompress : the input is collected in a small buffer, and the packets are decoded into a ring of the dictionary size,
+//                             from which the output is drained. So the memory doesn't depend on the data length.
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define   STREAM_IN_LEN                             (1 << 16)
+
+typedef enum {
+    ST_HEADER,
+    ST_RC_INIT,                                                         // the first 5 bytes of the range coder
+    ST_DATA,
+    ST_END
+} STREAM_STATE_t;
+
+typedef struct LzmaDStream_t {
+    STREAM_STATE_t state;
+    size_t         max_mem;                                             // the limit of win_cap + the literal probabilities, 0 means no limit
+    uint32_t       len_known;
+    size_t         len_left;                                            // the output bytes left, if the header records the length
+    LzmaDecoder_t  dec;                                                 // the literal probabilities are kept for the following files
+    RangeDecoder_t coder;                                               // it reads in[], and is moved with it
+    uint8_t       *p_win;                                               // the ring of win_len bytes (win_cap allocated)
+    size_t         win_len, win_cap;
+    size_t         win_pos;                                             // the decoded data in [pend_pos, win_pos) is not drained yet
+    size_t         pend_pos;
+    size_t         in_pos, in_len;
+    uint8_t        in [STREAM_IN_LEN];
+} LzmaDStream_t;
+
+
+void lzmaDStreamReset (LzmaDStream_t *p_st) {
+    p_st->state    = ST_HEADER;
+    p_st->win_len  = 0;
+    p_st->win_pos  = 0;
+    p_st->pend_pos = 0;
+    p_st->in_pos   = 0;
+    p_st->in_len   = 0;
+}
+
+
+LzmaDStream_t *lzmaDStreamNew (size_t max_mem) {
+    LzmaDStream_t *p_st = (LzmaDStream_t*)malloc(sizeof(LzmaDStream_t));
+    if (p_st) {
+        p_st->max_mem = max_mem;
+        p_st->p_win   = NULL;
+        p_st->win_cap = 0;
+        p_st->dec.probs_literal = NULL;
+        p_st->dec.max_lclp      = 0;
+        lzmaDStreamReset(p_st);
+    }
+    return p_st;
+}
+
+
+void lzmaDStreamFree (LzmaDStream_t *p_st) {
+    if (p_st) {
+        freeLzmaDecoder(&p_st->dec);
+        free(p_st->p_win);
+        free(p_st);
+    }
+}
+
+
+size_t lzmaDStreamMemUsage (void) {
+    return sizeof(LzmaDStream_t);
+}
+
+
+/// the ring is the dictionary, or the data length if it's known and shorter, rounded up to a multiple of 16 (see lzmaDecodePackets)
+static size_t getStreamWinLen (uint32_t dict_len, size_t len_left, uint32_t len_known) {
+    size_t win_len = dict_len;
+    if (len_known && len_left < win_len)
+        win_len = len_left;
+    win_len = (win_len + 15) & ~(size_t)15;
+    return (win_len == 0) ? 16 : win_len;
+}
+
+
+int lzmaDStreamMemNeed (uint8_t *p_src, size_t src_len, size_t *p_mem_need) {
+    uint8_t  lc, lp, pb;
+    uint32_t dict_len, len_known;
+    size_t   len_left;
+    
+    if (src_len < LZMA_HEADER_LEN)
+        return R_ERR_INPUT_OVERFLOW;
+    
+    RET_WHEN_ERR( parseLzmaHeader(p_src, &lc, &lp, &pb, &dict_len, &len_left, &len_known) );
+    
+    *p_mem_need = getStreamWinLen(dict_len, len_left, len_known) + sizeof(uint16_t) * N_LITERAL_PROBS(lc, lp);
+    return R_OK;
+}
+
+
+/// parse the header, and get the ring and the decoder ready. The buffers of the previous file are reused if they are large enough
+static int lzmaDStreamStart (LzmaDStream_t *p_st) {
+    uint8_t  lc, lp, pb;
+    uint32_t dict_len;
+    size_t   win_len, mem_need;
+    
+    RET_WHEN_ERR( parseLzmaHeader(p_st->in+p_st->in_pos, &lc, &lp, &pb, &dict_len, &p_st->len_left, &p_st->len_known) );
+    
+    win_len  = getStreamWinLen(dict_len, p_st->len_left, p_st->len_known);
+    mem_need = win_len + sizeof(uint16_t) * N_LITERAL_PROBS(lc, lp);
+    if (p_st->max_mem > 0 && mem_need > p_st->max_mem)
+        return R_ERR_MEMORY_RUNOUT;
+    
+    if (win_len > p_st->win_cap) {
+        free(p_st->p_win);
+        p_st->win_cap = 0;
+        p_st->p_win   = (uint8_t*)malloc(win_len);
+        if (p_st->p_win == NULL)
+            return R_ERR_MEMORY_RUNOUT;
+        p_st->win_cap = win_len;
+    }
+    p_st->win_len = win_len;
+    
+    if (p_st->dec.probs_literal == NULL || lc + lp > p_st->dec.max_lclp) {
+        freeLzmaDecoder(&p_st->dec);
+        RET_WHEN_ERR( newLzmaDecoder(&p_st->dec, lc, lp, pb, lc+lp) );
+    } else {
+        p_st->dec.lc = lc;
+        p_st->dec.lp = lp;
+        p_st->dec.pb = pb;
+        p_st->dec.hist_len = 0;
+        resetLzmaDecoderState(&p_st->dec);
+    }
+    
+    return R_OK;
+}
+
+
+int lzmaDStreamFeed (LzmaDStream_t *p_st, uint8_t *p_src, size_t *p_src_len, uint8_t *p_dst, size_t *p_dst_len, uint8_t finish) {
+    size_t src_pos = 0;
+    size_t dst_pos = 0;
+    
+    for (;;) {
+        size_t  n = p_st->win_pos - p_st->pend_pos;                                               // drain the decoded data
+        size_t  pos, pos_end;
+        uint8_t last, end_mark;
+        
+        if (n > (*p_dst_len) - dst_pos)
+            n = (*p_dst_len) - dst_pos;
+        if (n > 0) {
+            memcpy(p_dst+dst_pos, p_st->p_win+p_st->pend_pos, n);
+            p_st->pend_pos += n;
+            dst_pos        += n;
+        }
+        
+        if (p_st->pend_pos < p_st->win_pos)                                                       // user's output is full
+            break;
+        
+        if (p_st->win_pos == p_st->win_len)                                                       // all drained, go on from the start of the ring
+            p_st->win_pos = p_st->pend_pos = 0;
+        
+        if (p_st->state == ST_END) {                                                              // the data after the end is ignored, like lzmaD
+            src_pos = *p_src_len;
+            break;
+        }
+        
+        n = (*p_src_len) - src_pos;                                                               // collect input, after moving the unread bytes to the front
+        if (n > 0 && p_st->in_pos > 0) {
+            memmove(p_st->in, p_st->in+p_st->in_pos, p_st->in_len-p_st->in_pos);
+            p_st->in_len      -= p_st->in_pos;
+            if (p_st->state == ST_DATA)
+                p_st->coder.p_src -= p_st->in_pos;
+            p_st->in_pos       = 0;
+        }
+        if (n > STREAM_IN_LEN - p_st->in_len)
+            n = STREAM_IN_LEN - p_st->in_len;
+        memcpy(p_st->in+p_st->in_len, p_src+src_pos, n);
+        p_st->in_len += n;
+        src_pos      += n;
+        
+        last = finish && src_pos == (*p_src_len);                                                 // no more input after in[]
+        
+        if (p_st->state == ST_HEADER) {
+            if (p_st->in_len - p_st->in_pos < LZMA_HEADER_LEN) {
+                if (last)
+                    return R_ERR_INPUT_OVERFLOW;
+                break;                                                                            // need more input
+            }
+            RET_WHEN_ERR( lzmaDStreamStart(p_st) );
+            p_st->in_pos += LZMA_HEADER_LEN;
+            p_st->state   = (p_st->len_known && p_st->len_left == 0) ? ST_END : ST_RC_INIT;
+            
+        } else if (p_st->state == ST_RC_INIT) {
+            if (p_st->in_len - p_st->in_pos < 5 && !last)
+                break;                                                                            // need more input
+            p_st->coder = newRangeDecoder(p_st->in+p_st->in_pos, p_st->in_len-p_st->in_pos);
+            if (p_st->coder.overflow)
+                return R_ERR_INPUT_OVERFLOW;
+            p_st->in_pos = p_st->coder.p_src - p_st->in;
+            p_st->state  = ST_DATA;
+            
+        } else {
+            pos     = p_st->win_pos;
+            pos_end = p_st->win_len;
+            if (p_st->len_known && p_st->len_left < pos_end - pos)
+                pos_end = pos + p_st->len_left;
+            
+            p_st->coder.p_src_limit = p_st->in + p_st->in_len;
+            
+            RET_WHEN_ERR( lzmaDecodePackets(&p_st->dec, &p_st->coder, p_st->p_win, p_st->win_len, &pos, pos_end, !last, &end_mark) );
+            
+            n = pos - p_st->win_pos;
+            p_st->win_pos = pos;
+            p_st->in_pos  = p_st->coder.p_src - p_st->in;
+            
+            if (p_st->len_known) {
+                p_st->len_left -= n;
+                if (end_mark && p_st->len_left > 0)
+                    return R_ERR_OUTPUT_LEN_MISMATCH;
+                if (p_st->len_left == 0 && p_st->dec.rem_len > 0)                                 // the last match goes beyond the length
+                    return R_ERR_OUTPUT_OVERFLOW;
+            }
+            
+            if (end_mark || (p_st->len_known && p_st->len_left == 0)) {
+                p_st->state = ST_END;
+            } else if (n == 0) {                                                                  // the next packet needs more input
+                if (last)
+                    return R_ERR_INPUT_OVERFLOW;
+                if (src_pos == (*p_src_len))
+                    break;
+            }
+        }
+    }
+    
+    *p_src_len = src_pos;
+    *p_dst_len = dst_pos;
+    return R_OK;
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// for xz container : LZMA2 stream
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// An LZMA2 stream is a sequence of chunks, ended with a 0x00 byte (see lzmaC.c) :
+//   LZMA chunk         : control (0x80 | reset<<5 | (unpacked_len-1)>>16), 2 bytes (unpacked_len-1), 2 bytes (packed_len-1), [LCLPPB byte if reset>=2], packed data
+//   uncompressed chunk : control (0x01 resets the dictionary, 0x02 does not), 2 bytes (len-1), the raw data
+
+#define   LZMA2_LCLP_MAX                            4                    // LZMA2 requires lc+lp <= 4
+
+
+// decompress a raw LZMA2 stream (the data of an .xz block) to p_dst, which is also the dictionary, so there is no limit of the dictionary size.
+// the stream must take exactly src_len bytes. *p_dst_len is the output buffer length, and will be set to the output data length
+int lzma2Decode (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len) {
+    uint8_t *p_end = p_src + src_len;
+    uint8_t  need_dict_reset = 1;
+    uint8_t  need_props      = 1;
+    size_t   pos = 0;
+    int      ret_code = R_OK;
+    
+    LzmaDecoder_t dec;
+    
+    RET_WHEN_ERR( newLzmaDecoder(&dec, 0, 0, 0, LZMA2_LCLP_MAX) );
+    
+    for (;;) {
+        uint8_t control;
+        size_t  unpacked_len, packed_len;
+        
+        if (p_src >= p_end) {
+            ret_code = R_ERR_INPUT_OVERFLOW;
+            break;
+        }
+        
+        control = *(p_src++);
+        
+        if (control == 0x00) {                                                 // end of LZMA2 stream
+            if (p_src != p_end)
+                ret_code = R_ERR_DATA;
+            break;
+        }
+        
+        if (control == 0x01 || control >= 0xE0) {                              // dictionary reset
+            dec.hist_len    = 0;
+            need_dict_reset = 0;
+            need_props      = 1;
+        } else if (need_dict_reset || (control > 0x02 && control < 0x80)) {
+            ret_code = R_ERR_DATA;
+            break;
+        }
+        
+        if (control < 0x80) {                                                  // uncompressed chunk
+            if (p_end - p_src < 2) {
+                ret_code = R_ERR_INPUT_OVERFLOW;
+                break;
+            }
+            unpacked_len = (((size_t)p_src[0] << 8) | p_src[1]) + 1;
+            p_src += 2;
+            if ((size_t)(p_end - p_src) < unpacked_len) {
+                ret_code = R_ERR_INPUT_OVERFLOW;
+                break;
+            }
+            if (*p_dst_len - pos < unpacked_len) {
+                ret_code = R_ERR_OUTPUT_OVERFLOW;
+                break;
+            }
+            memcpy(p_dst+pos, p_src, unpacked_len);
+            p_src += unpacked_len;
+            pos   += unpacked_len;
+            dec.hist_len += unpacked_len;
+            
+        } else {                                                               // LZMA chunk
+            RangeDecoder_t coder;
+            uint8_t end_mark;
+            
+            if (p_end - p_src < 4 + (control >= 0xC0)) {
+                ret_code = R_ERR_INPUT_OVERFLOW;
+                break;
+            }
+            unpacked_len = (((size_t)(control & 0x1F) << 16) | ((size_t)p_src[0] << 8) | p_src[1]) + 1;
+            packed_len   = (((size_t)p_src[2] << 8) | p_src[3]) + 1;
+            p_src += 4;
+            
+            if (control >= 0xC0) {                                             // new properties
+                uint8_t byte = *(p_src++);
+                dec.lc = byte % 9;
+                byte  /= 9;
+                dec.lp = byte % 5;
+                dec.pb = byte / 5;
+                if (dec.pb > MAX_PB || dec.lc + dec.lp > LZMA2_LCLP_MAX) {
+                    ret_code = R_ERR_DATA;
+                    break;
+                }
+                need_props = 0;
+            } else if (need_props) {
+                ret_code = R_ERR_DATA;
+                break;
+            }
+            
+            if (control >= 0xA0)                                               // state reset
+                resetLzmaDecoderState(&dec);
+            
+            if ((size_t)(p_end - p_src) < packed_len) {
+                ret_code = R_ERR_INPUT_OVERFLOW;
+                break;
+            }
+            if (*p_dst_len - pos < unpacked_len) {
+                ret_code = R_ERR_OUTPUT_OVERFLOW;
+                break;
+            }
+            
+            coder = newRangeDecoder(p_src, packed_len);
+            
+            ret_code = lzmaDecodePackets(&dec, &coder, p_dst, *p_dst_len, &pos, pos+unpacked_len, 0, &end_mark);
+            
+            rangeDecodeNormalize(&coder);                                      // the normalization after the last bit, then the chunk must be exactly consumed
+            
+            if (ret_code == R_OK && (end_mark || dec.rem_len > 0 || coder.overflow || coder.code != 0 || coder.p_src != p_src+packed_len))
+                ret_code = R_ERR_DATA;
+            if (ret_code != R_OK)
+                break;
+            
+            p_src += packed_len;
+        }
+    }
+    
+    freeLzmaDecoder(&dec);
+    
+    RET_WHEN_ERR(ret_code);
+    
+    *p_dst_len = pos;
+    
+    return R_OK;
+}
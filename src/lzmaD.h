@@ -6,4 +6,36 @@
 
 int lzmaD (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len);
 
+// get the decompressed length from the header without decompressing. return 0 on success, or nonzero if the header is invalid,
+// e.g., it records a length that src_len bytes of LZMA data can never produce (which means the data is corrupted or not LZMA).
+// if the header doesn't record it (the data ends with an end mark), *p_dst_len = (size_t)-1, and lzmaD returns 3 (output overflow) if the buffer is too small.
+int lzmaDGetSize (uint8_t *p_src, size_t src_len, size_t *p_dst_len);
+
+// get the properties (lc, lp, pb and dictionary length) from the header of ".lzma" data. return 0 on success.
+int lzmaDGetProps (uint8_t *p_src, size_t src_len, uint8_t *p_lc, uint8_t *p_lp, uint8_t *p_pb, uint32_t *p_dict_len);
+
+// get the memory (in bytes) that lzmaD will allocate from the header (it depends on lc and lp). return 0 on success.
+int lzmaDGetMemUsage (uint8_t *p_src, size_t src_len, size_t *p_mem_usage);
+
+
+// streaming interface : feed the input chunk by chunk, and get the output chunk by chunk.
+//   the decoded data is kept in a ring of the dictionary length (or the data length if the header records a shorter one),
+//   so the memory doesn't depend on the data length. max_mem limits the ring and the probabilities (0 means no limit),
+//   lzmaDStreamFeed returns 1 (out of memory) if the header needs more.
+//   lzmaDStreamFeed consumes input from p_src (*p_src_len: input=available, output=consumed),
+//   and produces output to p_dst (*p_dst_len: input=capacity, output=produced).
+//   set finish=1 when there is no more input, and keep calling until it produces nothing.
+//   lzmaDStreamReset makes a stream ready for a new file, reusing its buffers.
+typedef struct LzmaDStream_t LzmaDStream_t;
+
+LzmaDStream_t *lzmaDStreamNew   (size_t max_mem);
+int            lzmaDStreamFeed  (LzmaDStream_t *p_st, uint8_t *p_src, size_t *p_src_len, uint8_t *p_dst, size_t *p_dst_len, uint8_t finish);
+void           lzmaDStreamReset (LzmaDStream_t *p_st);
+void           lzmaDStreamFree  (LzmaDStream_t *p_st);
+size_t         lzmaDStreamMemUsage (void);          // the memory (in bytes) allocated by lzmaDStreamNew, not including the ring and the probabilities
+
+// get the memory (in bytes) of the ring and the probabilities, which the header (the first 13 bytes of src) needs, to check it against max_mem
+// before creating the output. return 0 on success, nonzero if the header is incomplete or invalid.
+int            lzmaDStreamMemNeed (uint8_t *p_src, size_t src_len, size_t *p_mem_need);
+
 #endif // __LZMA_D_H__
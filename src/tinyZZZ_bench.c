@@ -0,0 +1,248 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "FileIO.h"
+#include "SysUtil.h"
+
+#include "gzipC.h"
+#include "lz4D.h"
+#include "lz4C.h"
+#include "zstdD.h"
+#include "lzmaD.h"
+#include "lzmaC.h"
+#include "lpaq8CD.h"
+
+#include "tinyZZZ_bench.h"
+
+
+
+/// unify the interfaces of the codecs. for the decompressors, *p_dst_len is the buffer capacity when calling.
+typedef int (*BenchFunc_t) (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len, uint8_t level);
+
+static int benchGzipC (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len, uint8_t level) {
+    (void)level;
+    return gzipC(p_src, src_len, p_dst, p_dst_len);
+}
+
+static int benchLz4C (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len, uint8_t level) {
+    (void)level;
+    return lz4C(p_src, src_len, p_dst, p_dst_len);
+}
+
+static int benchLz4D (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len, uint8_t level) {
+    (void)level;
+    return lz4D(p_src, src_len, p_dst, p_dst_len);
+}
+
+static int benchZstdD (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len, uint8_t level) {
+    (void)level;
+    zstdD(p_src, src_len, p_dst, p_dst_len);                   // zstdD exits the process on error
+    return 0;
+}
+
+static int benchLzmaC (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len, uint8_t level) {
+    LzmaCParams_t params;
+    lzmaCLevelParams(&params, level);
+    return lzmaC(p_src, src_len, p_dst, p_dst_len, &params);
+}
+
+static int benchLzmaD (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len, uint8_t level) {
+    (void)level;
+    return lzmaD(p_src, src_len, p_dst, p_dst_len);
+}
+
+static int benchLpaq8C (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len, uint8_t level) {
+    size_t mem_usage;
+    return lpaq8C(p_src, src_len, p_dst, p_dst_len, level, &mem_usage);
+}
+
+static int benchLpaq8D (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len, uint8_t level) {
+    size_t mem_usage;
+    return lpaq8D(p_src, src_len, p_dst, p_dst_len, &level, &mem_usage);
+}
+
+
+typedef struct {
+    const char   *name;
+    BenchFunc_t   comp;                   // NULL if the compression is not supported
+    BenchFunc_t   decomp;
+    size_t      (*bound) (size_t);        // compressed length bound
+    uint8_t       has_level;
+} BenchCodec_t;
+
+static const BenchCodec_t BENCH_CODECS [] = {
+    {"gzip" , benchGzipC , NULL       , gzipCBound , 0},
+    {"lz4"  , benchLz4C  , benchLz4D  , lz4CBound  , 0},
+    {"zstd" , NULL       , benchZstdD , NULL       , 0},
+    {"lzma" , benchLzmaC , benchLzmaD , lzmaCBound , 1},
+    {"lpaq8", benchLpaq8C, benchLpaq8D, lpaq8CBound, 1}
+};
+
+#define  N_BENCH_CODECS   (sizeof(BENCH_CODECS) / sizeof(BENCH_CODECS[0]))
+
+
+
+/// run func repeatedly until min_time is reached (at least once), and get the time of the fastest run.
+static int benchRun (BenchFunc_t func, uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t dst_cap, size_t *p_dst_len, uint8_t level, double min_time, double *p_best_time) {
+    double time_start = getWallTime();
+    
+    *p_best_time = -1.0;
+    
+    for (;;) {
+        double t0, t1;
+        int    ret_code;
+        
+        *p_dst_len = dst_cap;
+        t0 = getWallTime();
+        ret_code = func(p_src, src_len, p_dst, p_dst_len, level);
+        t1 = getWallTime();
+        
+        if (ret_code)
+            return ret_code;
+        
+        if (*p_best_time < 0 || t1 - t0 < *p_best_time)
+            *p_best_time = t1 - t0;
+        
+        if (t1 - time_start >= min_time)
+            return 0;
+    }
+}
+
+
+static void printSpeed (size_t len, double time) {
+    printf("  %9.2f MB/s", (1e-6*len) / (time + 1e-9));
+}
+
+
+/// benchmark a codec at a level. p_cmp is the compressed data when the codec doesn't support compression (ZSTD), otherwise NULL.
+/// return 0 when the round-trip succeeds.
+static int benchCodec (const BenchCodec_t *p_codec, uint8_t level, uint8_t *p_src, size_t src_len, uint8_t *p_cmp, size_t cmp_len, double min_time) {
+    uint8_t *p_cmp_buf = NULL, *p_dec_buf = NULL;
+    size_t   dec_cap, dec_len = 0;
+    double   time_comp = 0, time_decomp = 0;
+    int      ret_code = 0;
+    
+    printf("%-6s", p_codec->name);
+    if (p_codec->has_level) {
+        printf("  %5d", level);
+    } else {
+        printf("  %5s", "-");
+    }
+    fflush(stdout);                                            // show the codec name before the slow test starts
+    
+    if (p_codec->comp != NULL) {
+        size_t cmp_cap = p_codec->bound(src_len);
+        p_cmp_buf = (uint8_t*)malloc(cmp_cap);
+        if (p_cmp_buf == NULL) {
+            printf("  *** error : allocate memory failed\n");
+            return 1;
+        }
+        ret_code = benchRun(p_codec->comp, p_src, src_len, p_cmp_buf, cmp_cap, &cmp_len, level, min_time, &time_comp);
+        if (ret_code) {
+            printf("  *** error : compress failed (return_code = %d)\n", ret_code);
+            free(p_cmp_buf);
+            return 1;
+        }
+        p_cmp = p_cmp_buf;
+    }
+    
+    printf("  %12lu  %6.2f%%", cmp_len, (100.0*cmp_len) / (src_len + 1e-9));
+    if (p_codec->comp != NULL) {
+        printSpeed(src_len, time_comp);
+    } else {
+        printf("  %14s", "-");
+    }
+    fflush(stdout);
+    
+    if (p_codec->decomp == NULL) {
+        printf("  %14s  %5s\n", "-", "-");
+        free(p_cmp_buf);
+        return 0;
+    }
+    
+    dec_cap = src_len;
+    if (p_codec->comp == NULL) {                               // the compressed data is given, so the decompressed length may differ from src_len
+        zstdDGetSize(p_cmp, cmp_len, &dec_cap);
+    }
+    
+    p_dec_buf = (uint8_t*)malloc(dec_cap + 1);                 // +1 to avoid malloc(0)
+    if (p_dec_buf == NULL) {
+        printf("  *** error : allocate memory failed\n");
+        free(p_cmp_buf);
+        return 1;
+    }
+    
+    ret_code = benchRun(p_codec->decomp, p_cmp, cmp_len, p_dec_buf, dec_cap, &dec_len, level, min_time, &time_decomp);
+    
+    if (ret_code) {
+        printf("  *** error : decompress failed (return_code = %d)\n", ret_code);
+    } else {
+        printSpeed(dec_len, time_decomp);
+        ret_code = (dec_len != src_len || memcmp(p_src, p_dec_buf, src_len) != 0);
+        printf("  %5s\n", ret_code ? "ERROR" : "OK");
+    }
+    
+    free(p_cmp_buf);
+    free(p_dec_buf);
+    return ret_code;
+}
+
+
+
+int runBenchmark (const char *fname, const char *fname_zst, const char *codec_name, uint16_t level_mask, double min_time) {
+    uint8_t *p_src, *p_zst = NULL;
+    size_t   src_len, zst_len = 0;
+    size_t   i;
+    int      n_failed = 0;
+    
+    p_src = loadFromFile(&src_len, fname);
+    if (p_src == NULL) {
+        printf("*** error : open file %s failed\n", fname);
+        return 1;
+    }
+    
+    if (fname_zst != NULL) {
+        p_zst = loadFromFile(&zst_len, fname_zst);
+        if (p_zst == NULL) {
+            printf("*** error : open file %s failed\n", fname_zst);
+            free(p_src);
+            return 1;
+        }
+    }
+    
+    printf("benchmark %s (%lu bytes), repeat each test for at least %.1f sec, speeds are of the fastest run\n", fname, src_len, min_time);
+    printf("codec   level    compressed    ratio        compress      decompress  check\n");
+    
+    for (i=0; i<N_BENCH_CODECS; i++) {
+        const BenchCodec_t *p_codec = &BENCH_CODECS[i];
+        uint8_t level;
+        
+        if (codec_name != NULL && strcmp(codec_name, p_codec->name) != 0)
+            continue;
+        
+        if (p_codec->comp == NULL && p_zst == NULL) {          // ZSTD : only decompress, and needs a given .zst file
+            if (codec_name != NULL) {
+                printf("*** error : benchmarking %s needs a compressed file\n", p_codec->name);
+                n_failed ++;
+            }
+            continue;
+        }
+        
+        for (level=0; level<=9; level++) {
+            if (p_codec->has_level && !((level_mask >> level) & 1))
+                continue;
+            
+            if (benchCodec(p_codec, level, p_src, src_len, p_zst, zst_len, min_time))
+                n_failed ++;
+            
+            if (!p_codec->has_level)                           // only once for the codecs without level
+                break;
+        }
+    }
+    
+    free(p_src);
+    free(p_zst);
+    
+    return n_failed ? 1 : 0;
+}
@@ -0,0 +1,23 @@
+#ifndef   __TINYZZZ_BENCH_H__
+#define   __TINYZZZ_BENCH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// Function  : load a file once, and round-trip it in memory through the codecs. For each codec, the compression and decompression
+//             are repeated for at least min_time seconds, and the ratio and the speed of the fastest run are printed to stdout.
+//             The decompressed data is compared with the original data.
+// Parameter :
+//     const char *fname      : the file to benchmark
+//     const char *fname_zst  : a .zst file compressed from fname (e.g., by the official zstd), for benchmarking ZSTD decompression. NULL to skip ZSTD.
+//     const char *codec_name : only benchmark this codec ("gzip", "lz4", "zstd", "lzma" or "lpaq8"), NULL to benchmark all the codecs.
+//     uint16_t level_mask    : bit i is 1 means benchmarking level i (i=0~9), for the codecs that have levels (LPAQ8)
+//     double min_time        : the minimum time (in seconds) to repeat each compression and decompression
+// Return    :
+//     0 : success
+//     1 : failed, or the round-trip of some codec failed
+int runBenchmark (const char *fname, const char *fname_zst, const char *codec_name, uint16_t level_mask, double min_time);
+
+
+#endif // __TINYZZZ_BENCH_H__
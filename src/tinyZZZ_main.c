@@ -1,9 +1,11 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <time.h>
+#include <stdint.h>
 
 #include "FileIO.h"
+#include "Thread.h"
+#include "SysUtil.h"
 
 #include "gzipC.h"
 #include "lz4D.h"
@@ -13,6 +15,11 @@
 #include "lzmaC.h"
 #include "lpaq8CD.h"
 #include "zipC.h"
+#include "xzC.h"
+#include "xzD.h"
+
+#include "tinyZZZ_bench.h"
+#include "tinyZZZ_serve.h"
 
 
 
@@ -29,6 +36,7 @@ const char *USAGE =
     "|   - ZSTD  decompress                                                                      |\n"
     "|   - LZMA  decompress and compress                                                         |\n"
     "|   - LPAQ8 decompress and compress                                                         |\n"
+    "|   - XZ    decompress and compress (LZMA2, multithreaded)                                  |\n"
     "|   - compress a file to ZIP container file using deflate (GZIP) method or LZMA method      |\n"
     "|-------------------------------------------------------------------------------------------|\n"
     "|  Usage :                                                                                  |\n"
@@ -42,215 +50,1521 @@ const char *USAGE =
     "|   - compress a file to LZMA file :  tinyZZZ -c --lzma <input_file> <output_file(.lzma)>   |\n"
     "|   - decompress a LPAQ8 file      :  tinyZZZ -d --lpaq8 <input_file(.lpaq8)> <output_file> |\n"
     "|   - compress a file to LPAQ8 file:  tinyZZZ -c --lpaq8 <input_file> <output_file(.lpaq8)> |\n"
+    "|   - decompress a XZ file         :  tinyZZZ -d --xz   <input_file(.xz)> <output_file>     |\n"
+    "|   - compress a file to XZ file   :  tinyZZZ -c --xz   <input_file> <output_file(.xz)>     |\n"
     "|-------------------------------------------------------------------------------------------|\n"
     "|  Usage (compress to ZIP container) :                                                      |\n"
     "|   - use Deflate method : tinyZZZ -c --gzip --zip <input_file> <output_file(.zip)>         |\n"
     "|   - use LZMA method    : tinyZZZ -c --lzma --zip <input_file> <output_file(.zip)>         |\n"
+    "|-------------------------------------------------------------------------------------------|\n"
+    "|  Usage (pipe) : use \"-\" as <input_file> for stdin, or as <output_file> for stdout         |\n"
+    "|   - e.g. :  tar c dir | tinyZZZ -c --gzip - - | ssh host \"cat > dir.tar.gz\"               |\n"
+    "|-------------------------------------------------------------------------------------------|\n"
+    "|  Usage (LZMA compress options) :                                                          |\n"
+    "|   - add -0 ~ -9 to set the compress level, from the fastest to the smallest. (default: -6)|\n"
+    "|     The options below override the match finder, parser or dictionary size of the level.  |\n"
+    "|   - add --mf bt4 to use the binary-tree match finder, which is slower but finds longer and|\n"
+    "|     farther matches. Its memory is 8 x min(dictionary size, input length).                |\n"
+    "|     add --mf sa to index the input by a suffix array, which is slower, but finds the      |\n"
+    "|     nearest match of each length, for very repetitive data. Its memory is 10 x min(2 x    |\n"
+    "|     dictionary size, input length). (default: hc)                                         |\n"
+    "|   - add --dict <size> (4k~1g, e.g. 64m) to set the dictionary size, i.e., the max distance|\n"
+    "|     of the matches. A decoder needs min(dictionary, input length) of memory. (default: 1g)|\n"
+    "|   - add --stream to compress through a sliding window of 1.25 x the dictionary, so the    |\n"
+    "|     memory is bounded for any input. The header has no length, and the data has an end    |\n"
+    "|     marker. (default: load the whole input, and write its length to the header)           |\n"
+    "|   - add -d --lzma --stream to decompress through a ring of the dictionary size (or of the |\n"
+    "|     data length, if the header records a shorter one), so a large file can be piped, e.g. |\n"
+    "|     tinyZZZ -d --lzma --stream big.lzma - | grep error                                    |\n"
+    "|   - add --lclppb <lc>,<lp>,<pb> to set the literal context bits (0~8), literal position   |\n"
+    "|     bits (0~4) and position bits (0~4), e.g. 0,2,2 for 4-byte aligned data. XZ needs      |\n"
+    "|     lc+lp<=4. --lclppb auto compresses samples of each file with a few settings (using the|\n"
+    "|     -T threads) and picks the smallest. It cannot work with --stream.  (default: 4,0,3)   |\n"
+    "|   - add --parser greedy|lazy|optimal to choose the packets by a fixed score of the length |\n"
+    "|     and distance (greedy: at once, lazy: with 2 bytes look ahead), or by their bit costs  |\n"
+    "|     (optimal), which is about 3x slower than lazy but 5~15%% smaller. (default: lazy)      |\n"
+    "|   - add -T <N> (N>=2, 0 : all CPU cores) to run the match finder in a second thread, for  |\n"
+    "|     --parser optimal (-7 ~ -9) or --mf bt4. The output is the same. (default: 1)          |\n"
+    "|   - add --decode-bias <N> (0~8) to make --parser optimal charge each packet by its        |\n"
+    "|     decode work, so it takes fewer literals and longer matches. Measured at -7 : a text   |\n"
+    "|     log decodes 6~12%% faster and is 0.6~2%% larger (N=2~8). A numeric log decodes 4~5%%     |\n"
+    "|     faster and is <=2%% larger at N<=4, 12~17%% faster but 12~14%% larger at N=6~8. Source   |\n"
+    "|     code is <0.5%% larger with no gain. Structured binary may grow a lot. Incompressible   |\n"
+    "|     data doesn't grow. With --stats-json, the .lzma output is also decompressed once in   |\n"
+    "|     memory to time it (a single cold run, skipped if it needs more memory than -M).       |\n"
+    "|     (default: 0)                                                                          |\n"
+    "|-------------------------------------------------------------------------------------------|\n"
+    "|  Usage (XZ options) : the LZMA compress options above also apply to each block            |\n"
+    "|   - add -T <N> to (de)compress the blocks with <N> threads, -T 0 : all CPU cores. (def: 1)|\n"
+    "|   - add --block <size> to set the block size. The blocks are compressed independently, so |\n"
+    "|     smaller blocks give more parallelism but a worse ratio. (default: 3 x dict, 1m~24m)   |\n"
+    "|   - add --check crc32|crc64 to set the integrity check of each block. (default: crc64)    |\n"
+    "|   - add --range <offset>:<length> (e.g. 64m:4k) to decompress only a part of the data,    |\n"
+    "|     which only decompresses the blocks that cover it (found by the index of the .xz file) |\n"
+    "|-------------------------------------------------------------------------------------------|\n"
+    "|  Usage (statistics) : add --stats-json <file> to save the time of each phase, peak memory |\n"
+    "|    and codec parameters of a single file as JSON. <file> can be \"-\" for stdout. It can't  |\n"
+    "|    be used in batch mode (-j or --files-from), which processes many files                 |\n"
+    "|-------------------------------------------------------------------------------------------|\n"
+    "|  Usage (memory budget) : add -M <size> (e.g. 512k, 64m, 1g) to limit the memory of codecs.|\n"
+    "|    LZMA uses a smaller hash table and LPAQ8 a lower level to fit it, otherwise it fails.  |\n"
+    "|    In batch mode the budget is shared by the threads. Input/output files are not counted, |\n"
+    "|    but the output of LZMA decompress to stdout (-) is held in memory, so it is counted.   |\n"
+    "|-------------------------------------------------------------------------------------------|\n"
+    "|  Usage (batch mode, many files in one process using <N> threads) :                        |\n"
+    "|   - tinyZZZ -c --lz4  -j <N> <input_file1> <input_file2> ...                              |\n"
+    "|   - tinyZZZ -d --lzma -j <N> --files-from <list_file>                                     |\n"
+    "|     each line of <list_file> is <input_file> or <input_file><TAB><output_file>            |\n"
+    "|     if the output file is not given, it is named by adding (compress) or removing         |\n"
+    "|     (decompress) the suffix (.gz .lz4 .zst .lzma .lpaq8 .xz .zip). -j 0 : all CPU cores   |\n"
+    "|     an existing output file is not overwritten (that file fails) unless -f is given       |\n"
+    "|-------------------------------------------------------------------------------------------|\n"
+    "|  Usage (benchmark, round-trip a file in memory through all the codecs) :                  |\n"
+    "|   - tinyZZZ -b [<levels>] [--time <sec>] <input_file> [<input_file.zst>]                  |\n"
+    "|     <levels> are the LPAQ8 and LZMA levels, e.g. 3 , 1-5 or 0,3,9 . --time : seconds/test |\n"
+    "|     <input_file.zst> (compressed from <input_file>) is needed to benchmark ZSTD decompress|\n"
+    "|     add --gzip, --lz4, --zstd, --lzma or --lpaq8 to benchmark only one codec              |\n"
+    "|-------------------------------------------------------------------------------------------|\n"
+    "|  Usage (server, POSIX only. Serve compress/decompress requests on a Unix domain socket) : |\n"
+    "|   - tinyZZZ --serve <socket_file> [-j <N>] [-M <size>]                                    |\n"
+    "|     each of the <N> threads keeps its codec states warm, and serves a connection at a time|\n"
+    "|   - tinyZZZ --client <socket_file> -c --lz4 <input_file> <output_file>                    |\n"
+    "|     a simple client which sends a file as one request, and saves the response             |\n"
     "|-------------------------------------------------------------------------------------------|\n";
 
 
 
 
-/// remove a filename's path prefix. e.g., if fname is "a/b/c.txt", we will get "c.txt"
-static void removeDirectoryPathFromFileName (char *fname) {
-    char *p = fname;
-    char *q = fname;
-    for (; *p; p++) {
-        *q = *p;
-        if (*p == '/' || *p == '\\')      // '/' is file sep of linux, '\' is file sep of windows
-            q = fname;                    // back to base
-        else
-            q ++;
-    };
-    *q = '\0';
+
+
+
+/// get a filename without its path prefix. e.g., if fname is "a/b/c.txt", we will get "c.txt"
+static const char *getFileNameWithoutDirectory (const char *fname) {
+    const char *base = fname;
+    for (; *fname; fname++) {
+        if (*fname == '/' || *fname == '\\')  // '/' is file sep of linux, '\' is file sep of windows
+            base = fname + 1;
+    }
+    return base;
+}
+
+
+
+/// parse a size such as "65536", "512k", "64m" or "2g" (binary units, case insensitive).
+/// return 0 on success, or -1 if the string is not a size, or the size doesn't fit in size_t.
+static int parseSize (const char *str, size_t *p_size) {
+    size_t size = 0;
+    int    shift = 0;
+    if (!('0' <= *str && *str <= '9'))
+        return -1;
+    for (; '0' <= *str && *str <= '9'; str++) {
+        if (size > (SIZE_MAX - (*str - '0')) / 10)
+            return -1;
+        size = size * 10 + (*str - '0');
+    }
+    switch (*str) {
+        case 'k' : case 'K' : shift = 10;  str++;  break;
+        case 'm' : case 'M' : shift = 20;  str++;  break;
+        case 'g' : case 'G' : shift = 30;  str++;  break;
+    }
+    if (size > (SIZE_MAX >> shift))
+        return -1;
+    *p_size = size << shift;
+    return (*str == '\0' && size > 0) ? 0 : -1;
+}
+
+
+/// parse a range "<offset>:<length>" such as "64m:4k", the offset can be 0 but the length can not.
+/// return 0 on success, or -1 if the string is not a range.
+static int parseRange (const char *str, size_t *p_offset, size_t *p_len) {
+    char   buf [32];
+    size_t i;
+    for (i=0; str[i] && str[i] != ':' && i < sizeof(buf)-1; i++)
+        buf[i] = str[i];
+    buf[i] = '\0';
+    if (str[i] != ':')
+        return -1;
+    if (strcmp(buf, "0") == 0)
+        *p_offset = 0;
+    else if (parseSize(buf, p_offset))
+        return -1;
+    return parseSize(str+i+1, p_len);
+}
+
+
+
+/// parse a level list such as "3", "1-5", "0,3,9" or "1-3,9" to a bit mask, in which bit i means level i.
+/// return 0 on success, or -1 if the string is not a level list.
+static int parseLevelList (const char *str, uint16_t *p_mask) {
+    *p_mask = 0;
+    for (;;) {
+        int lo, hi;
+        if (!('0' <= *str && *str <= '9'))
+            return -1;
+        lo = hi = *(str++) - '0';
+        if (*str == '-') {
+            str ++;
+            if (!('0' <= *str && *str <= '9'))
+                return -1;
+            hi = *(str++) - '0';
+        }
+        for (; lo<=hi; lo++)
+            *p_mask |= (1 << lo);
+        if (*str == '\0')
+            return (*p_mask) ? 0 : -1;
+        if (*str != ',')
+            return -1;
+        str ++;
+    }
 }
 
 
 
 #define  IS_64b_SYSTEM  (sizeof(size_t) == 8)
 
+#define  MAX_DST_LEN         (IS_64b_SYSTEM ? 0x80000000 : 0x20000000)
 
+#define  R_OUTPUT_OVERFLOW   3     // the return code of LZMA, LPAQ8 and ZIP codecs when the output buffer is too small
 
-int main (int argc, char **argv) {
 
-    enum     {ACTION_NONE, COMPRESS, DECOMPRESS}         type_action = ACTION_NONE;
-    enum     {FORMAT_NONE, GZIP, LZ4, ZSTD, LZMA, LPAQ8} type_format = FORMAT_NONE;
-    enum     {NATIVE, ZIP}                            type_container = NATIVE;
 
-    char    *fname_src=NULL, *fname_dst=NULL;
-    uint8_t *p_src         , *p_dst;
-    size_t   src_len       ,  dst_len , MAX_DST_LEN = IS_64b_SYSTEM ? 0x80000000 : 0x20000000;
-    int      ret_code = 0;
-    uint8_t  compress_level = 2;
+static FILE *p_log = NULL;                 // the logs go to stdout, or to stderr when stdout carries the output data (output file name is "-")
 
 
-    // parse command line --------------------------------------------------------------------------------------------------
-    for (argc--; argc>=1; argc--) {                    // for all argv (inversely)
-        char *arg = argv[argc];
-        if (arg[0] == '-') {
-            if        (strcmp(arg, "-c"    ) == 0) {
-                type_action = COMPRESS;
-            } else if (strcmp(arg, "-d"    ) == 0) {
-                type_action = DECOMPRESS;
-            } else if (strcmp(arg, "--gzip") == 0) {
-                type_format = GZIP;
-            } else if (strcmp(arg, "--lz4" ) == 0) {
-                type_format = LZ4;
-            } else if (strcmp(arg, "--zstd") == 0) {
-                type_format = ZSTD;
-            } else if (strcmp(arg, "--lzma") == 0) {
-                type_format = LZMA;
-            } else if (strcmp(arg, "--lpaq8") == 0) {
-                type_format = LPAQ8;
-            } else if (strcmp(arg, "--zip" ) == 0) {
-                type_container = ZIP;
-            } else if ('0' <= arg[1] && arg[1] <= '9') {
-                compress_level = arg[1] - '0';
-            } else {
-                printf(USAGE);  // unknown switch
-                return -1;
-            }
-        } else if (fname_dst == NULL) {
-            fname_dst = arg;    // get destination file name
-        } else if (fname_src == NULL) {
-            fname_src = arg;    // get source file name
+
+typedef enum {ACTION_NONE, COMPRESS, DECOMPRESS}         Action_t;
+typedef enum {FORMAT_NONE, GZIP, LZ4, ZSTD, LZMA, LPAQ8, XZ} Format_t;
+typedef enum {NATIVE, ZIP}                               Container_t;
+
+typedef struct {
+    Action_t    type_action;
+    Format_t    type_format;
+    Container_t type_container;
+    uint8_t     compress_level;
+    uint8_t     verbose;                  // 1 : print the details of a single file.   0 : batch mode, only print errors
+    size_t      mem_budget;               // the memory budget of the codec of a worker (bytes), 0 means unlimited. The mapped input and output files are not counted
+    uint8_t     lzma_level;               // the level of LZMA/XZ compress, which lzma_params are derived from
+    LzmaCParams_t lzma_params;            // fitted to mem_budget
+    int         xz_threads;               // the threads of XZ compress, which are inside a worker
+    size_t      xz_block_len;             // 0 : the default of xzC
+    uint8_t     xz_check;
+    size_t      xz_range_offset;          // XZ decompress only the range [offset, offset+len) of the data
+    size_t      xz_range_len;             // 0 : the whole data
+    uint8_t     lzma_stream;              // 1 : LZMA compress (a sliding window of the dictionary) or decompress (a ring of the dictionary) in streaming mode
+    uint8_t     lzma_auto_lclppb;         // 1 : choose lc, lp and pb of LZMA/XZ compress for each file by trial
+    uint8_t     lzma_time_decode;         // 1 : after LZMA compress, decompress the output in memory to time it (for the statistics)
+    uint8_t     force;                    // 1 : overwrite the existing output files in batch mode
+} Options_t;
+
+
+
+/// the statistics of processing a file in single file mode. In batch mode they are not collected,
+/// since the CPU time of the process can't be split between the concurrent files.
+typedef enum {PHASE_LOAD, PHASE_CODEC, PHASE_SAVE, N_PHASES} Phase_t;
+
+typedef struct {
+    double   wall [N_PHASES];             // wall-clock time of each phase (seconds). When streaming, the phases interleave and each is the sum of its chunks
+    double   cpu  [N_PHASES];             // CPU time of the process in each phase (seconds)
+    double   wall_start, cpu_start;       // start time of the current phase
+    int      level;                       // codec parameters, -1 if not applicable
+    int      lc, lp, pb;
+    int64_t  dict_len;
+    int64_t  mem_usage;
+    int      decode_bias;                 // the decode_bias of LZMA/XZ compress, -1 if not applicable
+    double   decode_wall;                 // the wall-clock time to decompress the output of LZMA compress (seconds), -1 if not measured
+} RunStats_t;
+
+
+/// record the parameters of LZMA/XZ compress, and the memory they need
+static void statsLzmaParams (RunStats_t *p_stats, const Options_t *p_opt, const LzmaCParams_t *p_params) {
+    p_stats->level       = p_opt->lzma_level;
+    p_stats->lc          = p_params->lc;
+    p_stats->lp          = p_params->lp;
+    p_stats->pb          = p_params->pb;
+    p_stats->dict_len    = p_params->dict_len;
+    p_stats->decode_bias = (int)p_params->decode_bias;
+    if (p_opt->type_format == XZ) {
+        p_stats->mem_usage = xzCMemUsage(p_params, p_opt->xz_block_len, p_opt->xz_threads);
+    } else if (p_opt->lzma_stream) {
+        p_stats->mem_usage = lzmaCStreamMemUsage(p_params);
+    } else {
+        p_stats->mem_usage = lzmaCMemUsage(p_params);
+    }
+}
+
+
+static void statsStart (RunStats_t *p_stats) {
+    if (p_stats) {
+        p_stats->wall_start = getWallTime();
+        p_stats->cpu_start  = getCpuTime();
+    }
+}
+
+
+/// add the time since the last statsStart() or statsLap() to a phase, and start timing the next phase
+static void statsLap (RunStats_t *p_stats, Phase_t phase) {
+    if (p_stats) {
+        double wall = getWallTime();
+        double cpu  = getCpuTime();
+        p_stats->wall[phase] += wall - p_stats->wall_start;
+        p_stats->cpu [phase] += cpu  - p_stats->cpu_start;
+        p_stats->wall_start = wall;
+        p_stats->cpu_start  = cpu;
+    }
+}
+
+
+
+#define  STREAM_CHUNK_SIZE   (1<<20)
+
+typedef int (*StreamFeedFunc_t) (void *p_st, uint8_t *p_src, size_t *p_src_len, uint8_t *p_dst, size_t *p_dst_len, uint8_t finish);
+
+static int gzipCFeed (void *p_st, uint8_t *p_src, size_t *p_src_len, uint8_t *p_dst, size_t *p_dst_len, uint8_t finish) {
+    return gzipCStreamFeed((GzipCStream_t*)p_st, p_src, p_src_len, p_dst, p_dst_len, finish);
+}
+
+static int lz4CFeed (void *p_st, uint8_t *p_src, size_t *p_src_len, uint8_t *p_dst, size_t *p_dst_len, uint8_t finish) {
+    return lz4CStreamFeed((LZ4CStream_t*)p_st, p_src, p_src_len, p_dst, p_dst_len, finish);
+}
+
+static int lzmaCFeed (void *p_st, uint8_t *p_src, size_t *p_src_len, uint8_t *p_dst, size_t *p_dst_len, uint8_t finish) {
+    return lzmaCStreamFeed((LzmaCStream_t*)p_st, p_src, p_src_len, p_dst, p_dst_len, finish);
+}
+
+static int lz4DFeed (void *p_st, uint8_t *p_src, size_t *p_src_len, uint8_t *p_dst, size_t *p_dst_len, uint8_t finish) {
+    return lz4DStreamFeed((LZ4DStream_t*)p_st, p_src, p_src_len, p_dst, p_dst_len, finish);
+}
+
+static int lzmaDFeed (void *p_st, uint8_t *p_src, size_t *p_src_len, uint8_t *p_dst, size_t *p_dst_len, uint8_t finish) {
+    return lzmaDStreamFeed((LzmaDStream_t*)p_st, p_src, p_src_len, p_dst, p_dst_len, finish);
+}
+
+
+static int isStreamable (const Options_t *p_opt) {
+    return p_opt->type_container == NATIVE && ((p_opt->type_format == GZIP && p_opt->type_action == COMPRESS) || p_opt->type_format == LZ4 ||
+                                               (p_opt->type_format == LZMA && p_opt->lzma_stream));
+}
+
+
+
+/// the resources owned by a worker, which are created once and reused for all the files it processes,
+/// so that a batch of many small files doesn't pay the allocation of codec state for every file.
+typedef struct {
+    void            *p_st;                // streaming codec state (GZIP compress, LZ4 and LZMA compress/decompress), reset before each file
+    StreamFeedFunc_t feed;
+    uint8_t         *p_chunk_src;         // chunk buffers of streaming
+    uint8_t         *p_chunk_dst;
+} Worker_t;
+
+
+static void workerFree (const Options_t *p_opt, Worker_t *p_worker) {
+    if (p_worker->p_st) {
+        if        (p_opt->type_format == GZIP) {
+            gzipCStreamFree((GzipCStream_t*)p_worker->p_st);
+        } else if (p_opt->type_format == LZMA && p_opt->type_action == COMPRESS) {
+            lzmaCStreamFree((LzmaCStream_t*)p_worker->p_st);
+        } else if (p_opt->type_format == LZMA) {
+            lzmaDStreamFree((LzmaDStream_t*)p_worker->p_st);
+        } else if (p_opt->type_action == COMPRESS) {
+            lz4CStreamFree((LZ4CStream_t*)p_worker->p_st);
+        } else {
+            lz4DStreamFree((LZ4DStream_t*)p_worker->p_st);
+        }
+    }
+    free(p_worker->p_chunk_src);
+    free(p_worker->p_chunk_dst);
+    p_worker->p_st        = NULL;
+    p_worker->p_chunk_src = NULL;
+    p_worker->p_chunk_dst = NULL;
+}
+
+
+static int workerInit (const Options_t *p_opt, Worker_t *p_worker) {
+    p_worker->p_st        = NULL;
+    p_worker->feed        = NULL;
+    p_worker->p_chunk_src = NULL;
+    p_worker->p_chunk_dst = NULL;
+    
+    if (isStreamable(p_opt)) {
+        if        (p_opt->type_format == GZIP) {
+            p_worker->p_st = gzipCStreamNew();
+            p_worker->feed = gzipCFeed;
+        } else if (p_opt->type_format == LZMA && p_opt->type_action == COMPRESS) {
+            p_worker->p_st = lzmaCStreamNew(&p_opt->lzma_params);
+            p_worker->feed = lzmaCFeed;
+        } else if (p_opt->type_format == LZMA) {
+            p_worker->p_st = lzmaDStreamNew(p_opt->mem_budget);           // the ring is allocated by the header of each file, and fails if it exceeds the budget
+            p_worker->feed = lzmaDFeed;
+        } else if (p_opt->type_action == COMPRESS) {
+            p_worker->p_st = lz4CStreamNew();
+            p_worker->feed = lz4CFeed;
         } else {
-            printf(USAGE);      // too many file name
+            p_worker->p_st = lz4DStreamNew();
+            p_worker->feed = lz4DFeed;
+        }
+        p_worker->p_chunk_src = (uint8_t*)malloc(STREAM_CHUNK_SIZE);
+        p_worker->p_chunk_dst = (uint8_t*)malloc(STREAM_CHUNK_SIZE);
+        
+        if (p_worker->p_st == NULL || p_worker->p_chunk_src == NULL || p_worker->p_chunk_dst == NULL) {
+            fprintf(p_log, "*** error : allocate stream failed\n");
+            workerFree(p_opt, p_worker);
             return -1;
         }
     }
+    
+    return 0;
+}
+
+
+static void workerResetStream (const Options_t *p_opt, Worker_t *p_worker) {
+    if        (p_opt->type_format == GZIP) {
+        gzipCStreamReset((GzipCStream_t*)p_worker->p_st);
+    } else if (p_opt->type_format == LZMA && p_opt->type_action == COMPRESS) {
+        lzmaCStreamReset((LzmaCStream_t*)p_worker->p_st);
+    } else if (p_opt->type_format == LZMA) {
+        lzmaDStreamReset((LzmaDStream_t*)p_worker->p_st);
+    } else if (p_opt->type_action == COMPRESS) {
+        lz4CStreamReset((LZ4CStream_t*)p_worker->p_st);
+    } else {
+        lz4DStreamReset((LZ4DStream_t*)p_worker->p_st);
+    }
+}
+
+
 
-    if (fname_dst == NULL || fname_src == NULL || type_action == ACTION_NONE || type_format == FORMAT_NONE) {
-        printf(USAGE);      // insufficient file name
+/// read the source file chunk by chunk, feed the chunks to a streaming codec, and write the output chunk by chunk.
+/// so that the memory usage is bounded no matter how large the file is.
+static int streamFile (const Options_t *p_opt, const char *fname_src, const char *fname_dst, Worker_t *p_worker, size_t *p_src_len, size_t *p_dst_len, RunStats_t *p_stats) {
+    FileStream_t *p_fs_src, *p_fs_dst;
+    uint8_t *p_src = p_worker->p_chunk_src;
+    uint8_t *p_dst = p_worker->p_chunk_dst;
+    size_t   src_pos = 0, src_len = STREAM_CHUNK_SIZE;
+    size_t   mem_need;
+    uint8_t  finish  = 0;
+    int      ret_code = 0;
+    
+    *p_src_len = 0;
+    *p_dst_len = 0;
+    
+    p_fs_src = openFileStream(fname_src, 0);
+    if (p_fs_src == NULL) {
+        fprintf(p_log, "*** error : open file %s failed\n", fname_src);
         return -1;
     }
     
-    printf("input  file name = %s\n", fname_src);
-    printf("output file name = %s\n", fname_dst);
-    
+    if (readFromFileStream(p_fs_src, p_src, &src_len)) {                      // the first chunk is read before creating the output file, to check the header
+        fprintf(p_log, "*** error : read file %s failed\n", fname_src);
+        closeFileStream(p_fs_src);
+        return -1;
+    }
+    finish = (src_len == 0);
+    *p_src_len += src_len;
+    statsLap(p_stats, PHASE_LOAD);
     
-    // read source file --------------------------------------------------------------------------------------------------
-    p_src = loadFromFile(&src_len, fname_src);
-    if (p_src == NULL) {
-        printf("*** error : load file %s failed\n", fname_src);
+    if (p_opt->type_format == LZMA && p_opt->type_action == DECOMPRESS && p_opt->mem_budget > 0 &&
+        lzmaDStreamMemNeed(p_src, src_len, &mem_need) == 0 && mem_need > p_opt->mem_budget) {
+        fprintf(p_log, "*** error : the dictionary in the header of %s needs %lu bytes of memory to decompress, which exceeds the memory budget (%lu bytes)\n", fname_src, mem_need, p_opt->mem_budget);
+        closeFileStream(p_fs_src);
         return -1;
     }
-    printf("input  length    = %lu\n", src_len);
     
+    p_fs_dst = openFileStream(fname_dst, 1);
+    if (p_fs_dst == NULL) {
+        fprintf(p_log, "*** error : open file %s failed\n", fname_dst);
+        closeFileStream(p_fs_src);
+        return -1;
+    }
+    statsLap(p_stats, PHASE_SAVE);
     
-    // estimate destination size, and allocate destination buffer --------------------------------------------------------
-    switch (type_action) {
-        case COMPRESS :
-            dst_len = src_len + (src_len>>3) + 1048576;  // estimate maximum compressed size based on original size
+    while (ret_code == 0) {
+        size_t feed_len, out_len = STREAM_CHUNK_SIZE;
+        
+        if (src_pos == src_len && !finish) {                                   // current chunk is consumed, read next chunk
+            src_pos = 0;
+            src_len = STREAM_CHUNK_SIZE;
+            if (readFromFileStream(p_fs_src, p_src, &src_len)) {
+                fprintf(p_log, "*** error : read file %s failed\n", fname_src);
+                ret_code = -1;
+                break;
+            }
+            finish = (src_len == 0);
+            *p_src_len += src_len;
+            statsLap(p_stats, PHASE_LOAD);
+        }
+        
+        feed_len = src_len - src_pos;
+        ret_code = p_worker->feed(p_worker->p_st, p_src+src_pos, &feed_len, p_dst, &out_len, finish);
+        if (ret_code) {
+            fprintf(p_log, "*** error : failed (return_code = %d)\n", ret_code);
             break;
-        case DECOMPRESS :
-            dst_len = MAX_DST_LEN;
+        }
+        src_pos += feed_len;
+        statsLap(p_stats, PHASE_CODEC);
+        
+        if (writeToFileStream(p_fs_dst, p_dst, out_len)) {
+            fprintf(p_log, "*** error : write file %s failed\n", fname_dst);
+            ret_code = -1;
             break;
-        case ACTION_NONE :
-            printf(USAGE);
-            return -1;
+        }
+        *p_dst_len += out_len;
+        statsLap(p_stats, PHASE_SAVE);
+        
+        if (finish && out_len == 0)                                            // no more input, and no more output
+            break;
+    }
+    
+    closeFileStream(p_fs_src);
+    
+    if (closeFileStream(p_fs_dst) && ret_code == 0) {
+        fprintf(p_log, "*** error : save file %s failed\n", fname_dst);
+        ret_code = -1;
+    }
+    statsLap(p_stats, PHASE_SAVE);
+    
+    if (ret_code && strcmp(fname_dst, "-") != 0) {                             // don't leave a partial (or truncated) output file
+        remove(fname_dst);
     }
+    
+    return ret_code;
+}
+
 
-    if (dst_len > MAX_DST_LEN) {
-        dst_len = MAX_DST_LEN;
+
+/// compress or decompress a file. This is used by both the single file mode and the batch mode (called by many workers concurrently)
+/// p_stats collects the time of each phase and the codec parameters, it can be NULL.
+static int processFile (const Options_t *p_opt, Worker_t *p_worker, const char *fname_src, const char *fname_dst, size_t *p_src_len, size_t *p_dst_len, RunStats_t *p_stats) {
+    const char *fname_in_zip = getFileNameWithoutDirectory(fname_src);
+    FileMap_t map_src      ,  map_dst;
+    uint8_t *p_src         , *p_dst;
+    size_t   src_len       ,  dst_len;
+    size_t   mem_usage = 0;
+    int      ret_code = 0;
+    uint8_t  growable = 0;
+    uint8_t  compress_level = p_opt->compress_level;
+    size_t   mem_need = 0;
+    LzmaCParams_t lzma_params = p_opt->lzma_params;
+    
+    
+    if (isSameFile(fname_src, fname_dst)) {                   // the output would be truncated while the input is read from it
+        fprintf(p_log, "*** error : the input and output are the same file %s\n", fname_src);
+        return -1;
+    }
+    
+    
+    // streaming compress / decompress (for the codecs that support streaming) ------------------------------------------------
+    statsStart(p_stats);
+    
+    if (p_stats && (p_opt->type_format == LZMA || p_opt->type_format == XZ) && p_opt->type_action == COMPRESS) {
+        statsLzmaParams(p_stats, p_opt, &lzma_params);
+    }
+    
+    if (isStreamable(p_opt)) {
+        workerResetStream(p_opt, p_worker);
+        return streamFile(p_opt, fname_src, fname_dst, p_worker, p_src_len, p_dst_len, p_stats);
     }
     
-    p_dst = (uint8_t*)malloc(dst_len);
     
-    if (p_dst == NULL) {
-        printf("*** error : allocate destination buffer failed\n");
+    // map source file (read-only) ----------------------------------------------------------------------------------------
+    if (openInputFileMap(&map_src, fname_src)) {
+        fprintf(p_log, "*** error : load file %s failed\n", fname_src);
         return -1;
     }
+    p_src   = map_src.p_buf;
+    src_len = map_src.len;
+    if (p_opt->verbose) {
+        fprintf(p_log, "input  length    = %lu\n", src_len);
+    }
     
     
-    // do compress / decompress --------------------------------------------------------------------------------------------
-    switch (type_format) {
-        case GZIP : {
-            if (type_action == DECOMPRESS) {
-                printf("*** error : GZIP decompress is not yet supported\n");
-                return -1;
-            } else if (type_container != ZIP) {
-                ret_code = gzipC(p_src, src_len, p_dst, &dst_len);
-            } else {
-                removeDirectoryPathFromFileName(fname_src);
-                ret_code = zipCdeflate(p_src, src_len, p_dst, &dst_len, fname_src);
+    // get destination size (exact or upper bound) from the source header or the compress bound -------------------------
+    if (p_opt->type_action == COMPRESS) {
+        switch (p_opt->type_format) {
+            case GZIP  : dst_len = (p_opt->type_container == ZIP) ? zipCdeflateBound(src_len, fname_in_zip) : gzipCBound(src_len);  break;
+            case LZMA  : dst_len = (p_opt->type_container == ZIP) ? zipClzmaBound   (src_len, fname_in_zip) : lzmaCBound(src_len);  growable = 1;  break;
+            case LZ4   : dst_len = lz4CBound(src_len);    break;
+            case LPAQ8 : dst_len = lpaq8CBound(src_len);  growable = 1;  break;
+            case XZ    : dst_len = xzCBound(src_len, &p_opt->lzma_params, p_opt->xz_block_len);  break;
+            default    : dst_len = 0;                     break;
+        }
+    } else {
+        switch (p_opt->type_format) {
+            case LZMA  : ret_code = lzmaDGetSize (p_src, src_len, &dst_len);  break;
+            case LZ4   : ret_code = lz4DGetSize  (p_src, src_len, &dst_len);  break;
+            case LPAQ8 : ret_code = lpaq8DGetSize(p_src, src_len, &dst_len);  break;
+            case ZSTD  :            zstdDGetSize (p_src, src_len, &dst_len);  break;
+            case XZ    : ret_code = xzDGetSize   (p_src, src_len, &dst_len);  break;
+            default    : dst_len = 0;                                         break;
+        }
+        if (ret_code == 0 && p_opt->xz_range_len > 0) {           // the length of the range, clipped to the end of the data
+            dst_len = (p_opt->xz_range_offset < dst_len) ? (dst_len - p_opt->xz_range_offset) : 0;
+            if (dst_len > p_opt->xz_range_len)
+                dst_len = p_opt->xz_range_len;
+        }
+        if (ret_code == 0 && p_opt->mem_budget > 0) {             // the decompressor's memory depends on the header, check it before allocating anything
+            switch (p_opt->type_format) {
+                case LZMA  : ret_code = lzmaDGetMemUsage (p_src, src_len, &mem_need);  break;
+                case LPAQ8 : ret_code = lpaq8DGetMemUsage(p_src, src_len, &mem_need);  break;
+                default    : break;                                                    // fixed, already checked by fitMemoryBudget()
             }
-            break;
         }
-        case LZMA : {
-            if (type_action == DECOMPRESS) {
-                ret_code = lzmaD(p_src, src_len, p_dst, &dst_len);
-            } else if (type_container != ZIP) {
-                ret_code = lzmaC(p_src, src_len, p_dst, &dst_len);
-            } else {
-                removeDirectoryPathFromFileName(fname_src);
-                ret_code = zipClzma(p_src, src_len, p_dst, &dst_len, fname_src);
+        if (ret_code) {
+            fprintf(p_log, "*** error : parse header failed, %s is corrupted or not in this format (return_code = %d)\n", fname_src, ret_code);
+            closeFileMap(&map_src, 0);
+            return ret_code;
+        }
+        if (mem_need > p_opt->mem_budget && p_opt->mem_budget > 0) {
+            fprintf(p_log, "*** error : decompressing %s needs %lu bytes of memory, which exceeds the memory budget (%lu bytes)\n", fname_src, mem_need, p_opt->mem_budget);
+            closeFileMap(&map_src, 0);
+            return -1;
+        }
+        if (dst_len != (size_t)-1 && dst_len > p_opt->mem_budget && p_opt->mem_budget > 0 && strcmp(fname_dst, "-") == 0) {    // the output to stdout is buffered in memory, instead of mapped
+            fprintf(p_log, "*** error : the header of %s records %lu bytes of output, which is buffered in memory for stdout and exceeds the memory budget (%lu bytes)\n", fname_src, dst_len, p_opt->mem_budget);
+            closeFileMap(&map_src, 0);
+            return -1;
+        }
+        if (dst_len == (size_t)-1) {                              // size is not recorded in the header, start from a guess and grow the buffer on demand
+            dst_len  = (src_len > (MAX_DST_LEN>>3)) ? MAX_DST_LEN : ((src_len<<3) + 65536);
+            growable = 1;
+        }
+    }
+    
+    statsLap(p_stats, PHASE_LOAD);
+    
+    
+    // choose lc, lp and pb by compressing a sample with a few candidates (counted in the codec time) -------------------------
+    if (p_opt->lzma_auto_lclppb && p_opt->type_action == COMPRESS && (p_opt->type_format == LZMA || p_opt->type_format == XZ)) {
+        ret_code = lzmaCAutoLcLpPb(p_src, src_len, &lzma_params, p_opt->xz_threads);
+        if (ret_code) {
+            fprintf(p_log, "*** error : choose lc, lp and pb failed (return_code = %d)\n", ret_code);
+            closeFileMap(&map_src, 0);
+            return ret_code;
+        }
+        if (p_opt->verbose) {
+            fprintf(p_log, "lc, lp, pb       = %u, %u, %u  (auto)\n", lzma_params.lc, lzma_params.lp, lzma_params.pb);
+        }
+    }
+    
+    
+    // do compress / decompress, retry with a larger destination buffer if it overflows when the size is not exactly known --
+    for (;;) {
+        size_t dst_cap = dst_len;
+        
+        if (openOutputFileMap(&map_dst, fname_dst, dst_cap)) {     // the codecs write straight into the mapped destination file
+            fprintf(p_log, "*** error : allocate destination buffer failed\n");
+            closeFileMap(&map_src, 0);
+            return -1;
+        }
+        p_dst = map_dst.p_buf;
+        
+        switch (p_opt->type_format) {                             // note that the unsupported actions are already rejected by main()
+            case GZIP :
+                if (p_opt->type_container != ZIP) {
+                    ret_code = gzipC(p_src, src_len, p_dst, &dst_len);
+                } else {
+                    ret_code = zipCdeflate(p_src, src_len, p_dst, &dst_len, fname_in_zip);
+                }
+                break;
+            case LZMA :
+                if (p_opt->type_action == DECOMPRESS) {
+                    ret_code = lzmaD(p_src, src_len, p_dst, &dst_len);
+                } else if (p_opt->type_container != ZIP) {
+                    ret_code = lzmaC(p_src, src_len, p_dst, &dst_len, &lzma_params);
+                } else {
+                    ret_code = zipClzma(p_src, src_len, p_dst, &dst_len, fname_in_zip, &lzma_params);
+                }
+                break;
+            case LZ4 :
+                if (p_opt->type_action == DECOMPRESS) {
+                    ret_code = lz4D(p_src, src_len, p_dst, &dst_len);
+                } else {
+                    ret_code = lz4C(p_src, src_len, p_dst, &dst_len);
+                }
+                break;
+            case ZSTD :
+                zstdD(p_src, src_len, p_dst, &dst_len);
+                break;
+            case LPAQ8 :
+                if (p_opt->type_action == DECOMPRESS) {
+                    ret_code = lpaq8D(p_src, src_len, p_dst, &dst_len, &compress_level, &mem_usage);
+                } else {
+                    ret_code = lpaq8C(p_src, src_len, p_dst, &dst_len,  compress_level, &mem_usage);
+                }
+                break;
+            case XZ :
+                if (p_opt->type_action == COMPRESS) {
+                    ret_code = xzC(p_src, src_len, p_dst, &dst_len, &lzma_params, p_opt->xz_block_len, p_opt->xz_check, p_opt->xz_threads);
+                } else if (p_opt->xz_range_len > 0) {
+                    ret_code = xzDRange(p_src, src_len, p_opt->xz_range_offset, p_dst, &dst_len, p_opt->xz_threads);
+                } else {
+                    ret_code = xzD(p_src, src_len, p_dst, &dst_len, p_opt->xz_threads);
+                }
+                break;
+            case FORMAT_NONE :
+                ret_code = -1;
+                break;
+        }
+        
+        if (ret_code == R_OUTPUT_OVERFLOW && growable && dst_cap < MAX_DST_LEN) {
+            closeFileMap(&map_dst, 0);
+            dst_len = (dst_cap > (MAX_DST_LEN>>1)) ? MAX_DST_LEN : (dst_cap<<1);
+            continue;
+        }
+        
+        break;
+    }
+    
+    statsLap(p_stats, PHASE_CODEC);
+    
+    if (ret_code == 0 && p_stats && p_opt->lzma_time_decode) {                  // not counted in any phase. It's a single run, including the first touch of the buffer
+        size_t chk_len = src_len + 1;
+        if (p_opt->mem_budget > 0 && chk_len > p_opt->mem_budget) {             // the encoder is already freed, so the buffer of the decompressed data is counted against the budget
+            if (p_opt->verbose) {
+                fprintf(p_log, "decode time is not measured, since it needs %lu bytes of memory, which exceeds the memory budget\n", chk_len);
             }
-            break;
+        } else {
+            uint8_t *p_chk = (uint8_t*)malloc(chk_len);
+            double   wall  = getWallTime();
+            if (p_chk != NULL && lzmaD(p_dst, dst_len, p_chk, &chk_len) == 0 && chk_len == src_len) {
+                p_stats->decode_wall = getWallTime() - wall;
+            }
+            free(p_chk);
         }
-        case LZ4 : {
-            if (type_action == DECOMPRESS) {
-                ret_code = lz4D(p_src, src_len, p_dst, &dst_len);
-            } else if (type_container != ZIP) {
-                ret_code = lz4C(p_src, src_len, p_dst, &dst_len);
-            } else {
-                printf("*** error : LZ4 compress to ZIP is not supported\n");
-                return -1;
+        statsStart(p_stats);
+    }
+    
+    if (ret_code == 0 && p_stats) {
+        if ((p_opt->type_format == LZMA || p_opt->type_format == XZ) && p_opt->type_action == COMPRESS) {
+            statsLzmaParams(p_stats, p_opt, &lzma_params);                    // again, since lc, lp and pb may be chosen automatically
+        }
+        if (p_opt->type_format == LZMA && p_opt->type_container == NATIVE) {      // the codec parameters are in the .lzma header
+            uint8_t  lc, lp, pb;
+            uint32_t dict_len;
+            uint8_t *p_hdr = (p_opt->type_action == COMPRESS) ? p_dst   : p_src;
+            size_t   hdr_len = (p_opt->type_action == COMPRESS) ? dst_len : src_len;
+            if (lzmaDGetProps(p_hdr, hdr_len, &lc, &lp, &pb, &dict_len) == 0) {
+                p_stats->lc = lc;
+                p_stats->lp = lp;
+                p_stats->pb = pb;
+                p_stats->dict_len = dict_len;
             }
+        } else if (p_opt->type_format == LPAQ8) {
+            p_stats->level     = compress_level;
+            p_stats->mem_usage = mem_usage;
+        }
+    }
+    
+    closeFileMap(&map_src, 0);
+    
+    if (ret_code) {
+        fprintf(p_log, "*** error : failed (return_code = %d)\n", ret_code);
+        closeFileMap(&map_dst, 0);
+        if (strcmp(fname_dst, "-") != 0) {
+            remove(fname_dst);
+        }
+        return ret_code;
+    }
+    
+    if (p_opt->verbose && p_opt->type_format == LPAQ8) {
+        fprintf(p_log, "compress level   = %d\n", (int)compress_level);
+        fprintf(p_log, "memory usage     = %lu\n", mem_usage);
+    }
+    
+    if (closeFileMap(&map_dst, dst_len)) {
+        fprintf(p_log, "*** error : save file %s failed\n", fname_dst);
+        if (strcmp(fname_dst, "-") != 0) {
+            remove(fname_dst);
+        }
+        return -1;
+    }
+    
+    statsLap(p_stats, PHASE_SAVE);
+    
+    *p_src_len = src_len;
+    *p_dst_len = dst_len;
+    
+    return 0;
+}
+
+
+
+static int fileExists (const char *fname) {
+    FILE *fp = fopen(fname, "rb");
+    if (fp == NULL)
+        return 0;
+    fclose(fp);
+    return 1;
+}
+
+
+/// get the output file name in batch mode : add the suffix when compressing, remove the suffix (if it has) when decompressing.
+/// the returned string is malloc'd.
+static char *getOutputFileName (const Options_t *p_opt, const char *fname_src) {
+    static const char *SUFFIXES [] = {"", ".gz", ".lz4", ".zst", ".lzma", ".lpaq8", ".xz"};    // indexed by Format_t
+    const char *suffix  = (p_opt->type_container == ZIP) ? ".zip" : SUFFIXES[p_opt->type_format];
+    size_t      src_len = strlen(fname_src);
+    size_t      suf_len = strlen(suffix);
+    char       *fname_dst = (char*)malloc(src_len + suf_len + 5);
+    
+    if (fname_dst == NULL)
+        return NULL;
+    
+    strcpy(fname_dst, fname_src);
+    
+    if (p_opt->type_action == COMPRESS) {
+        strcat(fname_dst, suffix);
+    } else if (src_len > suf_len && strcmp(fname_src+src_len-suf_len, suffix) == 0) {
+        fname_dst[src_len-suf_len] = '\0';
+    } else {
+        strcat(fname_dst, ".out");
+    }
+    
+    return fname_dst;
+}
+
+
+
+typedef struct {
+    const char *fname_src;
+    char       *fname_dst;
+    uint8_t     fname_dst_malloced;
+} Job_t;
+
+
+typedef struct {
+    const Options_t *p_opt;
+    Job_t           *jobs;
+    size_t           n_jobs;
+    size_t           next_job;            // the index of the next job to be taken by a worker, protected by p_mutex
+    size_t           n_failed;            // protected by p_mutex
+    Mutex_t         *p_mutex;
+} Batch_t;
+
+
+/// a worker thread of batch mode : take the jobs one by one until all jobs are taken
+static void batchWorker (void *arg) {
+    Batch_t *p_batch = (Batch_t*)arg;
+    Worker_t worker;
+    int      init_ret_code = workerInit(p_batch->p_opt, &worker);
+    
+    for (;;) {
+        Job_t *p_job;
+        size_t src_len = 0, dst_len = 0;
+        int    ret_code = init_ret_code;
+        
+        mutexLock(p_batch->p_mutex);
+        p_job = (p_batch->next_job < p_batch->n_jobs) ? &p_batch->jobs[p_batch->next_job++] : NULL;
+        mutexUnlock(p_batch->p_mutex);
+        
+        if (p_job == NULL)
             break;
+        
+        if (ret_code == 0 && !p_batch->p_opt->force && fileExists(p_job->fname_dst)) {     // like gzip and xz, never overwrite an output file silently
+            fprintf(p_log, "*** error : %s already exists, add -f to overwrite it\n", p_job->fname_dst);
+            ret_code = -1;
         }
-        case ZSTD : {
-            if (type_action == DECOMPRESS) {
-                zstdD(p_src, src_len, p_dst, &dst_len);
-            } else {
-                printf("*** error : ZSTD compress is not yet supported\n");
-                return -1;
+        
+        if (ret_code == 0) {
+            ret_code = processFile(p_batch->p_opt, &worker, p_job->fname_src, p_job->fname_dst, &src_len, &dst_len, NULL);
+        }
+        
+        if (ret_code) {
+            fprintf(p_log, "*** error : %s -> %s failed\n", p_job->fname_src, p_job->fname_dst);
+            mutexLock(p_batch->p_mutex);
+            p_batch->n_failed ++;
+            mutexUnlock(p_batch->p_mutex);
+        } else {
+            fprintf(p_log, "%s -> %s  (%lu -> %lu)\n", p_job->fname_src, p_job->fname_dst, src_len, dst_len);
+        }
+    }
+    
+    if (init_ret_code == 0) {
+        workerFree(p_batch->p_opt, &worker);
+    }
+}
+
+
+/// parse the file list of --files-from : each line is "<input_file>" or "<input_file><TAB><output_file>".
+/// the file names point into *pp_list_buf, which must be kept until the jobs are done.
+static int loadFileList (const char *fname_list, uint8_t **pp_list_buf, Job_t **p_jobs, size_t *p_n_jobs) {
+    size_t list_len, i, n_lines = 1;
+    char  *p;
+    
+    *pp_list_buf = loadFromFile(&list_len, fname_list);   // the buffer is padded with zeros, so it's always null-terminated
+    if (*pp_list_buf == NULL) {
+        fprintf(p_log, "*** error : load file list %s failed\n", fname_list);
+        return -1;
+    }
+    
+    for (i=0; i<list_len; i++) {
+        if ((*pp_list_buf)[i] == '\n')
+            n_lines ++;
+    }
+    
+    *p_jobs = (Job_t*)realloc(*p_jobs, (*p_n_jobs + n_lines) * sizeof(Job_t));
+    if (*p_jobs == NULL) {
+        fprintf(p_log, "*** error : allocate job list failed\n");
+        return -1;
+    }
+    
+    for (p = (char*)(*pp_list_buf); *p; ) {
+        char *line = p, *tab;
+        for (; *p && *p != '\n'; p++);
+        if (*p) {
+            *(p++) = '\0';
+        }
+        i = strlen(line);
+        if (i > 0 && line[i-1] == '\r') {                     // the list file may be written on Windows
+            line[i-1] = '\0';
+        }
+        if (line[0] == '\0')                                  // skip empty line
+            continue;
+        (*p_jobs)[*p_n_jobs].fname_src = line;
+        (*p_jobs)[*p_n_jobs].fname_dst = NULL;
+        tab = strchr(line, '\t');
+        if (tab != NULL) {
+            *tab = '\0';
+            if (tab[1] != '\0')
+                (*p_jobs)[*p_n_jobs].fname_dst = tab + 1;
+        }
+        (*p_n_jobs) ++;
+    }
+    
+    return 0;
+}
+
+
+/// batch mode : process all the jobs with n_threads worker threads. Return the number of failed jobs.
+static size_t runBatch (const Options_t *p_opt, Job_t *jobs, size_t n_jobs, int n_threads) {
+    Batch_t    batch;
+    Thread_t **threads;
+    int        i;
+    
+    batch.p_opt    = p_opt;
+    batch.jobs     = jobs;
+    batch.n_jobs   = n_jobs;
+    batch.next_job = 0;
+    batch.n_failed = 0;
+    batch.p_mutex  = mutexNew();
+    
+    if (batch.p_mutex == NULL) {
+        fprintf(p_log, "*** error : create mutex failed\n");
+        return n_jobs;
+    }
+    
+    if ((size_t)n_threads > n_jobs) {
+        n_threads = (n_jobs > 0) ? (int)n_jobs : 1;
+    }
+    
+    threads = (Thread_t**)malloc(n_threads * sizeof(Thread_t*));
+    
+    if (n_threads <= 1 || threads == NULL) {                  // run in the main thread
+        batchWorker(&batch);
+    } else {
+        for (i=0; i<n_threads; i++) {
+            threads[i] = threadStart(batchWorker, &batch);
+            if (threads[i] == NULL) {
+                fprintf(p_log, "*** warning : start thread failed, continue with %d threads\n", i);
             }
-            break;
         }
-        case LPAQ8 : {
-            size_t mem_usage = 0;
-            if (type_action == DECOMPRESS) {
-                ret_code = lpaq8D(p_src, src_len, p_dst, &dst_len, &compress_level, &mem_usage);
-            } else if (type_container != ZIP) {
-                ret_code = lpaq8C(p_src, src_len, p_dst, &dst_len,  compress_level, &mem_usage);
+        batchWorker(&batch);                                  // the main thread also helps, which guarantees progress even if no thread is started
+        for (i=0; i<n_threads; i++) {
+            if (threads[i] != NULL) {
+                threadJoin(threads[i]);
+            }
+        }
+    }
+    
+    free(threads);
+    mutexFree(batch.p_mutex);
+    
+    return batch.n_failed;
+}
+
+
+
+/// pick the codec parameters (LZMA hash table, LPAQ8 level) that fit the memory budget of each worker,
+/// and check the codecs of fixed memory usage, so that we fail early with a clear error instead of running out of memory.
+/// the decompressors whose memory depends on the file header (LZMA, LPAQ8) are checked by processFile(), or by the LZMA stream decoder itself.
+static int fitMemoryBudget (Options_t *p_opt) {
+    size_t budget = p_opt->mem_budget;
+    size_t need   = 0;
+    
+    if (budget == 0)
+        return 0;
+    
+    if (p_opt->type_action == COMPRESS) {
+        switch (p_opt->type_format) {
+            case GZIP  : need = gzipCStreamMemUsage();  break;
+            case LZ4   : need = lz4CStreamMemUsage();   break;
+            case LZMA  :
+                lzmaCFitMemory(&p_opt->lzma_params, budget);                        // if failed, the parameters are the smallest
+                if (p_opt->lzma_stream) {
+                    while (lzmaCStreamMemUsage(&p_opt->lzma_params) > budget && p_opt->lzma_params.dict_len > 4096)
+                        p_opt->lzma_params.dict_len >>= 1;                         // the sliding window is about 1.25 x the dictionary
+                    need = lzmaCStreamMemUsage(&p_opt->lzma_params);
+                } else {
+                    need = lzmaCMemUsage(&p_opt->lzma_params);
+                }
+                break;
+            case XZ    :
+                lzmaCFitMemory(&p_opt->lzma_params, budget / p_opt->xz_threads);    // each thread has its own LZMA encoder
+                need = xzCMemUsage(&p_opt->lzma_params, p_opt->xz_block_len, p_opt->xz_threads);
+                break;
+            case LPAQ8 :
+                if (lpaq8MemUsage(p_opt->compress_level) > budget) {
+                    while (p_opt->compress_level > 0 && lpaq8MemUsage(p_opt->compress_level) > budget) {
+                        p_opt->compress_level --;
+                    }
+                    fprintf(p_log, "*** warning : compress level is reduced to %d to fit the memory budget\n", (int)p_opt->compress_level);
+                }
+                need = lpaq8MemUsage(p_opt->compress_level);
+                break;
+            default    : break;
+        }
+    } else {
+        switch (p_opt->type_format) {
+            case LZ4   : need = lz4DStreamMemUsage();   break;
+            case LZMA  : need = p_opt->lzma_stream ? lzmaDStreamMemUsage() : 0;  break;
+            case ZSTD  : need = zstdDMemUsage();        break;
+            default    : break;
+        }
+    }
+    
+    if (need > budget) {
+        fprintf(p_log, "*** error : the memory budget (%lu bytes) is too small, this codec needs at least %lu bytes\n", budget, need);
+        return -1;
+    }
+    
+    return 0;
+}
+
+
+
+/// print a string as a JSON string literal
+static void printJsonString (FILE *fp, const char *str) {
+    fputc('"', fp);
+    for (; *str; str++) {
+        unsigned char ch = (unsigned char)*str;
+        if (ch == '"' || ch == '\\') {
+            fprintf(fp, "\\%c", ch);
+        } else if (ch < 0x20) {
+            fprintf(fp, "\\u%04x", ch);
+        } else {
+            fputc(ch, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+
+/// write the statistics of single file mode as a JSON object, so that they can be ingested by a monitoring system.
+/// file name "-" means stdout. The codec parameters that are not applicable to the format are omitted.
+static int saveStatsJson (const char *fname, const Options_t *p_opt, const char *fname_src, const char *fname_dst, size_t src_len, size_t dst_len, const RunStats_t *p_stats) {
+    static const char *FORMAT_NAMES [] = {"", "gzip", "lz4", "zstd", "lzma", "lpaq8", "xz"};   // indexed by Format_t
+    static const char *PHASE_NAMES  [] = {"load", "codec", "save"};                       // indexed by Phase_t
+    size_t comp_len = (p_opt->type_action == COMPRESS) ? dst_len : src_len;
+    size_t orig_len = (p_opt->type_action == COMPRESS) ? src_len : dst_len;
+    FILE  *fp = (strcmp(fname, "-") == 0) ? stdout : fopen(fname, "w");
+    int    i, failed;
+    
+    if (fp == NULL)
+        return 1;
+    
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"action\": \"%s\",\n", (p_opt->type_action == COMPRESS) ? "compress" : "decompress");
+    fprintf(fp, "  \"format\": \"%s\",\n", FORMAT_NAMES[p_opt->type_format]);
+    fprintf(fp, "  \"container\": \"%s\",\n", (p_opt->type_container == ZIP) ? "zip" : "native");
+    fprintf(fp, "  \"input_file\": ");
+    printJsonString(fp, fname_src);
+    fprintf(fp, ",\n  \"output_file\": ");
+    printJsonString(fp, fname_dst);
+    fprintf(fp, ",\n");
+    fprintf(fp, "  \"input_bytes\": %lu,\n", src_len);
+    fprintf(fp, "  \"output_bytes\": %lu,\n", dst_len);
+    fprintf(fp, "  \"ratio\": %.6f,\n", (orig_len > 0) ? ((double)comp_len / orig_len) : 0.0);   // compressed length / original length
+    
+    fprintf(fp, "  \"wall_sec\": {");
+    for (i=0; i<N_PHASES; i++) {
+        fprintf(fp, "\"%s\": %.6f, ", PHASE_NAMES[i], p_stats->wall[i]);
+    }
+    fprintf(fp, "\"total\": %.6f},\n", p_stats->wall[PHASE_LOAD] + p_stats->wall[PHASE_CODEC] + p_stats->wall[PHASE_SAVE]);
+    
+    fprintf(fp, "  \"cpu_sec\": {");
+    for (i=0; i<N_PHASES; i++) {
+        fprintf(fp, "\"%s\": %.6f, ", PHASE_NAMES[i], p_stats->cpu[i]);
+    }
+    fprintf(fp, "\"total\": %.6f},\n", p_stats->cpu[PHASE_LOAD] + p_stats->cpu[PHASE_CODEC] + p_stats->cpu[PHASE_SAVE]);
+    
+    fprintf(fp, "  \"peak_rss_bytes\": %lu,\n", getPeakMemory());
+    
+    fprintf(fp, "  \"params\": {");
+    {   const char *sep = "";
+        if (p_stats->level     >= 0) { fprintf(fp, "%s\"level\": %d"           , sep, p_stats->level);  sep = ", "; }
+        if (p_stats->lc        >= 0) { fprintf(fp, "%s\"lc\": %d, \"lp\": %d, \"pb\": %d", sep, p_stats->lc, p_stats->lp, p_stats->pb);  sep = ", "; }
+        if (p_stats->dict_len  >= 0) { fprintf(fp, "%s\"dict_size\": %lu"      , sep, (unsigned long)p_stats->dict_len);   sep = ", "; }
+        if (p_stats->mem_usage >= 0) { fprintf(fp, "%s\"mem_usage_bytes\": %lu", sep, (unsigned long)p_stats->mem_usage);  sep = ", "; }
+        if (p_stats->decode_bias >= 0) { fprintf(fp, "%s\"decode_bias\": %d"  , sep, p_stats->decode_bias);  sep = ", "; }
+    }
+    fprintf(fp, "}");
+    if (p_stats->decode_wall >= 0) {                                             // the read side of the output, to weigh against the write side above
+        fprintf(fp, ",\n  \"decode_wall_sec\": %.6f", p_stats->decode_wall);
+    }
+    fprintf(fp, "\n");
+    fprintf(fp, "}\n");
+    
+    if (fp == stdout) {
+        failed = (fflush(fp) != 0);
+    } else {
+        failed = (fclose(fp) != 0);
+    }
+    
+    return failed;
+}
+
+
+
+int main (int argc, char **argv) {
+
+    Options_t opt;
+    memset(&opt, 0, sizeof(opt));
+    opt.type_action    = ACTION_NONE;
+    opt.type_format    = FORMAT_NONE;
+    opt.type_container = NATIVE;
+    opt.compress_level = 2;
+    opt.verbose        = 1;
+    opt.xz_threads     = 1;
+    opt.xz_check       = XZ_CHECK_CRC64;
+    
+    char   **fnames = (char**)malloc(argc * sizeof(char*));   // all the file names in the command line
+    int      n_fnames = 0, i;
+    
+    const char *fname_list = NULL;
+    int      n_threads = 1;
+    uint8_t  is_batch  = 0;
+    
+    uint8_t  is_bench  = 0;
+    uint16_t bench_level_mask = 0;
+    double   bench_time = 2.0;
+    
+    const char *fname_stats = NULL;
+    
+    const char *fname_serve  = NULL;
+    const char *fname_client = NULL;
+    
+    uint8_t  level_given = 0;
+    int      lzma_mf = -1, lzma_parser = -1;          // -1 : use the one of the level
+    size_t   lzma_dict = 0;                           //  0 : use the one of the level
+    int      lzma_lc = -1, lzma_lp = -1, lzma_pb = -1;  // -1 : use the default
+    int      lzma_decode_bias = -1;                   // -1 : use the default
+    
+    
+    p_log = stdout;
+    
+    
+    // parse command line --------------------------------------------------------------------------------------------------
+    if (fnames == NULL) {
+        fprintf(p_log, "*** error : allocate memory failed\n");
+        return -1;
+    }
+    
+    for (i=1; i<argc; i++) {
+        char *arg = argv[i];
+        if (arg[0] == '-' && arg[1] != '\0') {               // note that "-" alone is a file name (stdin or stdout)
+            if        (strcmp(arg, "-c"    ) == 0) {
+                opt.type_action = COMPRESS;
+            } else if (strcmp(arg, "-d"    ) == 0) {
+                opt.type_action = DECOMPRESS;
+            } else if (strcmp(arg, "--gzip") == 0) {
+                opt.type_format = GZIP;
+            } else if (strcmp(arg, "--lz4" ) == 0) {
+                opt.type_format = LZ4;
+            } else if (strcmp(arg, "--zstd") == 0) {
+                opt.type_format = ZSTD;
+            } else if (strcmp(arg, "--lzma") == 0) {
+                opt.type_format = LZMA;
+            } else if (strcmp(arg, "--lpaq8") == 0) {
+                opt.type_format = LPAQ8;
+            } else if (strcmp(arg, "--xz"  ) == 0) {
+                opt.type_format = XZ;
+            } else if (strcmp(arg, "--zip" ) == 0) {
+                opt.type_container = ZIP;
+            } else if (strcmp(arg, "-j"    ) == 0 && i+1 < argc && '0' <= argv[i+1][0] && argv[i+1][0] <= '9') {
+                n_threads = atoi(argv[++i]);
+                is_batch  = 1;
+            } else if (strcmp(arg, "-f"    ) == 0) {
+                opt.force = 1;
+            } else if (strcmp(arg, "--files-from") == 0 && i+1 < argc) {
+                fname_list = argv[++i];
+                is_batch   = 1;
+            } else if (strcmp(arg, "-b"    ) == 0) {
+                is_bench = 1;
+                if (i+2 < argc && parseLevelList(argv[i+1], &bench_level_mask) == 0) {   // the optional level list, which is followed by a file name
+                    i ++;
+                }
+            } else if (strcmp(arg, "--time") == 0 && i+1 < argc) {
+                bench_time = atof(argv[++i]);
+            } else if (strcmp(arg, "--stats-json") == 0 && i+1 < argc) {
+                fname_stats = argv[++i];
+            } else if (strcmp(arg, "--mf"  ) == 0 && i+1 < argc) {
+                i ++;
+                if        (strcmp(argv[i], "hc" ) == 0) {
+                    lzma_mf = LZMA_MF_HC;
+                } else if (strcmp(argv[i], "bt4") == 0) {
+                    lzma_mf = LZMA_MF_BT4;
+                } else if (strcmp(argv[i], "sa" ) == 0) {
+                    lzma_mf = LZMA_MF_SA;
+                } else {
+                    fprintf(p_log, "*** error : unknown match finder %s\n", argv[i]);
+                    return -1;
+                }
+            } else if (strcmp(arg, "--parser") == 0 && i+1 < argc) {
+                i ++;
+                if        (strcmp(argv[i], "greedy" ) == 0) {
+                    lzma_parser = LZMA_PARSER_GREEDY;
+                } else if (strcmp(argv[i], "lazy"   ) == 0) {
+                    lzma_parser = LZMA_PARSER_LAZY;
+                } else if (strcmp(argv[i], "optimal") == 0) {
+                    lzma_parser = LZMA_PARSER_OPTIMAL;
+                } else {
+                    fprintf(p_log, "*** error : unknown parser %s\n", argv[i]);
+                    return -1;
+                }
+            } else if (strcmp(arg, "--dict") == 0 && i+1 < argc) {
+                if (parseSize(argv[++i], &lzma_dict) || lzma_dict < 4096 || lzma_dict > (1<<30)) {
+                    fprintf(p_log, "*** error : invalid dictionary size %s, it should be 4k~1g\n", argv[i]);
+                    return -1;
+                }
+            } else if (strcmp(arg, "--lclppb") == 0 && i+1 < argc) {
+                i ++;
+                if (strcmp(argv[i], "auto") == 0) {
+                    opt.lzma_auto_lclppb = 1;
+                } else if (sscanf(argv[i], "%d,%d,%d", &lzma_lc, &lzma_lp, &lzma_pb) != 3 ||
+                           lzma_lc < 0 || lzma_lc > 8 || lzma_lp < 0 || lzma_lp > 4 || lzma_pb < 0 || lzma_pb > 4) {
+                    fprintf(p_log, "*** error : invalid --lclppb %s, it should be auto or <lc>,<lp>,<pb> of 0~8,0~4,0~4\n", argv[i]);
+                    return -1;
+                }
+            } else if (strcmp(arg, "--decode-bias") == 0 && i+1 < argc) {
+                lzma_decode_bias = atoi(argv[++i]);
+                if (lzma_decode_bias < 0 || lzma_decode_bias > LZMA_DECODE_BIAS_MAX || !('0' <= argv[i][0] && argv[i][0] <= '9')) {
+                    fprintf(p_log, "*** error : invalid --decode-bias %s, it should be 0~%d\n", argv[i], LZMA_DECODE_BIAS_MAX);
+                    return -1;
+                }
+            } else if (strcmp(arg, "--stream") == 0) {
+                opt.lzma_stream = 1;
+            } else if (strcmp(arg, "-T"    ) == 0 && i+1 < argc && '0' <= argv[i+1][0] && argv[i+1][0] <= '9') {
+                opt.xz_threads = atoi(argv[++i]);
+            } else if (strcmp(arg, "--block") == 0 && i+1 < argc) {
+                if (parseSize(argv[++i], &opt.xz_block_len)) {
+                    fprintf(p_log, "*** error : invalid block size %s\n", argv[i]);
+                    return -1;
+                }
+            } else if (strcmp(arg, "--check") == 0 && i+1 < argc) {
+                i ++;
+                if        (strcmp(argv[i], "crc32") == 0) {
+                    opt.xz_check = XZ_CHECK_CRC32;
+                } else if (strcmp(argv[i], "crc64") == 0) {
+                    opt.xz_check = XZ_CHECK_CRC64;
+                } else {
+                    fprintf(p_log, "*** error : unknown check %s\n", argv[i]);
+                    return -1;
+                }
+            } else if (strcmp(arg, "--range") == 0 && i+1 < argc) {
+                if (parseRange(argv[++i], &opt.xz_range_offset, &opt.xz_range_len)) {
+                    fprintf(p_log, "*** error : invalid range %s, it should be <offset>:<length>\n", argv[i]);
+                    return -1;
+                }
+            } else if (strcmp(arg, "--serve") == 0 && i+1 < argc) {
+                fname_serve = argv[++i];
+            } else if (strcmp(arg, "--client") == 0 && i+1 < argc) {
+                fname_client = argv[++i];
+            } else if (strcmp(arg, "-M"    ) == 0 && i+1 < argc) {
+                if (parseSize(argv[++i], &opt.mem_budget)) {
+                    fprintf(p_log, "*** error : invalid memory budget %s\n", argv[i]);
+                    return -1;
+                }
+            } else if ('0' <= arg[1] && arg[1] <= '9') {
+                opt.compress_level = arg[1] - '0';
+                level_given = 1;
             } else {
-                printf("*** error : LPAQ8 compress to ZIP is not supported\n");
+                printf(USAGE);  // unknown switch
                 return -1;
             }
-            printf("compress level   = %d\n", (int)compress_level);
-            printf("memory usage     = %lu\n", mem_usage);
-            break;
+        } else {
+            fnames[n_fnames++] = arg;
         }
-        case FORMAT_NONE : {
+    }
+    
+    opt.lzma_level = level_given ? opt.compress_level : LZMA_LEVEL_DEFAULT;
+    lzmaCLevelParams(&opt.lzma_params, opt.lzma_level);        // the level of LZMA compress, then the options which override it
+    if (lzma_mf     >= 0)
+        opt.lzma_params.match_finder = (uint32_t)lzma_mf;
+    if (lzma_parser >= 0)
+        opt.lzma_params.parser       = (uint32_t)lzma_parser;
+    if (lzma_dict   >  0)
+        opt.lzma_params.dict_len     = (uint32_t)lzma_dict;
+    if (lzma_lc     >= 0) {
+        opt.lzma_params.lc           = (uint8_t)lzma_lc;
+        opt.lzma_params.lp           = (uint8_t)lzma_lp;
+        opt.lzma_params.pb           = (uint8_t)lzma_pb;
+    }
+    if (lzma_decode_bias >= 0)
+        opt.lzma_params.decode_bias  = (uint32_t)lzma_decode_bias;
+    if (opt.xz_threads <= 0)
+        opt.xz_threads = getCpuCount();
+    if (opt.xz_threads > 1 && opt.type_format == LZMA)
+        opt.lzma_params.mf_thread = 1;                        // a single LZMA stream can only use a second thread, for the match finder
+
+    
+    // benchmark mode ------------------------------------------------------------------------------------------------------
+    if (is_bench) {
+        const char *codec_names [] = {NULL, "gzip", "lz4", "zstd", "lzma", "lpaq8", "xz"};      // indexed by Format_t
+        int ret_code;
+        
+        if (n_fnames < 1 || n_fnames > 2) {
             printf(USAGE);
             return -1;
         }
+        
+        if (bench_level_mask == 0) {
+            bench_level_mask = (1 << opt.compress_level);
+        }
+        
+        ret_code = runBenchmark(fnames[0], (n_fnames > 1) ? fnames[1] : NULL, codec_names[opt.type_format], bench_level_mask, bench_time);
+        
+        free(fnames);
+        return ret_code ? -1 : 0;
     }
     
-    if (ret_code) {
-        printf("*** error : failed (return_code = %d)\n", ret_code);
-        return ret_code;
+    
+    // server mode, the codec and the action are given by each request -----------------------------------------------------
+    if (fname_serve != NULL) {
+        int ret_code;
+        
+        if (n_fnames != 0) {
+            printf(USAGE);
+            return -1;
+        }
+        
+        if (n_threads <= 0) {
+            n_threads = getCpuCount();
+        }
+        
+        ret_code = runServer(fname_serve, n_threads, opt.mem_budget);
+        
+        free(fnames);
+        return ret_code ? -1 : 0;
     }
     
-
-    free(p_src);
     
-    printf("output length    = %lu\n", dst_len);
+    // the client of server mode. Format_t has the same values as the codec ids of the server protocol -----------------------
+    if (fname_client != NULL) {
+        int ret_code;
+        
+        if (opt.type_action == ACTION_NONE || opt.type_format == FORMAT_NONE || opt.type_container != NATIVE || n_fnames != 2) {
+            printf(USAGE);
+            return -1;
+        }
+        
+        if (opt.type_format == LZMA && !level_given)
+            opt.compress_level = LZMA_LEVEL_DEFAULT;                  // the server maps the level of LZMA by lzmaCLevelParams, the same as the command line
+        
+        ret_code = runClient(fname_client, (opt.type_action == COMPRESS) ? SERVE_COMPRESS : SERVE_DECOMPRESS, (uint8_t)opt.type_format, opt.compress_level, fnames[0], fnames[1]);
+        
+        free(fnames);
+        return ret_code ? -1 : 0;
+    }
     
-    {   size_t decomp_size = (type_action==COMPRESS) ? src_len : dst_len;
-        double time  = (double)clock() / CLOCKS_PER_SEC;
-        double speed = (0.001*decomp_size) / (time + 0.00000001);
-        printf("time consumed    = %.3f sec  (%.0f kB/s)\n", time, speed);
+    if (opt.type_action == ACTION_NONE || opt.type_format == FORMAT_NONE || (!is_batch && n_fnames != 2)) {
+        printf(USAGE);      // insufficient or too many file name
+        return -1;
     }
     
-    if (saveToFile(p_dst, dst_len, fname_dst)) {
-        printf("*** error : save file %s failed\n", fname_dst);
+    if ((opt.type_format == GZIP  && opt.type_action == DECOMPRESS) ||
+        (opt.type_format == ZSTD  && opt.type_action == COMPRESS  ) ||
+        (opt.type_format == LZ4   && opt.type_container == ZIP    ) ||
+        (opt.type_format == LPAQ8 && opt.type_container == ZIP    ) ||
+        (opt.type_format == XZ    && opt.type_container == ZIP    ) ) {
+        fprintf(p_log, "*** error : this action is not yet supported\n");
         return -1;
     }
     
-    free(p_dst);
+    if (opt.xz_range_len > 0 && (opt.type_format != XZ || opt.type_action != DECOMPRESS)) {
+        fprintf(p_log, "*** error : --range is only for XZ decompress\n");
+        return -1;
+    }
+    
+    if (opt.lzma_stream && (opt.type_format != LZMA || opt.type_container != NATIVE)) {
+        fprintf(p_log, "*** error : --stream is only for LZMA compress and decompress\n");
+        return -1;
+    }
+    
+    if ((opt.lzma_auto_lclppb || lzma_lc >= 0) && !((opt.type_format == LZMA || opt.type_format == XZ) && opt.type_action == COMPRESS)) {
+        fprintf(p_log, "*** error : --lclppb is only for LZMA and XZ compress\n");
+        return -1;
+    }
+    
+    if (opt.lzma_stream && opt.lzma_params.match_finder == LZMA_MF_SA) {
+        fprintf(p_log, "*** error : --mf sa sorts a fixed window of the input, it cannot work with --stream\n");
+        return -1;
+    }
+    
+    if (opt.lzma_auto_lclppb && opt.lzma_stream) {
+        fprintf(p_log, "*** error : --lclppb auto needs the whole input, it cannot work with --stream\n");
+        return -1;
+    }
+    
+    if (lzma_decode_bias > 0 && !((opt.type_format == LZMA || opt.type_format == XZ) && opt.type_action == COMPRESS)) {
+        fprintf(p_log, "*** error : --decode-bias is only for LZMA and XZ compress\n");
+        return -1;
+    }
+    
+    if (lzma_decode_bias > 0 && opt.lzma_params.parser != LZMA_PARSER_OPTIMAL) {
+        fprintf(p_log, "*** error : --decode-bias needs the optimal parser (-7 ~ -9 or --parser optimal)\n");
+        return -1;
+    }
+    
+    if (opt.type_format == XZ && opt.lzma_params.lc + opt.lzma_params.lp > 4) {
+        fprintf(p_log, "*** error : XZ (LZMA2) needs lc + lp <= 4\n");
+        return -1;
+    }
+    
+    if (is_batch && fname_stats != NULL) {
+        fprintf(p_log, "*** error : --stats-json is only for a single file, it cannot work with -j or --files-from\n");
+        return -1;
+    }
+    
+    
+    // batch mode ----------------------------------------------------------------------------------------------------------
+    if (is_batch) {
+        Job_t   *jobs = (Job_t*)malloc((n_fnames + 1) * sizeof(Job_t));
+        size_t   n_jobs = 0, n_failed, j;
+        uint8_t *p_list_buf = NULL;
+        
+        if (jobs == NULL) {
+            fprintf(p_log, "*** error : allocate job list failed\n");
+            return -1;
+        }
+        
+        for (i=0; i<n_fnames; i++) {
+            if (strcmp(fnames[i], "-") == 0) {
+                fprintf(p_log, "*** error : stdin/stdout is not supported in batch mode\n");
+                return -1;
+            }
+            jobs[n_jobs].fname_src = fnames[i];
+            jobs[n_jobs].fname_dst = NULL;
+            n_jobs ++;
+        }
+        
+        if (fname_list != NULL) {
+            if (loadFileList(fname_list, &p_list_buf, &jobs, &n_jobs))
+                return -1;
+        }
+        
+        for (j=0; j<n_jobs; j++) {
+            jobs[j].fname_dst_malloced = (jobs[j].fname_dst == NULL);
+            if (jobs[j].fname_dst_malloced) {
+                jobs[j].fname_dst = getOutputFileName(&opt, jobs[j].fname_src);
+                if (jobs[j].fname_dst == NULL) {
+                    fprintf(p_log, "*** error : allocate memory failed\n");
+                    return -1;
+                }
+            }
+        }
+        
+        if (n_threads <= 0) {
+            n_threads = getCpuCount();
+        }
+        
+        if ((size_t)n_threads > n_jobs && n_jobs > 0) {
+            n_threads = (int)n_jobs;
+        }
+        
+        opt.mem_budget /= n_threads;                          // the budget is shared by the workers
+        if (fitMemoryBudget(&opt))
+            return -1;
+        
+        opt.verbose = 0;
+        
+        n_failed = runBatch(&opt, jobs, n_jobs, n_threads);
+        
+        fprintf(p_log, "%lu files processed, %lu failed\n", n_jobs, n_failed);
+        
+        for (j=0; j<n_jobs; j++) {
+            if (jobs[j].fname_dst_malloced) {
+                free(jobs[j].fname_dst);
+            }
+        }
+        free(jobs);
+        free(p_list_buf);
+        free(fnames);
+        
+        return (n_failed > 0) ? -1 : 0;
+    }
+    
+    
+    // single file mode. file name "-" means stdin or stdout -------------------------------------------------------------
+    {
+        const char *fname_src = fnames[0];
+        const char *fname_dst = fnames[1];
+        size_t      src_len = 0, dst_len = 0;
+        Worker_t    worker;
+        RunStats_t  stats;
+        int         ret_code;
+        
+        memset(&stats, 0, sizeof(stats));
+        stats.level = stats.lc = stats.lp = stats.pb = -1;
+        stats.dict_len = stats.mem_usage = -1;
+        stats.decode_bias = -1;
+        stats.decode_wall = -1.0;
+        
+        if (strcmp(fname_dst, "-") == 0) {
+            p_log = stderr;
+            if (fname_stats != NULL && strcmp(fname_stats, "-") == 0) {
+                fprintf(p_log, "*** error : stdout can't carry both the output data and the statistics\n");
+                return -1;
+            }
+        }
+        
+        fprintf(p_log, "input  file name = %s\n", fname_src);
+        fprintf(p_log, "output file name = %s\n", fname_dst);
+        
+        if (fitMemoryBudget(&opt))
+            return -1;
+        
+        opt.lzma_time_decode = (fname_stats != NULL && opt.type_format == LZMA && opt.type_action == COMPRESS && opt.type_container == NATIVE && !opt.lzma_stream);
+        
+        if (workerInit(&opt, &worker))
+            return -1;
+        
+        ret_code = processFile(&opt, &worker, fname_src, fname_dst, &src_len, &dst_len, &stats);
+        
+        workerFree(&opt, &worker);
+        free(fnames);
+        
+        if (ret_code)
+            return ret_code;
+        
+        if (isStreamable(&opt)) {
+            fprintf(p_log, "input  length    = %lu\n", src_len);
+        }
+        fprintf(p_log, "output length    = %lu\n", dst_len);
+        
+        {   size_t decomp_size = (opt.type_action==COMPRESS) ? src_len : dst_len;
+            double time  = stats.wall[PHASE_LOAD] + stats.wall[PHASE_CODEC] + stats.wall[PHASE_SAVE];
+            double speed = (0.001*decomp_size) / (time + 0.00000001);
+            fprintf(p_log, "time consumed    = %.3f sec  (%.0f kB/s)   load %.3f + codec %.3f + save %.3f sec\n", time, speed, stats.wall[PHASE_LOAD], stats.wall[PHASE_CODEC], stats.wall[PHASE_SAVE]);
+            if (stats.decode_wall >= 0) {
+                fprintf(p_log, "decode time      = %.3f sec  (%.0f kB/s)\n", stats.decode_wall, (0.001*decomp_size) / (stats.decode_wall + 0.00000001));
+            }
+        }
+        
+        if (fname_stats != NULL) {
+            if (saveStatsJson(fname_stats, &opt, fname_src, fname_dst, src_len, dst_len, &stats)) {
+                fprintf(p_log, "*** error : save statistics to %s failed\n", fname_stats);
+                return -1;
+            }
+        }
+    }
     
     return 0;
 }
-
@@ -0,0 +1,666 @@
+#define _DEFAULT_SOURCE                  // for the socket functions and lstat when compiling with -std=c99
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#if !defined(_WIN32)
+    #include <errno.h>
+    #include <signal.h>
+    #include <unistd.h>
+    #include <sys/socket.h>
+    #include <sys/stat.h>
+    #include <sys/un.h>
+#endif
+
+#include "FileIO.h"
+#include "Thread.h"
+#include "SysUtil.h"
+
+#include "gzipC.h"
+#include "lz4D.h"
+#include "lz4C.h"
+#include "lzmaD.h"
+#include "lzmaC.h"
+#include "lpaq8CD.h"
+
+#include "tinyZZZ_serve.h"
+
+
+
+#if defined(_WIN32)
+
+
+int runServer (const char *sock_path, int n_threads, size_t mem_budget) {
+    fprintf(stderr, "*** error : the server is only supported on POSIX systems\n");
+    return 1;
+}
+
+
+int runClient (const char *sock_path, uint8_t action, uint8_t codec, uint8_t level, const char *fname_src, const char *fname_dst) {
+    fprintf(stderr, "*** error : the server is only supported on POSIX systems\n");
+    return 1;
+}
+
+
+#else
+
+
+
+#define  IS_64b_SYSTEM        (sizeof(size_t) == 8)
+
+#define  MAX_PAYLOAD_LEN      (IS_64b_SYSTEM ? 0x80000000 : 0x20000000)    // the same as the output limit of the command line
+
+#define  PADDING_LEN          65536         // the request payload is followed by zero padding, the same as the buffer of loadFromFile
+
+#define  WARM_BUFFER_MAX      (64<<20)      // the buffers larger than this are released after the request, so that a huge request doesn't pin its memory
+
+#define  R_OUTPUT_OVERFLOW    3             // the return code of LZMA and LPAQ8 codecs when the output buffer is too small
+
+
+static const uint8_t REQUEST_MAGIC  [4] = {'T', 'Z', 'Q', 1};
+static const uint8_t RESPONSE_MAGIC [4] = {'T', 'Z', 'R', 1};
+
+
+
+static void putLE (uint8_t *p, uint64_t value, int n_bytes) {
+    for (; n_bytes>0; n_bytes--) {
+        *(p++) = (uint8_t)value;
+        value >>= 8;
+    }
+}
+
+
+static uint64_t getLE (const uint8_t *p, int n_bytes) {
+    uint64_t value = 0;
+    for (p+=n_bytes; n_bytes>0; n_bytes--) {
+        value <<= 8;
+        value |= *(--p);
+    }
+    return value;
+}
+
+
+/// read len bytes from a socket. return the number of bytes read, which is less than len only when the peer closed the connection or on error.
+static size_t recvAll (int fd, uint8_t *p_buf, size_t len) {
+    size_t pos = 0;
+    while (pos < len) {
+        size_t  n = (len - pos > (1<<30)) ? (1<<30) : (len - pos);
+        ssize_t ret = read(fd, p_buf+pos, n);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+        pos += (size_t)ret;
+    }
+    return pos;
+}
+
+
+/// write len bytes to a socket. return 0 on success, 1 on error (e.g., the peer closed the connection).
+static int sendAll (int fd, const uint8_t *p_buf, size_t len) {
+    size_t pos = 0;
+    while (pos < len) {
+        size_t  n = (len - pos > (1<<30)) ? (1<<30) : (len - pos);
+        ssize_t ret = write(fd, p_buf+pos, n);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return 1;
+        pos += (size_t)ret;
+    }
+    return 0;
+}
+
+
+/// fill the address of a socket path. return 0 on success, 1 if the path is too long.
+static int getSocketAddr (const char *sock_path, struct sockaddr_un *p_addr) {
+    memset(p_addr, 0, sizeof(*p_addr));
+    p_addr->sun_family = AF_UNIX;
+    if (strlen(sock_path) >= sizeof(p_addr->sun_path))
+        return 1;
+    strcpy(p_addr->sun_path, sock_path);
+    return 0;
+}
+
+
+/// make sure the buffer has at least need bytes, the data in it is kept. return 0 on success, 1 if out of memory.
+static int reserveBuffer (uint8_t **pp_buf, size_t *p_cap, size_t need) {
+    uint8_t *p_new;
+    if (*p_cap >= need)
+        return 0;
+    p_new = (uint8_t*)realloc(*pp_buf, need);
+    if (p_new == NULL)
+        return 1;
+    *pp_buf = p_new;
+    *p_cap  = need;
+    return 0;
+}
+
+
+
+typedef int (*StreamFeedFunc_t) (void *p_st, uint8_t *p_src, size_t *p_src_len, uint8_t *p_dst, size_t *p_dst_len, uint8_t finish);
+
+static int gzipCFeed (void *p_st, uint8_t *p_src, size_t *p_src_len, uint8_t *p_dst, size_t *p_dst_len, uint8_t finish) {
+    return gzipCStreamFeed((GzipCStream_t*)p_st, p_src, p_src_len, p_dst, p_dst_len, finish);
+}
+
+static int lz4CFeed (void *p_st, uint8_t *p_src, size_t *p_src_len, uint8_t *p_dst, size_t *p_dst_len, uint8_t finish) {
+    return lz4CStreamFeed((LZ4CStream_t*)p_st, p_src, p_src_len, p_dst, p_dst_len, finish);
+}
+
+static int lz4DFeed (void *p_st, uint8_t *p_src, size_t *p_src_len, uint8_t *p_dst, size_t *p_dst_len, uint8_t finish) {
+    return lz4DStreamFeed((LZ4DStream_t*)p_st, p_src, p_src_len, p_dst, p_dst_len, finish);
+}
+
+
+
+typedef struct {
+    int            listen_fd;
+    size_t         mem_budget;            // the memory budget of the codecs of a thread (bytes), 0 means unlimited
+} Server_t;
+
+
+/// the warm context of a server thread, which is created once and reused for all the requests it serves.
+typedef struct {
+    GzipCStream_t *p_gzipc;               // streaming codec states, reset before each request
+    LZ4CStream_t  *p_lz4c;
+    LZ4DStream_t  *p_lz4d;
+    uint8_t       *p_in;                  // request payload, followed by PADDING_LEN bytes of zeros
+    uint8_t       *p_out;                 // response payload
+    size_t         in_cap, out_cap;
+} ServeWorker_t;
+
+
+static void serveWorkerFree (ServeWorker_t *p_worker) {
+    if (p_worker->p_gzipc) gzipCStreamFree(p_worker->p_gzipc);
+    if (p_worker->p_lz4c ) lz4CStreamFree (p_worker->p_lz4c );
+    if (p_worker->p_lz4d ) lz4DStreamFree (p_worker->p_lz4d );
+    free(p_worker->p_in);
+    free(p_worker->p_out);
+}
+
+
+static int serveWorkerInit (ServeWorker_t *p_worker) {
+    p_worker->p_gzipc = gzipCStreamNew();
+    p_worker->p_lz4c  = lz4CStreamNew();
+    p_worker->p_lz4d  = lz4DStreamNew();
+    p_worker->p_in    = NULL;
+    p_worker->p_out   = NULL;
+    p_worker->in_cap  = 0;
+    p_worker->out_cap = 0;
+
+    if (p_worker->p_gzipc == NULL || p_worker->p_lz4c == NULL || p_worker->p_lz4d == NULL) {
+        serveWorkerFree(p_worker);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/// release the buffers that a huge request has grown
+static void serveWorkerTrim (ServeWorker_t *p_worker) {
+    if (p_worker->in_cap > WARM_BUFFER_MAX) {
+        free(p_worker->p_in);
+        p_worker->p_in   = NULL;
+        p_worker->in_cap = 0;
+    }
+    if (p_worker->out_cap > WARM_BUFFER_MAX) {
+        free(p_worker->p_out);
+        p_worker->p_out   = NULL;
+        p_worker->out_cap = 0;
+    }
+}
+
+
+
+/// run a streaming codec over the whole request payload, the output buffer is grown when it's full.
+static int serveStream (ServeWorker_t *p_worker, StreamFeedFunc_t feed, void *p_st, size_t in_len, size_t out_cap, size_t *p_out_len, const char **p_msg) {
+    size_t in_pos = 0, out_pos = 0;
+
+    if (out_cap > MAX_PAYLOAD_LEN)
+        out_cap = MAX_PAYLOAD_LEN;
+
+    if (reserveBuffer(&p_worker->p_out, &p_worker->out_cap, out_cap)) {
+        *p_msg = "allocate output buffer failed";
+        return SERVE_NO_MEMORY;
+    }
+
+    for (;;) {
+        size_t feed_len = in_len - in_pos;
+        size_t out_len  = p_worker->out_cap - out_pos;
+
+        if (out_len == 0) {                                                    // output buffer is full
+            size_t new_cap = (p_worker->out_cap > (MAX_PAYLOAD_LEN>>1)) ? MAX_PAYLOAD_LEN : (p_worker->out_cap<<1);
+            if (p_worker->out_cap >= MAX_PAYLOAD_LEN) {
+                *p_msg = "output is too long";
+                return SERVE_CODEC_ERROR;
+            }
+            if (reserveBuffer(&p_worker->p_out, &p_worker->out_cap, new_cap)) {
+                *p_msg = "allocate output buffer failed";
+                return SERVE_NO_MEMORY;
+            }
+            continue;
+        }
+
+        if (feed(p_st, p_worker->p_in+in_pos, &feed_len, p_worker->p_out+out_pos, &out_len, 1)) {
+            *p_msg = "codec failed, the input may be corrupted";
+            return SERVE_CODEC_ERROR;
+        }
+        in_pos  += feed_len;
+        out_pos += out_len;
+
+        if (out_len == 0) {                                                    // no more output
+            if (in_pos == in_len)
+                break;
+            if (feed_len == 0) {
+                *p_msg = "codec failed, the input is not consumed";
+                return SERVE_CODEC_ERROR;
+            }
+        }
+    }
+
+    *p_out_len = out_pos;
+    return SERVE_OK;
+}
+
+
+
+/// process a request whose payload is in p_worker->p_in. On success the output is in p_worker->p_out, otherwise *p_msg is the error message.
+static int serveRequest (const Server_t *p_server, ServeWorker_t *p_worker, uint8_t action, uint8_t codec, uint8_t level, size_t in_len, size_t *p_out_len, const char **p_msg) {
+    uint8_t *p_in = p_worker->p_in;
+    LzmaCParams_t lzma_params;
+    size_t   out_cap  = 0;
+    size_t   mem_need = 0;
+    size_t   mem_usage;
+    uint8_t  growable = 0;
+    int      ret_code = 0;
+
+    if (action != SERVE_COMPRESS && action != SERVE_DECOMPRESS) {
+        *p_msg = "unknown action";
+        return SERVE_BAD_REQUEST;
+    }
+
+
+    // streaming codecs : use the warm states --------------------------------------------------------------------------------
+    if (codec == SERVE_CODEC_GZIP && action == SERVE_COMPRESS) {
+        gzipCStreamReset(p_worker->p_gzipc);
+        return serveStream(p_worker, gzipCFeed, p_worker->p_gzipc, in_len, gzipCBound(in_len), p_out_len, p_msg);
+    }
+
+    if (codec == SERVE_CODEC_LZ4 && action == SERVE_COMPRESS) {
+        lz4CStreamReset(p_worker->p_lz4c);
+        return serveStream(p_worker, lz4CFeed, p_worker->p_lz4c, in_len, lz4CBound(in_len), p_out_len, p_msg);
+    }
+
+    if (codec == SERVE_CODEC_LZ4) {
+        if (lz4DGetSize(p_in, in_len, &out_cap)) {
+            *p_msg = "parse header failed";
+            return SERVE_CODEC_ERROR;
+        }
+        lz4DStreamReset(p_worker->p_lz4d);
+        return serveStream(p_worker, lz4DFeed, p_worker->p_lz4d, in_len, out_cap+1, p_out_len, p_msg);
+    }
+
+
+    // the other codecs : get the output size (exact or upper bound) and the memory they need ---------------------------------
+    if        (codec == SERVE_CODEC_LZMA  && action == SERVE_COMPRESS) {
+        if (level > 9) {
+            *p_msg = "invalid compress level";
+            return SERVE_BAD_REQUEST;
+        }
+        lzmaCLevelParams(&lzma_params, level);
+        if (p_server->mem_budget > 0)
+            lzmaCFitMemory(&lzma_params, p_server->mem_budget);               // if failed, the request is rejected by the check below
+        out_cap  = lzmaCBound(in_len);
+        mem_need = lzmaCMemUsage(&lzma_params);
+        growable = 1;
+    } else if (codec == SERVE_CODEC_LZMA ) {
+        ret_code = lzmaDGetSize(p_in, in_len, &out_cap);
+        if (ret_code == 0)
+            ret_code = lzmaDGetMemUsage(p_in, in_len, &mem_need);
+        if (out_cap == (size_t)-1) {                                           // size is not recorded in the header, start from a guess and grow the buffer on demand
+            out_cap  = (in_len > (MAX_PAYLOAD_LEN>>3)) ? MAX_PAYLOAD_LEN : ((in_len<<3) + 65536);
+            growable = 1;
+        }
+    } else if (codec == SERVE_CODEC_LPAQ8 && action == SERVE_COMPRESS) {
+        if (level > 9) {
+            *p_msg = "invalid compress level";
+            return SERVE_BAD_REQUEST;
+        }
+        out_cap  = lpaq8CBound(in_len);
+        mem_need = lpaq8MemUsage(level);
+        growable = 1;
+    } else if (codec == SERVE_CODEC_LPAQ8) {
+        ret_code = lpaq8DGetSize(p_in, in_len, &out_cap);
+        if (ret_code == 0)
+            ret_code = lpaq8DGetMemUsage(p_in, in_len, &mem_need);
+    } else if (codec == SERVE_CODEC_ZSTD) {
+        *p_msg = "ZSTD is not served, since its decoder exits the process on corrupted data";
+        return SERVE_BAD_REQUEST;
+    } else {
+        *p_msg = "unsupported codec or action";
+        return SERVE_BAD_REQUEST;
+    }
+
+    if (ret_code) {
+        *p_msg = "parse header failed";
+        return SERVE_CODEC_ERROR;
+    }
+
+    if (mem_need > p_server->mem_budget && p_server->mem_budget > 0) {
+        *p_msg = "the codec needs more memory than the memory budget";
+        return SERVE_NO_MEMORY;
+    }
+
+    if (out_cap > MAX_PAYLOAD_LEN)
+        out_cap = MAX_PAYLOAD_LEN;
+
+
+    // do compress / decompress, retry with a larger output buffer if it overflows when the size is not exactly known ---------
+    for (;;) {
+        size_t out_len = out_cap;
+
+        if (reserveBuffer(&p_worker->p_out, &p_worker->out_cap, out_cap)) {
+            *p_msg = "allocate output buffer failed";
+            return SERVE_NO_MEMORY;
+        }
+
+        if (codec == SERVE_CODEC_LZMA) {
+            if (action == SERVE_COMPRESS) {
+                ret_code = lzmaC(p_in, in_len, p_worker->p_out, &out_len, &lzma_params);
+            } else {
+                ret_code = lzmaD(p_in, in_len, p_worker->p_out, &out_len);
+            }
+        } else {
+            if (action == SERVE_COMPRESS) {
+                ret_code = lpaq8C(p_in, in_len, p_worker->p_out, &out_len, level, &mem_usage);
+            } else {
+                ret_code = lpaq8D(p_in, in_len, p_worker->p_out, &out_len, &level, &mem_usage);
+            }
+        }
+
+        if (ret_code == R_OUTPUT_OVERFLOW && growable && out_cap < MAX_PAYLOAD_LEN) {
+            out_cap = (out_cap > (MAX_PAYLOAD_LEN>>1)) ? MAX_PAYLOAD_LEN : (out_cap<<1);
+            continue;
+        }
+
+        if (ret_code) {
+            *p_msg = "codec failed, the input may be corrupted";
+            return SERVE_CODEC_ERROR;
+        }
+
+        *p_out_len = out_len;
+        return SERVE_OK;
+    }
+}
+
+
+
+static int sendResponse (int fd, uint32_t status, const uint8_t *p_payload, size_t len) {
+    uint8_t hdr [SERVE_HEADER_LEN];
+    memcpy(hdr, RESPONSE_MAGIC, 4);
+    putLE(hdr+4, status, 4);
+    putLE(hdr+8, len   , 8);
+    return sendAll(fd, hdr, SERVE_HEADER_LEN) || sendAll(fd, p_payload, len);
+}
+
+
+static int sendError (int fd, uint32_t status, const char *msg) {
+    return sendResponse(fd, status, (const uint8_t*)msg, strlen(msg));
+}
+
+
+/// serve the requests of a connection one by one, until the client closes it.
+/// when the request stream can't be followed any more (e.g., a malformed header), the connection is closed after an error response.
+static void serveConnection (const Server_t *p_server, ServeWorker_t *p_worker, int fd) {
+    for (;;) {
+        uint8_t     hdr [SERVE_HEADER_LEN];
+        size_t      hdr_len = recvAll(fd, hdr, SERVE_HEADER_LEN);
+        uint64_t    in_len;
+        size_t      out_len = 0;
+        const char *msg = "";
+        int         status, failed;
+
+        if (hdr_len == 0)                                                      // the client closed the connection
+            return;
+
+        if (hdr_len < SERVE_HEADER_LEN || memcmp(hdr, REQUEST_MAGIC, 4) != 0) {
+            sendError(fd, SERVE_BAD_REQUEST, "malformed request header");
+            return;
+        }
+
+        in_len = getLE(hdr+8, 8);
+
+        if (in_len > MAX_PAYLOAD_LEN) {
+            sendError(fd, SERVE_BAD_REQUEST, "payload is too long");
+            return;
+        }
+
+        if (reserveBuffer(&p_worker->p_in, &p_worker->in_cap, (size_t)in_len + PADDING_LEN)) {
+            sendError(fd, SERVE_NO_MEMORY, "allocate input buffer failed");
+            return;
+        }
+
+        if (recvAll(fd, p_worker->p_in, (size_t)in_len) < in_len)             // the client closed the connection in the middle of a request
+            return;
+
+        memset(p_worker->p_in + in_len, 0, PADDING_LEN);
+
+        status = serveRequest(p_server, p_worker, hdr[4], hdr[5], hdr[6], (size_t)in_len, &out_len, &msg);
+
+        if (status == SERVE_OK) {
+            failed = sendResponse(fd, status, p_worker->p_out, out_len);
+        } else {
+            failed = sendError(fd, status, msg);
+        }
+
+        serveWorkerTrim(p_worker);
+
+        if (failed)
+            return;
+    }
+}
+
+
+/// a server thread : accept the connections one by one and serve them, using its own warm context
+static void serveThread (void *arg) {
+    const Server_t *p_server = (const Server_t*)arg;
+    ServeWorker_t   worker;
+
+    if (serveWorkerInit(&worker)) {
+        fprintf(stderr, "*** error : allocate codec states failed\n");
+        return;
+    }
+
+    for (;;) {
+        int fd = accept(p_server->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            fprintf(stderr, "*** error : accept failed (errno = %d)\n", errno);
+            break;
+        }
+        serveConnection(p_server, &worker, fd);
+        close(fd);
+    }
+
+    serveWorkerFree(&worker);
+}
+
+
+
+static const char *p_sock_path_to_remove = NULL;
+
+static void onTerminate (int sig) {
+    (void)sig;
+    unlink(p_sock_path_to_remove);                                             // unlink and _exit are async-signal-safe
+    _exit(0);
+}
+
+
+/// create a socket, bind it to the path and listen. A socket file left by a dead server (nobody is listening on it) is replaced.
+/// return the socket, or -1 on failure.
+static int openListenSocket (const char *sock_path) {
+    struct sockaddr_un addr;
+    struct stat        st;
+    int fd;
+
+    if (getSocketAddr(sock_path, &addr)) {
+        fprintf(stderr, "*** error : socket path %s is too long\n", sock_path);
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        fprintf(stderr, "*** error : create socket failed\n");
+        return -1;
+    }
+
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        uint8_t stale = 0;
+        if (errno == EADDRINUSE && lstat(sock_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+            int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (probe >= 0) {
+                stale = (connect(probe, (struct sockaddr*)&addr, sizeof(addr)) != 0 && errno == ECONNREFUSED);
+                close(probe);
+            }
+        }
+        if (!stale || unlink(sock_path) != 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+            fprintf(stderr, "*** error : bind socket to %s failed, it may be in use\n", sock_path);
+            close(fd);
+            return -1;
+        }
+    }
+
+    if (listen(fd, SOMAXCONN) != 0) {
+        fprintf(stderr, "*** error : listen on %s failed\n", sock_path);
+        close(fd);
+        unlink(sock_path);
+        return -1;
+    }
+
+    return fd;
+}
+
+
+
+int runServer (const char *sock_path, int n_threads, size_t mem_budget) {
+    Server_t server;
+    size_t   mem_fixed = gzipCStreamMemUsage() + lz4CStreamMemUsage() + lz4DStreamMemUsage();
+    int      i, n_started = 0;
+
+    if (n_threads < 1)
+        n_threads = 1;
+
+    server.mem_budget  = mem_budget / n_threads;                               // the budget is shared by the threads
+
+    if (server.mem_budget > 0) {
+        if (mem_fixed > server.mem_budget) {
+            fprintf(stderr, "*** error : the memory budget (%lu bytes per thread) is too small, the codec states need %lu bytes\n", server.mem_budget, mem_fixed);
+            return 1;
+        }
+        server.mem_budget -= mem_fixed;                                        // LZMA compress fits the parameters of each request's level to the rest
+    }
+
+    server.listen_fd = openListenSocket(sock_path);
+    if (server.listen_fd < 0)
+        return 1;
+
+    p_sock_path_to_remove = sock_path;
+    signal(SIGINT , onTerminate);
+    signal(SIGTERM, onTerminate);
+    signal(SIGPIPE, SIG_IGN);                                                  // a client that goes away makes write() fail instead of killing the server
+
+    for (i=1; i<n_threads; i++) {                                              // the main thread is also a server thread
+        if (threadStart(serveThread, &server) != NULL) {                        // the threads are never joined, the server stops by a signal
+            n_started ++;
+        }
+    }
+
+    printf("listening on %s with %d threads\n", sock_path, n_started + 1);
+    fflush(stdout);
+
+    serveThread(&server);
+
+    close(server.listen_fd);
+    unlink(sock_path);
+    return 1;
+}
+
+
+
+int runClient (const char *sock_path, uint8_t action, uint8_t codec, uint8_t level, const char *fname_src, const char *fname_dst) {
+    FILE    *p_log = (strcmp(fname_dst, "-") == 0) ? stderr : stdout;
+    struct sockaddr_un addr;
+    uint8_t  hdr [SERVE_HEADER_LEN];
+    uint8_t *p_src, *p_dst = NULL;
+    size_t   src_len, dst_len;
+    uint32_t status;
+    double   time_start, time_end;
+    int      fd, ret_code = 1;
+
+    if (getSocketAddr(sock_path, &addr)) {
+        fprintf(p_log, "*** error : socket path %s is too long\n", sock_path);
+        return 1;
+    }
+
+    p_src = loadFromFile(&src_len, fname_src);
+    if (p_src == NULL) {
+        fprintf(p_log, "*** error : load file %s failed\n", fname_src);
+        return 1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        fprintf(p_log, "*** error : connect to %s failed\n", sock_path);
+        if (fd >= 0)
+            close(fd);
+        free(p_src);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    time_start = getWallTime();
+
+    memcpy(hdr, REQUEST_MAGIC, 4);
+    hdr[4] = action;
+    hdr[5] = codec;
+    hdr[6] = level;
+    hdr[7] = 0;
+    putLE(hdr+8, src_len, 8);
+
+    if (sendAll(fd, hdr, SERVE_HEADER_LEN) || sendAll(fd, p_src, src_len) || recvAll(fd, hdr, SERVE_HEADER_LEN) < SERVE_HEADER_LEN || memcmp(hdr, RESPONSE_MAGIC, 4) != 0) {
+        fprintf(p_log, "*** error : communicate with the server failed\n");
+    } else {
+        status  = (uint32_t)getLE(hdr+4, 4);
+        dst_len = (size_t)  getLE(hdr+8, 8);
+        p_dst   = (uint8_t*)malloc(dst_len + 1);
+        if (p_dst == NULL || recvAll(fd, p_dst, dst_len) < dst_len) {
+            fprintf(p_log, "*** error : receive the response failed\n");
+        } else if (status != SERVE_OK) {
+            p_dst[dst_len] = '\0';
+            fprintf(p_log, "*** error : the server returned status %u : %s\n", status, (char*)p_dst);
+        } else {
+            time_end = getWallTime();
+            if (saveToFile(p_dst, dst_len, fname_dst)) {
+                fprintf(p_log, "*** error : save file %s failed\n", fname_dst);
+            } else {
+                fprintf(p_log, "input  length    = %lu\n", src_len);
+                fprintf(p_log, "output length    = %lu\n", dst_len);
+                fprintf(p_log, "request latency  = %.3f ms\n", 1000.0 * (time_end - time_start));
+                ret_code = 0;
+            }
+        }
+    }
+
+    close(fd);
+    free(p_src);
+    free(p_dst);
+    return ret_code;
+}
+
+
+#endif // _WIN32
@@ -0,0 +1,71 @@
+#ifndef   __TINYZZZ_SERVE_H__
+#define   __TINYZZZ_SERVE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// The protocol of the server, over a Unix domain stream socket. A connection carries any number of requests one after another,
+// each request gets a response before the next request is read. All the integers are little-endian.
+//
+//   request  : 16 bytes header + payload
+//       byte 0~3   : magic 'T' 'Z' 'Q' 1
+//       byte 4     : action, 'c' (compress) or 'd' (decompress)
+//       byte 5     : codec, SERVE_CODEC_*
+//       byte 6     : compress level (0~9), only used by LZMA and LPAQ8 compress. LZMA uses the parameters of lzmaCLevelParams()
+//       byte 7     : 0
+//       byte 8~15  : payload length
+//
+//   response : 16 bytes header + payload
+//       byte 0~3   : magic 'T' 'Z' 'R' 1
+//       byte 4~7   : status, SERVE_*
+//       byte 8~15  : payload length
+//     the payload is the output data when the status is SERVE_OK, otherwise a text message of the error.
+
+#define  SERVE_HEADER_LEN       16
+
+#define  SERVE_COMPRESS         'c'
+#define  SERVE_DECOMPRESS       'd'
+
+#define  SERVE_CODEC_GZIP       1         // compress only
+#define  SERVE_CODEC_LZ4        2
+#define  SERVE_CODEC_ZSTD       3         // not served, since the ZSTD decoder exits the process on corrupted data
+#define  SERVE_CODEC_LZMA       4
+#define  SERVE_CODEC_LPAQ8      5
+#define  SERVE_CODEC_XZ         6         // not served yet
+
+#define  SERVE_OK               0
+#define  SERVE_BAD_REQUEST      1         // malformed header, unsupported action or codec, or too long payload
+#define  SERVE_NO_MEMORY        2         // out of memory, or the codec needs more memory than the budget
+#define  SERVE_CODEC_ERROR      3         // the codec failed, e.g., the compressed data is corrupted
+
+
+// Function  : listen on a Unix domain socket and serve the requests until the process is killed (SIGINT or SIGTERM removes the socket file).
+//             Each thread serves one connection at a time, and keeps its codec states and buffers across the requests,
+//             so that the latency of a request is only the codec work.
+//             Only supported on POSIX systems, on Windows it returns 1 immediately.
+// Parameter :
+//     const char *sock_path         : the path of the socket file. A socket file left by a dead server is replaced
+//     int n_threads                 : the number of threads, i.e., the number of connections served concurrently
+//     size_t mem_budget             : the memory budget of the codecs of all the threads (bytes), 0 means unlimited.
+//                                     the LZMA compress parameters of a request's level are shrunk to fit the budget of a thread
+// Return    :
+//     1 : failed to start
+int runServer (const char *sock_path, int n_threads, size_t mem_budget);
+
+
+// Function  : a simple client of the server : send a file as one request, and save the response to a file.
+// Parameter :
+//     const char *sock_path : the path of the socket file of the server
+//     uint8_t action        : SERVE_COMPRESS or SERVE_DECOMPRESS
+//     uint8_t codec         : SERVE_CODEC_*
+//     uint8_t level         : compress level
+//     const char *fname_src : input file name, "-" means stdin
+//     const char *fname_dst : output file name, "-" means stdout
+// Return    :
+//     0 : success
+//     1 : failed, or the server returned an error
+int runClient (const char *sock_path, uint8_t action, uint8_t codec, uint8_t level, const char *fname_src, const char *fname_dst);
+
+
+#endif // __TINYZZZ_SERVE_H__
@@ -0,0 +1,435 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>   // malloc, free
+#include <string.h>   // memcpy, memmove
+
+#include "lzmaC.h"    // LzmaCParams_t, lzmaCDefaultParams, lzmaCMemUsage
+#include "xzC.h"
+#include "Thread.h"
+
+
+int lzma2Encode (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len, const LzmaCParams_t *p_params);    // lzmaC.c
+size_t lzma2Bound (size_t src_len);                                                                                     // lzmaC.c
+
+
+#define   R_OK                           0
+#define   R_ERR_MEMORY_RUNOUT            1
+#define   R_ERR_UNSUPPORTED              2
+#define   R_ERR_OUTPUT_OVERFLOW          3
+
+#define   RET_WHEN_ERR(err_code)          { int ec = (err_code); if (ec)  return ec; }
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// check functions
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static uint32_t calcCrc32 (const uint8_t *p_src, size_t src_len) {
+    static const uint32_t TABLE_CRC32 [] = { 0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c, 0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c };
+    
+    uint32_t crc = 0xFFFFFFFF;
+    const uint8_t *p_end = p_src + src_len;
+    
+    for (; p_src<p_end; p_src++) {
+        crc ^= *p_src;
+        crc = TABLE_CRC32[crc & 0x0f] ^ (crc >> 4);
+        crc = TABLE_CRC32[crc & 0x0f] ^ (crc >> 4);
+    }
+    
+    return ~crc;
+}
+
+
+static uint64_t calcCrc64 (const uint8_t *p_src, size_t src_len) {         // CRC-64/XZ (ECMA-182 polynomial, reflected)
+    static const uint64_t TABLE_CRC64 [] = {
+        0x0000000000000000ULL, 0x7D9BA13851336649ULL, 0xFB374270A266CC92ULL, 0x86ACE348F355AADBULL, 0x64B62BCAEBC387A1ULL, 0x192D8AF2BAF0E1E8ULL, 0x9F8169BA49A54B33ULL, 0xE21AC88218962D7AULL,
+        0xC96C5795D7870F42ULL, 0xB4F7F6AD86B4690BULL, 0x325B15E575E1C3D0ULL, 0x4FC0B4DD24D2A599ULL, 0xADDA7C5F3C4488E3ULL, 0xD041DD676D77EEAAULL, 0x56ED3E2F9E224471ULL, 0x2B769F17CF112238ULL };
+    
+    uint64_t crc = 0xFFFFFFFFFFFFFFFFULL;
+    const uint8_t *p_end = p_src + src_len;
+    
+    for (; p_src<p_end; p_src++) {
+        crc ^= *p_src;
+        crc = TABLE_CRC64[crc & 0x0f] ^ (crc >> 4);
+        crc = TABLE_CRC64[crc & 0x0f] ^ (crc >> 4);
+    }
+    
+    return ~crc;
+}
+
+
+static size_t getCheckLen (uint8_t check) {
+    return (check == XZ_CHECK_CRC64) ? 8 : 4;
+}
+
+
+/// write the check of the data (little-endian), return its length
+static size_t writeCheck (uint8_t *p_dst, const uint8_t *p_src, size_t src_len, uint8_t check) {
+    uint64_t value = (check == XZ_CHECK_CRC64) ? calcCrc64(p_src, src_len) : calcCrc32(p_src, src_len);
+    size_t   i, len = getCheckLen(check);
+    
+    for (i=0; i<len; i++)
+        *(p_dst++) = (uint8_t)(value >> (i*8));
+    
+    return len;
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// .xz container
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// A .xz file is : stream header (12 bytes), blocks, index, stream footer (12 bytes).
+//   block  : block header, LZMA2 data, 0~3 bytes padding, check of the uncompressed data
+//   index  : 0x00, number of blocks, (unpadded length, uncompressed length) of each block, padding, CRC32
+// The lengths in the block header and index are variable-length integers (7 bits per byte, low bits first).
+// All the headers, blocks and the index are aligned to 4 bytes.
+
+#define   XZ_STREAM_HEADER_LEN              12
+#define   XZ_STREAM_FOOTER_LEN              12
+#define   XZ_BLOCK_HEADER_MAX_LEN           32                 // 2 + two VLI (at most 9 bytes each) + 3 bytes filter flags, aligned to 4, + 4 bytes CRC32
+#define   XZ_CHECK_MAX_LEN                  8
+#define   XZ_FILTER_ID_LZMA2                0x21
+
+#define   XZ_BLOCK_LEN_MIN                  ((size_t)1<<20)
+#define   XZ_BLOCK_LEN_DEFAULT_MAX          ((size_t)24<<20)
+
+#define   ALIGN4(n)                         (((n) + 3) & ~(size_t)3)
+
+
+static const uint8_t XZ_MAGIC [6] = {0xFD, '7', 'z', 'X', 'Z', 0x00};
+
+
+static size_t writeVli (uint8_t *p_dst, size_t value) {
+    size_t len = 0;
+    for (; value >= 0x80; value >>= 7)
+        p_dst[len++] = (uint8_t)(value | 0x80);
+    p_dst[len++] = (uint8_t)value;
+    return len;
+}
+
+
+static void writeU32 (uint8_t *p_dst, uint32_t value) {
+    p_dst[0] = (uint8_t)(value >> 0);
+    p_dst[1] = (uint8_t)(value >> 8);
+    p_dst[2] = (uint8_t)(value >>16);
+    p_dst[3] = (uint8_t)(value >>24);
+}
+
+
+/// the dictionary size byte of the LZMA2 filter : the size is (2 | (byte & 1)) << (byte / 2 + 11), round up to it
+static uint8_t getLzma2DictByte (uint32_t dict_len) {
+    uint8_t b;
+    for (b=0; b<40; b++) {
+        if ((uint64_t)(2 | (b & 1)) << (b / 2 + 11) >= dict_len)
+            break;
+    }
+    return b;
+}
+
+
+static size_t getBlockLen (const LzmaCParams_t *p_params, size_t block_len) {
+    return (block_len > 0) ? block_len : xzCDefaultBlockLen(p_params);
+}
+
+
+/// the space reserved for each block in the output buffer, they are moved together after all the blocks are done
+static size_t getBlockSlotLen (size_t src_len, size_t block_len) {
+    if (block_len > src_len)
+        block_len = src_len;
+    return XZ_BLOCK_HEADER_MAX_LEN + ALIGN4(lzma2Bound(block_len)) + XZ_CHECK_MAX_LEN;
+}
+
+
+static size_t writeStreamFlags (uint8_t *p_dst, uint8_t check) {
+    p_dst[0] = 0x00;
+    p_dst[1] = check;
+    writeU32(p_dst+2, calcCrc32(p_dst, 2));
+    return 6;
+}
+
+
+static size_t writeBlockHeader (uint8_t *p_dst, size_t compressed_len, size_t uncompressed_len, uint8_t dict_byte) {
+    size_t len = 2;
+    
+    len += writeVli(p_dst+len, compressed_len);
+    len += writeVli(p_dst+len, uncompressed_len);
+    p_dst[len++] = XZ_FILTER_ID_LZMA2;
+    p_dst[len++] = 1;                                          // length of the filter properties
+    p_dst[len++] = dict_byte;
+    for (; len & 3; len++)                                     // header padding
+        p_dst[len] = 0x00;
+    
+    p_dst[0] = (uint8_t)((len + 4) / 4 - 1);                   // header length, including the CRC32
+    p_dst[1] = 0xC0;                                           // flags : 1 filter, compressed and uncompressed lengths are present
+    
+    writeU32(p_dst+len, calcCrc32(p_dst, len));
+    
+    return len + 4;
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// multithreaded block compress
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+typedef struct {
+    size_t   compressed_len;                                   // the length of LZMA2 data, which is in the slot of the block
+    size_t   uncompressed_len;
+    size_t   header_len;
+    size_t   check_len;
+    uint8_t  header [XZ_BLOCK_HEADER_MAX_LEN];
+    uint8_t  check  [XZ_CHECK_MAX_LEN];
+} XzBlock_t;
+
+
+typedef struct {
+    uint8_t             *p_src;
+    size_t               src_len;
+    uint8_t             *p_slots;                              // block i is compressed to p_slots + i * slot_len
+    size_t               slot_len;
+    size_t               block_len;
+    const LzmaCParams_t *p_params;
+    uint8_t              check;
+    uint8_t              dict_byte;
+    XzBlock_t           *blocks;
+    size_t               n_blocks;
+    size_t               next_block;                           // the next block to be taken by a thread, protected by p_mutex
+    int                  ret_code;                             // the first error, protected by p_mutex
+    Mutex_t             *p_mutex;
+} XzJobs_t;
+
+
+/// the thread function : take the blocks one by one and compress them, until all the blocks are taken or a block failed
+static void xzBlockWorker (void *arg) {
+    XzJobs_t *p_jobs = (XzJobs_t*)arg;
+    
+    for (;;) {
+        size_t     i;
+        XzBlock_t *p_block;
+        uint8_t   *p_src;
+        int        ret_code;
+    
+        mutexLock(p_jobs->p_mutex);
+        i = (p_jobs->ret_code == R_OK) ? p_jobs->next_block++ : p_jobs->n_blocks;    // stop taking blocks after an error
+        mutexUnlock(p_jobs->p_mutex);
+    
+        if (i >= p_jobs->n_blocks)
+            break;
+    
+        p_block = &p_jobs->blocks[i];
+        p_src   = p_jobs->p_src + i * p_jobs->block_len;
+    
+        p_block->uncompressed_len = p_jobs->src_len - i * p_jobs->block_len;
+        if (p_block->uncompressed_len > p_jobs->block_len)
+            p_block->uncompressed_len = p_jobs->block_len;
+    
+        p_block->compressed_len = p_jobs->slot_len - XZ_BLOCK_HEADER_MAX_LEN;
+    
+        ret_code = lzma2Encode(p_src, p_block->uncompressed_len, p_jobs->p_slots + i*p_jobs->slot_len + XZ_BLOCK_HEADER_MAX_LEN, &p_block->compressed_len, p_jobs->p_params);
+    
+        if (ret_code == R_OK) {
+            p_block->header_len = writeBlockHeader(p_block->header, p_block->compressed_len, p_block->uncompressed_len, p_jobs->dict_byte);
+            p_block->check_len  = writeCheck(p_block->check, p_src, p_block->uncompressed_len, p_jobs->check);
+        } else {
+            mutexLock(p_jobs->p_mutex);
+            if (p_jobs->ret_code == R_OK)
+                p_jobs->ret_code = ret_code;
+            mutexUnlock(p_jobs->p_mutex);
+        }
+    }
+}
+
+
+/// compress all the blocks with n_threads threads (the calling thread is one of them)
+static int runXzJobs (XzJobs_t *p_jobs, int n_threads) {
+    Thread_t **threads = NULL;
+    int        i;
+    
+    p_jobs->p_mutex = mutexNew();
+    if (p_jobs->p_mutex == NULL)
+        return R_ERR_MEMORY_RUNOUT;
+    
+    if ((size_t)n_threads > p_jobs->n_blocks)
+        n_threads = (int)p_jobs->n_blocks;
+    
+    if (n_threads > 1)
+        threads = (Thread_t**)malloc((n_threads-1) * sizeof(Thread_t*));
+    
+    if (threads == NULL) {                                     // single thread, or failed to allocate the thread list
+        xzBlockWorker(p_jobs);
+    } else {
+        for (i=0; i<n_threads-1; i++)
+            threads[i] = threadStart(xzBlockWorker, p_jobs);  // if a thread failed to start, the others take its blocks
+        xzBlockWorker(p_jobs);
+        for (i=0; i<n_threads-1; i++) {
+            if (threads[i] != NULL)
+                threadJoin(threads[i]);
+        }
+        free(threads);
+    }
+    
+    mutexFree(p_jobs->p_mutex);
+    
+    return p_jobs->ret_code;
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// xz compress function
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+size_t xzCDefaultBlockLen (const LzmaCParams_t *p_params) {
+    LzmaCParams_t params;
+    size_t block_len;
+    
+    if (p_params == NULL) {
+        lzmaCDefaultParams(&params);
+        p_params = &params;
+    }
+    
+    block_len = (size_t)3 * p_params->dict_len;
+    
+    if (block_len < XZ_BLOCK_LEN_MIN)
+        block_len = XZ_BLOCK_LEN_MIN;
+    if (block_len > XZ_BLOCK_LEN_DEFAULT_MAX)
+        block_len = XZ_BLOCK_LEN_DEFAULT_MAX;
+    
+    return block_len;
+}
+
+
+size_t xzCMemUsage (const LzmaCParams_t *p_params, size_t block_len, int n_threads) {
+    LzmaCParams_t params;
+    
+    if (p_params == NULL) {
+        lzmaCDefaultParams(&params);
+        p_params = &params;
+    }
+    
+    (void)block_len;                                           // the match finder shrinks for short blocks, but the upper bound is the same
+    
+    if (n_threads <= 0)
+        n_threads = getCpuCount();
+    
+    return (size_t)n_threads * (lzmaCMemUsage(p_params) + 65536);    // + a buffer of an LZMA2 chunk
+}
+
+
+int xzC (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len, const LzmaCParams_t *p_params, size_t block_len, uint8_t check, int n_threads) {
+    XzJobs_t  jobs;
+    uint8_t  *p = p_dst;
+    uint8_t  *p_index;
+    size_t    dict_len, i;
+    int       ret_code;
+    
+    LzmaCParams_t params;
+    
+    if (p_params == NULL) {
+        lzmaCDefaultParams(&params);
+        p_params = &params;
+    }
+    
+    if (check != XZ_CHECK_CRC32 && check != XZ_CHECK_CRC64)
+        return R_ERR_UNSUPPORTED;
+    
+    block_len = getBlockLen(p_params, block_len);
+    
+    if (*p_dst_len < xzCBound(src_len, p_params, block_len))
+        return R_ERR_OUTPUT_OVERFLOW;
+    
+    if (n_threads <= 0)
+        n_threads = getCpuCount();
+    
+    dict_len = (block_len < src_len) ? block_len : src_len;   // a block never refers to the data out of it, so the decoder needs at most a block
+    if (dict_len > p_params->dict_len)
+        dict_len = p_params->dict_len;
+    
+    jobs.p_src      = p_src;
+    jobs.src_len    = src_len;
+    jobs.p_slots    = p_dst + XZ_STREAM_HEADER_LEN;
+    jobs.slot_len   = getBlockSlotLen(src_len, block_len);
+    jobs.block_len  = block_len;
+    jobs.p_params   = p_params;
+    jobs.check      = check;
+    jobs.dict_byte  = getLzma2DictByte(dict_len);
+    jobs.n_blocks   = (src_len + block_len - 1) / block_len;
+    jobs.next_block = 0;
+    jobs.ret_code   = R_OK;
+    jobs.blocks     = (XzBlock_t*)malloc((jobs.n_blocks + 1) * sizeof(XzBlock_t));
+    
+    if (jobs.blocks == NULL)
+        return R_ERR_MEMORY_RUNOUT;
+    
+    ret_code = runXzJobs(&jobs, n_threads);
+    
+    if (ret_code != R_OK) {
+        free(jobs.blocks);
+        return ret_code;
+    }
+    
+    // stream header ----------------------------------------------------
+    memcpy(p, XZ_MAGIC, sizeof(XZ_MAGIC));
+    p += sizeof(XZ_MAGIC);
+    p += writeStreamFlags(p, check);
+    
+    // blocks : move them together, the data of a block (after the header space of its slot) is never before the current position --------
+    for (i=0; i<jobs.n_blocks; i++) {
+        XzBlock_t *p_block = &jobs.blocks[i];
+        memcpy(p, p_block->header, p_block->header_len);
+        p += p_block->header_len;
+        memmove(p, jobs.p_slots + i*jobs.slot_len + XZ_BLOCK_HEADER_MAX_LEN, p_block->compressed_len);
+        p += p_block->compressed_len;
+        for (; (p - p_dst) & 3; p++)                           // block padding
+            *p = 0x00;
+        memcpy(p, p_block->check, p_block->check_len);
+        p += p_block->check_len;
+    }
+    
+    // index ----------------------------------------------------
+    p_index = p;
+    *(p++) = 0x00;                                             // index indicator
+    p += writeVli(p, jobs.n_blocks);
+    for (i=0; i<jobs.n_blocks; i++) {
+        XzBlock_t *p_block = &jobs.blocks[i];
+        p += writeVli(p, p_block->header_len + p_block->compressed_len + p_block->check_len);   // unpadded length, i.e., without the block padding
+        p += writeVli(p, p_block->uncompressed_len);
+    }
+    for (; (p - p_index) & 3; p++)                             // index padding
+        *p = 0x00;
+    writeU32(p, calcCrc32(p_index, p - p_index));
+    p += 4;
+    
+    // stream footer ----------------------------------------------------
+    writeU32(p+4, (uint32_t)((p - p_index) / 4 - 1));          // backward size : the index length
+    p[8] = 0x00;                                               // stream flags
+    p[9] = check;
+    writeU32(p, calcCrc32(p+4, 6));
+    p[10] = 'Y';
+    p[11] = 'Z';
+    p += XZ_STREAM_FOOTER_LEN;
+    
+    free(jobs.blocks);
+    
+    *p_dst_len = p - p_dst;
+    
+    return R_OK;
+}
+
+
+size_t xzCBound (size_t src_len, const LzmaCParams_t *p_params, size_t block_len) {
+    size_t n_blocks;
+    
+    block_len = getBlockLen(p_params, block_len);
+    n_blocks  = (src_len + block_len - 1) / block_len;
+    
+    return XZ_STREAM_HEADER_LEN + n_blocks * getBlockSlotLen(src_len, block_len) + 16 + n_blocks * 18 + XZ_STREAM_FOOTER_LEN;    // the index has at most 18 bytes per block, and 16 bytes of the others
+}
@@ -0,0 +1,46 @@
+#ifndef   __XZ_C_H__
+#define   __XZ_C_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lzmaC.h"
+
+
+#define   XZ_CHECK_CRC32        0x01
+#define   XZ_CHECK_CRC64        0x04
+
+
+// Function  : get the default block length of .xz compress : 3 times the dictionary length, between 1MB and 24MB (like "xz -T").
+//             a block is compressed independently, so smaller blocks give more parallelism, but a worse compression ratio.
+size_t xzCDefaultBlockLen (const LzmaCParams_t *p_params);
+
+
+// Function  : get the memory usage of xzC (not including the input and output buffers)
+size_t xzCMemUsage (const LzmaCParams_t *p_params, size_t block_len, int n_threads);
+
+
+// Function  : compress data to .xz format. The input is split into blocks of block_len bytes, which are compressed
+//             independently (LZMA2 filter) by n_threads threads. The output does not depend on n_threads.
+// Parameter :
+//     uint8_t *p_src                : input data
+//     size_t   src_len              : input data length
+//     uint8_t *p_dst                : the output buffer, which should be at least xzCBound(src_len, block_len) bytes
+//     size_t  *p_dst_len            : the length of output buffer, and will be set to output data length
+//     const LzmaCParams_t *p_params : LZMA parameters of each block, NULL to use the default parameters
+//     size_t   block_len            : the uncompressed length of a block, 0 to use xzCDefaultBlockLen()
+//     uint8_t  check                : XZ_CHECK_CRC32 or XZ_CHECK_CRC64, the integrity check of each block
+//     int      n_threads            : the number of threads, 0 means all the CPU cores
+// Return    :
+//     0 : success
+//     1 : out of memory
+//     2 : unsupported parameters
+//     3 : output overflow
+int xzC (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len, const LzmaCParams_t *p_params, size_t block_len, uint8_t check, int n_threads);
+
+
+// the output buffer length that xzC needs, with the same p_params and block_len
+size_t xzCBound (size_t src_len, const LzmaCParams_t *p_params, size_t block_len);
+
+
+#endif // __XZ_C_H__
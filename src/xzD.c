@@ -0,0 +1,555 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>   // malloc, realloc, free
+#include <string.h>   // memcmp, memcpy, memmove
+
+#include "xzD.h"
+#include "Thread.h"
+
+
+int lzma2Decode (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len);    // lzmaD.c
+
+
+#define   R_OK                           0
+#define   R_ERR_MEMORY_RUNOUT            1
+#define   R_ERR_UNSUPPORTED              2
+#define   R_ERR_OUTPUT_OVERFLOW          3
+#define   R_ERR_INPUT_OVERFLOW           4
+#define   R_ERR_DATA                     5
+#define   R_ERR_OUTPUT_LEN_MISMATCH      6
+#define   R_ERR_CHECK                    7
+
+#define   RET_WHEN_ERR(err_code)          { int ec = (err_code); if (ec)  return ec; }
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// check functions
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static uint32_t calcCrc32 (const uint8_t *p_src, size_t src_len) {
+    static const uint32_t TABLE_CRC32 [] = { 0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c, 0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c };
+    
+    uint32_t crc = 0xFFFFFFFF;
+    const uint8_t *p_end = p_src + src_len;
+    
+    for (; p_src<p_end; p_src++) {
+        crc ^= *p_src;
+        crc = TABLE_CRC32[crc & 0x0f] ^ (crc >> 4);
+        crc = TABLE_CRC32[crc & 0x0f] ^ (crc >> 4);
+    }
+    
+    return ~crc;
+}
+
+
+static uint64_t calcCrc64 (const uint8_t *p_src, size_t src_len) {         // CRC-64/XZ (ECMA-182 polynomial, reflected)
+    static const uint64_t TABLE_CRC64 [] = {
+        0x0000000000000000ULL, 0x7D9BA13851336649ULL, 0xFB374270A266CC92ULL, 0x86ACE348F355AADBULL, 0x64B62BCAEBC387A1ULL, 0x192D8AF2BAF0E1E8ULL, 0x9F8169BA49A54B33ULL, 0xE21AC88218962D7AULL,
+        0xC96C5795D7870F42ULL, 0xB4F7F6AD86B4690BULL, 0x325B15E575E1C3D0ULL, 0x4FC0B4DD24D2A599ULL, 0xADDA7C5F3C4488E3ULL, 0xD041DD676D77EEAAULL, 0x56ED3E2F9E224471ULL, 0x2B769F17CF112238ULL };
+    
+    uint64_t crc = 0xFFFFFFFFFFFFFFFFULL;
+    const uint8_t *p_end = p_src + src_len;
+    
+    for (; p_src<p_end; p_src++) {
+        crc ^= *p_src;
+        crc = TABLE_CRC64[crc & 0x0f] ^ (crc >> 4);
+        crc = TABLE_CRC64[crc & 0x0f] ^ (crc >> 4);
+    }
+    
+    return ~crc;
+}
+
+
+/// the length of the check field : 0 for none, 4 for CRC32, 8 for CRC64, 32 for SHA-256, and the reserved check IDs also have their lengths
+static size_t getCheckLen (uint8_t check) {
+    return (check == 0) ? 0 : ((size_t)4 << ((check - 1) / 3));
+}
+
+
+/// verify the check of the data, only CRC32 (0x01) and CRC64 (0x04) are verified, the others are skipped
+static int verifyCheck (const uint8_t *p_check, const uint8_t *p_src, size_t src_len, uint8_t check) {
+    uint64_t value = 0;
+    size_t   i;
+    
+    if (check == 0x01)
+        value = calcCrc32(p_src, src_len);
+    else if (check == 0x04)
+        value = calcCrc64(p_src, src_len);
+    else
+        return R_OK;
+    
+    for (i=0; i<getCheckLen(check); i++) {
+        if (p_check[i] != (uint8_t)(value >> (i*8)))
+            return R_ERR_CHECK;
+    }
+    
+    return R_OK;
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// .xz container parsing
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// See xzC.c for the .xz format. A .xz file can have several streams, each followed by 0 or more stream padding (4 zero bytes).
+// The index at the end of each stream records the (unpadded length, uncompressed length) of all its blocks,
+// so the positions of all the blocks in the input and the output are known before decompressing them.
+
+#define   XZ_STREAM_HEADER_LEN              12
+#define   XZ_STREAM_FOOTER_LEN              12
+#define   XZ_FILTER_ID_LZMA2                0x21
+#define   XZ_VLI_MAX_LEN                    9
+
+#define   ALIGN4(n)                         (((n) + 3) & ~(size_t)3)
+
+
+static const uint8_t XZ_MAGIC [6] = {0xFD, '7', 'z', 'X', 'Z', 0x00};
+
+
+typedef struct {
+    size_t   offset;                                           // the position of the block header in the .xz data
+    size_t   unpadded_len;                                     // block header + compressed data + check, without the block padding
+    size_t   uncompressed_offset;                              // the position of the block in the decompressed data
+    size_t   uncompressed_len;
+    uint8_t  check;
+} XzDBlock_t;
+
+
+static uint32_t readU32 (const uint8_t *p_src) {
+    return (uint32_t)p_src[0] | ((uint32_t)p_src[1] << 8) | ((uint32_t)p_src[2] << 16) | ((uint32_t)p_src[3] << 24);
+}
+
+
+/// read a variable-length integer (7 bits per byte, low bits first), which must be in the shortest form
+static int readVli (const uint8_t **pp_src, const uint8_t *p_end, size_t *p_value) {
+    const uint8_t *p = *pp_src;
+    uint64_t value = 0;
+    uint32_t i;
+    
+    for (i=0; i<XZ_VLI_MAX_LEN; i++) {
+        if (p >= p_end)
+            return R_ERR_DATA;
+        value |= (uint64_t)(*p & 0x7F) << (i*7);
+        if ((*(p++) & 0x80) == 0) {
+            if (i > 0 && p[-1] == 0x00)                        // not the shortest form
+                return R_ERR_DATA;
+            if (value > (size_t)-1)
+                return R_ERR_UNSUPPORTED;
+            *pp_src  = p;
+            *p_value = (size_t)value;
+            return R_OK;
+        }
+    }
+    
+    return R_ERR_DATA;
+}
+
+
+/// parse the 2 bytes stream flags : a reserved byte (must be 0) and the check ID
+static int parseStreamFlags (const uint8_t *p_src, uint8_t *p_check) {
+    if (p_src[0] != 0x00 || p_src[1] > 0x0F)
+        return R_ERR_UNSUPPORTED;
+    *p_check = p_src[1];
+    return R_OK;
+}
+
+
+/// parse the last stream which ends before *p_end (skip the stream padding), insert its blocks to the front of the block list, and set *p_end to the start of the stream
+static int parseXzStream (uint8_t *p_src, size_t *p_end, XzDBlock_t **p_blocks, size_t *p_n_blocks) {
+    const uint8_t *p, *p_footer, *p_index, *p_index_end, *p_header;
+    size_t end = *p_end, index_len, blocks_len = 0, stream_start, n, i;
+    uint8_t check;
+    XzDBlock_t *blocks;
+    
+    for (; end >= 4 && readU32(p_src+end-4) == 0; end -= 4);  // stream padding
+    
+    if (end < XZ_STREAM_HEADER_LEN + XZ_STREAM_FOOTER_LEN)
+        return R_ERR_DATA;
+    
+    // stream footer ----------------------------------------------------
+    p_footer = p_src + end - XZ_STREAM_FOOTER_LEN;
+    
+    if (p_footer[10] != 'Y' || p_footer[11] != 'Z' || readU32(p_footer) != calcCrc32(p_footer+4, 6))
+        return R_ERR_DATA;
+    
+    RET_WHEN_ERR( parseStreamFlags(p_footer+8, &check) );
+    
+    index_len = ((size_t)readU32(p_footer+4) + 1) * 4;       // backward size
+    
+    if (index_len > end - XZ_STREAM_HEADER_LEN - XZ_STREAM_FOOTER_LEN)
+        return R_ERR_DATA;
+    
+    // index ----------------------------------------------------
+    p_index     = p_footer - index_len;
+    p_index_end = p_footer - 4;
+    
+    if (p_index[0] != 0x00 || readU32(p_index_end) != calcCrc32(p_index, index_len-4))
+        return R_ERR_DATA;
+    
+    p = p_index + 1;
+    
+    RET_WHEN_ERR( readVli(&p, p_index_end, &n) );
+    
+    if (n > index_len / 2)                                     // each record has at least 2 bytes
+        return R_ERR_DATA;
+    
+    blocks = (XzDBlock_t*)realloc(*p_blocks, (*p_n_blocks + n + 1) * sizeof(XzDBlock_t));
+    
+    if (blocks == NULL)
+        return R_ERR_MEMORY_RUNOUT;
+    
+    *p_blocks = blocks;
+    
+    memmove(blocks+n, blocks, (*p_n_blocks) * sizeof(XzDBlock_t));    // the blocks of the later streams
+    *p_n_blocks += n;
+    
+    for (i=0; i<n; i++) {
+        RET_WHEN_ERR( readVli(&p, p_index_end, &blocks[i].unpadded_len) );
+        RET_WHEN_ERR( readVli(&p, p_index_end, &blocks[i].uncompressed_len) );
+        
+        if (blocks[i].unpadded_len <= getCheckLen(check) || blocks[i].unpadded_len > end)
+            return R_ERR_DATA;
+        
+        blocks[i].offset = blocks_len;                         // relative to the first block, for now
+        blocks[i].check  = check;
+        blocks_len += ALIGN4(blocks[i].unpadded_len);
+    }
+    
+    if (p_index_end - p > 3)                                   // the index padding is 0~3 bytes
+        return R_ERR_DATA;
+    for (; p<p_index_end; p++)
+        if (*p != 0x00)
+            return R_ERR_DATA;
+    
+    // stream header ----------------------------------------------------
+    if (blocks_len > (size_t)(p_index - p_src) - XZ_STREAM_HEADER_LEN)
+        return R_ERR_DATA;
+    
+    stream_start = (p_index - p_src) - blocks_len - XZ_STREAM_HEADER_LEN;
+    p_header = p_src + stream_start;
+    
+    if (memcmp(p_header, XZ_MAGIC, sizeof(XZ_MAGIC)) || memcmp(p_header+6, p_footer+8, 2) || readU32(p_header+8) != calcCrc32(p_header+6, 2))
+        return R_ERR_DATA;
+    
+    for (i=0; i<n; i++)
+        blocks[i].offset += stream_start + XZ_STREAM_HEADER_LEN;
+    
+    *p_end = stream_start;
+    
+    return R_OK;
+}
+
+
+/// get the list of all the blocks in the order of the decompressed data, and the decompressed length
+static int parseXzIndex (uint8_t *p_src, size_t src_len, XzDBlock_t **p_blocks, size_t *p_n_blocks, size_t *p_total_len) {
+    XzDBlock_t *blocks   = NULL;
+    size_t      n_blocks = 0;
+    size_t      end = src_len, total_len = 0, i;
+    int         ret_code = R_OK;
+    
+    if (src_len == 0 || (src_len & 3))                         // all the streams and the stream padding are aligned to 4 bytes
+        return R_ERR_DATA;
+    
+    while (end > 0 && ret_code == R_OK)
+        ret_code = parseXzStream(p_src, &end, &blocks, &n_blocks);
+    
+    for (i=0; i<n_blocks && ret_code == R_OK; i++) {
+        blocks[i].uncompressed_offset = total_len;
+        total_len += blocks[i].uncompressed_len;
+        if (total_len < blocks[i].uncompressed_len)            // overflow
+            ret_code = R_ERR_UNSUPPORTED;
+    }
+    
+    if (ret_code != R_OK) {
+        free(blocks);
+        return ret_code;
+    }
+    
+    *p_blocks    = blocks;
+    *p_n_blocks  = n_blocks;
+    *p_total_len = total_len;
+    
+    return R_OK;
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// block decompress
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/// decompress a block to p_dst, which has p_block->uncompressed_len bytes, and verify its check
+static int decodeXzBlock (uint8_t *p_src, const XzDBlock_t *p_block, uint8_t *p_dst) {
+    uint8_t       *p_header = p_src + p_block->offset;
+    const uint8_t *p, *p_header_end;
+    size_t         header_len, check_len, compressed_len, value, dst_len, i;
+    uint8_t        flags;
+    int            ret_code;
+    
+    // block header ----------------------------------------------------
+    header_len = ((size_t)p_header[0] + 1) * 4;
+    check_len  = getCheckLen(p_block->check);
+    
+    if (p_header[0] == 0x00 || header_len + check_len >= p_block->unpadded_len)
+        return R_ERR_DATA;
+    
+    p_header_end   = p_header + header_len - 4;
+    compressed_len = p_block->unpadded_len - header_len - check_len;
+    
+    if (readU32(p_header_end) != calcCrc32(p_header, header_len-4))
+        return R_ERR_DATA;
+    
+    flags = p_header[1];
+    p     = p_header + 2;
+    
+    if (flags & 0x3C)                                          // reserved bits
+        return R_ERR_UNSUPPORTED;
+    
+    if (flags & 0x40) {                                        // compressed length is present
+        RET_WHEN_ERR( readVli(&p, p_header_end, &value) );
+        if (value != compressed_len)
+            return R_ERR_DATA;
+    }
+    
+    if (flags & 0x80) {                                        // uncompressed length is present
+        RET_WHEN_ERR( readVli(&p, p_header_end, &value) );
+        if (value != p_block->uncompressed_len)
+            return R_ERR_DATA;
+    }
+    
+    if ((flags & 0x03) != 0)                                   // only 1 filter (LZMA2) is supported, e.g., no BCJ filters
+        return R_ERR_UNSUPPORTED;
+    
+    RET_WHEN_ERR( readVli(&p, p_header_end, &value) );        // filter ID
+    if (value != XZ_FILTER_ID_LZMA2)
+        return R_ERR_UNSUPPORTED;
+    
+    RET_WHEN_ERR( readVli(&p, p_header_end, &value) );        // length of the filter properties
+    if (value != 1 || p >= p_header_end || *p > 40)            // the dictionary size byte, which is not needed since the output buffer is the dictionary
+        return R_ERR_DATA;
+    p++;
+    
+    for (; p<p_header_end; p++)                                // header padding
+        if (*p != 0x00)
+            return R_ERR_DATA;
+    
+    // LZMA2 data ----------------------------------------------------
+    dst_len  = p_block->uncompressed_len;
+    ret_code = lzma2Decode(p_header+header_len, compressed_len, p_dst, &dst_len);
+    
+    if (ret_code == R_ERR_OUTPUT_OVERFLOW || (ret_code == R_OK && dst_len != p_block->uncompressed_len))
+        return R_ERR_OUTPUT_LEN_MISMATCH;
+    
+    RET_WHEN_ERR(ret_code);
+    
+    // block padding and check ----------------------------------------------------
+    p = p_header + ALIGN4(header_len + compressed_len);
+    
+    for (i=header_len+compressed_len; i&3; i++)
+        if (p_header[i] != 0x00)
+            return R_ERR_DATA;
+    
+    return verifyCheck(p, p_dst, dst_len, p_block->check);
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// multithreaded block decompress
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+typedef struct {
+    uint8_t          *p_src;
+    const XzDBlock_t *blocks;
+    size_t            end_block;                               // decompress the blocks from next_block to end_block-1
+    size_t            offset;                                  // the uncompressed range [offset, offset+len) is written to p_dst
+    size_t            len;
+    uint8_t          *p_dst;
+    size_t            next_block;                              // the next block to be taken by a thread, protected by p_mutex
+    int               ret_code;                                // the first error, protected by p_mutex
+    Mutex_t          *p_mutex;
+} XzDJobs_t;
+
+
+/// decompress a block to its position in the output. If the block is not entirely in the range, decompress it to a temporary buffer and copy the part in the range.
+static int decodeXzBlockInRange (const XzDJobs_t *p_jobs, const XzDBlock_t *p_block) {
+    size_t   start = p_block->uncompressed_offset;
+    size_t   end   = start + p_block->uncompressed_len;
+    size_t   copy_start, copy_end;
+    uint8_t *p_buf;
+    int      ret_code;
+    
+    if (start >= p_jobs->offset && end <= p_jobs->offset + p_jobs->len)
+        return decodeXzBlock(p_jobs->p_src, p_block, p_jobs->p_dst + (start - p_jobs->offset));
+    
+    p_buf = (uint8_t*)malloc(p_block->uncompressed_len);
+    
+    if (p_buf == NULL)
+        return R_ERR_MEMORY_RUNOUT;
+    
+    ret_code = decodeXzBlock(p_jobs->p_src, p_block, p_buf);
+    
+    if (ret_code == R_OK) {
+        copy_start = (start > p_jobs->offset) ? start : p_jobs->offset;
+        copy_end   = (end < p_jobs->offset + p_jobs->len) ? end : p_jobs->offset + p_jobs->len;
+        memcpy(p_jobs->p_dst + (copy_start - p_jobs->offset), p_buf + (copy_start - start), copy_end - copy_start);
+    }
+    
+    free(p_buf);
+    
+    return ret_code;
+}
+
+
+/// the thread function : take the blocks one by one and decompress them, until all the blocks are taken or a block failed
+static void xzDBlockWorker (void *arg) {
+    XzDJobs_t *p_jobs = (XzDJobs_t*)arg;
+    
+    for (;;) {
+        size_t i;
+        int    ret_code;
+    
+        mutexLock(p_jobs->p_mutex);
+        i = (p_jobs->ret_code == R_OK) ? p_jobs->next_block++ : p_jobs->end_block;   // stop taking blocks after an error
+        mutexUnlock(p_jobs->p_mutex);
+    
+        if (i >= p_jobs->end_block)
+            break;
+    
+        ret_code = decodeXzBlockInRange(p_jobs, &p_jobs->blocks[i]);
+    
+        if (ret_code != R_OK) {
+            mutexLock(p_jobs->p_mutex);
+            if (p_jobs->ret_code == R_OK)
+                p_jobs->ret_code = ret_code;
+            mutexUnlock(p_jobs->p_mutex);
+        }
+    }
+}
+
+
+/// decompress the blocks with n_threads threads (the calling thread is one of them)
+static int runXzDJobs (XzDJobs_t *p_jobs, int n_threads) {
+    Thread_t **threads = NULL;
+    int        i;
+    
+    p_jobs->p_mutex = mutexNew();
+    if (p_jobs->p_mutex == NULL)
+        return R_ERR_MEMORY_RUNOUT;
+    
+    if (n_threads <= 0)
+        n_threads = getCpuCount();
+    
+    if ((size_t)n_threads > p_jobs->end_block - p_jobs->next_block)
+        n_threads = (int)(p_jobs->end_block - p_jobs->next_block);
+    
+    if (n_threads > 1)
+        threads = (Thread_t**)malloc((n_threads-1) * sizeof(Thread_t*));
+    
+    if (threads == NULL) {                                     // single thread, or failed to allocate the thread list
+        xzDBlockWorker(p_jobs);
+    } else {
+        for (i=0; i<n_threads-1; i++)
+            threads[i] = threadStart(xzDBlockWorker, p_jobs); // if a thread failed to start, the others take its blocks
+        xzDBlockWorker(p_jobs);
+        for (i=0; i<n_threads-1; i++) {
+            if (threads[i] != NULL)
+                threadJoin(threads[i]);
+        }
+        free(threads);
+    }
+    
+    mutexFree(p_jobs->p_mutex);
+    
+    return p_jobs->ret_code;
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// xz decompress functions
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+int xzDGetSize (uint8_t *p_src, size_t src_len, size_t *p_dst_len) {
+    XzDBlock_t *blocks;
+    size_t      n_blocks;
+    
+    RET_WHEN_ERR( parseXzIndex(p_src, src_len, &blocks, &n_blocks, p_dst_len) );
+    
+    free(blocks);
+    
+    return R_OK;
+}
+
+
+/// decompress the range [offset, offset+*p_dst_len) of the data. If whole is set, all the blocks are decompressed (and verified), including the empty ones.
+static int xzDecode (uint8_t *p_src, size_t src_len, size_t offset, uint8_t *p_dst, size_t *p_dst_len, int n_threads, uint8_t whole) {
+    XzDBlock_t *blocks;
+    XzDJobs_t   jobs;
+    size_t      n_blocks, total_len, len = *p_dst_len;
+    int         ret_code;
+    
+    RET_WHEN_ERR( parseXzIndex(p_src, src_len, &blocks, &n_blocks, &total_len) );
+    
+    if (whole) {
+        if (len < total_len) {
+            free(blocks);
+            return R_ERR_OUTPUT_OVERFLOW;
+        }
+        offset = 0;
+        len    = total_len;
+    } else {
+        if (offset > total_len)
+            offset = total_len;
+        if (len > total_len - offset)
+            len = total_len - offset;
+    }
+    
+    jobs.p_src      = p_src;
+    jobs.blocks     = blocks;
+    jobs.offset     = offset;
+    jobs.len        = len;
+    jobs.p_dst      = p_dst;
+    jobs.next_block = 0;
+    jobs.end_block  = n_blocks;
+    jobs.ret_code   = R_OK;
+    
+    if (!whole) {                                              // only the blocks which overlap the range
+        for (; jobs.next_block<n_blocks; jobs.next_block++)
+            if (blocks[jobs.next_block].uncompressed_offset + blocks[jobs.next_block].uncompressed_len > offset)
+                break;
+        for (jobs.end_block=jobs.next_block; jobs.end_block<n_blocks; jobs.end_block++)
+            if (blocks[jobs.end_block].uncompressed_offset >= offset + len)
+                break;
+    }
+    
+    ret_code = R_OK;
+    
+    if (jobs.next_block < jobs.end_block)
+        ret_code = runXzDJobs(&jobs, n_threads);
+    
+    free(blocks);
+    
+    RET_WHEN_ERR(ret_code);
+    
+    *p_dst_len = len;
+    
+    return R_OK;
+}
+
+
+int xzD (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len, int n_threads) {
+    return xzDecode(p_src, src_len, 0, p_dst, p_dst_len, n_threads, 1);
+}
+
+
+int xzDRange (uint8_t *p_src, size_t src_len, size_t offset, uint8_t *p_dst, size_t *p_dst_len, int n_threads) {
+    return xzDecode(p_src, src_len, offset, p_dst, p_dst_len, n_threads, 0);
+}
@@ -0,0 +1,39 @@
+#ifndef   __XZ_D_H__
+#define   __XZ_D_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// Function  : get the decompressed length of .xz data from its index, without decompressing.
+// Return    : 0 on success, 5 if the .xz container is corrupted
+int xzDGetSize (uint8_t *p_src, size_t src_len, size_t *p_dst_len);
+
+
+// Function  : decompress .xz data (one or more concatenated streams, with stream padding). The blocks (LZMA2 filter only)
+//             are independent, and the index gives the position of each block in the output, so they are decompressed by n_threads threads.
+//             the CRC32 and CRC64 checks are verified, the other checks (e.g., SHA-256) are skipped.
+// Parameter :
+//     uint8_t *p_src                : input .xz data
+//     size_t   src_len              : input data length
+//     uint8_t *p_dst                : the output buffer
+//     size_t  *p_dst_len            : the length of output buffer, and will be set to output data length
+//     int      n_threads            : the number of threads, 0 means all the CPU cores
+// Return    :
+//     0 : success
+//     1 : out of memory
+//     2 : unsupported (filters other than LZMA2)
+//     3 : output overflow
+//     4 : input overflow
+//     5 : data corrupted
+//     6 : output length mismatch
+//     7 : check (CRC) mismatch
+int xzD (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len, int n_threads);
+
+
+// Function  : decompress a range of the uncompressed data : *p_dst_len bytes from offset. Only the blocks which cover the range are decompressed.
+//             *p_dst_len is clipped to the end of the data. The return value is the same as xzD.
+int xzDRange (uint8_t *p_src, size_t src_len, size_t offset, uint8_t *p_dst, size_t *p_dst_len, int n_threads);
+
+
+#endif // __XZ_D_H__
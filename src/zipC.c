@@ -1,10 +1,13 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "lzmaC.h"    // LzmaCParams_t, lzmaCBound
 
-int writeZipLzmaProperty (uint8_t *p_dst, size_t *p_dst_len);                                                   // lzmaC.c
-int lzmaEncode    (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len, uint8_t with_end_mark);   // lzmaC.c
-int deflateEncode (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len);                          // gzipC.c
+
+int writeZipLzmaProperty (uint8_t *p_dst, size_t *p_dst_len, const LzmaCParams_t *p_params, size_t src_len);                                   // lzmaC.c
+int lzmaEncode    (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len, uint8_t with_end_mark, const LzmaCParams_t *p_params);   // lzmaC.c
+int deflateEncode (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len);                                             // gzipC.c
+size_t gzipCBound (size_t src_len);                                                                                                // gzipC.c
 
 
 #define   R_OK                           0
@@ -193,7 +196,7 @@ static uint32_t calcCrc32 (const uint8_t *p_src, size_t src_len) {
 }
 
 
-static int zipC (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len, const char *file_name_in_zip, uint8_t comp_method) {
+static int zipC (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len, const char *file_name_in_zip, uint8_t comp_method, const LzmaCParams_t *p_params) {
     size_t zip_hdr_len, lzma_prop_len, cmprs_len, zip_ftr_len;                                          // there are 4 parts of the final output data : ZIP header, ZIP LZMA property, LZMA compressed data, and ZIP footer
     uint32_t crc;
     
@@ -203,7 +206,7 @@ static int zipC (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_l
     
     if (comp_method == COMP_METHOD_LZMA) {
         lzma_prop_len = *p_dst_len - zip_hdr_len;                                                       // set available space for ZIP LZMA property
-        RET_WHEN_ERR( writeZipLzmaProperty(p_dst+zip_hdr_len, &lzma_prop_len) );
+        RET_WHEN_ERR( writeZipLzmaProperty(p_dst+zip_hdr_len, &lzma_prop_len, p_params, src_len) );
     } else {
         lzma_prop_len = 0;
     }
@@ -211,7 +214,7 @@ static int zipC (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_l
     cmprs_len = *p_dst_len - zip_hdr_len - lzma_prop_len;                                               // set available space for LZMA compressed data
     
     if (comp_method == COMP_METHOD_LZMA) {
-        RET_WHEN_ERR(   lzmaEncode(p_src, src_len, p_dst+zip_hdr_len+lzma_prop_len, &cmprs_len, 1));
+        RET_WHEN_ERR(   lzmaEncode(p_src, src_len, p_dst+zip_hdr_len+lzma_prop_len, &cmprs_len, 1, p_params));
     } else {
         RET_WHEN_ERR(deflateEncode(p_src, src_len, p_dst+zip_hdr_len+lzma_prop_len, &cmprs_len));
     }
@@ -236,12 +239,21 @@ static int zipC (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_l
 }
 
 
-int zipClzma    (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len, const char *file_name_in_zip) {
-    return zipC(p_src, src_len, p_dst, p_dst_len, file_name_in_zip, COMP_METHOD_LZMA);
+int zipClzma    (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len, const char *file_name_in_zip, const LzmaCParams_t *p_params) {
+    return zipC(p_src, src_len, p_dst, p_dst_len, file_name_in_zip, COMP_METHOD_LZMA, p_params);
 }
 
 
 int zipCdeflate (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len, const char *file_name_in_zip) {
-    return zipC(p_src, src_len, p_dst, p_dst_len, file_name_in_zip, COMP_METHOD_DEFLATE);
+    return zipC(p_src, src_len, p_dst, p_dst_len, file_name_in_zip, COMP_METHOD_DEFLATE, NULL);
+}
+
+
+size_t zipClzmaBound    (size_t src_len, const char *file_name_in_zip) {
+    return ZIP_HEADER_LEN_EXCLUDE_FILENAME + ZIP_FOOTER_LEN_EXCLUDE_FILENAME + 2 * getStringLength(file_name_in_zip) + lzmaCBound(src_len);   // lzmaCBound also covers the ZIP LZMA property, since it covers the longer .lzma header
 }
 
+
+size_t zipCdeflateBound (size_t src_len, const char *file_name_in_zip) {
+    return ZIP_HEADER_LEN_EXCLUDE_FILENAME + ZIP_FOOTER_LEN_EXCLUDE_FILENAME + 2 * getStringLength(file_name_in_zip) + gzipCBound(src_len);
+}
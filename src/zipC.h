@@ -4,7 +4,14 @@
 #include <stddef.h>
 #include <stdint.h>
 
-int zipClzma    (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len, const char *file_name_in_zip);
+#include "lzmaC.h"
+
+// p_params : LZMA parameters, NULL to use the default parameters
+int zipClzma    (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len, const char *file_name_in_zip, const LzmaCParams_t *p_params);
 int zipCdeflate (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len, const char *file_name_in_zip);
 
+// the output buffer length that zipClzma / zipCdeflate needs. (see lzmaCBound and gzipCBound)
+size_t zipClzmaBound    (size_t src_len, const char *file_name_in_zip);
+size_t zipCdeflateBound (size_t src_len, const char *file_name_in_zip);
+
 #endif // __ZIP_C_H__
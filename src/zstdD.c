@@ -2,7 +2,7 @@
 #include <stdint.h>   // uint8_t, uint16_t, int32_t, uint64_t
 #include <string.h>   // memset, memcpy
 #include <stdlib.h>   // malloc, free, exit
-#include <stdio.h>    // printf
+#include <stdio.h>    // fprintf
 
 
 typedef uint8_t  u8;
@@ -17,7 +17,7 @@ typedef uint64_t u64;
 #define MAX_SEQ_SIZE          (0x18000)
 
 /// This decoder calls exit(1) when it encounters an error, however a production library should propagate error codes
-#define ERROR(msg)               { printf("Error: %s\n", (msg)); exit(1); }
+#define ERROR(msg)               { fprintf(stderr, "Error: %s\n", (msg)); exit(1); }
 #define ERROR_IF(cond, msg)      { if((cond)) ERROR(msg); }
 #define ERROR_I_SIZE_IF(cond)    { ERROR_IF((cond), ("Input buffer smaller than it should be or input is corrupted")); }
 #define ERROR_O_SIZE_IF(cond)    { ERROR_IF((cond), ("Output buffer overflow")); }
@@ -756,3 +756,58 @@ void zstdD (u8 *p_src, size_t src_len, u8 *p_dst, size_t *p_dst_len) {
     free(p_ctx);
     *p_dst_len = (p_dst - p_dst_base);
 }
+
+
+size_t zstdDMemUsage (void) {
+    return sizeof(frame_context_t);
+}
+
+
+
+/// get the decompressed length without decompressing : use Frame_Content_Size when a frame records it,
+/// otherwise walk the block headers of the frame to get an upper bound (a compressed block never decodes to more than ZSTD_BLOCK_SIZE_MAX).
+void zstdDGetSize (u8 *p_src, size_t src_len, size_t *p_dst_len) {
+    istream_t st_src = istream_new(p_src, src_len);
+    size_t total = 0;
+    while (istream_get_remain_len(&st_src) > 0) {
+        u64 magic = istream_readbytes(&st_src, 4);
+        if (magic == ZSTD_MAGIC_NUMBER) {
+            u8 checksum_flag, block_last, block_type;
+            size_t window_size, decoded_len, block_len, frame_bound = 0;
+            parse_frame_header(&st_src, &checksum_flag, &window_size, &decoded_len);
+            do {
+                block_last = istream_readbits(&st_src, 1);
+                block_type = istream_readbits(&st_src, 2);
+                block_len  = istream_readbits(&st_src, 21);
+                switch (block_type) {
+                    case 0:    // Raw_Block
+                        istream_skip(&st_src, block_len);
+                        frame_bound += block_len;
+                        break;
+                    case 1:    // RLE_Block
+                        istream_skip(&st_src, 1);
+                        frame_bound += block_len;
+                        break;
+                    case 2:    // Compressed_Block
+                        istream_skip(&st_src, block_len);
+                        frame_bound += ZSTD_BLOCK_SIZE_MAX;
+                        break;
+                    default: ERROR_CORRUPT_IF(1);
+                }
+            } while (!block_last);
+            if (checksum_flag) {
+                istream_skip(&st_src, 4);
+            }
+            if (decoded_len && decoded_len < frame_bound) {
+                frame_bound = decoded_len;     // exact length. (a corrupted Frame_Content_Size larger than the bound is ignored)
+            }
+            total += frame_bound;
+        } else if (SKIP_MAGIC_NUMBER_MIN <= magic && magic <= SKIP_MAGIC_NUMBER_MAX) {
+            size_t skip_frame_len = istream_readbytes(&st_src, 4);
+            istream_skip(&st_src, skip_frame_len);
+        } else {
+            ERROR_NOT_ZSTD_IF(1);
+        }
+    }
+    *p_dst_len = total;
+}
@@ -6,4 +6,10 @@
 
 void zstdD (uint8_t *p_src, size_t src_len, uint8_t *p_dst, size_t *p_dst_len);
 
+// get the decompressed length without decompressing : exact if all frames record Frame_Content_Size, otherwise an upper bound.
+void zstdDGetSize (uint8_t *p_src, size_t src_len, size_t *p_dst_len);
+
+// the memory (in bytes) allocated by zstdD
+size_t zstdDMemUsage (void);
+
 #endif // __ZSTD_D_H__
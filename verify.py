@@ -1,10 +1,12 @@
 import sys
 import os
 import shutil
+import struct
 
 import gzip         # pip install zipp==3.8.0
 import lzma         # pip install zipp==3.8.0
 import zipfile      # pip install zipp==3.8.0
+import zlib
 import lz4.frame    # pip install lz4==3.1.3
 import zstandard    # pip install zstandard==0.23.0
 
@@ -53,6 +55,7 @@ def official_compress (input_path, output_path, compress_level) :
             data_in = fpin.read()
             if   suffix == '.gz'   :  data_out = gzip.compress(data_in)
             elif suffix == '.lzma' :  data_out = lzma.compress(data_in, format=lzma.FORMAT_ALONE, preset=compress_level, filters=None)
+            elif suffix == '.xz'   :  data_out = lzma.compress(data_in, format=lzma.FORMAT_XZ, preset=compress_level, filters=None)
             elif suffix == '.lz4'  :  data_out = lz4.frame.compress(data_in, compression_level=compress_level)
             elif suffix == '.zst'  :  data_out = zstandard.compress(data_in, level=compress_level)
             else : 
@@ -69,6 +72,7 @@ def official_decompress (input_path, output_path) :
             data_in = fpin.read()
             if   suffix == '.gz'   :  data_out = gzip.decompress(data_in)
             elif suffix == '.lzma' :  data_out = lzma.decompress(data_in)
+            elif suffix == '.xz'   :  data_out = lzma.decompress(data_in, format=lzma.FORMAT_XZ)
             elif suffix == '.lz4'  :  data_out = lz4.frame.decompress(data_in)
             elif suffix == '.zst'  :  data_out = zstandard.decompress(data_in)
             else : 
@@ -77,6 +81,38 @@ def official_decompress (input_path, output_path) :
             fpout.write(data_out)
 
 
+def official_compress_XZ_blocks (input_path, output_path, block_len) :   # a multi-block .xz (like "xz -T"), each block is compressed by the official LZMA2 encoder
+    print(f'official XZ compress (blocks of {block_len} bytes) {input_path} -> {output_path}')
+    with open(input_path, 'rb') as fp :
+        data_in = fp.read()
+    filters = [{'id': lzma.FILTER_LZMA2, 'preset': 6, 'dict_size': 1<<23}]
+    header  = bytes([0x00, 0x01])                                                   # stream flags : CRC32 check
+    data_out = b'\xFD7zXZ\x00' + header + struct.pack('<I', zlib.crc32(header))
+    index, block_count = b'', 0
+    for i in range(0, len(data_in), block_len) :
+        block_in  = data_in[i : i+block_len]
+        block_hdr = bytes([0x02, 0x00, 0x21, 0x01, 22, 0x00, 0x00, 0x00])            # 12-byte header, 1 filter : LZMA2, dictionary 8MB
+        block_out = block_hdr + struct.pack('<I', zlib.crc32(block_hdr)) + lzma.compress(block_in, format=lzma.FORMAT_RAW, filters=filters)
+        index    += encode_xz_varint(len(block_out) + 4) + encode_xz_varint(len(block_in))
+        block_count += 1
+        data_out += block_out + bytes(-len(block_out) % 4) + struct.pack('<I', zlib.crc32(block_in))
+    index  = b'\x00' + encode_xz_varint(block_count) + index
+    index += bytes(-len(index) % 4)
+    index += struct.pack('<I', zlib.crc32(index))
+    footer = struct.pack('<I', len(index)//4 - 1) + header
+    data_out += index + struct.pack('<I', zlib.crc32(footer)) + footer + b'YZ'
+    with open(output_path, 'wb') as fp :
+        fp.write(data_out)
+
+
+def encode_xz_varint (value) :
+    data = b''
+    while value >= 0x80 :
+        data += bytes([(value & 0x7F) | 0x80])
+        value >>= 7
+    return data + bytes([value])
+
+
 def offical_check_zip (input_path) :
     print(f'{GREEN_MARK}offical_check_zip {input_path}{RESET_MARK}')
     with zipfile.ZipFile(input_path, mode='r') as zipf:
@@ -95,6 +131,29 @@ def assert_file_content_same (file_path1, file_path2) :
                 exit(1)
 
 
+def assert_file_size_not_larger (file_path, ref_file_path, ratio) :
+    size     = os.path.getsize(file_path)
+    ref_size = os.path.getsize(ref_file_path)
+    if size > ref_size * ratio :
+        print(f'{RED_MARK}***Error: {file_path} ({size} bytes) is larger than {ratio} x {ref_file_path} ({ref_size} bytes) ! {RESET_MARK}')
+        exit(1)
+
+
+def assert_file_content_same_as_part (file_path1, offset, length, file_path2) :
+    with     open(file_path1, "rb") as fp1:
+        with open(file_path2, "rb") as fp2:
+            data1 = fp1.read()[offset : offset+length]
+            data2 = fp2.read()
+            if data1 != data2 :
+                print(f'{RED_MARK}***Error: content mismatch between {file_path1}[{offset}:{offset+length}] and {file_path2} ! {RESET_MARK}')
+                exit(1)
+
+
+def make_structured_file (file_path) :   # 2MB of little-endian uint32 (i*7), a table of records which is easy for LZMA
+    with open(file_path, 'wb') as fp :
+        fp.write(struct.pack('<524288I', *[i*7 for i in range(524288)]))
+
+
 if __name__ == '__main__' :
     try :
         INPUT_DIR = sys.argv[1]
@@ -143,6 +202,50 @@ if __name__ == '__main__' :
             official_decompress_LZMA(f'{TEMP_FILE_PATH}.lzma', TEMP_FILE_PATH)
             assert_file_content_same(orig_file_path,        TEMP_FILE_PATH)
 
+            # LZMA : tinyZZZ (streaming) -> offical ------------------------------------------------------
+            runTinyZZZ(f'-c --lzma --stream {TEMP_FILE_PATH} {TEMP_FILE_PATH}.lzma')
+            official_decompress_LZMA(f'{TEMP_FILE_PATH}.lzma', TEMP_FILE_PATH)
+            assert_file_content_same(orig_file_path,        TEMP_FILE_PATH)
+            
+            # LZMA : tinyZZZ (level 0) -> offical --------------------------------------------------------
+            runTinyZZZ(f'-c --lzma -0 {TEMP_FILE_PATH} {TEMP_FILE_PATH}.lzma')
+            official_decompress_LZMA(f'{TEMP_FILE_PATH}.lzma', TEMP_FILE_PATH)
+            assert_file_content_same(orig_file_path,        TEMP_FILE_PATH)
+            
+            # LZMA : tinyZZZ (level 9) -> offical --------------------------------------------------------
+            runTinyZZZ(f'-c --lzma -9 {TEMP_FILE_PATH} {TEMP_FILE_PATH}.lzma')
+            official_decompress_LZMA(f'{TEMP_FILE_PATH}.lzma', TEMP_FILE_PATH)
+            assert_file_content_same(orig_file_path,        TEMP_FILE_PATH)
+            
+            # LZMA : tinyZZZ (greedy parser) -> offical --------------------------------------------------
+            runTinyZZZ(f'-c --lzma --parser greedy {TEMP_FILE_PATH} {TEMP_FILE_PATH}.lzma')
+            official_decompress_LZMA(f'{TEMP_FILE_PATH}.lzma', TEMP_FILE_PATH)
+            assert_file_content_same(orig_file_path,        TEMP_FILE_PATH)
+            
+            # LZMA : tinyZZZ (optimal parser) -> offical -------------------------------------------------
+            runTinyZZZ(f'-c --lzma --parser optimal {TEMP_FILE_PATH} {TEMP_FILE_PATH}.lzma')
+            official_decompress_LZMA(f'{TEMP_FILE_PATH}.lzma', TEMP_FILE_PATH)
+            assert_file_content_same(orig_file_path,        TEMP_FILE_PATH)
+            
+            # XZ   : offical -> tinyZZZ ------------------------------------------------------------------
+            official_compress(       TEMP_FILE_PATH,       f'{TEMP_FILE_PATH}.xz', compress_level=6)
+            runTinyZZZ(f'-d --xz    {TEMP_FILE_PATH}.xz    {TEMP_FILE_PATH}')
+            assert_file_content_same(orig_file_path,        TEMP_FILE_PATH)
+            
+            # XZ   : tinyZZZ -> tinyZZZ ------------------------------------------------------------------
+            runTinyZZZ(f'-c --xz    {TEMP_FILE_PATH}       {TEMP_FILE_PATH}.xz')
+            runTinyZZZ(f'-d --xz    {TEMP_FILE_PATH}.xz    {TEMP_FILE_PATH}')
+            assert_file_content_same(orig_file_path,        TEMP_FILE_PATH)
+            
+            # XZ   : tinyZZZ -> offical ------------------------------------------------------------------
+            official_decompress(  f'{TEMP_FILE_PATH}.xz',   TEMP_FILE_PATH)
+            assert_file_content_same(orig_file_path,        TEMP_FILE_PATH)
+            
+            # XZ   : tinyZZZ (multi-threaded, small blocks, CRC32) -> offical --------------------------------
+            runTinyZZZ(f'-c --xz -T 4 --block 64k --check crc32 {TEMP_FILE_PATH} {TEMP_FILE_PATH}.xz')
+            official_decompress(  f'{TEMP_FILE_PATH}.xz',   TEMP_FILE_PATH)
+            assert_file_content_same(orig_file_path,        TEMP_FILE_PATH)
+            
             # LZ4  : offical -> tinyZZZ ------------------------------------------------------------------
             official_compress(       TEMP_FILE_PATH,      f'{TEMP_FILE_PATH}.lz4', compress_level=5)
             runTinyZZZ(f'-d --lz4   {TEMP_FILE_PATH}.lz4   {TEMP_FILE_PATH}')
@@ -181,4 +284,24 @@ if __name__ == '__main__' :
     
             print(f'\n{YELLOW_MARK} === {orig_file_path} test passed ===\n {RESET_MARK}')
     
+    # LZMA -9 on structured binary : tinyZZZ -> official, and the optimal parser must not get stuck in literals ----------
+    struct_file_path = os.path.join(temp_dir_path, 'structured.bin')
+    make_structured_file(struct_file_path)
+    runTinyZZZ(f'-c --lzma -9 {struct_file_path}  {struct_file_path}.lzma')
+    official_decompress(  f'{struct_file_path}.lzma', TEMP_FILE_PATH)
+    assert_file_content_same(struct_file_path,        TEMP_FILE_PATH)
+    official_compress(       struct_file_path,      f'{struct_file_path}.official.lzma', compress_level=9)
+    assert_file_size_not_larger(f'{struct_file_path}.lzma', f'{struct_file_path}.official.lzma', 1.2)
+    
+    # XZ (official multi-block) : offical -> tinyZZZ, the whole data with threads, and a range which crosses a block boundary ----------
+    official_compress_XZ_blocks(struct_file_path, f'{struct_file_path}.xz', block_len=262144)
+    official_decompress(  f'{struct_file_path}.xz',   TEMP_FILE_PATH)
+    assert_file_content_same(struct_file_path,        TEMP_FILE_PATH)
+    runTinyZZZ(f'-d --xz -T 4 {struct_file_path}.xz   {TEMP_FILE_PATH}')
+    assert_file_content_same(struct_file_path,        TEMP_FILE_PATH)
+    runTinyZZZ(f'-d --xz -T 4 --range 255k:16k {struct_file_path}.xz {TEMP_FILE_PATH}')
+    assert_file_content_same_as_part(struct_file_path, 255*1024, 16*1024, TEMP_FILE_PATH)
+    runTinyZZZ(f'-d --xz --range 1000:1000 {struct_file_path}.xz {TEMP_FILE_PATH}')
+    assert_file_content_same_as_part(struct_file_path, 1000, 1000, TEMP_FILE_PATH)
+    
     print(f'\n{YELLOW_MARK} === all test passed ===\n {RESET_MARK}')